@@ -9,6 +9,7 @@
 #include "caffe/internal_thread.hpp"
 #include "caffe/util/blocking_queue.hpp"
 #include "caffe/util/db.hpp"
+#include "caffe/util/record_arena.hpp"
 
 namespace caffe {
 
@@ -36,15 +37,37 @@ class DataReader {
   // Queue pairs are shared between a body and its readers
   class QueuePair {
    public:
-    explicit QueuePair(int size);
+    QueuePair(int size, const shared_ptr<RecordArena>& arena);
     ~QueuePair();
 
     BlockingQueue<Datum*> free_;
     BlockingQueue<Datum*> full_;
+    /// Where the records of the queues are allocated.
+    shared_ptr<RecordArena> arena_;
 
   DISABLE_COPY_AND_ASSIGN(QueuePair);
   };
 
+  // With reader_threads > 1, reads and parses the records of one key range
+  // into its own queue pair, for the body to hand out.
+  class Shard : public InternalThread {
+   public:
+    Shard(db::Cursor* cursor, const string& begin, const string& end,
+        int size, const shared_ptr<RecordArena>& arena);
+    virtual ~Shard();
+
+    QueuePair qp_;
+
+   protected:
+    void InternalThreadEntry();
+
+    shared_ptr<db::Cursor> cursor_;
+    // The range is [begin_, end_), or up to the last key for an empty end_.
+    const string begin_, end_;
+
+  DISABLE_COPY_AND_ASSIGN(Shard);
+  };
+
   // A single body is created per source
   class Body : public InternalThread {
    public:
@@ -54,8 +77,19 @@ class DataReader {
    protected:
     void InternalThreadEntry();
     void read_one(db::Cursor* cursor, QueuePair* qp);
+    /// Splits the source among reader_threads shards.
+    void StartShards(db::DB* db, db::Cursor* cursor);
 
     const LayerParameter param_;
+    /// Shared by the queue pairs of the body, its shards and its readers.
+    shared_ptr<RecordArena> arena_;
+    /// Set with reader_threads > 1; read_one takes from them in turn.
+    vector<shared_ptr<Shard> > shards_;
+    int next_shard_;
+    /// The records in the range of each shard, those each still has to give
+    /// in the current pass over the source, and their sum.
+    vector<int64_t> shard_records_, shard_left_;
+    int64_t pass_left_;
     BlockingQueue<shared_ptr<QueuePair> > new_queue_pairs_;
 
     friend class DataReader;
@@ -69,7 +103,7 @@ class DataReader {
     return param.name() + ":" + param.data_param().source();
   }
 
-  const shared_ptr<QueuePair> queue_pair_;
+  shared_ptr<QueuePair> queue_pair_;
   shared_ptr<Body> body_;
 
   static map<const string, boost::weak_ptr<DataReader::Body> > bodies_;
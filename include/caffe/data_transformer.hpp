@@ -11,6 +11,34 @@
 #include <vector>
 namespace caffe {
 
+/**
+ * @brief A read-only view of one image's pixels, such as one of the bytes
+ *        fields of a TripletDatum, so it can be transformed in place
+ *        instead of being copied into a Datum first.
+ *
+ * The view does not own data; it must outlive the Transform call.
+ */
+struct DatumView {
+  DatumView(const char* data, size_t size, int channels, int height,
+      int width, bool encoded)
+      : data(data), size(size), channels(channels), height(height),
+        width(width), encoded(encoded), float_data(NULL) {}
+  explicit DatumView(const Datum& datum)
+      : data(datum.data().data()), size(datum.data().size()),
+        channels(datum.channels()), height(datum.height()),
+        width(datum.width()), encoded(datum.encoded()),
+        float_data(datum.float_data().data()) {}
+
+  const char* data;
+  size_t size;
+  int channels;
+  int height;
+  int width;
+  bool encoded;
+  /// Only set for views of a Datum; used when size is 0.
+  const float* float_data;
+};
+
 /**
  * @brief Applies common transformations to the input data, such as
  * scaling, mirroring, substracting the image mean...
@@ -26,6 +54,9 @@ class DataTransformer {
    *    transformation.
    */
   void InitRand();
+  /// Same as InitRand(), with the given seed instead of one drawn from
+  /// the Caffe RNG of the calling thread.
+  void InitRand(unsigned int rng_seed);
 
   /**
    * @brief Applies the transformation defined in the data layer's
@@ -39,6 +70,17 @@ class DataTransformer {
    */
   void Transform(const Datum& datum, Blob<Dtype>* transformed_blob);
 
+  /**
+   * @brief Applies the transformation to an image that lives in some other
+   * message, without copying it into a Datum.
+   *
+   * @param view
+   *    DatumView of the raw or encoded image bytes.
+   * @param transformed_blob
+   *    This is destination blob, as for Transform(const Datum&, ...).
+   */
+  void Transform(const DatumView& view, Blob<Dtype>* transformed_blob);
+
   /**
    * @brief Applies the transformation defined in the data layer's
    * transform_param block to a vector of Datum.
@@ -100,6 +142,14 @@ class DataTransformer {
    *    Datum containing the data to be transformed.
    */
   vector<int> InferBlobShape(const Datum& datum);
+  /**
+   * @brief Infers the shape of transformed_blob will have when
+   *    the transformation is applied to the viewed image.
+   *
+   * @param view
+   *    DatumView of the image to be transformed.
+   */
+  vector<int> InferBlobShape(const DatumView& view);
   /**
    * @brief Infers the shape of transformed_blob will have when
    *    the transformation is applied to the data.
@@ -127,6 +177,9 @@ class DataTransformer {
    *    cv::Mat containing the data to be transformed.
    */
   vector<int> InferBlobShape(const cv::Mat& cv_img);
+  /// Decodes an encoded view honoring force_color and force_gray, as
+  /// Transform does.
+  cv::Mat DecodeView(const DatumView& view);
 #endif  // USE_OPENCV
 
  protected:
@@ -140,7 +193,7 @@ class DataTransformer {
    */
   virtual int Rand(int n);
 
-  void Transform(const Datum& datum, Dtype* transformed_data);
+  void Transform(const DatumView& view, Dtype* transformed_data);
   // Tranformation parameters
   TransformationParameter param_;
 
@@ -1,6 +1,8 @@
 #ifndef CAFFE_DATA_LAYERS_HPP_
 #define CAFFE_DATA_LAYERS_HPP_
 
+#include <boost/function.hpp>
+#include <string>
 #include <vector>
 
 #include "caffe/blob.hpp"
@@ -9,6 +11,7 @@
 #include "caffe/layer.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/thread_pool.hpp"
 #include "caffe/util/triplet_blocking_queue.hpp"
 
 namespace caffe {
@@ -50,6 +53,9 @@ template <typename Dtype>
 class Batch {
  public:
   Blob<Dtype> data_, label_;
+  /// Keys of the DB records the batch was loaded from, for the layers that
+  /// need to report them along with the batch.
+  vector<string> keys_;
 };
 
 template <typename Dtype>
@@ -68,18 +74,65 @@ class BasePrefetchingDataLayer :
   virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
 
-  // Prefetches batches (asynchronously if to GPU memory)
-  static const int PREFETCH_COUNT = 3;
+  /// Number of batches currently prefetched ahead of the net.
+  inline int prefetch_depth() const { return prefetch_.size(); }
 
  protected:
   virtual void InternalThreadEntry();
   virtual void load_batch(Batch<Dtype>* batch) = 0;
 
-  Batch<Dtype> prefetch_[PREFETCH_COUNT];
+  /// The per item work of load_batch: decode and transform item into the
+  /// batch using the given transformer and its transformed_data_ view.
+  typedef boost::function<void(int, DataTransformer<Dtype>*, Blob<Dtype>*)>
+      LoadItemFunc;
+  /**
+   * @brief Calls load_item for every item in [0, n), on
+   *        prefetch_param.decode_threads threads.
+   *
+   * With one thread this is a plain loop over data_transformer_ and
+   * transformed_data_. Otherwise item i runs on lane i % lanes, which owns
+   * a DataTransformer and a view blob shaped like transformed_data_, and
+   * the lane transformer is reseeded per item with a seed drawn here in
+   * item order. Items must write disjoint parts of the batch and not touch
+   * state shared with other items.
+   */
+  void LoadItems(int n, const LoadItemFunc& load_item);
+  void LoadLanes(int n, const LoadItemFunc* load_item, int begin, int end);
+
+  /**
+   * @brief Pops the next loaded batch for Forward, keeping track of how
+   *        often the net has to wait for it.
+   *
+   * Grows the prefetch depth per prefetch_param when the net starves, and
+   * logs the wait times every prefetch_param.report_interval calls.
+   */
+  Batch<Dtype>* NextBatch();
+  /// Called by NextBatch with each batch it hands to Forward, before the
+  /// batch is copied out, for layers that report per batch state.
+  virtual void OnNextBatch(const Batch<Dtype>& batch) {}
+  /// Adds a batch shaped like like to the free queue, if prefetch_param
+  /// max_depth and memory_budget_mb allow it. Main thread only.
+  void GrowPrefetch(const Batch<Dtype>& like);
+
+  // Prefetches batches (asynchronously if to GPU memory); grown only by
+  // the main thread, after the prefetch thread has started.
+  vector<shared_ptr<Batch<Dtype> > > prefetch_;
   BlockingQueue<Batch<Dtype>*> prefetch_free_;
   BlockingQueue<Batch<Dtype>*> prefetch_full_;
+  /// The batch the top blobs point into since the last Forward, given back
+  /// to prefetch_free_ by the next one. NULL while the tops hold copies.
+  Batch<Dtype>* prefetch_current_;
+  /// Forward passes seen, and those of the current window that waited.
+  int forward_count_;
+  int starved_count_;
 
   Blob<Dtype> transformed_data_;
+
+  /// Set when prefetch_param.decode_threads > 1.
+  shared_ptr<ThreadPool> decode_pool_;
+  vector<shared_ptr<DataTransformer<Dtype> > > lane_transformers_;
+  vector<shared_ptr<Blob<Dtype> > > lane_data_;
+  vector<unsigned int> item_seeds_;
 };
 
 }  // namespace caffe
@@ -9,6 +9,8 @@
 
 #include "caffe/layers/loss_layer.hpp"
 #include "caffe/layers/softmax_layer.hpp"
+#include "caffe/util/memory_bank.hpp"
+#include "caffe/util/thread_pool.hpp"
 
 namespace caffe {
 
@@ -23,10 +25,74 @@ class Triplet {
     int third_;
 };
 
+/// Loss terms gathered for one anchor while mining, summed in anchor order.
+struct TripletMiningStats {
+  double pair_loss;
+  double rank_loss;
+  double smp_rank_loss;
+  int64_t num_pair;
+  int64_t num_tri;
+  int64_t num_err;
+  int64_t num_smp;
+};
+
+/**
+ * Streaming state of one anchor in the tiled mode. Negatives arrive tile by
+ * tile and are only counted into bins by their rank among the positive
+ * distances, so no row of the distance matrix is ever kept. Their triplet
+ * weights are folded into BatchTripletLossLayer::tile_grad_ as they arrive;
+ * only the weights of the positives are kept.
+ */
+template <typename Dtype>
+struct TripletAnchorState {
+  /// distances to the positives in ascending order, and their ids
+  vector<Dtype> pos_dist;
+  vector<int> pos_id;
+  /// bin r: negatives with exactly r positive distances below them
+  vector<int64_t> bad_count;
+  vector<double> bad_sum;
+  /// bin r: negatives with exactly r (positive distance + margin) <= them
+  vector<int64_t> hit_count;
+  vector<double> hit_sum;
+  int64_t num_neg;
+  /// minus the triplet weight of each positive (see
+  /// BatchTripletLossLayer::dist_), in the order of pos_id
+  vector<Dtype> pos_weight;
+  /// sum of the weights of the triplets using this sample as negative
+  Dtype neg_weight;
+};
+
 /**
  * @brief Computes the hinge loss for learning to rank with triplet sampling.
  *        The triplet sampling scheme is similar with FaceNet.
  *
+ * Triplets are never enumerated one by one. Every anchor sorts the distances
+ * to its negatives once, so the loss, the accuracy and the number of
+ * margin-violating negatives of each positive pair come from two binary
+ * searches and a prefix sum, which makes a batch cost O(n^2 log n) instead
+ * of O(n^3). Anchors are mined in parallel on a ThreadPool.
+ *
+ * With triplet_loss_param.tile_size > 0 no num x num buffer is allocated:
+ * distances are computed tile against tile (SYRK on the diagonal, each
+ * off-diagonal tile once for both of its sides), negatives are streamed into
+ * per-anchor bins, and their share of the gradient is accumulated tile by
+ * tile. Memory is then O(num * dim) plus the positive pairs of the batch,
+ * however many triplets violate the margin.
+ *
+ * With triplet_loss_param.memory_bank_size > 0 the embeddings of previous
+ * iterations are kept in a MemoryBank and mined as extra negatives of every
+ * anchor. They count in the loss and the statistics like in-batch negatives
+ * but receive no gradient.
+ *
+ * triplet_loss_param.loss_mode NPAIR and LIFTED reuse the distance matrix
+ * for losses over all positive pairs: each anchor needs one pass over its
+ * negatives (a log-sum-exp), so every sample gets a gradient term from every
+ * other one at O(n^2) cost. Their gradient is a weighted graph Laplacian
+ * times the features. The accuracy top still counts triplets; debug
+ * entry 0 is then the mean loss of the pairs with a positive exponent (the
+ * hinge for LIFTED), entry 2 is 0 and entry 4 is the number of those pairs.
+ * These modes need the dense layout: no tile_size and no memory bank.
+ *
  * @param bottom input Blob vector (length 2)
  *   -# @f$ (N \times C \times 1 \times 1) @f$
  *      the features @f$ x \in [-\infty, +\infty]@f$
@@ -70,13 +136,114 @@ class BatchTripletLossLayer : public LossLayer<Dtype> {
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 
-  vector<Triplet> triplets_;
-  vector<pair<int, int> > pos_pairs_;
+  /// Turns dist_ into distances and mines every anchor; fills the tops.
+  void MineTriplets(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  /// Mines the triplets whose query lies in [begin, end).
+  void MineAnchors(const Dtype* label, const Dtype* norm_data, Dtype* dist,
+      Dtype* weights, Dtype* bank_dist, Dtype* bank_weights, int begin,
+      int end);
+  /// NPAIR and LIFTED: adds the norms to the rows [begin, end) of dist,
+  /// counts the wrongly ranked triplets and sums the negatives of every
+  /// anchor into log_neg_sum_; NPAIR also fills the rows of weights.
+  void ScoreAnchors(const Dtype* label, const Dtype* norm_data, Dtype* dist,
+      Dtype* weights, int begin, int end);
+  /// LIFTED: the loss and weight rows [begin, end) once log_neg_sum_ is done.
+  void LiftAnchors(const Dtype* label, const Dtype* dist, Dtype* weights,
+      int begin, int end);
+  /// Fills rows [begin, end) of the aggregator from pair weights (see dist_).
+  void AggregatePairRows(const Dtype* weight, Dtype loss_weight,
+      Dtype* agg_data, int begin, int end);
+  /// Fills rows [begin, end) of the aggregator from the mined triplets.
+  void AggregateRows(const Dtype* weights, Dtype loss_weight,
+      Dtype* agg_data, int begin, int end);
+  /// Fills the num x num aggregator (gradient = aggregator * features).
+  void BuildAggregator(Dtype loss_weight, Dtype* agg_data);
+  /// Sets bank_rows_ and the bank pointers the mining workers read.
+  void SyncBank();
+  /// Indexes the batch by label with a counting sort; any order works.
+  void GroupLabels(const Dtype* label, int num);
+  /// Sums stats_ in anchor order and writes loss, accuracy and debug tops.
+  void ReduceStats(const vector<Blob<Dtype>*>& top);
+  /// Gradient scales of one sampled triplet and of one positive pair.
+  Dtype RankScale(Dtype loss_weight) const;
+  Dtype PairScale(Dtype loss_weight) const;
+  /// Stores the batch in the memory bank once it is no longer needed.
+  void PushToBank(const vector<Blob<Dtype>*>& bottom);
+
+  /// Tiled mode: the forward and backward passes without num x num buffers.
+  void ForwardTiled(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  void BackwardTiled(const vector<Blob<Dtype>*>& top,
+      const vector<Blob<Dtype>*>& bottom);
+  /// Collects the positives of anchors [begin, end) and resets their bins.
+  void InitAnchors(const Dtype* feat, const Dtype* norm_data, int dim,
+      int begin, int end);
+  /// Computes the tile pairs tasks[begin, end) and streams their negatives,
+  /// adding their weighted features to the rows of grad.
+  void MineTiles(const Dtype* feat, const Dtype* norm_data,
+      const Dtype* label, int dim, const vector<pair<int, int> >* tasks,
+      Dtype* grad, int begin, int end);
+  /// Streams the memory bank to the anchors of tiles [begin, end).
+  void MineBankTiles(const Dtype* feat, const Dtype* norm_data,
+      const Dtype* bank_feat, const Dtype* label, int dim, Dtype* grad,
+      int begin, int end);
+  /// Feeds one negative at distance dist to the state of an anchor and
+  /// returns the weight of the triplets it is sampled in.
+  Dtype FeedNegative(TripletAnchorState<Dtype>* state, Dtype dist);
+  /// Turns the bins of anchors [begin, end) into stats_ and positive weights.
+  void FinishAnchors(int begin, int end);
+  /// diff rows [begin, end) = scale * (tile_grad_ rows and their positives).
+  void GatherRows(const Dtype* feat, const Dtype* grad, int dim,
+      Dtype scale1, Dtype scale2, Dtype* diff, int begin, int end);
+  /// diff rows [begin, end) += scale * the transposed positive weights.
+  void ScatterColumns(const Dtype* feat, int dim, Dtype scale1, Dtype* diff,
+      int begin, int end);
+
+  /**
+   * dist_ holds the pairwise squared distances; its diff holds, for every
+   * query i, the number of sampled triplets using x as negative minus the
+   * number using x as positive. That is all the backward pass needs.
+   * In the NPAIR and LIFTED modes row i of the diff holds instead the
+   * derivatives of the loss terms of anchor i w.r.t. the squared distances.
+   */
   Blob<Dtype> dist_;
   Blob<Dtype> norm_;
   shared_ptr<SyncedMemory> aggregator_;
+  /// Same-label groups: group g holds the samples
+  /// members_[boundary_[g]] ... members_[boundary_[g+1] - 1] in batch order,
+  /// and sample i belongs to group_[i].
+  vector<int> boundary_;
+  vector<int> members_;
+  vector<int> group_;
+  vector<int> bucket_;
+  vector<TripletMiningStats> stats_;
+  int tile_size_;
+  vector<TripletAnchorState<Dtype> > anchors_;
+  /// tiled mode: sum over the mined negatives k of each query i of
+  /// w_ik * x_k, and of w_ki * x_k over the queries k using i as negative
+  Blob<Dtype> tile_grad_;
+  /// transposed positive weights of the tiled mode, grouped by column
+  vector<int> col_start_;
+  vector<pair<int, Dtype> > col_weights_;
+  /// Negatives from earlier batches; index num + k in the weights means
+  /// bank row k. bank_dist_ is num x bank_rows_ and is laid out like dist_.
+  shared_ptr<MemoryBank<Dtype> > bank_;
+  Blob<Dtype> bank_dist_;
+  int bank_rows_;
+  /// bank labels and norms, fetched on the calling thread by SyncBank
+  const Dtype* bank_label_;
+  const Dtype* bank_norm_;
+  int64_t num_pair_;
+  int64_t num_smp_;
+  shared_ptr<ThreadPool> pool_;
   Dtype margin_;
   Dtype mu_;
+  TripletLossParameter_LossMode loss_mode_;
+  /// NPAIR and LIFTED: 1 / number of loss terms, and per anchor the log of
+  /// its summed exponentiated negatives
+  Dtype term_scale_;
+  vector<Dtype> log_neg_sum_;
 };
 
 
@@ -11,6 +11,7 @@
 #include "caffe/layer.hpp"
 #include "caffe/layers/base_data_layer.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/packed_features.hpp"
 
 namespace caffe {
 
@@ -40,6 +41,8 @@ class BinaryDataLayer : public BasePrefetchingDataLayer<Dtype> {
   vector<std::pair<std::string, int> > lines_;
   int lines_id_;
   vector<int> top_shape_;
+  /// Set with image_data_param.packed_source.
+  shared_ptr<PackedFeatureFile> packed_;
 };
 
 
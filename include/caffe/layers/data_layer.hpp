@@ -30,8 +30,13 @@ class DataLayer : public BasePrefetchingDataLayer<Dtype> {
 
  protected:
   virtual void load_batch(Batch<Dtype>* batch);
+  /// Transforms datums_[item_id] into item item_id of batch.
+  void TransformItem(Batch<Dtype>* batch, Dtype* top_data, int item_id,
+      DataTransformer<Dtype>* transformer, Blob<Dtype>* transformed);
 
   DataReader reader_;
+  /// the records of the batch being loaded, in reader order
+  vector<Datum*> datums_;
 };
 
 }  // namespace caffe
@@ -9,30 +9,32 @@
 #include "caffe/data_transformer.hpp"
 #include "caffe/internal_thread.hpp"
 #include "caffe/layer.hpp"
-#include "caffe/layers/similarity_layer.hpp"
+#include "caffe/layers/multiple_similarity_layer.hpp"
 #include "caffe/proto/caffe.pb.h"
 
 namespace caffe {
 
 /**
- * @brief Computes the Dot-Product Similarity @f$ S = q^\top  p  @f$.
+ * @brief Computes the Dot-Product Similarity of every anchor to its k
+ *        samples, @f$ S = agg_j(q^\top p_j) @f$.
+ *
+ * The k dot products of a record come from one small GEMM.
  */
 template <typename Dtype>
-class DotProductMultipleSimilarityLayer : public SimilarityLayer<Dtype> {
+class DotProductMultipleSimilarityLayer
+    : public MultipleSimilarityLayer<Dtype> {
  public:
   explicit DotProductMultipleSimilarityLayer(const LayerParameter& param)
-     : SimilarityLayer<Dtype>(param) {}
-  virtual inline const char* type() const { return "DotProductMultipleSimilarity"; }
+     : MultipleSimilarityLayer<Dtype>(param) {}
+  virtual inline const char* type() const {
+    return "DotProductMultipleSimilarity";
+  }
  protected:
   /// @copydoc EuclideanLossLayer
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
-  //virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
-  //    const vector<Blob<Dtype>*>& top);
   virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
-  //virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
-  //    const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 };
 
 }  // namespace caffe
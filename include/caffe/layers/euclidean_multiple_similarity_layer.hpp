@@ -0,0 +1,48 @@
+#ifndef CAFFE_EUCLIDEAN_MULTIPLE_SIMILARITY_LAYER_HPP_
+#define CAFFE_EUCLIDEAN_MULTIPLE_SIMILARITY_LAYER_HPP_
+
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/layers/multiple_similarity_layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+
+namespace caffe {
+
+/**
+ * @brief Computes the Euclidean Similarity of every anchor to its k
+ *        samples, @f$ S = agg_j(- \frac{1}{2}
+ *          \left| \left| q - p_j \right| \right|_2^2) @f$.
+ *
+ * The distances are expanded to @f$ |q|^2 + |p_j|^2 - 2 q^\top p_j @f$, so
+ * the k products of an anchor come from one gemv and no bottom-sized
+ * difference blob is needed.
+ */
+template <typename Dtype>
+class EuclideanMultipleSimilarityLayer
+    : public MultipleSimilarityLayer<Dtype> {
+ public:
+  explicit EuclideanMultipleSimilarityLayer(const LayerParameter& param)
+     : MultipleSimilarityLayer<Dtype>(param) {}
+  virtual inline const char* type() const {
+    return "EuclideanMultipleSimilarity";
+  }
+
+  /**
+   * @brief Fills sim with @f$ -\frac{1}{2} |a - b_j|^2 @f$ of the anchor a
+   *        to each of its k samples b by the expansion above.
+   */
+  static void Similarities(int k, int dim, const Dtype* a, const Dtype* b,
+      Dtype* sim);
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_EUCLIDEAN_MULTIPLE_SIMILARITY_LAYER_HPP_
@@ -1,6 +1,7 @@
 #ifndef CAFFE_HDML_LOSS_UPPER_BOUND_LAYER_HPP_
 #define CAFFE_HDML_LOSS_UPPER_BOUND_LAYER_HPP_
 
+#include <stdint.h>
 #include <vector>
 
 #include "caffe/blob.hpp"
@@ -8,6 +9,7 @@
 #include "caffe/proto/caffe.pb.h"
 
 #include "caffe/layers/loss_layer.hpp"
+#include "caffe/util/thread_pool.hpp"
 
 namespace caffe {
 
@@ -26,6 +28,10 @@ namespace caffe {
  *   -# @f$ (1 \times 1 \times 1 \times 1) @f$
  *      the computed upper bound of the HDML loss: @f$ E =
  *      @f$
+ *
+ * The samples are independent and are processed in parallel, each chunk of
+ * them with its own persistent dynamic programming workspace, on
+ * triplet_loss_param.num_threads threads (0 for one per hardware thread).
  */
 template <typename Dtype>
 class HDMLLossUpperBoundLayer : public LossLayer<Dtype> {
@@ -34,6 +40,8 @@ class HDMLLossUpperBoundLayer : public LossLayer<Dtype> {
       : LossLayer<Dtype>(param) {}
   virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
 
   virtual inline const char* type() const { return "HDMLLossUpperBound"; }
   virtual inline int ExactNumTopBlobs() const { return 1; }
@@ -57,24 +65,36 @@ class HDMLLossUpperBoundLayer : public LossLayer<Dtype> {
     return true;
   }
  private:
-  void compute_h(const Blob<Dtype> * qry,
-      const Blob<Dtype> * pos, const Blob<Dtype> * neg);
-  void compute_infer_loss(const Blob<Dtype> * qry,
-      const Blob<Dtype> * pos, const Blob<Dtype> * neg);
-  Dtype compute_loss_ub();
-
-  Blob<Dtype> infer_cont_;      // N x D x 3 x 1, cont(i, e_i) in Eq (10)
-  Blob<int> infer_qry_buffer_;  // N x D x 3 x 1, a in Eq (10)
-  Blob<int> infer_pos_buffer_;  // N x D x 3 x 1, b in Eq (10)
-  Blob<int> infer_neg_buffer_;  // N x D x 3 x 1, c in Eq (10)
-
-  Blob<int> h_qry_;             // N x D x 1 x 1, h   in Eq(6)
-  Blob<int> h_pos_;             // N x D x 1 x 1, h^+ in Eq(6)
-  Blob<int> h_neg_;             // N x D x 1 x 1, h^- in Eq(6)
-
-  Blob<int> g_qry_;             // N x D x 1 x 1, g   in Eq(6)
-  Blob<int> g_pos_;             // N x D x 1 x 1, g^+ in Eq(6)
-  Blob<int> g_neg_;             // N x D x 1 x 1, g^- in Eq(6)
+  /// Scratch space of one chunk of samples, reused across iterations.
+  struct Workspace {
+    vector<Dtype> cont;         // D x 3, cont(i, e_i) in Eq (10)
+    /// D x 3, (a, b, c) in Eq (10) as the bits 0, 1 and 2, set for +1
+    vector<unsigned char> sign;
+    /// two rows of the m table, padded by two entries on each side so the
+    /// bit loop needs no range checks
+    vector<Dtype> m_rows;
+    vector<signed char> choice; // D x (2D + 1), e_i picked for each m
+  };
+
+  /// Runs the steps below on the samples of chunks [begin, end) of num.
+  void ProcessChunks(int num, const Dtype* qry, const Dtype* pos, const Dtype* neg,
+      uint64_t* h, uint64_t* g, int begin, int end);
+  void compute_h(const Dtype* qry, const Dtype* pos, const Dtype* neg,
+      uint64_t* h_qry, uint64_t* h_pos, uint64_t* h_neg);
+  void compute_infer_loss(const Dtype* qry, const Dtype* pos,
+      const Dtype* neg, Workspace* ws);
+  Dtype compute_loss_ub(Workspace* ws, uint64_t* g_qry, uint64_t* g_pos,
+      uint64_t* g_neg);
+
+  int nb_;
+  shared_ptr<ThreadPool> pool_;
+  vector<Workspace> workspace_;
+  /// the loss of every sample, summed in sample order; sized in Reshape
+  vector<Dtype> sample_loss_;
+
+  /// 3 x N codes of D bits packed as in caffe_cpu_pack_bits
+  vector<uint64_t> h_;          // h, h^+ and h^- in Eq(6)
+  vector<uint64_t> g_;          // g, g^+ and g^- in Eq(6)
 };
 
 
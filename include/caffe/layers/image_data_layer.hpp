@@ -36,9 +36,14 @@ class ImageDataLayer : public BasePrefetchingDataLayer<Dtype> {
   shared_ptr<Caffe::RNG> prefetch_rng_;
   virtual void ShuffleImages();
   virtual void load_batch(Batch<Dtype>* batch);
+  /// Reads and transforms batch_files_[item_id] into item item_id of batch.
+  void LoadImage(Batch<Dtype>* batch, Dtype* prefetch_data, int item_id,
+      DataTransformer<Dtype>* transformer, Blob<Dtype>* transformed);
 
   vector<std::pair<std::string, int> > lines_;
   int lines_id_;
+  /// the files of the batch being loaded; lines_ may be reshuffled meanwhile
+  vector<std::string> batch_files_;
 };
 
 
@@ -0,0 +1,53 @@
+#ifndef CAFFE_MULTIPLE_SIMILARITY_LAYER_HPP_
+#define CAFFE_MULTIPLE_SIMILARITY_LAYER_HPP_
+
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/layers/similarity_layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+
+namespace caffe {
+
+/**
+ * @brief An interface for similarities of every anchor to k samples.
+ *
+ * bottom[0] holds N anchors and bottom[1] holds N * k samples; anchor i
+ * goes with samples i * k ... i * k + k - 1. Subclasses fill sim_ with the
+ * N x k similarities, which are combined by
+ * multiple_similarity_param.aggregation (mean, max or log-sum-exp).
+ * The aggregation weights are kept from the forward pass, so Backward can
+ * run any number of times on one Forward.
+ */
+template <typename Dtype>
+class MultipleSimilarityLayer : public SimilarityLayer<Dtype> {
+ public:
+  explicit MultipleSimilarityLayer(const LayerParameter& param)
+     : SimilarityLayer<Dtype>(param) {}
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  /**
+   * @brief Combines the k similarities sim of one anchor as set by param
+   *        and returns the result; weight receives its derivative w.r.t.
+   *        each of them.
+   */
+  static Dtype AggregateRow(const MultipleSimilarityParameter& param, int k,
+      const Dtype* sim, Dtype* weight);
+
+ protected:
+  /// Reduces every row of sim_ into top_data and fills weight_.
+  void Aggregate(Dtype* top_data);
+  /// Fills the diff of sim_ with dE / dsim_ from the weights and top diff.
+  void BackwardAggregate(const Dtype* top_diff);
+
+  /// N x k similarities; the diff holds dE / dsim_ij in the backward pass.
+  Blob<Dtype> sim_;
+  /// N x k aggregation weights dS_i / dsim_ij of the forward pass
+  Blob<Dtype> weight_;
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_MULTIPLE_SIMILARITY_LAYER_HPP_
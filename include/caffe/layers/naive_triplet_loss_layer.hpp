@@ -9,6 +9,8 @@
 
 #include "caffe/layers/loss_layer.hpp"
 #include "caffe/layers/softmax_layer.hpp"
+#include "caffe/util/hardness_table.hpp"
+#include "caffe/util/memory_bank.hpp"
 
 namespace caffe {
 
@@ -16,9 +18,15 @@ namespace caffe {
 /**
  * @brief Computes the hinge loss for pair-wise learning to rank task.
  *
- * @param bottom input Blob vector (length 1)
+ * @param bottom input Blob vector (length 1 or 2)
  *   -# @f$ (3N \times D \times 1 \times 1) @f$
  *      feature @f$ qry/pos/neg (N \times D \times 1 \times 1) @f$.
+ *   -# @f$ (N \times 1 \times 1 \times 1) @f$
+ *      the query labels; required with triplet_loss_param.memory_bank_size.
+ *      Queries and positives of every TRAIN forward pass are then kept in a
+ *      MemoryBank and every bank entry with another label is a further
+ *      negative of the later queries. Each query adds the mean hinge over
+ *      its bank negatives. TEST nets keep no bank and skip that term.
  * @param top output Blob vector (length 2)
  *   -# @f$ (1 \times 1 \times 1 \times 1) @f$
  *      the computed hinge loss: @f$ E =
@@ -39,7 +47,8 @@ class NaiveTripletLossLayer : public LossLayer<Dtype> {
       const vector<Blob<Dtype>*>& top);
 
   virtual inline const char* type() const { return "NaiveTripletLoss"; }
-  virtual inline int ExactNumBottomBlobs() const { return 1; }
+  virtual inline int MinBottomBlobs() const { return 1; }
+  virtual inline int MaxBottomBlobs() const { return 2; }
   virtual inline int ExactNumTopBlobs() const { return 2; }
 
  protected:
@@ -57,15 +66,23 @@ class NaiveTripletLossLayer : public LossLayer<Dtype> {
    * to both inputs -- override to return true and always allow force_backward.
    */
   virtual inline bool AllowForceBackward(const int bottom_index) const {
-    return true;
+    return bottom_index == 0;
   }
 
+  /// Fills bank_sim_ with S(q, b) for every query and bank row.
+  void ComputeBankSimilarity();
+  /// Turns the bank hinges into gradient weights and fills bank_grad_ and
+  /// bank_pos_weight_, before the batch is pushed to the bank.
+  void WeighBankNegatives(const Dtype* qry_label);
+
   /// The internal SimilarityLayer.
   Blob<Dtype> qry_feat_;
   Blob<Dtype> pos_feat_;
   Blob<Dtype> neg_feat_;
   Blob<Dtype> pos_sim_;
   Blob<Dtype> neg_sim_;
+  /// the query diff of the positive similarity
+  Blob<Dtype> qry_diff_;
 
   shared_ptr<Layer<Dtype> > split_layer_;
   vector<Blob<Dtype>*> split_bottom_vec_;
@@ -79,6 +96,18 @@ class NaiveTripletLossLayer : public LossLayer<Dtype> {
   shared_ptr<Layer<Dtype> > neg_sim_layer_;
   vector<Blob<Dtype>*> neg_sim_bottom_vec_;
   vector<Blob<Dtype>*> neg_sim_top_vec_;
+
+  /// Negatives from earlier batches; bank_sim_ is N x bank_rows_ and its
+  /// diff holds the weight of every violating bank negative. Per query,
+  /// bank_grad_ holds the unscaled gradient of its bank terms and
+  /// bank_pos_weight_ the weight they put on S(q, p).
+  shared_ptr<MemoryBank<Dtype> > bank_;
+  Blob<Dtype> bank_sim_;
+  Blob<Dtype> bank_grad_;
+  vector<Dtype> bank_pos_weight_;
+  int bank_rows_;
+  /// Receives the per-record losses with hard_mining_param.table.
+  shared_ptr<HardnessTable> hardness_;
 };
 
 }  // namespace caffe
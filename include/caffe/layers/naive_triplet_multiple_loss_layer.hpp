@@ -9,6 +9,7 @@
 
 #include "caffe/layers/loss_layer.hpp"
 #include "caffe/layers/softmax_layer.hpp"
+#include "caffe/util/hardness_table.hpp"
 
 namespace caffe {
 
@@ -16,13 +17,26 @@ namespace caffe {
 /**
  * @brief Computes the hinge loss for pair-wise learning to rank task.
  *
+ * The bottom holds B * A anchors, then B * P positives and the negatives,
+ * with B = batch_size, A = anchor_len and P = pos_len. Anchor i goes with
+ * the k_p positives i * k_p ... i * k_p + k_p - 1 and likewise with k_n
+ * negatives, where k_p and k_n are the number of positives and negatives
+ * per anchor. The Multiple similarities combine the k similarities of an
+ * anchor as set by multiple_similarity_param; the plain ones need
+ * k_p = k_n = 1.
+ *
+ * For the DotProduct and Euclidean similarities, plain or Multiple, the
+ * similarities are computed straight from the bottom blob, so no slice or
+ * similarity sub-layers are involved. Any other sim_type is run as a pair
+ * of sub-layers over a slice of the bottom.
+ *
  * @param bottom input Blob vector (length 1)
- *   -# @f$ (3N \times D \times 1 \times 1) @f$
- *      feature @f$ qry/pos/neg (N \times D \times 1 \times 1) @f$.
+ *   -# @f$ (B(A + P + N) \times D \times 1 \times 1) @f$
+ *      the anchor, positive and negative features.
  * @param top output Blob vector (length 2)
  *   -# @f$ (1 \times 1 \times 1 \times 1) @f$
  *      the computed hinge loss: @f$ E =
- *        \frac{1}{N} \sum\limits_{n=1}^N
+ *        \frac{1}{BA} \sum\limits_{n=1}^{BA}
  *        [\max(0, margin - S(q, p^+) + S(q, p^-))]
  *      @f$
  *   -# @f$ (1 \times 1 \times 1 \times 1) @f$
@@ -43,12 +57,13 @@ class NaiveTripletMultipleLossLayer : public LossLayer<Dtype> {
   virtual inline int ExactNumTopBlobs() const { return 2; }
 
  protected:
-  /// @copydoc NaiveTripletLossLayer 
+  /// @copydoc NaiveTripletLossLayer
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
 
   /**
-   * @brief Computes the hinge loss error gradient w.r.t. the similarities.
+   * @brief Computes the hinge loss error gradient w.r.t. the features,
+   *        all three segments in one pass.
    */
   virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
@@ -60,26 +75,48 @@ class NaiveTripletMultipleLossLayer : public LossLayer<Dtype> {
     return true;
   }
 
-  /// The internal SimilarityLayer.
-  Blob<Dtype> qry_feat_;
-  Blob<Dtype> pos_feat_;
-  Blob<Dtype> neg_feat_;
+  /// The fused path: S(q, b_j) of an anchor q and its k samples b.
+  void Similarities(int k, int dim, const Dtype* q, const Dtype* b,
+      Dtype* sim) const;
+  /// dq += alpha * sum_j w_j dS(q, b_j) / dq, and
+  /// db_j = alpha * w_j dS(q, b_j) / db_j.
+  void SimilarityGradient(int k, int dim, const Dtype* q, const Dtype* b,
+      const Dtype* w, Dtype alpha, Dtype* dq, Dtype* db) const;
+  /// The sub-layer path of the other similarities.
+  void SetUpSubLayers(const vector<Blob<Dtype>*>& bottom);
+  void BackwardSubLayers(Dtype scale);
+
+  /// S(q, p) and S(q, n) of every anchor, and the aggregation weights of
+  /// its k_p positives and k_n negatives.
   Blob<Dtype> pos_sim_;
   Blob<Dtype> neg_sim_;
+  Blob<Dtype> pos_weight_;
+  Blob<Dtype> neg_weight_;
+  /// the hinge of every anchor; the diff flags the active ones
+  Blob<Dtype> triplet_loss_;
   int batch_size_;
   int anchor_len_;
   int pos_len_;
   int neg_len_;
+  /// the computation used for sim_type
+  bool fused_;
+  bool dot_product_;
+  bool multiple_;
+  /// Receives the per-record losses with hard_mining_param.table.
+  shared_ptr<HardnessTable> hardness_;
 
+  /// The sub-layer path: slices of the bottom, the query diff of the
+  /// positive similarity, and the similarity layers.
+  Blob<Dtype> qry_feat_;
+  Blob<Dtype> pos_feat_;
+  Blob<Dtype> neg_feat_;
+  Blob<Dtype> qry_diff_;
   shared_ptr<Layer<Dtype> > split_layer_;
   vector<Blob<Dtype>*> split_bottom_vec_;
   vector<Blob<Dtype>*> split_top_vec_;
-
   shared_ptr<Layer<Dtype> > pos_sim_layer_;
-  //What does these two variables mean?
   vector<Blob<Dtype>*> pos_sim_bottom_vec_;
   vector<Blob<Dtype>*> pos_sim_top_vec_;
-
   shared_ptr<Layer<Dtype> > neg_sim_layer_;
   vector<Blob<Dtype>*> neg_sim_bottom_vec_;
   vector<Blob<Dtype>*> neg_sim_top_vec_;
@@ -9,6 +9,7 @@
 
 #include "caffe/layers/loss_layer.hpp"
 #include "caffe/layers/softmax_layer.hpp"
+#include "caffe/util/hardness_table.hpp"
 
 namespace caffe {
 
@@ -33,6 +34,8 @@ class PairwiseRankingLossLayer : public LossLayer<Dtype> {
  public:
   explicit PairwiseRankingLossLayer(const LayerParameter& param)
       : LossLayer<Dtype>(param) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
 
   virtual inline const char* type() const { return "PairwiseRankingLoss"; }
   virtual inline int ExactNumTopBlobs() const { return 1; }
@@ -54,6 +57,9 @@ class PairwiseRankingLossLayer : public LossLayer<Dtype> {
   virtual inline bool AllowForceBackward(const int bottom_index) const {
     return true;
   }
+
+  /// Receives the per-record losses with hard_mining_param.table.
+  shared_ptr<HardnessTable> hardness_;
 };
 
 
@@ -0,0 +1,70 @@
+#ifndef CAFFE_PK_DATA_LAYER_HPP_
+#define CAFFE_PK_DATA_LAYER_HPP_
+
+#include <string>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/data_transformer.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/layers/base_data_layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/db.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Provides P x K batches of a labeled Datum DB to the Net, for the
+ *        batch triplet losses, without a precomputed triplet list.
+ *
+ * At setup the layer walks the DB of data_param once to index its keys by
+ * label; labels with fewer than two images are left out, as they cannot
+ * form a positive pair. Each batch then holds pk_sampler_param.num_labels
+ * labels with pk_sampler_param.images_per_label images each, label after
+ * label. Labels are taken from a shuffled order and the images of a label
+ * from a shuffled order of its own, both reshuffled once used up, so every
+ * image comes round about as often as the others of its label.
+ */
+template <typename Dtype>
+class PKDataLayer : public BasePrefetchingDataLayer<Dtype> {
+ public:
+  explicit PKDataLayer(const LayerParameter& param)
+      : BasePrefetchingDataLayer<Dtype>(param) {}
+  virtual ~PKDataLayer();
+  virtual void DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline const char* type() const { return "PKData"; }
+  virtual inline int ExactNumBottomBlobs() const { return 0; }
+  virtual inline int MinTopBlobs() const { return 1; }
+  virtual inline int MaxTopBlobs() const { return 2; }
+
+ protected:
+  virtual void load_batch(Batch<Dtype>* batch);
+  /// Transforms datums_[item_id] into item item_id of batch.
+  void TransformItem(Batch<Dtype>* batch, Dtype* top_data, int item_id,
+      DataTransformer<Dtype>* transformer, Blob<Dtype>* transformed);
+  /// Picks the keys of the next batch into batch_keys_.
+  void SampleBatchKeys();
+
+  shared_ptr<db::DB> db_;
+  /// Walks db_ from the prefetch thread once set up.
+  shared_ptr<db::Cursor> cursor_;
+  shared_ptr<Caffe::RNG> prefetch_rng_;
+  /// the labels kept, and the keys of each in their current order
+  vector<int> labels_;
+  vector<vector<string> > keys_;
+  /// the current order of the labels, as indices into labels_
+  vector<int> label_order_;
+  /// where the next batch starts in label_order_ and in each keys_[i]
+  int label_pos_;
+  vector<int> key_pos_;
+  /// the keys and records of the batch being loaded, label by label
+  vector<string> batch_keys_;
+  vector<Datum> datums_;
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_PK_DATA_LAYER_HPP_
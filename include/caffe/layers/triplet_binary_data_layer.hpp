@@ -11,6 +11,7 @@
 #include "caffe/layer.hpp"
 #include "caffe/layers/base_data_layer.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/packed_features.hpp"
 
 namespace caffe {
 
@@ -39,6 +40,8 @@ class TripletBinaryDataLayer : public BasePrefetchingDataLayer<Dtype> {
 
   vector<vector<std::string> > lines_;
   vector<int> top_shape_;
+  /// Set with image_data_param.packed_source.
+  shared_ptr<PackedFeatureFile> packed_;
   int lines_id_;
 };
 
@@ -20,6 +20,8 @@
 #include "caffe/layers/base_data_layer.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/db.hpp"
+#include "caffe/util/decoded_image_cache.hpp"
+#include "caffe/util/hardness_table.hpp"
 
 namespace caffe {
 
@@ -41,20 +43,38 @@ class TripletDBDataLayer : public BasePrefetchingDataLayer<Dtype> {
   virtual inline int ExactNumBottomBlobs() const { return 0; }
   virtual inline int ExactNumTopBlobs() const { return 1; }
 
-  //we need this function to extract a Datum from a TripletDatum so as to predict the output blob
-  //shape.
+  //we need this function to view an image of a TripletDatum, both to predict the output blob
+  //shape and to transform it without copying its bytes.
   /*
  * @param: tag = 0 means extract the anchor image;
  *         tag = 1 means extract the positive image;
  *         tag = 2 means extract the negative image;
  */
- Datum UnravelTripletDatumToDatum( const TripletDatum& triplet_datum, int tag );
+ DatumView UnravelTripletDatumToView( const TripletDatum& triplet_datum, int tag );
  protected:
   //shared_ptr<Caffe::RNG> prefetch_rng_;
   //virtual void ShuffleTriplets();
   virtual void load_batch(Batch<Dtype>* batch);
+  /// Transforms image k % 3 of datums_[k / 3] into its slot of batch.
+  void TransformImage(Batch<Dtype>* batch, Dtype* prefetch_data, int k,
+      DataTransformer<Dtype>* transformer, Blob<Dtype>* transformed);
+  /// Hands the record keys of the batch about to be copied out to
+  /// hardness_, for the loss layers of the net.
+  virtual void OnNextBatch(const Batch<Dtype>& batch);
+  /// Transforms view, the image image_id of the image table (-1 if the
+  /// source has none), decoding it through image_cache_ when there is one.
+  void TransformView(const DatumView& view, int image_id,
+      DataTransformer<Dtype>* transformer, Blob<Dtype>* transformed);
 
   TripletDataReader reader_;
+  /// Set with hard_mining_param.table in the TRAIN phase.
+  shared_ptr<HardnessTable> hardness_;
+#ifdef USE_OPENCV
+  /// Set with image_cache_param.size_mb for sources with an image table.
+  shared_ptr<DecodedImageCache> image_cache_;
+#endif  // USE_OPENCV
+  /// the records of the batch being loaded, in reader order
+  vector<TripletDatum*> datums_;
 
   //vector<vector<std::string> > lines_;
   //int lines_id_;
@@ -11,6 +11,8 @@
 #include "caffe/layer.hpp"
 #include "caffe/layers/base_data_layer.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/decoded_image_cache.hpp"
+#include "caffe/util/triplet_list.hpp"
 
 namespace caffe {
 
@@ -36,9 +38,27 @@ class TripletImageDataLayer : public BasePrefetchingDataLayer<Dtype> {
   shared_ptr<Caffe::RNG> prefetch_rng_;
   virtual void ShuffleTriplets();
   virtual void load_batch(Batch<Dtype>* batch);
+  /// Reads and transforms the triplet of pending_[k] into its slots of
+  /// batch, or marks it failed if one of its images cannot be read.
+  void LoadTriplet(Batch<Dtype>* batch, Dtype* prefetch_data, int k,
+      DataTransformer<Dtype>* transformer, Blob<Dtype>* transformed);
+#ifdef USE_OPENCV
+  /// ReadImageToCVMat with the image_data_param size and color, through
+  /// image_cache_ when there is one.
+  cv::Mat ReadImage(const string& filename);
+#endif  // USE_OPENCV
 
-  vector<vector<std::string> > lines_;
+  TripletList lines_;
   int lines_id_;
+  /// the triplet of each item of the batch being loaded
+  vector<TripletList::Triplet> batch_triplets_;
+  /// the items still to be loaded, and whether each item succeeded
+  vector<int> pending_;
+  vector<char> loaded_;
+#ifdef USE_OPENCV
+  /// Set with image_cache_param.size_mb.
+  shared_ptr<DecodedImageCache> image_cache_;
+#endif  // USE_OPENCV
 };
 
 }  // namespace caffe
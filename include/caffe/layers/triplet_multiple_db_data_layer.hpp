@@ -20,6 +20,8 @@
 #include "caffe/layers/base_data_layer.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/db.hpp"
+#include "caffe/util/decoded_image_cache.hpp"
+#include "caffe/util/hardness_table.hpp"
 
 namespace caffe {
 
@@ -41,22 +43,41 @@ class TripletMultipleDBDataLayer : public BasePrefetchingDataLayer<Dtype> {
   virtual inline int ExactNumBottomBlobs() const { return 0; }
   virtual inline int ExactNumTopBlobs() const { return 1; }
 
-  //we need this function to extract a Datum from a TripletDatum so as to predict the output blob
-  //shape.
+  //we need this function to view an image of a TripletMultipleDatum, both to predict the
+  //output blob shape and to transform it without copying its bytes.
   /*
- * @param: tag = 0 means extract the anchor image;
- *         tag = 1 means extract the positive image;
- *         tag = 2 means extract the negative image;
+ * @param: tag = 0 means extract the anchor images;
+ *         tag = 1 means extract the positive images;
+ *         tag = 2 means extract the negative images;
+ *         index picks one of the images of tag.
  */
- Datum PeepUnravelTripletMultipleDatumToDatum( const TripletMultipleDatum& triplet_multiple_datum, int tag );
- std::vector< Datum > UnravelTripletMultipleDatumToDatum( const TripletMultipleDatum& triplet_multiple_datum, int tag );
+ DatumView UnravelTripletMultipleDatumToView( const TripletMultipleDatum& triplet_multiple_datum, int tag, int index );
+ int CompImgNumPerTag( const TripletMultipleDatum& triplet_multiple_datum, int tag );
  int CompImgNumPerBatch( const TripletMultipleDatum& triplet_multiple_datum );
  protected:
   //shared_ptr<Caffe::RNG> prefetch_rng_;
   //virtual void ShuffleTriplets();
   virtual void load_batch(Batch<Dtype>* batch);
+  /// Transforms every image of datums_[item_id] into its slot of batch.
+  void TransformRecord(Batch<Dtype>* batch, Dtype* prefetch_data, int item_id,
+      DataTransformer<Dtype>* transformer, Blob<Dtype>* transformed);
+  /// Hands the record keys of the batch about to be copied out to
+  /// hardness_, for the loss layers of the net.
+  virtual void OnNextBatch(const Batch<Dtype>& batch);
+  /// Transforms view, the image image_id of the image table (-1 if the
+  /// source has none), decoding it through image_cache_ when there is one.
+  void TransformView(const DatumView& view, int image_id,
+      DataTransformer<Dtype>* transformer, Blob<Dtype>* transformed);
 
   TripletMultipleDataReader reader_;
+  /// Set with hard_mining_param.table in the TRAIN phase.
+  shared_ptr<HardnessTable> hardness_;
+#ifdef USE_OPENCV
+  /// Set with image_cache_param.size_mb for sources with an image table.
+  shared_ptr<DecodedImageCache> image_cache_;
+#endif  // USE_OPENCV
+  /// the records of the batch being loaded, in reader order
+  vector<TripletMultipleDatum*> datums_;
 
   //vector<vector<std::string> > lines_;
   //int lines_id_;
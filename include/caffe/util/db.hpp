@@ -1,7 +1,9 @@
 #ifndef CAFFE_UTIL_DB_HPP
 #define CAFFE_UTIL_DB_HPP
 
+#include <stdint.h>
 #include <string>
+#include <vector>
 
 #include "caffe/common.hpp"
 #include "caffe/proto/caffe.pb.h"
@@ -15,14 +17,41 @@ class Cursor {
   Cursor() { }
   virtual ~Cursor() { }
   virtual void SeekToFirst() = 0;
+  // Moves to the first record whose key is not less than key.
+  virtual void Seek(const string& key) {
+    for (SeekToFirst(); valid() && this->key() < key; Next()) { }
+  }
   virtual void Next() = 0;
   virtual string key() = 0;
   virtual string value() = 0;
+  // Points data at the bytes of the current value, without copying them
+  // where the backend allows. They stay valid until the cursor moves.
+  virtual void value_view(const char** data, size_t* size) {
+    value_ = value();
+    *data = value_.data();
+    *size = value_.size();
+  }
   virtual bool valid() = 0;
+  // Returns the number of records the cursor can see, or -1 if the backend
+  // cannot tell without walking them.
+  virtual int64_t num_records() { return -1; }
+
+ protected:
+  string value_;
 
   DISABLE_COPY_AND_ASSIGN(Cursor);
 };
 
+// Parses the current value of cursor into message, from the bytes of the
+// DB itself where the backend allows.
+template <typename Message>
+inline bool ParseValue(Cursor* cursor, Message* message) {
+  const char* data;
+  size_t size;
+  cursor->value_view(&data, &size);
+  return message->ParseFromArray(data, size);
+}
+
 class Transaction {
  public:
   Transaction() { }
@@ -41,6 +70,9 @@ class DB {
   virtual void Close() = 0;
   virtual Cursor* NewCursor() = 0;
   virtual Transaction* NewTransaction() = 0;
+  // Hints that about num_records records of record_bytes each are about to
+  // be written, so the DB can size its storage once instead of growing it.
+  virtual void Reserve(size_t num_records, size_t record_bytes) { }
 
   DISABLE_COPY_AND_ASSIGN(DB);
 };
@@ -50,6 +82,15 @@ DB* GetDB(TripletDataParameter::DB backend);
 DB* GetDB(TripletMultipleDataParameter::DB backend);
 DB* GetDB(const string& backend);
 
+// Splits the records into shards ranges of about equal size, for readers
+// that read a DB from several cursors. Fills starts with the first key of
+// each range; range i ends where range i + 1 starts, the last one at the
+// end of the DB. Walks the keys up to the last start, and all of them once
+// more first when the cursor does not know num_records. Leaves the cursor
+// at the first key and returns the number of records; range i holds
+// (i + 1) * count / shards - i * count / shards of them.
+int64_t ShardKeyRanges(Cursor* cursor, int shards, vector<string>* starts);
+
 }  // namespace db
 }  // namespace caffe
 
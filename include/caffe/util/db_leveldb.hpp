@@ -17,9 +17,15 @@ class LevelDBCursor : public Cursor {
     : iter_(iter) { SeekToFirst(); }
   ~LevelDBCursor() { delete iter_; }
   virtual void SeekToFirst() { iter_->SeekToFirst(); }
+  virtual void Seek(const string& key) { iter_->Seek(key); }
   virtual void Next() { iter_->Next(); }
   virtual string key() { return iter_->key().ToString(); }
   virtual string value() { return iter_->value().ToString(); }
+  virtual void value_view(const char** data, size_t* size) {
+    leveldb::Slice value = iter_->value();
+    *data = value.data();
+    *size = value.size();
+  }
   virtual bool valid() { return iter_->Valid(); }
 
  private:
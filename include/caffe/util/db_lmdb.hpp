@@ -26,6 +26,11 @@ class LMDBCursor : public Cursor {
     mdb_txn_abort(mdb_txn_);
   }
   virtual void SeekToFirst() { Seek(MDB_FIRST); }
+  virtual void Seek(const string& key) {
+    mdb_key_.mv_size = key.size();
+    mdb_key_.mv_data = const_cast<char*>(key.data());
+    Seek(MDB_SET_RANGE);
+  }
   virtual void Next() { Seek(MDB_NEXT); }
   virtual string key() {
     return string(static_cast<const char*>(mdb_key_.mv_data), mdb_key_.mv_size);
@@ -34,7 +39,17 @@ class LMDBCursor : public Cursor {
     return string(static_cast<const char*>(mdb_value_.mv_data),
         mdb_value_.mv_size);
   }
+  // The bytes live in the map, valid for the read transaction.
+  virtual void value_view(const char** data, size_t* size) {
+    *data = static_cast<const char*>(mdb_value_.mv_data);
+    *size = mdb_value_.mv_size;
+  }
   virtual bool valid() { return valid_; }
+  virtual int64_t num_records() {
+    MDB_stat stat;
+    MDB_CHECK(mdb_stat(mdb_txn_, mdb_cursor_dbi(mdb_cursor_), &stat));
+    return stat.ms_entries;
+  }
 
  private:
   void Seek(MDB_cursor_op op) {
@@ -83,6 +98,7 @@ class LMDB : public DB {
   }
   virtual LMDBCursor* NewCursor();
   virtual LMDBTransaction* NewTransaction();
+  virtual void Reserve(size_t num_records, size_t record_bytes);
 
  private:
   MDB_env* mdb_env_;
@@ -0,0 +1,68 @@
+#ifndef CAFFE_UTIL_DECODED_IMAGE_CACHE_HPP_
+#define CAFFE_UTIL_DECODED_IMAGE_CACHE_HPP_
+
+#ifdef USE_OPENCV
+#include <opencv2/core/core.hpp>
+
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief A size-bounded LRU cache of decoded, not yet transformed images,
+ *        for data layers whose images repeat across records.
+ *
+ * Keys are chosen by the layers, e.g. a file path or an image table id
+ * along with the decode options. Caches are shared by name across the
+ * process (see image_cache_param), and may be used from several threads.
+ * Cached images share their pixels with the cache and must not be written.
+ */
+class DecodedImageCache {
+ public:
+  /// Returns the cache called name, creating it with capacity bytes on
+  /// first use.
+  static shared_ptr<DecodedImageCache> Get(const string& name,
+      size_t capacity);
+
+  /// Sets image to the cached image of key and returns true, or returns
+  /// false if it is not cached.
+  bool Lookup(const string& key, cv::Mat* image);
+  /// Caches image under key, evicting the least recently used images to
+  /// stay within capacity. Empty or too large images are not cached.
+  void Insert(const string& key, const cv::Mat& image);
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+  /// Bytes of pixels held.
+  size_t size() const;
+
+ protected:
+  explicit DecodedImageCache(size_t capacity);
+
+  typedef std::list<std::pair<string, cv::Mat> > LRUList;
+
+  /// Move synchronization fields out instead of including boost/thread.hpp
+  class sync;
+
+  shared_ptr<sync> sync_;
+  const size_t capacity_;
+  size_t size_;
+  /// most recently used first
+  LRUList lru_;
+  map<string, LRUList::iterator> index_;
+  uint64_t hits_;
+  uint64_t misses_;
+
+  DISABLE_COPY_AND_ASSIGN(DecodedImageCache);
+};
+
+}  // namespace caffe
+
+#endif  // USE_OPENCV
+#endif  // CAFFE_UTIL_DECODED_IMAGE_CACHE_HPP_
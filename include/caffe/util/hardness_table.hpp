@@ -0,0 +1,96 @@
+#ifndef CAFFE_UTIL_HARDNESS_TABLE_HPP_
+#define CAFFE_UTIL_HARDNESS_TABLE_HPP_
+
+#include <deque>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/db.hpp"
+
+namespace caffe {
+
+/**
+ * @brief The recent loss of every training record, keyed by its DB key.
+ *
+ * A data layer publishes the keys of the batch the net is about to run,
+ * the loss layers of that net fold their per-record losses into the table,
+ * and the reader of the data layer uses the table to pick which records to
+ * emit next (see HardnessSampler). Tables are shared by name across the
+ * process, so the data and loss layers only need the same
+ * hard_mining_param.table. There is a single slot for the batch keys, so
+ * a table serves one net run by one solver.
+ */
+class HardnessTable {
+ public:
+  /// Returns the table called name, creating it on first use.
+  static shared_ptr<HardnessTable> Get(const string& name);
+
+  /// Sets the keys of the records of the current batch, in batch order.
+  void SetBatchKeys(const vector<string>& keys);
+
+  /**
+   * @brief Folds the losses of the current batch into the table.
+   *
+   * count must be a multiple of the number of batch keys; each record owns
+   * count / keys consecutive losses and its hardness moves towards their
+   * mean by 1 - momentum. Does nothing if no batch keys were set.
+   */
+  template <typename Dtype>
+  void Update(int count, const Dtype* loss, float momentum);
+
+  /**
+   * @brief The expected number of times a record should be emitted per
+   *        pass over the DB: its hardness over the mean hardness, clamped
+   *        to [min_rate, max_rate]. Records never seen get 1.
+   */
+  float SampleRate(const string& key, float min_rate, float max_rate);
+
+  int size();
+
+ protected:
+  HardnessTable();
+
+  /// Move synchronization fields out instead of including boost/thread.hpp
+  class sync;
+
+  shared_ptr<sync> sync_;
+  map<string, float> hardness_;
+  /// the sum of all hardness_ values, for the mean
+  double total_;
+  vector<string> batch_keys_;
+
+  DISABLE_COPY_AND_ASSIGN(HardnessTable);
+};
+
+/**
+ * @brief Walks a DB cursor for a reader thread, skipping easy records and
+ *        repeating hard ones by their HardnessTable sample rate.
+ *
+ * A record with rate r < 1 is emitted with probability r; one with r >= 1
+ * is emitted and queued for about r - 1 more visits. Queued repeats are
+ * served every other call so they spread over the following batches.
+ */
+class HardnessSampler {
+ public:
+  explicit HardnessSampler(const HardMiningParameter& param);
+
+  /// Sets key and value to the next record to emit and moves the cursor
+  /// past it, wrapping around at the end of the DB.
+  void Next(db::Cursor* cursor, string* key, string* value);
+
+ protected:
+  const HardMiningParameter param_;
+  shared_ptr<HardnessTable> table_;
+  std::deque<std::pair<string, string> > repeats_;
+  bool repeat_turn_;
+
+  DISABLE_COPY_AND_ASSIGN(HardnessSampler);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_HARDNESS_TABLE_HPP_
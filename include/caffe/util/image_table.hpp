@@ -0,0 +1,65 @@
+#ifndef CAFFE_UTIL_IMAGE_TABLE_HPP_
+#define CAFFE_UTIL_IMAGE_TABLE_HPP_
+
+#include <map>
+#include <string>
+
+#include "caffe/common.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/db.hpp"
+
+namespace caffe {
+
+/**
+ * An image table is a DB holding every image of a triplet set once, as a
+ * Datum keyed by ImageTableKey(id). The triplet records of such a set only
+ * carry the image ids (anchor_id, pos_id, neg_id), and the triplet readers
+ * fill in the image bytes from the table named by image_source.
+ */
+
+/// The DB key of image id in an image table.
+string ImageTableKey(int id);
+
+/// Reads image id from the image table walked by cursor.
+void ReadImageFromTable(db::Cursor* cursor, int id, Datum* image);
+
+/**
+ * @brief CHECKs that image has the shape of the first image of its record,
+ *        unless it is encoded and only gets its shape when decoded.
+ *
+ * The raw bytes of every image of a record are read as one blob shape.
+ */
+void CheckImageShape(const Datum& image, const Datum& first);
+
+#ifdef USE_OPENCV
+/// Writes an image table, assigning ids to images by file name.
+class ImageTableWriter {
+ public:
+  /// Images are read with ReadImageToDatum and the given size and color.
+  ImageTableWriter(const string& backend, const string& source, int height,
+      int width, bool is_color);
+  ~ImageTableWriter();
+
+  /**
+   * @brief Returns the id of filename, reading it into the table when it
+   *        is first seen, or -1 if it cannot be read.
+   */
+  int Id(const string& filename, const string& encoding);
+  /// Number of images in the table.
+  inline int size() const { return num_images_; }
+
+ protected:
+  shared_ptr<db::DB> db_;
+  shared_ptr<db::Transaction> txn_;
+  const int height_, width_;
+  const bool is_color_;
+  map<string, int> ids_;
+  int num_images_;
+
+  DISABLE_COPY_AND_ASSIGN(ImageTableWriter);
+};
+#endif  // USE_OPENCV
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_IMAGE_TABLE_HPP_
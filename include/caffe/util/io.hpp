@@ -139,6 +139,19 @@ bool DecodeDatumNative(Datum* datum);
 bool DecodeDatum(Datum* datum, bool is_color);
 
 #ifdef USE_OPENCV
+/**
+ * @brief Returns the cv::imread flag for an image to be resized to
+ *        height x width: IMREAD_REDUCED_* for a JPEG at least twice that
+ *        size, which decodes at 1/2, 1/4 or 1/8 scale in the DCT domain,
+ *        and the plain color or grayscale flag otherwise.
+ *
+ * Only the JPEG marker headers are read to find the size.
+ */
+int ImageReadFlagForSize(const string& filename, const int height,
+    const int width, const bool is_color);
+
+// Resizes to height x width when both are positive; JPEGs at least twice
+// that size are decoded at a reduced scale first.
 cv::Mat ReadImageToCVMat(const string& filename,
     const int height, const int width, const bool is_color);
 
@@ -152,6 +165,9 @@ cv::Mat ReadImageToCVMat(const string& filename);
 
 cv::Mat DecodeDatumToCVMatNative(const Datum& datum);
 cv::Mat DecodeDatumToCVMat(const Datum& datum, bool is_color);
+// Decode an encoded image straight from its bytes, without copying them.
+cv::Mat DecodeBytesToCVMatNative(const char* data, size_t size);
+cv::Mat DecodeBytesToCVMat(const char* data, size_t size, bool is_color);
 bool ReadMultipleTripletImagesToMultipleTripletDatum( const struct MultipleTripletPair& mult_triplet_img_list, const int height, const int width, const bool is_color, const std::string& encoding, TripletMultipleDatum* mult_triplet_datum);
 
 
@@ -25,6 +25,13 @@ void caffe_cpu_gemv(const CBLAS_TRANSPOSE TransA, const int M, const int N,
     const Dtype alpha, const Dtype* A, const Dtype* x, const Dtype beta,
     Dtype* y);
 
+// Symmetric rank-k update of the upper triangle of the N x N matrix C:
+// C = alpha * A * A^T + beta * C (A is N x K), or A^T * A when TransA is set
+// (A is K x N). The strictly lower triangle of C is left untouched.
+template <typename Dtype>
+void caffe_cpu_syrk(const CBLAS_TRANSPOSE TransA, const int N, const int K,
+    const Dtype alpha, const Dtype* A, const Dtype beta, Dtype* C);
+
 template <typename Dtype>
 void caffe_axpy(const int N, const Dtype alpha, const Dtype* X,
     Dtype* Y);
@@ -142,6 +149,41 @@ DEFINE_CAFFE_CPU_UNARY_FUNC(fabs, y[i] = std::fabs(x[i]));
 template <typename Dtype>
 void caffe_cpu_scale(const int n, const Dtype alpha, const Dtype *x, Dtype* y);
 
+// Binary codes are packed 64 bits per word: bit j of a code lives in bit
+// j % 64 of word j / 64, and the unused high bits of the last word are 0.
+inline int caffe_code_words(const int nbits) { return (nbits + 63) / 64; }
+
+inline int caffe_popcount(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(x);
+#else
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return static_cast<int>((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// Packs the signs of n rows of nbits values; a bit is set iff x > 0.
+template <typename Dtype>
+void caffe_cpu_pack_bits(const int n, const int nbits, const Dtype* x,
+    uint64_t* codes);
+
+// Unpacks n codes of nbits into +1 / -1 values.
+template <typename Dtype>
+void caffe_cpu_unpack_bits(const int n, const int nbits,
+    const uint64_t* codes, Dtype* x);
+
+// Returns the number of differing bits of two codes of nwords words.
+int caffe_cpu_hamming_distance(const int nwords, const uint64_t* a,
+    const uint64_t* b);
+
+// dist[i] = hamming distance of query to code i of n codes. On x86 the
+// kernel is picked at run time: AVX2 for codes of 256 bits or more, then
+// popcnt, then a portable fallback.
+void caffe_cpu_hamming_distances(const int n, const int nwords,
+    const uint64_t* query, const uint64_t* codes, int* dist);
+
 #ifndef CPU_ONLY  // GPU
 
 // Decaf gpu gemm provides an interface that is almost the same as the cpu
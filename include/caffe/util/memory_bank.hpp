@@ -0,0 +1,48 @@
+#ifndef CAFFE_UTIL_MEMORY_BANK_HPP_
+#define CAFFE_UTIL_MEMORY_BANK_HPP_
+
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief A ring buffer of recent embeddings and their labels.
+ *
+ * Loss layers mine extra negatives from it across iterations. The stored
+ * rows are plain copies: nothing is backpropagated into them. Rows are
+ * kept in slot order, not in age order; once the bank is full every Push
+ * overwrites the oldest rows.
+ */
+template <typename Dtype>
+class MemoryBank {
+ public:
+  MemoryBank(int capacity, int dim);
+
+  /// Copies num rows of dim features, and their labels, into the bank.
+  void Push(int num, const Dtype* feat, const Dtype* label);
+
+  inline int size() const { return size_; }
+  inline int capacity() const { return feat_.num(); }
+  inline int dim() const { return feat_.count(1); }
+  /// The features of the size() filled slots, one row per slot.
+  inline const Blob<Dtype>& feat() const { return feat_; }
+  inline const Dtype* label() const { return label_.cpu_data(); }
+  /// The squared L2 norms of the stored rows.
+  inline const Dtype* norm() const { return norm_.cpu_data(); }
+
+ protected:
+  Blob<Dtype> feat_;
+  Blob<Dtype> label_;
+  Blob<Dtype> norm_;
+  int head_;
+  int size_;
+
+  DISABLE_COPY_AND_ASSIGN(MemoryBank);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_MEMORY_BANK_HPP_
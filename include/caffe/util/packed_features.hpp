@@ -0,0 +1,105 @@
+#ifndef CAFFE_UTIL_PACKED_FEATURES_HPP_
+#define CAFFE_UTIL_PACKED_FEATURES_HPP_
+
+#include <stdint.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * A packed feature file holds a directory of binary feature blobs (as read
+ * by ReadBinaryBlob, with their shape and dtype in a meta file) in one file:
+ *
+ *   PackedFeatureHeader
+ *   num rows of channels * height * width values, back to back
+ *   num row ids, sorted by the name of their row
+ *   num offsets of the row names, then the NUL-terminated names
+ *
+ * PackedFeatureFile maps it once and finds rows by name with a binary
+ * search over the mapping, so no per-row file is opened or kept in memory.
+ */
+struct PackedFeatureHeader {
+  char magic[8];
+  /// 4 for float32 rows, 8 for float64 rows
+  uint32_t value_size;
+  int32_t channels;
+  int32_t height;
+  int32_t width;
+  int64_t num;
+  /// where the rows, the sorted row ids and the name offsets start
+  uint64_t rows_offset;
+  uint64_t index_offset;
+  uint64_t names_offset;
+};
+
+class PackedFeatureFile {
+ public:
+  PackedFeatureFile();
+  ~PackedFeatureFile();
+
+  /// Maps filename, failing if it is not a packed feature file.
+  void Open(const string& filename);
+  void Close();
+
+  inline int64_t num() const { return header_->num; }
+  inline int channels() const { return header_->channels; }
+  inline int height() const { return header_->height; }
+  inline int width() const { return header_->width; }
+  /// Values per row.
+  inline int count() const {
+    return header_->channels * header_->height * header_->width;
+  }
+
+  /// The row called name, or -1 if there is none.
+  int64_t Find(const string& name) const;
+  const char* name(int64_t row) const;
+
+  /// Asks the kernel to read the pages of row ahead of a copy.
+  void WillNeed(int64_t row) const;
+  /// Copies row into data, converting its values to Dtype.
+  template <typename Dtype>
+  void CopyRow(int64_t row, Dtype* data) const;
+
+ protected:
+  const char* data_;
+  size_t size_;
+  const PackedFeatureHeader* header_;
+  const int64_t* index_;
+  const uint64_t* names_;
+
+DISABLE_COPY_AND_ASSIGN(PackedFeatureFile);
+};
+
+/// Writes a packed feature file one row at a time.
+class PackedFeatureWriter {
+ public:
+  /// value_size is 4 for float32 and 8 for float64 values.
+  PackedFeatureWriter(const string& filename, int value_size, int channels,
+      int height, int width);
+  ~PackedFeatureWriter();
+
+  /// Appends a row of count() values of value_size bytes each.
+  void Add(const string& name, const char* values);
+  /// Writes the name index and the header; called by the destructor.
+  void Close();
+
+  inline int64_t num() const { return names_.size(); }
+  inline size_t row_bytes() const { return row_bytes_; }
+
+ protected:
+  string filename_;
+  FILE* file_;
+  PackedFeatureHeader header_;
+  size_t row_bytes_;
+  vector<string> names_;
+
+DISABLE_COPY_AND_ASSIGN(PackedFeatureWriter);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_PACKED_FEATURES_HPP_
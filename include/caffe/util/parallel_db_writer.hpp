@@ -0,0 +1,87 @@
+#ifndef CAFFE_UTIL_PARALLEL_DB_WRITER_HPP_
+#define CAFFE_UTIL_PARALLEL_DB_WRITER_HPP_
+
+#include <boost/function.hpp>
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/db.hpp"
+
+/**
+ Forward declare boost::thread instead of including boost/thread.hpp
+ to avoid a boost/NVCC issues (#1009, #1010) on OSX.
+ */
+namespace boost { class thread; }
+
+namespace caffe {
+
+/**
+ * @brief Encodes the records of a DB on a set of threads and writes them in
+ *        index order, committing as it goes.
+ *
+ * Workers take the next index and encode it while the calling thread puts
+ * the encoded records into the DB. At most max_pending records are encoded
+ * ahead of the one being written, which bounds the memory held when the DB
+ * is slower than the encoders, or one record is slow to encode.
+ */
+class ParallelDBWriter {
+ public:
+  /**
+   * @brief Encodes record index into its key and value; returns false to
+   *        leave the record out. Called on several threads at once.
+   */
+  typedef boost::function<bool(int, string*, string*)> EncodeFunc;
+
+  /// @param num_threads encoding threads; 0 for one per core.
+  ParallelDBWriter(db::DB* db, int num_threads, int max_pending,
+      int commit_every);
+  ~ParallelDBWriter();
+
+  /**
+   * @brief Writes records [0, num) and returns how many were encoded.
+   *
+   * First encodes sample_size records spread over the range to Reserve
+   * the DB for all of them.
+   */
+  int Run(int num, const EncodeFunc& encode, int sample_size);
+
+ protected:
+  void Reserve(int num, int sample_size);
+  void EncodeSample(const vector<int>& indices, vector<size_t>* bytes,
+      int begin, int end);
+  void WorkerEntry();
+
+  /**
+   Move synchronization fields out instead of including boost/thread.hpp
+   to avoid a boost/NVCC issues (#1009, #1010) on OSX.
+   */
+  class sync;
+
+  struct Record {
+    bool ready;
+    bool ok;
+    string key;
+    string value;
+  };
+
+  db::DB* db_;
+  int num_threads_;
+  int max_pending_;
+  int commit_every_;
+  shared_ptr<sync> sync_;
+
+  // State of the current Run, guarded by sync_: records are encoded into
+  // pending_[index % max_pending_].
+  EncodeFunc encode_;
+  int num_;
+  int next_encode_;
+  int next_write_;
+  vector<Record> pending_;
+
+DISABLE_COPY_AND_ASSIGN(ParallelDBWriter);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_PARALLEL_DB_WRITER_HPP_
@@ -0,0 +1,54 @@
+#ifndef CAFFE_UTIL_RECORD_ARENA_HPP_
+#define CAFFE_UTIL_RECORD_ARENA_HPP_
+
+#include <google/protobuf/stubs/common.h>
+
+#if GOOGLE_PROTOBUF_VERSION >= 3000000
+#include <google/protobuf/arena.h>
+#define CAFFE_RECORD_ARENA
+#endif
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Allocates the records a reader recycles through its queues.
+ *
+ * The queues of one source share a protobuf Arena, so records swapped from
+ * queue to queue stay on the same arena (a swap is then a pointer swap) and
+ * are all freed with it. Without arenas (protobuf 2) records come from the
+ * heap and are deleted with Release.
+ */
+class RecordArena {
+ public:
+  RecordArena() {}
+
+  template <typename Message>
+  Message* Create() {
+#ifdef CAFFE_RECORD_ARENA
+    return google::protobuf::Arena::CreateMessage<Message>(&arena_);
+#else
+    return new Message();
+#endif
+  }
+
+  /// Frees a record of Create unless the arena owns it.
+  template <typename Message>
+  static void Release(Message* record) {
+#ifndef CAFFE_RECORD_ARENA
+    delete record;
+#endif
+  }
+
+ protected:
+#ifdef CAFFE_RECORD_ARENA
+  google::protobuf::Arena arena_;
+#endif
+
+DISABLE_COPY_AND_ASSIGN(RecordArena);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_RECORD_ARENA_HPP_
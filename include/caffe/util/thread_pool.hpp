@@ -0,0 +1,66 @@
+#ifndef CAFFE_UTIL_THREAD_POOL_HPP_
+#define CAFFE_UTIL_THREAD_POOL_HPP_
+
+#include <boost/function.hpp>
+#include <vector>
+
+#include "caffe/common.hpp"
+
+/**
+ Forward declare boost::thread instead of including boost/thread.hpp
+ to avoid a boost/NVCC issues (#1009, #1010) on OSX.
+ */
+namespace boost { class thread; }
+
+namespace caffe {
+
+/**
+ * @brief A fixed set of worker threads that run data-parallel loops for
+ *        CPU layers.
+ *
+ * ParallelFor splits [0, n) into chunks that are handed out to the workers
+ * and to the calling thread, and blocks until every chunk is done. Callers
+ * that write results per index (and reduce them afterwards in index order)
+ * get the same output no matter how many threads the pool has.
+ */
+class ThreadPool {
+ public:
+  /// @param num_threads total parallelism including the calling thread;
+  ///        0 picks boost::thread::hardware_concurrency().
+  explicit ThreadPool(int num_threads);
+  ~ThreadPool();
+
+  /// Calls func(begin, end) on disjoint ranges covering [0, n).
+  void ParallelFor(int n, const boost::function<void(int, int)>& func);
+
+  inline int size() const { return num_threads_; }
+
+ protected:
+  void WorkerEntry();
+  void RunChunks();
+
+  /**
+   Move synchronization fields out instead of including boost/thread.hpp
+   to avoid a boost/NVCC issues (#1009, #1010) on OSX.
+   */
+  class sync;
+
+  int num_threads_;
+  vector<shared_ptr<boost::thread> > workers_;
+  shared_ptr<sync> sync_;
+
+  // State of the loop currently being run, guarded by sync_.
+  boost::function<void(int, int)> func_;
+  int n_;
+  int grain_;
+  int next_;
+  int busy_;
+  int generation_;
+  bool stop_;
+
+DISABLE_COPY_AND_ASSIGN(ThreadPool);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_THREAD_POOL_HPP_
@@ -0,0 +1,72 @@
+#ifndef CAFFE_UTIL_TRIPLET_LIST_HPP_
+#define CAFFE_UTIL_TRIPLET_LIST_HPP_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/rng.hpp"
+#include "caffe/util/thread_pool.hpp"
+
+namespace caffe {
+
+/**
+ * @brief A list of image triplets with every distinct path stored once.
+ *
+ * The paths live back to back in one character pool and a triplet is three
+ * path ids, so memory grows with the number of distinct paths plus 12 bytes
+ * per triplet rather than with three strings per triplet.
+ */
+class TripletList {
+ public:
+  struct Triplet {
+    uint32_t id[3];
+  };
+
+  TripletList() {}
+
+  /**
+   * @brief Reads source, a text file with one triplet of whitespace
+   *        separated paths per line, appending to the list.
+   *
+   * Blocks of the file are split into lines and their paths interned on
+   * pool; the triplets keep the order of the file. Lines that do not hold
+   * exactly three paths are skipped with a warning.
+   */
+  void Load(const string& source, ThreadPool* pool);
+
+  /**
+   * @brief Drops the triplets that refer to a file which cannot be opened
+   *        or does not start with the header of an image format OpenCV
+   *        reads. Each distinct path is checked once, on pool.
+   * @return the number of triplets dropped.
+   */
+  int Validate(const string& root_folder, ThreadPool* pool);
+
+  void Shuffle(caffe::rng_t* rng);
+
+  inline int size() const { return triplets_.size(); }
+  inline int num_paths() const { return offsets_.size(); }
+  inline const Triplet& triplet(int i) const { return triplets_[i]; }
+  inline const char* path(uint32_t id) const {
+    return &pool_[offsets_[id]];
+  }
+  /// Bytes held by the pool, the path offsets and the triplets.
+  size_t memory_bytes() const;
+
+ protected:
+  /// NUL-terminated paths, and where each path id starts in pool_.
+  vector<char> pool_;
+  vector<uint64_t> offsets_;
+  vector<Triplet> triplets_;
+
+DISABLE_COPY_AND_ASSIGN(TripletList);
+};
+
+/// Whether the file starts with the header of an image format OpenCV reads.
+bool HasImageHeader(const string& filename);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_TRIPLET_LIST_HPP_
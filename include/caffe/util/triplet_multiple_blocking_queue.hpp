@@ -1,6 +1,7 @@
 #ifndef CAFFE_UTIL_TRIPLET_MULTIPLE_BLOCKING_QUEUE_HPP_
 #define CAFFE_UTIL_TRIPLET_MULTIPLE_BLOCKING_QUEUE_HPP_
 
+#include <stdint.h>
 #include <queue>
 #include <string>
 
@@ -26,6 +27,13 @@ class TripletMultipleBlockingQueue {
 
   size_t size() const;
 
+  // Starvation counters: how many pop() calls there were, how many of them
+  // found the queue empty, and how long those waited in total. A wait in
+  // peek() is counted with the pop() of the same element.
+  uint64_t num_pops() const;
+  uint64_t num_waits() const;
+  double wait_seconds() const;
+
  protected:
   /**
    Move synchronization fields out instead of including boost/thread.hpp
@@ -36,6 +44,11 @@ class TripletMultipleBlockingQueue {
 
   std::queue<T> queue_;
   shared_ptr<sync> sync_;
+  uint64_t num_pops_;
+  uint64_t num_waits_;
+  uint64_t wait_us_;
+  /// the front element was waited for; counted when it is popped
+  bool front_waited_;
 
 DISABLE_COPY_AND_ASSIGN(TripletMultipleBlockingQueue);
 };
@@ -15,9 +15,7 @@ using boost::weak_ptr;
 map<const string, weak_ptr<DataReader::Body> > DataReader::bodies_;
 static boost::mutex bodies_mutex_;
 
-DataReader::DataReader(const LayerParameter& param)
-    : queue_pair_(new QueuePair(  //
-        param.data_param().prefetch() * param.data_param().batch_size())) {
+DataReader::DataReader(const LayerParameter& param) {
   // Get or create a body
   boost::mutex::scoped_lock lock(bodies_mutex_);
   string key = source_key(param);
@@ -27,6 +25,9 @@ DataReader::DataReader(const LayerParameter& param)
     body_.reset(new Body(param));
     bodies_[key] = weak_ptr<Body>(body_);
   }
+  queue_pair_.reset(new QueuePair(
+      param.data_param().prefetch() * param.data_param().batch_size(),
+      body_->arena_));
   body_->new_queue_pairs_.push(queue_pair_);
 }
 
@@ -41,20 +42,21 @@ DataReader::~DataReader() {
 
 //
 
-DataReader::QueuePair::QueuePair(int size) {
+DataReader::QueuePair::QueuePair(int size,
+    const shared_ptr<RecordArena>& arena) : arena_(arena) {
   // Initialize the free queue with requested number of datums
   for (int i = 0; i < size; ++i) {
-    free_.push(new Datum());
+    free_.push(arena_->Create<Datum>());
   }
 }
 
 DataReader::QueuePair::~QueuePair() {
   Datum* datum;
   while (free_.try_pop(&datum)) {
-    delete datum;
+    RecordArena::Release(datum);
   }
   while (full_.try_pop(&datum)) {
-    delete datum;
+    RecordArena::Release(datum);
   }
 }
 
@@ -62,6 +64,9 @@ DataReader::QueuePair::~QueuePair() {
 
 DataReader::Body::Body(const LayerParameter& param)
     : param_(param),
+      arena_(new RecordArena()),
+      next_shard_(0),
+      pass_left_(0),
       new_queue_pairs_() {
   StartInternalThread();
 }
@@ -74,6 +79,7 @@ void DataReader::Body::InternalThreadEntry() {
   shared_ptr<db::DB> db(db::GetDB(param_.data_param().backend()));
   db->Open(param_.data_param().source(), db::READ);
   shared_ptr<db::Cursor> cursor(db->NewCursor());
+  StartShards(db.get(), cursor.get());
   vector<shared_ptr<QueuePair> > qps;
   try {
     int solver_count = param_.phase() == TRAIN ? Caffe::solver_count() : 1;
@@ -86,11 +92,27 @@ void DataReader::Body::InternalThreadEntry() {
       read_one(cursor.get(), qp.get());
       qps.push_back(qp);
     }
+    // Log the queue waits about every report_interval batches.
+    const uint64_t report_records =
+        static_cast<uint64_t>(param_.prefetch_param().report_interval())
+        * param_.data_param().batch_size();
+    uint64_t records = 0;
     // Main loop
     while (!must_stop()) {
       for (int i = 0; i < solver_count; ++i) {
         read_one(cursor.get(), qps[i].get());
       }
+      if (report_records > 0 && ++records % report_records == 0) {
+        for (int i = 0; i < solver_count; ++i) {
+          LOG(INFO) << "Reader of " << param_.name() << " queue " << i
+              << ": layer waited " << qps[i]->full_.num_waits() << " / "
+              << qps[i]->full_.num_pops() << " times, "
+              << qps[i]->full_.wait_seconds() << " s; reader waited "
+              << qps[i]->free_.num_waits() << " / "
+              << qps[i]->free_.num_pops() << " times, "
+              << qps[i]->free_.wait_seconds() << " s";
+        }
+      }
       // Check no additional readers have been created. This can happen if
       // more than one net is trained at a time per process, whether single
       // or multi solver. It might also happen if two data layers have same
@@ -100,12 +122,59 @@ void DataReader::Body::InternalThreadEntry() {
   } catch (boost::thread_interrupted&) {
     // Interrupted exception is expected on shutdown
   }
+  // Their cursors must go before db. A stop request that ended the loop
+  // through must_stop() is still pending, and would cut the joins of the
+  // shards short, leaving them running on freed queues.
+  boost::this_thread::disable_interruption no_interruption;
+  shards_.clear();
+}
+
+void DataReader::Body::StartShards(db::DB* db, db::Cursor* cursor) {
+  const int reader_threads = param_.data_param().reader_threads();
+  if (reader_threads <= 1) {
+    return;
+  }
+  vector<string> starts;
+  const int64_t count = db::ShardKeyRanges(cursor, reader_threads, &starts);
+  for (int i = 0; i < reader_threads; ++i) {
+    shard_records_.push_back((i + 1) * count / reader_threads
+        - i * count / reader_threads);
+    // Cursors are made here, one at a time, and then only used by a shard.
+    shards_.push_back(shared_ptr<Shard>(new Shard(db->NewCursor(), starts[i],
+        i + 1 < reader_threads ? starts[i + 1] : string(),
+        param_.data_param().batch_size(), arena_)));
+  }
+  LOG(INFO) << "Reading " << param_.data_param().source() << " with "
+      << reader_threads << " threads";
 }
 
 void DataReader::Body::read_one(db::Cursor* cursor, QueuePair* qp) {
   Datum* datum = qp->free_.pop();
-  // TODO deserialize in-place instead of copy?
-  datum->ParseFromString(cursor->value());
+  if (!shards_.empty()) {
+    // Each shard gives as many records per pass as its range holds, so that
+    // every pass has each record once, in the same order.
+    if (pass_left_ == 0) {
+      shard_left_ = shard_records_;
+      for (int i = 0; i < shard_records_.size(); ++i) {
+        pass_left_ += shard_records_[i];
+      }
+      next_shard_ = 0;
+    }
+    while (shard_left_[next_shard_] == 0) {
+      next_shard_ = (next_shard_ + 1) % shards_.size();
+    }
+    --shard_left_[next_shard_];
+    --pass_left_;
+    // Swap the next parsed record in, giving the shard back an empty one.
+    QueuePair* shard = &shards_[next_shard_]->qp_;
+    next_shard_ = (next_shard_ + 1) % shards_.size();
+    Datum* parsed = shard->full_.pop();
+    datum->Swap(parsed);
+    shard->free_.push(parsed);
+    qp->full_.push(datum);
+    return;
+  }
+  db::ParseValue(cursor, datum);
   qp->full_.push(datum);
 
   // go to the next iter
@@ -116,4 +185,33 @@ void DataReader::Body::read_one(db::Cursor* cursor, QueuePair* qp) {
   }
 }
 
+//
+
+DataReader::Shard::Shard(db::Cursor* cursor, const string& begin,
+    const string& end, int size, const shared_ptr<RecordArena>& arena)
+    : qp_(size, arena), cursor_(cursor), begin_(begin), end_(end) {
+  StartInternalThread();
+}
+
+DataReader::Shard::~Shard() {
+  StopInternalThread();
+}
+
+void DataReader::Shard::InternalThreadEntry() {
+  try {
+    cursor_->Seek(begin_);
+    while (!must_stop()) {
+      Datum* datum = qp_.free_.pop();
+      db::ParseValue(cursor_.get(), datum);
+      qp_.full_.push(datum);
+      cursor_->Next();
+      if (!cursor_->valid() || (!end_.empty() && cursor_->key() >= end_)) {
+        cursor_->Seek(begin_);
+      }
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+}
+
 }  // namespace caffe
@@ -440,18 +440,18 @@ DataTransformer<Dtype>::DataTransformer(const TransformationParameter& param,
 }
 
 template<typename Dtype>
-void DataTransformer<Dtype>::Transform(const Datum& datum,
+void DataTransformer<Dtype>::Transform(const DatumView& view,
                                        Dtype* transformed_data) {
-  const string& data = datum.data();
-  const int datum_channels = datum.channels();
-  const int datum_height = datum.height();
-  const int datum_width = datum.width();
+  const char* data = view.data;
+  const int datum_channels = view.channels;
+  const int datum_height = view.height;
+  const int datum_width = view.width;
 
   const int crop_size = param_.crop_size();
   const Dtype scale = param_.scale();
   const bool do_mirror = param_.mirror() && Rand(2);
   const bool has_mean_file = param_.has_mean_file();
-  const bool has_uint8 = data.size() > 0;
+  const bool has_uint8 = view.size > 0;
   const bool has_mean_values = mean_values_.size() > 0;
 
   CHECK_GT(datum_channels, 0);
@@ -509,7 +509,7 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
           datum_element =
             static_cast<Dtype>(static_cast<uint8_t>(data[data_index]));
         } else {
-          datum_element = datum.float_data(data_index);
+          datum_element = view.float_data[data_index];
         }
         if (has_mean_file) {
           transformed_data[top_index] =
@@ -528,23 +528,33 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
 }
 
 
+#ifdef USE_OPENCV
+template<typename Dtype>
+cv::Mat DataTransformer<Dtype>::DecodeView(const DatumView& view) {
+  CHECK(!(param_.force_color() && param_.force_gray()))
+      << "cannot set both force_color and force_gray";
+  if (param_.force_color() || param_.force_gray()) {
+    // If force_color then decode in color otherwise decode in gray.
+    return DecodeBytesToCVMat(view.data, view.size, param_.force_color());
+  }
+  return DecodeBytesToCVMatNative(view.data, view.size);
+}
+#endif  // USE_OPENCV
+
 template<typename Dtype>
 void DataTransformer<Dtype>::Transform(const Datum& datum,
                                        Blob<Dtype>* transformed_blob) {
-  // If datum is encoded, decoded and transform the cv::image.
-  if (datum.encoded()) {
+  Transform(DatumView(datum), transformed_blob);
+}
+
+template<typename Dtype>
+void DataTransformer<Dtype>::Transform(const DatumView& view,
+                                       Blob<Dtype>* transformed_blob) {
+  // If the image is encoded, decode and transform the cv::image.
+  if (view.encoded) {
 #ifdef USE_OPENCV
-    CHECK(!(param_.force_color() && param_.force_gray()))
-        << "cannot set both force_color and force_gray";
-    cv::Mat cv_img;
-    if (param_.force_color() || param_.force_gray()) {
-    // If force_color then decode in color otherwise decode in gray.
-      cv_img = DecodeDatumToCVMat(datum, param_.force_color());
-    } else {
-      cv_img = DecodeDatumToCVMatNative(datum);
-    }
     // Transform the cv::image into blob.
-    return Transform(cv_img, transformed_blob);
+    return Transform(DecodeView(view), transformed_blob);
 #else
     LOG(FATAL) << "Encoded datum requires OpenCV; compile with USE_OPENCV.";
 #endif  // USE_OPENCV
@@ -555,9 +565,9 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
   }
 
   const int crop_size = param_.crop_size();
-  const int datum_channels = datum.channels();
-  const int datum_height = datum.height();
-  const int datum_width = datum.width();
+  const int datum_channels = view.channels;
+  const int datum_height = view.height;
+  const int datum_width = view.width;
 
   // Check dimensions.
   const int channels = transformed_blob->channels();
@@ -579,7 +589,7 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
   }
 
   Dtype* transformed_data = transformed_blob->mutable_cpu_data();
-  Transform(datum, transformed_data);
+  Transform(view, transformed_data);
 }
 
 template<typename Dtype>
@@ -848,27 +858,23 @@ void DataTransformer<Dtype>::Transform(Blob<Dtype>* input_blob,
 
 template<typename Dtype>
 vector<int> DataTransformer<Dtype>::InferBlobShape(const Datum& datum) {
-  if (datum.encoded()) {
+  return InferBlobShape(DatumView(datum));
+}
+
+template<typename Dtype>
+vector<int> DataTransformer<Dtype>::InferBlobShape(const DatumView& view) {
+  if (view.encoded) {
 #ifdef USE_OPENCV
-    CHECK(!(param_.force_color() && param_.force_gray()))
-        << "cannot set both force_color and force_gray";
-    cv::Mat cv_img;
-    if (param_.force_color() || param_.force_gray()) {
-    // If force_color then decode in color otherwise decode in gray.
-      cv_img = DecodeDatumToCVMat(datum, param_.force_color());
-    } else {
-      cv_img = DecodeDatumToCVMatNative(datum);
-    }
     // InferBlobShape using the cv::image.
-    return InferBlobShape(cv_img);
+    return InferBlobShape(DecodeView(view));
 #else
     LOG(FATAL) << "Encoded datum requires OpenCV; compile with USE_OPENCV.";
 #endif  // USE_OPENCV
   }
   const int crop_size = param_.crop_size();
-  const int datum_channels = datum.channels();
-  const int datum_height = datum.height();
-  const int datum_width = datum.width();
+  const int datum_channels = view.channels;
+  const int datum_height = view.height;
+  const int datum_width = view.width;
   // Check dimensions.
   CHECK_GT(datum_channels, 0);
   CHECK_GE(datum_height, crop_size);
@@ -932,7 +938,17 @@ void DataTransformer<Dtype>::InitRand() {
   const bool needs_rand = param_.mirror() ||
       (phase_ == TRAIN && param_.crop_size());
   if (needs_rand) {
-    const unsigned int rng_seed = caffe_rng_rand();
+    InitRand(caffe_rng_rand());
+  } else {
+    rng_.reset();
+  }
+}
+
+template <typename Dtype>
+void DataTransformer<Dtype>::InitRand(unsigned int rng_seed) {
+  const bool needs_rand = param_.mirror() ||
+      (phase_ == TRAIN && param_.crop_size());
+  if (needs_rand) {
     rng_.reset(new Caffe::RNG(rng_seed));
   } else {
     rng_.reset();
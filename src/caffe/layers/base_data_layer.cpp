@@ -1,4 +1,6 @@
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
+#include <algorithm>
 #include <vector>
 
 #include "caffe/blob.hpp"
@@ -8,6 +10,7 @@
 #include "caffe/layers/base_data_layer.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/math_functions.hpp"
 
 namespace caffe {
 
@@ -36,9 +39,13 @@ template <typename Dtype>
 BasePrefetchingDataLayer<Dtype>::BasePrefetchingDataLayer(
     const LayerParameter& param)
     : BaseDataLayer<Dtype>(param),
-      prefetch_free_(), prefetch_full_() {
-  for (int i = 0; i < PREFETCH_COUNT; ++i) {
-    prefetch_free_.push(&prefetch_[i]);
+      prefetch_free_(), prefetch_full_(), prefetch_current_(NULL),
+      forward_count_(0), starved_count_(0) {
+  const int depth = param.prefetch_param().depth();
+  CHECK_GT(depth, 0) << "prefetch_param.depth must be positive";
+  for (int i = 0; i < depth; ++i) {
+    prefetch_.push_back(shared_ptr<Batch<Dtype> >(new Batch<Dtype>()));
+    prefetch_free_.push(prefetch_[i].get());
   }
 }
 
@@ -50,22 +57,34 @@ void BasePrefetchingDataLayer<Dtype>::LayerSetUp(
   // calls so that the prefetch thread does not accidentally make simultaneous
   // cudaMalloc calls when the main thread is running. In some GPUs this
   // seems to cause failures if we do not so.
-  for (int i = 0; i < PREFETCH_COUNT; ++i) {
-    prefetch_[i].data_.mutable_cpu_data();
+  for (int i = 0; i < prefetch_.size(); ++i) {
+    prefetch_[i]->data_.mutable_cpu_data();
     if (this->output_labels_) {
-      prefetch_[i].label_.mutable_cpu_data();
+      prefetch_[i]->label_.mutable_cpu_data();
     }
   }
 #ifndef CPU_ONLY
   if (Caffe::mode() == Caffe::GPU) {
-    for (int i = 0; i < PREFETCH_COUNT; ++i) {
-      prefetch_[i].data_.mutable_gpu_data();
+    for (int i = 0; i < prefetch_.size(); ++i) {
+      prefetch_[i]->data_.mutable_gpu_data();
       if (this->output_labels_) {
-        prefetch_[i].label_.mutable_gpu_data();
+        prefetch_[i]->label_.mutable_gpu_data();
       }
     }
   }
 #endif
+  CHECK_GT(this->layer_param_.prefetch_param().grow_window(), 0);
+  const int decode_threads =
+      this->layer_param_.prefetch_param().decode_threads();
+  if (decode_threads > 1) {
+    decode_pool_.reset(new ThreadPool(decode_threads));
+    for (int i = 0; i < decode_threads; ++i) {
+      lane_transformers_.push_back(shared_ptr<DataTransformer<Dtype> >(
+          new DataTransformer<Dtype>(this->transform_param_, this->phase_)));
+      lane_data_.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    }
+    LOG(INFO) << "Decoding with " << decode_threads << " threads";
+  }
   DLOG(INFO) << "Initializing prefetch";
   this->data_transformer_->InitRand();
   StartInternalThread();
@@ -103,25 +122,145 @@ void BasePrefetchingDataLayer<Dtype>::InternalThreadEntry() {
 #endif
 }
 
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::LoadItems(int n,
+    const LoadItemFunc& load_item) {
+  if (!decode_pool_) {
+    for (int item_id = 0; item_id < n; ++item_id) {
+      load_item(item_id, this->data_transformer_.get(),
+          &this->transformed_data_);
+    }
+    return;
+  }
+  // Seeds come from the prefetch thread's RNG in item order, so an item's
+  // random crop and mirror do not depend on which lane runs it.
+  item_seeds_.resize(n);
+  for (int item_id = 0; item_id < n; ++item_id) {
+    item_seeds_[item_id] = caffe_rng_rand();
+  }
+  for (int i = 0; i < lane_data_.size(); ++i) {
+    lane_data_[i]->ReshapeLike(this->transformed_data_);
+  }
+  decode_pool_->ParallelFor(std::min<int>(n, lane_data_.size()), boost::bind(
+      &BasePrefetchingDataLayer<Dtype>::LoadLanes, this, n, &load_item,
+      _1, _2));
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::LoadLanes(int n,
+    const LoadItemFunc* load_item, int begin, int end) {
+  const int lanes = lane_data_.size();
+  for (int lane = begin; lane < end; ++lane) {
+    DataTransformer<Dtype>* transformer = lane_transformers_[lane].get();
+    for (int item_id = lane; item_id < n; item_id += lanes) {
+      transformer->InitRand(item_seeds_[item_id]);
+      (*load_item)(item_id, transformer, lane_data_[lane].get());
+    }
+  }
+}
+
+template <typename Dtype>
+Batch<Dtype>* BasePrefetchingDataLayer<Dtype>::NextBatch() {
+  const PrefetchParameter& param = this->layer_param_.prefetch_param();
+  // Solvers sharing this layer pop prefetch_full_ concurrently, so a wait
+  // counted here may be another solver's; the growth heuristic tolerates it.
+  const uint64_t waits = prefetch_full_.num_waits();
+  Batch<Dtype>* batch = prefetch_full_.pop("Data layer prefetch queue empty");
+  if (prefetch_full_.num_waits() > waits) {
+    ++starved_count_;
+  }
+  OnNextBatch(*batch);
+  ++forward_count_;
+  if (forward_count_ % param.grow_window() == 0) {
+    if (starved_count_ > param.grow_threshold() * param.grow_window()) {
+      LOG(INFO) << "Data layer " << this->layer_param_.name() << " waited in "
+          << starved_count_ << " of the last " << param.grow_window()
+          << " forward passes";
+      GrowPrefetch(*batch);
+    }
+    starved_count_ = 0;
+  }
+  if (param.report_interval() > 0 &&
+      forward_count_ % param.report_interval() == 0) {
+    LOG(INFO) << "Data layer " << this->layer_param_.name() << " prefetch "
+        << "depth " << prefetch_.size() << ": net waited "
+        << prefetch_full_.num_waits() << " / " << prefetch_full_.num_pops()
+        << " times, " << prefetch_full_.wait_seconds() << " s; prefetch "
+        << "thread waited " << prefetch_free_.num_waits() << " / "
+        << prefetch_free_.num_pops() << " times, "
+        << prefetch_free_.wait_seconds() << " s";
+  }
+  return batch;
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::GrowPrefetch(const Batch<Dtype>& like) {
+  const PrefetchParameter& param = this->layer_param_.prefetch_param();
+  if (prefetch_.size() >= param.max_depth()) {
+    return;
+  }
+  const size_t batch_bytes =
+      (like.data_.count() + like.label_.count()) * sizeof(Dtype);
+  if (param.memory_budget_mb() > 0 && (prefetch_.size() + 1) * batch_bytes >
+      static_cast<size_t>(param.memory_budget_mb()) << 20) {
+    LOG_FIRST_N(INFO, 1) << "Prefetch depth of " << this->layer_param_.name()
+        << " held at " << prefetch_.size() << " by memory_budget_mb";
+    return;
+  }
+  // Allocate here rather than in the prefetch thread, as in LayerSetUp.
+  shared_ptr<Batch<Dtype> > batch(new Batch<Dtype>());
+  batch->data_.ReshapeLike(like.data_);
+  batch->data_.mutable_cpu_data();
+  if (this->output_labels_) {
+    batch->label_.ReshapeLike(like.label_);
+    batch->label_.mutable_cpu_data();
+  }
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    batch->data_.mutable_gpu_data();
+    if (this->output_labels_) {
+      batch->label_.mutable_gpu_data();
+    }
+  }
+#endif
+  prefetch_.push_back(batch);
+  prefetch_free_.push(batch.get());
+  LOG(INFO) << "Prefetch depth of " << this->layer_param_.name()
+      << " grown to " << prefetch_.size();
+}
+
 template <typename Dtype>
 void BasePrefetchingDataLayer<Dtype>::Forward_cpu(
     const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
-  Batch<Dtype>* batch = prefetch_full_.pop("Data layer prefetch queue empty");
+  // The net is done with the batch handed out by the previous pass.
+  if (prefetch_current_) {
+    prefetch_free_.push(prefetch_current_);
+    prefetch_current_ = NULL;
+  }
+  Batch<Dtype>* batch = NextBatch();
   // Reshape to loaded data.
   top[0]->ReshapeLike(batch->data_);
-  // Copy the data
-  caffe_copy(batch->data_.count(), batch->data_.cpu_data(),
-             top[0]->mutable_cpu_data());
-  DLOG(INFO) << "Prefetch copied";
   if (this->output_labels_) {
     // Reshape to loaded labels.
     top[1]->ReshapeLike(batch->label_);
-    // Copy the labels.
-    caffe_copy(batch->label_.count(), batch->label_.cpu_data(),
-        top[1]->mutable_cpu_data());
   }
-
-  prefetch_free_.push(batch);
+  if (Caffe::solver_count() > 1) {
+    // The solvers share this layer but not its tops, so they get copies.
+    caffe_copy(batch->data_.count(), batch->data_.cpu_data(),
+               top[0]->mutable_cpu_data());
+    if (this->output_labels_) {
+      caffe_copy(batch->label_.count(), batch->label_.cpu_data(),
+          top[1]->mutable_cpu_data());
+    }
+    prefetch_free_.push(batch);
+    return;
+  }
+  // Hand the batch memory itself to the tops until the next pass.
+  top[0]->set_cpu_data(batch->data_.mutable_cpu_data());
+  if (this->output_labels_) {
+    top[1]->set_cpu_data(batch->label_.mutable_cpu_data());
+  }
+  prefetch_current_ = batch;
 }
 
 #ifdef CPU_ONLY
@@ -7,23 +7,40 @@ namespace caffe {
 template <typename Dtype>
 void BasePrefetchingDataLayer<Dtype>::Forward_gpu(
     const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
-  Batch<Dtype>* batch = prefetch_full_.pop("Data layer prefetch queue empty");
+  // The net is done with the batch handed out by the previous pass.
+  if (prefetch_current_) {
+    prefetch_free_.push(prefetch_current_);
+    prefetch_current_ = NULL;
+  }
+  Batch<Dtype>* batch = NextBatch();
   // Reshape to loaded data.
   top[0]->ReshapeLike(batch->data_);
-  // Copy the data
-  caffe_copy(batch->data_.count(), batch->data_.gpu_data(),
-      top[0]->mutable_gpu_data());
   if (this->output_labels_) {
     // Reshape to loaded labels.
     top[1]->ReshapeLike(batch->label_);
-    // Copy the labels.
-    caffe_copy(batch->label_.count(), batch->label_.gpu_data(),
-        top[1]->mutable_gpu_data());
   }
-  // Ensure the copy is synchronous wrt the host, so that the next batch isn't
-  // copied in meanwhile.
-  CUDA_CHECK(cudaStreamSynchronize(cudaStreamDefault));
-  prefetch_free_.push(batch);
+  if (Caffe::solver_count() > 1) {
+    // The solvers share this layer but not its tops, so they get copies.
+    caffe_copy(batch->data_.count(), batch->data_.gpu_data(),
+        top[0]->mutable_gpu_data());
+    if (this->output_labels_) {
+      caffe_copy(batch->label_.count(), batch->label_.gpu_data(),
+          top[1]->mutable_gpu_data());
+    }
+    // Ensure the copy is synchronous wrt the host, so that the next batch
+    // isn't copied in meanwhile.
+    CUDA_CHECK(cudaStreamSynchronize(cudaStreamDefault));
+    prefetch_free_.push(batch);
+    return;
+  }
+  // Hand the batch memory itself to the tops until the next pass. gpu_data()
+  // leaves the batch synced, so refilling it on the prefetch thread does not
+  // first copy it back from the device.
+  top[0]->set_gpu_data(const_cast<Dtype*>(batch->data_.gpu_data()));
+  if (this->output_labels_) {
+    top[1]->set_gpu_data(const_cast<Dtype*>(batch->label_.gpu_data()));
+  }
+  prefetch_current_ = batch;
 }
 
 INSTANTIATE_LAYER_GPU_FORWARD(BasePrefetchingDataLayer);
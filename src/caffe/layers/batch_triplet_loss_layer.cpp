@@ -1,5 +1,8 @@
+#include <boost/bind.hpp>
 #include <algorithm>
 #include <cfloat>
+#include <cmath>
+#include <limits>
 #include <vector>
 
 #include "caffe/layers/batch_triplet_loss_layer.hpp"
@@ -31,6 +34,22 @@ void BatchTripletLossLayer<Dtype>::LayerSetUp(
     
   margin_ = this->layer_param_.triplet_loss_param().margin();
   mu_ = this->layer_param_.triplet_loss_param().mu();
+  tile_size_ = this->layer_param_.triplet_loss_param().tile_size();
+  bank_rows_ = 0;
+  bank_label_ = NULL;
+  bank_norm_ = NULL;
+  int bank_size = this->layer_param_.triplet_loss_param().memory_bank_size();
+  if (bank_size > 0) {
+    bank_.reset(new MemoryBank<Dtype>(bank_size,
+        bottom[0]->count() / bottom[0]->num()));
+  }
+  loss_mode_ = this->layer_param_.triplet_loss_param().loss_mode();
+  if (loss_mode_ != TripletLossParameter_LossMode_TRIPLET) {
+    CHECK_EQ(tile_size_, 0) << "NPAIR and LIFTED need the dense layout.";
+    CHECK(!bank_) << "NPAIR and LIFTED do not support the memory bank.";
+  }
+  pool_.reset(new ThreadPool(
+      this->layer_param_.triplet_loss_param().num_threads()));
 }
 
 template <typename Dtype>
@@ -44,145 +63,201 @@ void BatchTripletLossLayer<Dtype>::Reshape(
   }
 
   int num = bottom[0]->num();
-  dist_.Reshape(num, num, 1, 1);
   norm_.Reshape(num, 1, 1, 1);
-  aggregator_.reset(new SyncedMemory(num * num * sizeof(Dtype)));
+  if (tile_size_ > 0) {
+    tile_grad_.ReshapeLike(*bottom[0]);
+    return;
+  }
+  dist_.Reshape(num, num, 1, 1);
+  if (!aggregator_ || aggregator_->size() != num * num * sizeof(Dtype)) {
+    aggregator_.reset(new SyncedMemory(num * num * sizeof(Dtype)));
+  }
 }
 
 
 template <typename Dtype>
 void BatchTripletLossLayer<Dtype>::Forward_cpu(
     const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
-  // The forward pass computes the pairwise distances.
+  if (tile_size_ > 0) {
+    ForwardTiled(bottom, top);
+    return;
+  }
   const Dtype* feat_data = bottom[0]->cpu_data();
-  const Dtype* label = bottom[1]->cpu_data();
-  Dtype* loss_data = top[0]->mutable_cpu_data();
-  Dtype* accy_data = top[1]->mutable_cpu_data();
   int num = bottom[0]->num();
   int dim = bottom[0]->count() / num;
-  bool sample = this->layer_param_.triplet_loss_param().sample();
+
+  caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, num, num, dim, Dtype(-2),
+      feat_data, feat_data, Dtype(0), dist_.mutable_cpu_data());
+  SyncBank();
+  if (bank_rows_ > 0) {
+    bank_dist_.Reshape(num, bank_rows_, 1, 1);
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, num, bank_rows_, dim,
+        Dtype(-2), feat_data, bank_->feat().cpu_data(), Dtype(0),
+        bank_dist_.mutable_cpu_data());
+  }
+  MineTriplets(bottom, top);
+}
+
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::MineTriplets(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  const Dtype* label = bottom[1]->cpu_data();
+  int num = bottom[0]->num();
 
   /**
-   * Computing the pairwise Euclidean distance
+   * dist_ holds -2 * X * X^T, so the squared norms sit on its diagonal.
+   * Each anchor adds them to its own row right before mining it.
    */
   Dtype* norm_data = norm_.mutable_cpu_data();
-  memset(norm_data, 0, norm_.count() * sizeof(norm_data[0]));
-  triplets_.clear();
-  pos_pairs_.clear();
-
-  Dtype* dist_data = dist_.mutable_cpu_data();
-  caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, num, num, dim, Dtype(-2),
-      feat_data, feat_data, Dtype(0), dist_data);
-
   for (int i=0; i<num; ++i) {
     norm_data[i] = -0.5 * dist_.data_at(i, i, 0, 0);
   }
+  GroupLabels(label, num);
+  stats_.resize(num);
 
-  for (int i=0; i<num; ++i) {
-    dist_data = dist_.mutable_cpu_data() + dist_.offset(i);
-    for (int j=0; j<num; ++j) {
-      dist_data[j] += (norm_data[i] + norm_data[j]);
+  if (loss_mode_ != TripletLossParameter_LossMode_TRIPLET) {
+    // one term per ordered (NPAIR) or unordered (LIFTED) positive pair
+    int64_t num_terms = 0;
+    for (int g=0; g+1<boundary_.size(); ++g) {
+      int64_t size = boundary_[g+1] - boundary_[g];
+      num_terms += size * (size - 1);
     }
+    if (loss_mode_ == TripletLossParameter_LossMode_LIFTED) {
+      num_terms /= 2;
+    }
+    term_scale_ = num_terms > 0 ? Dtype(1) / num_terms : Dtype(0);
+    log_neg_sum_.resize(num);
+    pool_->ParallelFor(num, boost::bind(
+        &BatchTripletLossLayer<Dtype>::ScoreAnchors, this, label, norm_data,
+        dist_.mutable_cpu_data(), dist_.mutable_cpu_diff(), _1, _2));
+    if (loss_mode_ == TripletLossParameter_LossMode_LIFTED) {
+      pool_->ParallelFor(num, boost::bind(
+          &BatchTripletLossLayer<Dtype>::LiftAnchors, this, label,
+          dist_.cpu_data(), dist_.mutable_cpu_diff(), _1, _2));
+    }
+    ReduceStats(top);
+    return;
+  }
+
+  // Touch the buffers here: SyncedMemory is not safe to sync from workers.
+  Dtype* bank_dist = NULL;
+  Dtype* bank_weights = NULL;
+  if (bank_rows_ > 0) {
+    bank_dist = bank_dist_.mutable_cpu_data();
+    bank_weights = bank_dist_.mutable_cpu_diff();
   }
+  pool_->ParallelFor(num, boost::bind(&BatchTripletLossLayer<Dtype>::MineAnchors,
+      this, label, norm_data, dist_.mutable_cpu_data(),
+      dist_.mutable_cpu_diff(), bank_dist, bank_weights, _1, _2));
+  ReduceStats(top);
+}
+
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::SyncBank() {
+  bank_rows_ = bank_ ? bank_->size() : 0;
+  // SyncedMemory is not safe to sync from workers, see MineTriplets.
+  bank_label_ = bank_rows_ > 0 ? bank_->label() : NULL;
+  bank_norm_ = bank_rows_ > 0 ? bank_->norm() : NULL;
+}
 
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::GroupLabels(const Dtype* label, int num) {
   /**
-   * Find boundary of different classes.
-   * A batch is composed by small groups with items belongs to the same class.
-   *  e.g. gruop size is 3, batch size is 15:
-   *    1 1 1 2 2 2 3 3 3 1 1 1 4 4 4
+   * Bucket the samples by label, so a class may be spread over the batch:
+   *    1 2 3 1 4 2 3 1 4 ...
+   * Labels are class ids; a label range much wider than the batch is
+   * first compressed to the ranks of the distinct labels.
    */
-  vector<int> boundary;
-  Dtype prev = Dtype(-1);
+  group_.resize(num);
+  int min_label = 0, max_label = -1;
   for (int i=0; i<num; ++i) {
-    if (prev != label[i]) {
-      boundary.push_back(i);
-      prev = label[i];
+    group_[i] = static_cast<int>(label[i]);
+    if (i == 0 || group_[i] < min_label) {
+      min_label = group_[i];
+    }
+    if (i == 0 || group_[i] > max_label) {
+      max_label = group_[i];
     }
   }
-  boundary.push_back(num);
-
-  /**
-   * Sampling triplets and computing the loss
-   */
-  Dtype pair_loss = Dtype(0);
-  Dtype rank_loss = Dtype(0);
-  Dtype smp_rank_loss = Dtype(0);
-  int num_tri = 0;
-  int num_err = 0;
-  Dtype cur_rank_loss;
-  Dtype pos_dist;
-  Dtype neg_dist;
-  Dtype one_minus_mu = Dtype(1) - mu_;
-
-  if (one_minus_mu > Dtype(0)) {
-    // classes
-    for (int c=0; c<boundary.size()-1; c++) {
-      // query
-      for (int i=boundary[c]; i<boundary[c+1]; ++i) {
-        const Dtype * dist_data  = dist_.cpu_data() + dist_.offset(i);
-        // positive
-        for (int j=boundary[c]; j<boundary[c+1]; ++j) {
-          if (i == j) {
-            continue;
-          }
-          pair_loss += dist_data[j];
-          pos_pairs_.push_back(make_pair<int, int>(i, j));
-        }
-      }
+  if (static_cast<int64_t>(max_label) - min_label < 4 * num) {
+    for (int i=0; i<num; ++i) {
+      group_[i] -= min_label;
     }
+    bucket_.assign(max_label - min_label + 1, 0);
+  } else {
+    members_ = group_;
+    std::sort(members_.begin(), members_.end());
+    members_.erase(std::unique(members_.begin(), members_.end()),
+        members_.end());
+    for (int i=0; i<num; ++i) {
+      group_[i] = std::lower_bound(members_.begin(), members_.end(),
+          group_[i]) - members_.begin();
+    }
+    bucket_.assign(members_.size(), 0);
+  }
+  for (int i=0; i<num; ++i) {
+    ++bucket_[group_[i]];
+  }
+  // renumber the non-empty buckets to groups and lay them out in order
+  boundary_.assign(1, 0);
+  for (int b=0; b<bucket_.size(); ++b) {
+    if (bucket_[b] > 0) {
+      int size = bucket_[b];
+      bucket_[b] = boundary_.size() - 1;
+      boundary_.push_back(boundary_.back() + size);
+    }
+  }
+  vector<int> fill(boundary_.begin(), boundary_.end() - 1);
+  members_.resize(num);
+  for (int i=0; i<num; ++i) {
+    group_[i] = bucket_[group_[i]];
+    members_[fill[group_[i]]++] = i;
   }
-  int num_pair = pos_pairs_.size();
-  pair_loss = num_pair > 0 ? pair_loss / num_pair : 0;
+}
 
-  // classes
-  for (int c=0; c<boundary.size()-1; c++) {
-    // query
-    for (int i=boundary[c]; i<boundary[c+1]; ++i) {
-      const Dtype * dist_data  = dist_.cpu_data() + dist_.offset(i);
-      // positive
-      for (int j=boundary[c]; j<boundary[c+1]; ++j) {
-        if (i == j) {
-          continue;
-        }
-        pos_dist = dist_data[j];
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::ReduceStats(
+    const vector<Blob<Dtype>*>& top) {
+  Dtype* loss_data = top[0]->mutable_cpu_data();
+  Dtype* accy_data = top[1]->mutable_cpu_data();
 
-        // negative groups
-        for (int m=0; m<boundary.size()-1; m++) {
-          if (label[boundary[m]] == label[i]) {
-            continue;
-          }
-          // negative
-          for (int k=boundary[m]; k<boundary[m+1]; ++k) {
-            ++num_tri;
-            neg_dist = dist_data[k];
-            // DLOG(INFO) << "\t" << pos_dist << "\t" << neg_dist;
-            cur_rank_loss = margin_ + pos_dist - neg_dist;
-            // LOG(INFO) << cur_rank_loss;
-            num_err += (pos_dist >= neg_dist);
-            if (cur_rank_loss > 0) {
-              rank_loss += cur_rank_loss;
-              if (!sample || neg_dist > pos_dist) {
-                smp_rank_loss += cur_rank_loss;
-                triplets_.push_back(Triplet(i, j, k));
-              }
-            }
-          } // end of negative
-        } // end of negative groups
-      } // end of positive
-    } // end of query
-  } // end of classes
-  rank_loss = num_tri > 0 ? rank_loss / num_tri : 0;
-
-  // average loss among all triplets
-  loss_data[0] = rank_loss * mu_ + pair_loss * one_minus_mu;
+  /**
+   * Reduce in anchor order so the result does not depend on the threads.
+   */
+  double pair_loss = 0;
+  double rank_loss = 0;
+  double smp_rank_loss = 0;
+  int64_t num_tri = 0;
+  int64_t num_err = 0;
+  num_pair_ = 0;
+  num_smp_ = 0;
+  for (int i=0; i<stats_.size(); ++i) {
+    pair_loss += stats_[i].pair_loss;
+    rank_loss += stats_[i].rank_loss;
+    smp_rank_loss += stats_[i].smp_rank_loss;
+    num_pair_ += stats_[i].num_pair;
+    num_tri += stats_[i].num_tri;
+    num_err += stats_[i].num_err;
+    num_smp_ += stats_[i].num_smp;
+  }
+  if (loss_mode_ != TripletLossParameter_LossMode_TRIPLET) {
+    // the pair terms already are the whole loss
+    rank_loss = num_pair_ > 0 ? rank_loss / num_pair_ : 0;
+    pair_loss = 0;
+    loss_data[0] = rank_loss;
+  } else {
+    pair_loss = num_pair_ > 0 ? pair_loss / num_pair_ : 0;
+    rank_loss = num_tri > 0 ? rank_loss / num_tri : 0;
+    // average loss among all triplets
+    loss_data[0] = rank_loss * mu_ + pair_loss * (Dtype(1) - mu_);
+  }
   // average accuracy among all triplets
   accy_data[0] = Dtype(1) - (num_tri > 0 ? Dtype(num_err) / num_tri : 0);
   if (top.size() == 3) {
-    int num_smp = triplets_.size();
     Dtype* debug_data = top[2]->mutable_cpu_data();
 
     // 0: average rank loss over sampled triplets
-    debug_data[0] = num_smp > 0 ? smp_rank_loss / num_smp : 0;
+    debug_data[0] = num_smp_ > 0 ? smp_rank_loss / num_smp_ : 0;
     // 1: average rank loss over all triplets
     debug_data[1] = rank_loss;
     // 2: average pair loss
@@ -190,10 +265,380 @@ void BatchTripletLossLayer<Dtype>::Forward_cpu(
     // 3: number of possible triplets
     debug_data[3] = num_tri;
     // 4: number of sampled triplets
-    debug_data[4] = num_smp;
+    debug_data[4] = num_smp_;
+  }
+}
+
+/// Orders (distance, index) pairs by distance, ties by index.
+template <typename Dtype>
+static bool dist_index_less(const pair<Dtype, int>& a,
+    const pair<Dtype, int>& b) {
+  return a.first < b.first || (a.first == b.first && a.second < b.second);
+}
+
+/// True while margin + pos_dist - neg_dist > 0, i.e. the triplet violates.
+template <typename Dtype>
+class ViolatesMargin {
+ public:
+  explicit ViolatesMargin(Dtype margin) : margin_(margin) {}
+  bool operator()(const pair<Dtype, int>& neg, Dtype pos_dist) const {
+    return margin_ + pos_dist - neg.first > 0;
+  }
+ private:
+  Dtype margin_;
+};
+
+/// True while neg_dist <= pos_dist, i.e. the triplet is ranked wrong.
+template <typename Dtype>
+static bool not_farther(const pair<Dtype, int>& neg, Dtype pos_dist) {
+  return neg.first <= pos_dist;
+}
+
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::MineAnchors(const Dtype* label,
+    const Dtype* norm_data, Dtype* dist, Dtype* weights, Dtype* bank_dist,
+    Dtype* bank_weights, int begin, int end) {
+  int num = dist_.num();
+  bool sample = this->layer_param_.triplet_loss_param().sample();
+  bool pair_term = Dtype(1) - mu_ > Dtype(0);
+  const Dtype* bank_label = bank_label_;
+  const Dtype* bank_norm = bank_norm_;
+
+  vector<pair<Dtype, int> > negs;
+  vector<double> prefix;
+  vector<int> cover;
+  negs.reserve(num + bank_rows_);
+  prefix.reserve(num + bank_rows_ + 1);
+  cover.reserve(num + bank_rows_ + 1);
+
+  for (int i=begin; i<end; ++i) {
+    Dtype* dist_data = dist + i * num;
+    Dtype* weight = weights + i * num;
+    for (int j=0; j<num; ++j) {
+      dist_data[j] += (norm_data[i] + norm_data[j]);
+    }
+    caffe_set(num, Dtype(0), weight);
+    TripletMiningStats& st = stats_[i];
+    memset(&st, 0, sizeof(st));
+
+    // negatives of the query, sorted by distance, with prefix sums
+    negs.clear();
+    for (int k=0; k<num; ++k) {
+      if (label[k] != label[i]) {
+        negs.push_back(make_pair(dist_data[k], k));
+      }
+    }
+    // bank row k is negative num + k
+    Dtype* bank_dist_data = bank_dist + i * bank_rows_;
+    Dtype* bank_weight = bank_weights + i * bank_rows_;
+    if (bank_rows_ > 0) {
+      caffe_set(bank_rows_, Dtype(0), bank_weight);
+    }
+    for (int k=0; k<bank_rows_; ++k) {
+      bank_dist_data[k] += norm_data[i] + bank_norm[k];
+      if (bank_label[k] != label[i]) {
+        negs.push_back(make_pair(bank_dist_data[k], num + k));
+      }
+    }
+    std::sort(negs.begin(), negs.end(), dist_index_less<Dtype>);
+    int num_neg = negs.size();
+    prefix.assign(1, 0.);
+    for (int r=0; r<num_neg; ++r) {
+      prefix.push_back(prefix.back() + negs[r].first);
+    }
+    cover.assign(num_neg + 1, 0);
+
+    // positive
+    int g = group_[i];
+    for (int p=boundary_[g]; p<boundary_[g+1]; ++p) {
+      int j = members_[p];
+      if (i == j) {
+        continue;
+      }
+      Dtype pos_dist = dist_data[j];
+      if (pair_term) {
+        st.pair_loss += pos_dist;
+        ++st.num_pair;
+      }
+      // negatives [0, num_hit) violate the margin, [0, num_bad) are ranked
+      // wrong; the sampling scheme keeps [num_bad, num_hit) only.
+      int num_hit = std::lower_bound(negs.begin(), negs.end(), pos_dist,
+          ViolatesMargin<Dtype>(margin_)) - negs.begin();
+      int num_bad = std::lower_bound(negs.begin(), negs.end(), pos_dist,
+          not_farther<Dtype>) - negs.begin();
+      double shifted = double(margin_) + pos_dist;
+      st.num_tri += num_neg;
+      st.num_err += num_bad;
+      st.rank_loss += num_hit * shifted - prefix[num_hit];
+
+      int lo = sample ? std::min(num_bad, num_hit) : 0;
+      if (lo < num_hit) {
+        st.smp_rank_loss += (num_hit - lo) * shifted
+            - (prefix[num_hit] - prefix[lo]);
+        st.num_smp += num_hit - lo;
+        weight[j] -= num_hit - lo;
+        ++cover[lo];
+        --cover[num_hit];
+      }
+    }
+
+    // every negative counts the positives whose sampled range covers it
+    int covered = 0;
+    for (int r=0; r<num_neg; ++r) {
+      covered += cover[r];
+      if (negs[r].second < num) {
+        weight[negs[r].second] += covered;
+      } else {
+        bank_weight[negs[r].second - num] += covered;
+      }
+    }
+  }
+}
+
+/// log(exp(a) + exp(b)), where either may be -inf
+static double log_add_exp(double a, double b) {
+  double top = std::max(a, b);
+  if (top == -std::numeric_limits<double>::infinity()) {
+    return top;
+  }
+  return top + std::log(std::exp(a - top) + std::exp(b - top));
+}
+
+/// The Euclidean distance of LIFTED, kept away from 0 for its gradient.
+template <typename Dtype>
+static Dtype lifted_dist(Dtype squared) {
+  return std::sqrt(std::max(squared, Dtype(1e-12)));
+}
+
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::ScoreAnchors(const Dtype* label,
+    const Dtype* norm_data, Dtype* dist, Dtype* weights, int begin, int end) {
+  int num = dist_.num();
+  bool npair = loss_mode_ == TripletLossParameter_LossMode_NPAIR;
+
+  vector<Dtype> negs;
+  negs.reserve(num);
+  for (int i=begin; i<end; ++i) {
+    Dtype* dist_data = dist + i * num;
+    Dtype* weight = weights + i * num;
+    for (int j=0; j<num; ++j) {
+      dist_data[j] += (norm_data[i] + norm_data[j]);
+    }
+    caffe_set(num, Dtype(0), weight);
+    TripletMiningStats& st = stats_[i];
+    memset(&st, 0, sizeof(st));
+
+    negs.clear();
+    for (int k=0; k<num; ++k) {
+      if (label[k] != label[i]) {
+        negs.push_back(dist_data[k]);
+      }
+    }
+    std::sort(negs.begin(), negs.end());
+    int num_neg = negs.size();
+    /**
+     * log sum_n exp(-d(i, n)) for NPAIR and log sum_n exp(margin - D(i, n))
+     * for LIFTED, shifted by the largest exponent, the closest negative's.
+     */
+    double log_sum = -std::numeric_limits<double>::infinity();
+    if (num_neg > 0) {
+      double top = npair ? -negs[0] : margin_ - lifted_dist(negs[0]);
+      double sum = 0;
+      for (int r=0; r<num_neg; ++r) {
+        sum += std::exp((npair ? -negs[r] : margin_ - lifted_dist(negs[r]))
+            - top);
+      }
+      log_sum = top + std::log(sum);
+    }
+    log_neg_sum_[i] = log_sum;
+
+    // NPAIR: the loss log(1 + exp(z)) of a positive pair, with
+    // z = d(i, j) + log_sum, and its derivative sigmoid(z) for each of them.
+    double neg_weight = 0;
+    int g = group_[i];
+    for (int p=boundary_[g]; p<boundary_[g+1]; ++p) {
+      int j = members_[p];
+      if (i == j) {
+        continue;
+      }
+      Dtype pos_dist = dist_data[j];
+      st.num_tri += num_neg;
+      st.num_err += std::upper_bound(negs.begin(), negs.end(), pos_dist)
+          - negs.begin();
+      if (!npair) {
+        continue;
+      }
+      ++st.num_pair;
+      if (num_neg == 0) {
+        continue;
+      }
+      double z = pos_dist + log_sum;
+      double loss = z > 0 ? z + std::log1p(std::exp(-z))
+          : std::log1p(std::exp(z));
+      st.rank_loss += loss;
+      if (z > 0) {
+        st.smp_rank_loss += loss;
+        ++st.num_smp;
+      }
+      double scale = term_scale_ / (1 + std::exp(-z));
+      weight[j] += scale;
+      neg_weight += scale;
+    }
+    if (neg_weight > 0) {
+      for (int k=0; k<num; ++k) {
+        if (label[k] != label[i]) {
+          weight[k] -= neg_weight * std::exp(-dist_data[k] - log_sum);
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::LiftAnchors(const Dtype* label,
+    const Dtype* dist, Dtype* weights, int begin, int end) {
+  int num = dist_.num();
+  for (int i=begin; i<end; ++i) {
+    const Dtype* dist_data = dist + i * num;
+    Dtype* weight = weights + i * num;
+    TripletMiningStats& st = stats_[i];
+
+    /**
+     * J(i, j) = log(E(i) + E(j)) + D(i, j) with E = exp(log_neg_sum_). Both
+     * rows see the pair: the loss counts in the lower one, and each adds
+     * half of d / dD(i, j) and the part of d / dE that goes through E(i).
+     * Weights are w.r.t. squared distances: dD / dd = 1 / (2 D).
+     */
+    double neg_weight = 0;
+    int g = group_[i];
+    for (int p=boundary_[g]; p<boundary_[g+1]; ++p) {
+      int j = members_[p];
+      if (i == j) {
+        continue;
+      }
+      if (i < j) {
+        ++st.num_pair;
+      }
+      double log_sum = log_add_exp(log_neg_sum_[i], log_neg_sum_[j]);
+      Dtype pos_dist = lifted_dist(dist_data[j]);
+      double hinge = log_sum + pos_dist;
+      if (!(hinge > 0)) {
+        continue;
+      }
+      if (i < j) {
+        st.rank_loss += 0.5 * hinge * hinge;
+        st.smp_rank_loss += 0.5 * hinge * hinge;
+        ++st.num_smp;
+      }
+      double scale = term_scale_ * hinge;
+      weight[j] += scale / (4 * pos_dist);
+      neg_weight += scale * std::exp(log_neg_sum_[i] - log_sum);
+    }
+    if (neg_weight > 0) {
+      for (int k=0; k<num; ++k) {
+        if (label[k] != label[i]) {
+          Dtype neg_dist = lifted_dist(dist_data[k]);
+          weight[k] -= neg_weight * std::exp(margin_ - neg_dist
+              - log_neg_sum_[i]) / (2 * neg_dist);
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::AggregatePairRows(const Dtype* weight,
+    Dtype loss_weight, Dtype* agg_data, int begin, int end) {
+  int num = dist_.num();
+  /**
+   * With c(i, x) = W(i, x) + W(x, i), the derivative w.r.t. d(i, x), and
+   * d d(i, x) / d x_i = 2 (x_i - x_x), the gradient is
+   * 2 * (diag(row sums of C) - C) times the features.
+   */
+  Dtype scale = 2 * loss_weight;
+  for (int i=begin; i<end; ++i) {
+    Dtype* agg_row = agg_data + i * num;
+    Dtype row_sum = 0;
+    for (int x=0; x<num; ++x) {
+      Dtype c = weight[i * num + x] + weight[x * num + i];
+      agg_row[x] = -scale * c;
+      row_sum += c;
+    }
+    agg_row[i] += scale * row_sum;
+  }
+}
+
+template <typename Dtype>
+Dtype BatchTripletLossLayer<Dtype>::RankScale(Dtype loss_weight) const {
+  return num_smp_ > 0 ? Dtype(2) / num_smp_ * mu_ * loss_weight : Dtype(0);
+}
+
+template <typename Dtype>
+Dtype BatchTripletLossLayer<Dtype>::PairScale(Dtype loss_weight) const {
+  return num_pair_ > 0 ?
+      Dtype(2) / num_pair_ * (Dtype(1) - mu_) * loss_weight : Dtype(0);
+}
+
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::PushToBank(
+    const vector<Blob<Dtype>*>& bottom) {
+  if (bank_) {
+    bank_->Push(bottom[0]->num(), bottom[0]->cpu_data(),
+        bottom[1]->cpu_data());
   }
 }
 
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::AggregateRows(const Dtype* weight,
+    Dtype loss_weight, Dtype* agg_data, int begin, int end) {
+  int num = dist_.num();
+  Dtype scale1 = RankScale(loss_weight);
+  Dtype scale2 = PairScale(loss_weight);
+
+  /**
+   * For a triplet (q, p, n) the rank loss adds
+   *   q: n - p,  p: p - q,  n: q - n
+   * to the gradients. Summed over the triplets with per-query weights W
+   * this is scale1 * (W + W^T - diag(column sums of W)).
+   */
+  for (int i=begin; i<end; ++i) {
+    Dtype* agg_row = agg_data + i * num;
+    Dtype col_sum = 0;
+    for (int x=0; x<num; ++x) {
+      agg_row[x] = scale1 * (weight[i * num + x] + weight[x * num + i]);
+      col_sum += weight[x * num + i];
+    }
+    agg_row[i] -= scale1 * col_sum;
+
+    // Positive pairs come in both orders, so each one adds twice.
+    if (scale2 > 0) {
+      int g = group_[i];
+      for (int p=boundary_[g]; p<boundary_[g+1]; ++p) {
+        int j = members_[p];
+        if (i == j) {
+          continue;
+        }
+        agg_row[i] += 2 * scale2;
+        agg_row[j] -= 2 * scale2;
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::BuildAggregator(Dtype loss_weight,
+    Dtype* agg_data) {
+  if (loss_mode_ != TripletLossParameter_LossMode_TRIPLET) {
+    pool_->ParallelFor(dist_.num(), boost::bind(
+        &BatchTripletLossLayer<Dtype>::AggregatePairRows, this,
+        dist_.cpu_diff(), loss_weight, agg_data, _1, _2));
+    return;
+  }
+  pool_->ParallelFor(dist_.num(), boost::bind(
+      &BatchTripletLossLayer<Dtype>::AggregateRows, this, dist_.cpu_diff(),
+      loss_weight, agg_data, _1, _2));
+}
+
 template <typename Dtype>
 void BatchTripletLossLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
@@ -201,47 +646,364 @@ void BatchTripletLossLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     LOG(FATAL) << this->type()
                << " Layer cannot backpropagate to label inputs.";
   }
-  if (propagate_down[0]) {
+  if (propagate_down[0] && tile_size_ > 0) {
+    BackwardTiled(top, bottom);
+  } else if (propagate_down[0]) {
     Blob<Dtype>* feat = bottom[0];
     const Dtype* feat_data = feat->cpu_data();
     Dtype* feat_diff = feat->mutable_cpu_diff();
     int count = feat->count();
     int num = feat->num();
     int dim = count / num;
-    int agg_step = num * sizeof(Dtype);
     Dtype * agg_data = (Dtype *)aggregator_->mutable_cpu_data();
-    caffe_memset(num * agg_step, 0, agg_data);
+    BuildAggregator(top[0]->cpu_diff()[0], agg_data);
+
+    caffe_cpu_gemm(CblasNoTrans, CblasNoTrans, num, dim, num,
+        Dtype(1), agg_data, feat_data, Dtype(0), feat_diff);
+    // bank negatives only pull on the queries
+    if (bank_rows_ > 0) {
+      caffe_cpu_gemm(CblasNoTrans, CblasNoTrans, num, dim, bank_rows_,
+          RankScale(top[0]->cpu_diff()[0]), bank_dist_.cpu_diff(),
+          bank_->feat().cpu_data(), Dtype(1), feat_diff);
+    }
+  }
+  PushToBank(bottom);
+}
+
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::ForwardTiled(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  const Dtype* feat_data = bottom[0]->cpu_data();
+  const Dtype* label = bottom[1]->cpu_data();
+  int num = bottom[0]->num();
+  int dim = bottom[0]->count() / num;
+
+  Dtype* norm_data = norm_.mutable_cpu_data();
+  for (int i=0; i<num; ++i) {
+    norm_data[i] = caffe_cpu_dot(dim, feat_data + i * dim,
+        feat_data + i * dim);
+  }
+  GroupLabels(label, num);
+  anchors_.resize(num);
+  stats_.resize(num);
+  Dtype* grad = tile_grad_.mutable_cpu_data();
+  caffe_set(tile_grad_.count(), Dtype(0), grad);
+  pool_->ParallelFor(num, boost::bind(&BatchTripletLossLayer<Dtype>::InitAnchors,
+      this, feat_data, norm_data, dim, _1, _2));
+
+  /**
+   * Every unordered pair of tiles is computed once. The pairs are scheduled
+   * in rounds (circle method) so that no two tasks of a round share a tile,
+   * which lets the workers update the anchors of both sides without locks.
+   */
+  int num_tiles = (num + tile_size_ - 1) / tile_size_;
+  vector<pair<int, int> > tasks;
+  for (int t=0; t<num_tiles; ++t) {
+    tasks.push_back(make_pair(t, t));
+  }
+  pool_->ParallelFor(tasks.size(), boost::bind(
+      &BatchTripletLossLayer<Dtype>::MineTiles, this, feat_data, norm_data,
+      label, dim, &tasks, grad, _1, _2));
+  int circle = num_tiles + num_tiles % 2;  // an odd count gets a dummy tile
+  for (int r=0; r<circle-1; ++r) {
+    tasks.clear();
+    if (circle - 1 < num_tiles) {
+      tasks.push_back(make_pair(r, circle - 1));
+    }
+    for (int k=1; k<circle/2; ++k) {
+      int a = (r + k) % (circle - 1);
+      int b = (r - k + circle - 1) % (circle - 1);
+      tasks.push_back(make_pair(std::min(a, b), std::max(a, b)));
+    }
+    pool_->ParallelFor(tasks.size(), boost::bind(
+        &BatchTripletLossLayer<Dtype>::MineTiles, this, feat_data, norm_data,
+        label, dim, &tasks, grad, _1, _2));
+  }
+  SyncBank();
+  if (bank_rows_ > 0) {
+    pool_->ParallelFor(num_tiles, boost::bind(
+        &BatchTripletLossLayer<Dtype>::MineBankTiles, this, feat_data,
+        norm_data, bank_->feat().cpu_data(), label, dim, grad, _1, _2));
+  }
+
+  pool_->ParallelFor(num, boost::bind(
+      &BatchTripletLossLayer<Dtype>::FinishAnchors, this, _1, _2));
+  ReduceStats(top);
+}
 
-    Dtype scale1 = Dtype(2) / triplets_.size() * mu_;
-    for (int i=0; i<triplets_.size(); ++i) {
-      int qry_id = triplets_[i].first_;
-      int pos_id = triplets_[i].second_;
-      int neg_id = triplets_[i].third_;
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::InitAnchors(const Dtype* feat,
+    const Dtype* norm_data, int dim, int begin, int end) {
+  bool pair_term = Dtype(1) - mu_ > Dtype(0);
+  vector<pair<Dtype, int> > pos;
+  for (int i=begin; i<end; ++i) {
+    TripletAnchorState<Dtype>& state = anchors_[i];
+    TripletMiningStats& st = stats_[i];
+    memset(&st, 0, sizeof(st));
 
-      agg_data[qry_id * num + neg_id] += scale1;
-      agg_data[qry_id * num + pos_id] -= scale1;
+    pos.clear();
+    int g = group_[i];
+    for (int p=boundary_[g]; p<boundary_[g+1]; ++p) {
+      int j = members_[p];
+      if (i == j) {
+        continue;
+      }
+      Dtype pos_dist = norm_data[i] + norm_data[j]
+          - 2 * caffe_cpu_dot(dim, feat + i * dim, feat + j * dim);
+      pos.push_back(make_pair(pos_dist, j));
+      if (pair_term) {
+        st.pair_loss += pos_dist;
+        ++st.num_pair;
+      }
+    }
+    std::sort(pos.begin(), pos.end(), dist_index_less<Dtype>);
+    int num_pos = pos.size();
+    state.pos_dist.resize(num_pos);
+    state.pos_id.resize(num_pos);
+    for (int r=0; r<num_pos; ++r) {
+      state.pos_dist[r] = pos[r].first;
+      state.pos_id[r] = pos[r].second;
+    }
+    state.bad_count.assign(num_pos + 1, 0);
+    state.bad_sum.assign(num_pos + 1, 0.);
+    state.hit_count.assign(num_pos + 1, 0);
+    state.hit_sum.assign(num_pos + 1, 0.);
+    state.num_neg = 0;
+    state.pos_weight.assign(num_pos, Dtype(0));
+    state.neg_weight = 0;
+  }
+}
 
-      agg_data[pos_id * num + pos_id] += scale1;
-      agg_data[pos_id * num + qry_id] -= scale1;
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::MineTiles(const Dtype* feat,
+    const Dtype* norm_data, const Dtype* label, int dim,
+    const vector<pair<int, int> >* tasks, Dtype* grad, int begin, int end) {
+  int num = norm_.num();
+  vector<Dtype> block(tile_size_ * tile_size_);
+  for (int t=begin; t<end; ++t) {
+    int row = (*tasks)[t].first * tile_size_;
+    int col = (*tasks)[t].second * tile_size_;
+    int rows = std::min(tile_size_, num - row);
+    int cols = std::min(tile_size_, num - col);
+    bool diagonal = (row == col);
+    if (diagonal) {
+      caffe_cpu_syrk<Dtype>(CblasNoTrans, rows, dim, Dtype(-2),
+          feat + row * dim, Dtype(0), &block[0]);
+    } else {
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, rows, cols, dim,
+          Dtype(-2), feat + row * dim, feat + col * dim, Dtype(0), &block[0]);
+    }
+    for (int a=0; a<rows; ++a) {
+      int i = row + a;
+      // syrk only fills the upper triangle of the diagonal tiles
+      for (int b=(diagonal ? a + 1 : 0); b<cols; ++b) {
+        int k = col + b;
+        if (label[i] == label[k]) {
+          continue;
+        }
+        Dtype dist = norm_data[i] + norm_data[k] + block[a * cols + b];
+        Dtype w_ik = FeedNegative(&anchors_[i], dist);
+        Dtype w_ki = FeedNegative(&anchors_[k], dist);
+        // Both rows belong to this task's tiles, see ForwardTiled.
+        if (w_ik + w_ki > 0) {
+          caffe_axpy(dim, w_ik + w_ki, feat + k * dim, grad + i * dim);
+          caffe_axpy(dim, w_ik + w_ki, feat + i * dim, grad + k * dim);
+          anchors_[k].neg_weight += w_ik;
+          anchors_[i].neg_weight += w_ki;
+        }
+      }
+    }
+  }
+}
 
-      agg_data[neg_id * num + qry_id] += scale1;
-      agg_data[neg_id * num + neg_id] -= scale1;
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::MineBankTiles(const Dtype* feat,
+    const Dtype* norm_data, const Dtype* bank_feat, const Dtype* label,
+    int dim, Dtype* grad, int begin, int end) {
+  int num = norm_.num();
+  const Dtype* bank_label = bank_label_;
+  const Dtype* bank_norm = bank_norm_;
+  vector<Dtype> block(tile_size_ * tile_size_);
+  for (int t=begin; t<end; ++t) {
+    int row = t * tile_size_;
+    int rows = std::min(tile_size_, num - row);
+    for (int col=0; col<bank_rows_; col+=tile_size_) {
+      int cols = std::min(tile_size_, bank_rows_ - col);
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, rows, cols, dim,
+          Dtype(-2), feat + row * dim, bank_feat + col * dim, Dtype(0),
+          &block[0]);
+      for (int a=0; a<rows; ++a) {
+        int i = row + a;
+        for (int b=0; b<cols; ++b) {
+          int k = col + b;
+          if (label[i] == bank_label[k]) {
+            continue;
+          }
+          // bank negatives only pull on the queries
+          Dtype w = FeedNegative(&anchors_[i],
+              norm_data[i] + bank_norm[k] + block[a * cols + b]);
+          if (w > 0) {
+            caffe_axpy(dim, w, bank_feat + k * dim, grad + i * dim);
+          }
+        }
+      }
     }
+  }
+}
 
-    Dtype scale2 = Dtype(2) / pos_pairs_.size() * (Dtype(1) - mu_);
-    for (int i=0; i<pos_pairs_.size(); ++i) {
-      int qry_id = pos_pairs_[i].first;
-      int pos_id = pos_pairs_[i].second;
+/// True while margin + pos_dist - neg_dist > 0, for upper_bound.
+template <typename Dtype>
+class ViolatedBy {
+ public:
+  explicit ViolatedBy(Dtype margin) : margin_(margin) {}
+  bool operator()(Dtype neg_dist, Dtype pos_dist) const {
+    return margin_ + pos_dist - neg_dist > 0;
+  }
+ private:
+  Dtype margin_;
+};
 
-      agg_data[qry_id * num + qry_id] += scale2;
-      agg_data[qry_id * num + pos_id] -= scale2;
+template <typename Dtype>
+Dtype BatchTripletLossLayer<Dtype>::FeedNegative(
+    TripletAnchorState<Dtype>* state, Dtype dist) {
+  ++state->num_neg;
+  int num_pos = state->pos_dist.size();
+  if (num_pos == 0) {
+    return Dtype(0);
+  }
+  // positives [bad, num_pos) are not closer than the negative,
+  // positives [hit, num_pos) are violated by it
+  int bad = std::lower_bound(state->pos_dist.begin(), state->pos_dist.end(),
+      dist) - state->pos_dist.begin();
+  int hit = std::upper_bound(state->pos_dist.begin(), state->pos_dist.end(),
+      dist, ViolatedBy<Dtype>(margin_)) - state->pos_dist.begin();
+  ++state->bad_count[bad];
+  state->bad_sum[bad] += dist;
+  ++state->hit_count[hit];
+  state->hit_sum[hit] += dist;
+
+  int covered = num_pos - hit;
+  if (this->layer_param_.triplet_loss_param().sample()) {
+    covered -= num_pos - bad;
+  }
+  return Dtype(covered);
+}
+
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::FinishAnchors(int begin, int end) {
+  bool sample = this->layer_param_.triplet_loss_param().sample();
+  for (int i=begin; i<end; ++i) {
+    TripletAnchorState<Dtype>& state = anchors_[i];
+    TripletMiningStats& st = stats_[i];
+    int num_pos = state.pos_dist.size();
+    st.num_tri = num_pos * state.num_neg;
 
-      agg_data[pos_id * num + pos_id] += scale2;
-      agg_data[pos_id * num + qry_id] -= scale2;
+    int64_t num_hit = 0;
+    int64_t num_bad = 0;
+    double hit_sum = 0;
+    double bad_sum = 0;
+    for (int r=0; r<num_pos; ++r) {
+      num_hit += state.hit_count[r];
+      hit_sum += state.hit_sum[r];
+      num_bad += state.bad_count[r];
+      bad_sum += state.bad_sum[r];
+      double shifted = double(margin_) + state.pos_dist[r];
+      st.num_err += num_bad;
+      st.rank_loss += num_hit * shifted - hit_sum;
+
+      int64_t num_smp = num_hit;
+      double smp_sum = hit_sum;
+      if (sample) {
+        num_smp -= num_bad;
+        smp_sum -= bad_sum;
+      }
+      if (num_smp > 0) {
+        st.smp_rank_loss += num_smp * shifted - smp_sum;
+        st.num_smp += num_smp;
+        state.pos_weight[r] = Dtype(-num_smp);
+      }
     }
+  }
+}
 
-    caffe_cpu_gemm(CblasNoTrans, CblasNoTrans, num, dim, num,
-        Dtype(1), agg_data, feat_data, Dtype(0), feat_diff);
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::BackwardTiled(
+    const vector<Blob<Dtype>*>& top, const vector<Blob<Dtype>*>& bottom) {
+  const Dtype* feat_data = bottom[0]->cpu_data();
+  Dtype* feat_diff = bottom[0]->mutable_cpu_diff();
+  int num = bottom[0]->num();
+  int dim = bottom[0]->count() / num;
+  Dtype scale1 = RankScale(top[0]->cpu_diff()[0]);
+  Dtype scale2 = PairScale(top[0]->cpu_diff()[0]);
+
+  // Group the positive weights by column, keeping the anchor order.
+  col_start_.assign(num + 1, 0);
+  for (int i=0; i<num; ++i) {
+    const TripletAnchorState<Dtype>& state = anchors_[i];
+    for (int r=0; r<state.pos_id.size(); ++r) {
+      if (state.pos_weight[r] != 0) {
+        ++col_start_[state.pos_id[r] + 1];
+      }
+    }
+  }
+  for (int x=0; x<num; ++x) {
+    col_start_[x + 1] += col_start_[x];
+  }
+  col_weights_.resize(col_start_[num]);
+  vector<int> fill(col_start_.begin(), col_start_.end() - 1);
+  for (int i=0; i<num; ++i) {
+    const TripletAnchorState<Dtype>& state = anchors_[i];
+    for (int r=0; r<state.pos_id.size(); ++r) {
+      if (state.pos_weight[r] != 0) {
+        col_weights_[fill[state.pos_id[r]]++] =
+            make_pair(i, state.pos_weight[r]);
+      }
+    }
+  }
+
+  pool_->ParallelFor(num, boost::bind(&BatchTripletLossLayer<Dtype>::GatherRows,
+      this, feat_data, tile_grad_.cpu_data(), dim, scale1, scale2, feat_diff,
+      _1, _2));
+  pool_->ParallelFor(num, boost::bind(
+      &BatchTripletLossLayer<Dtype>::ScatterColumns, this, feat_data, dim,
+      scale1, feat_diff, _1, _2));
+}
+
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::GatherRows(const Dtype* feat,
+    const Dtype* grad, int dim, Dtype scale1, Dtype scale2, Dtype* diff,
+    int begin, int end) {
+  for (int i=begin; i<end; ++i) {
+    const TripletAnchorState<Dtype>& state = anchors_[i];
+    Dtype* diff_i = diff + i * dim;
+    caffe_cpu_scale(dim, scale1, grad + i * dim, diff_i);
+    caffe_axpy(dim, -scale1 * state.neg_weight, feat + i * dim, diff_i);
+    for (int r=0; r<state.pos_id.size(); ++r) {
+      caffe_axpy(dim, scale1 * state.pos_weight[r],
+          feat + state.pos_id[r] * dim, diff_i);
+    }
+    // Positive pairs come in both orders, so each one adds twice.
+    if (scale2 > 0) {
+      for (int r=0; r<state.pos_id.size(); ++r) {
+        caffe_axpy(dim, 2 * scale2, feat + i * dim, diff_i);
+        caffe_axpy(dim, -2 * scale2, feat + state.pos_id[r] * dim, diff_i);
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void BatchTripletLossLayer<Dtype>::ScatterColumns(const Dtype* feat, int dim,
+    Dtype scale1, Dtype* diff, int begin, int end) {
+  for (int x=begin; x<end; ++x) {
+    Dtype* diff_x = diff + x * dim;
+    Dtype col_sum = 0;
+    for (int e=col_start_[x]; e<col_start_[x + 1]; ++e) {
+      caffe_axpy(dim, scale1 * col_weights_[e].second,
+          feat + col_weights_[e].first * dim, diff_x);
+      col_sum += col_weights_[e].second;
+    }
+    caffe_axpy(dim, -scale1 * col_sum, feat + x * dim, diff_x);
   }
 }
 
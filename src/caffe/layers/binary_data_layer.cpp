@@ -59,23 +59,38 @@ void BinaryDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
     CHECK_GT(lines_.size(), skip) << "Not enough points to skip";
     lines_id_ = skip;
   }
-  // Load meta data
-  std::ifstream metafile((root_folder + "meta").c_str());
-  std::string dtype;
-  metafile >> dtype;
-  // int n, c, h, w;
-  // metafile << n << c << h << w;
   vector<int> & top_shape = this->top_shape_;
   top_shape.resize(4);
-  for (int i = 0; i < top_shape.size(); ++i) {
-    metafile >> this->top_shape_[i];
+  const string& packed_source =
+      this->layer_param_.image_data_param().packed_source();
+  if (!packed_source.empty()) {
+    LOG(INFO) << "Opening packed features " << packed_source;
+    packed_.reset(new PackedFeatureFile());
+    packed_->Open(packed_source);
+    top_shape[1] = packed_->channels();
+    top_shape[2] = packed_->height();
+    top_shape[3] = packed_->width();
+    for (int i = 0; i < lines_.size(); ++i) {
+      CHECK_GE(packed_->Find(lines_[i].first), 0) << "No row "
+          << lines_[i].first << " in " << packed_source;
+    }
+  } else {
+    // Load meta data
+    std::ifstream metafile((root_folder + "meta").c_str());
+    std::string dtype;
+    metafile >> dtype;
+    // int n, c, h, w;
+    // metafile << n << c << h << w;
+    for (int i = 0; i < top_shape.size(); ++i) {
+      metafile >> this->top_shape_[i];
+    }
   }
   // Reshape prefetch_data and top[0] according to the batch_size.
   const int batch_size = this->layer_param_.image_data_param().batch_size();
   CHECK_GT(batch_size, 0) << "Positive batch size required";
   this->top_shape_[0] = batch_size;
-  for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
-    this->prefetch_[i].data_.Reshape(this->top_shape_);
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    this->prefetch_[i]->data_.Reshape(this->top_shape_);
   }
   top[0]->Reshape(this->top_shape_);
 
@@ -85,8 +100,8 @@ void BinaryDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   // label
   vector<int> label_shape(1, batch_size);
   top[1]->Reshape(label_shape);
-  for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
-    this->prefetch_[i].label_.Reshape(label_shape);
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    this->prefetch_[i]->label_.Reshape(label_shape);
   }
 }
 
@@ -119,7 +134,15 @@ void BinaryDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
   // datum scales
   const int lines_size = lines_.size();
   const int count = top_shape[1] * top_shape[2] * top_shape[3];
+  vector<int64_t> rows;
   for (int item_id = 0; item_id < batch_size; ++item_id) {
+    if (packed_) {
+      // Only name the rows here, so that their pages are all read ahead
+      // before the first copy.
+      CHECK_GT(lines_size, lines_id_);
+      rows.push_back(packed_->Find(lines_[lines_id_].first));
+      packed_->WillNeed(rows.back());
+    } else {
       // get a blob
       timer.Start();
       CHECK_GT(lines_size, lines_id_);
@@ -128,6 +151,7 @@ void BinaryDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
           prefetch_data + offset, count);
       read_time += timer.MicroSeconds();
       CHECK(ret == 0) << "Could not load " << lines_[lines_id_].first;
+    }
 
       prefetch_label[item_id] = lines_[lines_id_].second;
     // go to the next iter
@@ -141,6 +165,12 @@ void BinaryDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
       }
     }
   }
+  timer.Start();
+  for (int item_id = 0; item_id < rows.size(); ++item_id) {
+    packed_->CopyRow(rows[item_id],
+        prefetch_data + batch->data_.offset(item_id));
+  }
+  read_time += timer.MicroSeconds();
   batch_timer.Stop();
   DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
   DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
@@ -0,0 +1,77 @@
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/layers/euclidean_multiple_similarity_layer.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void EuclideanMultipleSimilarityLayer<Dtype>::Similarities(int k, int dim,
+    const Dtype* a, const Dtype* b, Dtype* sim) {
+  // -0.5 * |a - b|^2 = a.b - 0.5 * |a|^2 - 0.5 * |b|^2
+  caffe_cpu_gemv<Dtype>(CblasNoTrans, k, dim, Dtype(1), b, a, Dtype(0), sim);
+  Dtype anchor_norm = caffe_cpu_dot(dim, a, a);
+  for (int j=0; j<k; ++j) {
+    sim[j] -= Dtype(0.5) * (anchor_norm
+        + caffe_cpu_dot(dim, b + j * dim, b + j * dim));
+  }
+}
+
+template <typename Dtype>
+void EuclideanMultipleSimilarityLayer<Dtype>::Forward_cpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  int num = bottom[0]->num();
+  int dim = bottom[0]->count() / num;
+  int k = this->sim_.channels();
+  const Dtype* pa = bottom[0]->cpu_data();
+  const Dtype* pb = bottom[1]->cpu_data();
+  Dtype* sim = this->sim_.mutable_cpu_data();
+  for (int i=0; i<num; ++i) {
+    Similarities(k, dim, pa + i * dim, pb + i * k * dim, sim + i * k);
+  }
+  this->Aggregate(top[0]->mutable_cpu_data());
+}
+
+template <typename Dtype>
+void EuclideanMultipleSimilarityLayer<Dtype>::Backward_cpu(
+    const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+    const vector<Blob<Dtype>*>& bottom) {
+  int num = bottom[0]->num();
+  int dim = bottom[0]->count() / num;
+  int k = this->sim_.channels();
+  const Dtype* pa = bottom[0]->cpu_data();
+  const Dtype* pb = bottom[1]->cpu_data();
+  this->BackwardAggregate(top[0]->cpu_diff());
+  const Dtype* weight = this->sim_.cpu_diff();
+  // dS/da = sum_j w_j * (b_j - a),  dS/db_j = w_j * (a - b_j)
+  if (propagate_down[0]) {
+    Dtype* anchor_diff = bottom[0]->mutable_cpu_diff();
+    for (int i=0; i<num; ++i) {
+      const Dtype* w = weight + i * k;
+      Dtype weight_sum = 0;
+      for (int j=0; j<k; ++j) {
+        weight_sum += w[j];
+      }
+      caffe_copy(dim, pa + i * dim, anchor_diff + i * dim);
+      caffe_cpu_gemv<Dtype>(CblasTrans, k, dim, Dtype(1), pb + i * k * dim,
+          w, -weight_sum, anchor_diff + i * dim);
+    }
+  }
+  if (propagate_down[1]) {
+    Dtype* pos_neg_diff = bottom[1]->mutable_cpu_diff();
+    for (int i=0; i<num; ++i) {
+      const Dtype* w = weight + i * k;
+      Dtype* diff = pos_neg_diff + i * k * dim;
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, k, dim, 1, Dtype(1),
+          w, pa + i * dim, Dtype(0), diff);
+      for (int j=0; j<k; ++j) {
+        caffe_axpy(dim, -w[j], pb + (i * k + j) * dim, diff + j * dim);
+      }
+    }
+  }
+}
+
+INSTANTIATE_CLASS(EuclideanMultipleSimilarityLayer);
+REGISTER_LAYER_CLASS(EuclideanMultipleSimilarity);
+}  // namespace caffe
@@ -1,3 +1,4 @@
+#include <boost/bind.hpp>
 #include <algorithm>
 #include <cfloat>
 #include <cmath>
@@ -12,173 +13,146 @@ namespace caffe {
 
 template <typename Dtype>
 void HDMLLossUpperBoundLayer<Dtype>::compute_h(
-    const Blob<Dtype> * qry,
-    const Blob<Dtype> * pos,
-    const Blob<Dtype> * neg) {
-  int num = qry->num();
-  int nb = qry->channels();
-  for (int k=0; k<num; k++) {
-    const Dtype * qry_k = qry->cpu_data() + qry->offset(k);
-    const Dtype * pos_k = pos->cpu_data() + pos->offset(k);
-    const Dtype * neg_k = neg->cpu_data() + neg->offset(k);
-
-    int * p_h_qry = this->h_qry_.mutable_cpu_data() + this->h_qry_.offset(k);
-    int * p_h_pos = this->h_pos_.mutable_cpu_data() + this->h_pos_.offset(k);
-    int * p_h_neg = this->h_neg_.mutable_cpu_data() + this->h_neg_.offset(k);
-
-    for (int i=0; i<nb; i++) {
-      p_h_qry[i] = qry_k[i] > 0 ? 1 : -1;
-      p_h_pos[i] = pos_k[i] > 0 ? 1 : -1;
-      p_h_neg[i] = neg_k[i] > 0 ? 1 : -1;
-    }
-  }
+    const Dtype* qry_k, const Dtype* pos_k, const Dtype* neg_k,
+    uint64_t* p_h_qry, uint64_t* p_h_pos, uint64_t* p_h_neg) {
+  caffe_cpu_pack_bits(1, nb_, qry_k, p_h_qry);
+  caffe_cpu_pack_bits(1, nb_, pos_k, p_h_pos);
+  caffe_cpu_pack_bits(1, nb_, neg_k, p_h_neg);
 }
 
 template <typename Dtype>
 void HDMLLossUpperBoundLayer<Dtype>::compute_infer_loss(
-    const Blob<Dtype> * qry,
-    const Blob<Dtype> * pos,
-    const Blob<Dtype> * neg) {
-  int num = qry->num();
-  int nb = qry->channels();
-
-  for (int k=0; k<num; k++) {
-    const Dtype * qry_k = qry->cpu_data() + qry->offset(k);
-    const Dtype * pos_k = pos->cpu_data() + pos->offset(k);
-    const Dtype * neg_k = neg->cpu_data() + neg->offset(k);
-
-    for (int i=0; i<nb; ++i) {
-      // index(ei) starts from -1 to +1
-      Dtype * p_cont = this->infer_cont_.mutable_cpu_data() + \
-                       this->infer_cont_.offset(k, i, 1);
-      int * p_qry_buf = this->infer_qry_buffer_.mutable_cpu_data() + \
-                        this->infer_qry_buffer_.offset(k, i, 1);
-      int * p_pos_buf = this->infer_pos_buffer_.mutable_cpu_data() + \
-                        this->infer_pos_buffer_.offset(k, i, 1);
-      int * p_neg_buf = this->infer_neg_buffer_.mutable_cpu_data() + \
-                        this->infer_neg_buffer_.offset(k, i, 1);
-
-      for (int ei=-1; ei<=1; ++ei) {
-        p_cont[ei] = -1 - qry_k[i] - pos_k[i] - neg_k[i];
-      }
-      Dtype cont;
-      for (int a=-1; a<=1; a+=2) {
-        for (int b=-1; b<=1; b+=2) {
-          for (int c=-1; c<=1; c+=2) {
-            int ei = (a != b) - (a != c);
-            cont = a * qry_k[i] + b * pos_k[i] + c * neg_k[i];
-            if (cont > p_cont[ei]) {
-              p_cont[ei] = cont;
-              p_qry_buf[ei] = a;
-              p_pos_buf[ei] = b;
-              p_neg_buf[ei] = c;
-            }
+    const Dtype* qry_k, const Dtype* pos_k, const Dtype* neg_k,
+    Workspace* ws) {
+  for (int i=0; i<nb_; ++i) {
+    // index(ei) starts from -1 to +1
+    Dtype* p_cont = &ws->cont[i * 3 + 1];
+    unsigned char* p_sign = &ws->sign[i * 3 + 1];
+
+    // strictly below every combination, so each ei gets one
+    for (int ei=-1; ei<=1; ++ei) {
+      p_cont[ei] = -1 - std::abs(qry_k[i]) - std::abs(pos_k[i])
+          - std::abs(neg_k[i]);
+    }
+    Dtype cont;
+    for (int a=-1; a<=1; a+=2) {
+      for (int b=-1; b<=1; b+=2) {
+        for (int c=-1; c<=1; c+=2) {
+          int ei = (a != b) - (a != c);
+          cont = a * qry_k[i] + b * pos_k[i] + c * neg_k[i];
+          if (cont > p_cont[ei]) {
+            p_cont[ei] = cont;
+            p_sign[ei] = (a > 0) | (b > 0) << 1 | (c > 0) << 2;
           }
         }
       }
     }
   }
-  // this->infer_cont_.print();
-  // exit(1);
 }
 
 
 template <typename Dtype>
-Dtype HDMLLossUpperBoundLayer<Dtype>::compute_loss_ub() {
-  int num = this->infer_cont_.num();
-  int nb = this->infer_cont_.channels();
-  int step = nb * 2 + 1;
-
-  Dtype * m_table = new Dtype[step * nb];
-  Dtype * p_m_old;
-  Dtype * p_m_cur;
-
-  int * choice_table = new int[step * nb];
-  int * p_c;
-
-  Dtype loss_ub = 0.0;
-  Dtype cur_loss;
-
-  for (int k=0; k<num; ++k) {
-    /**
-     * Compute the table
-     */
-    const Dtype * p_cont = this->infer_cont_.cpu_data() + \
-                           this->infer_cont_.offset(k, 0, 1);
-    p_m_cur = m_table + nb;
-    p_c = choice_table + nb;
+Dtype HDMLLossUpperBoundLayer<Dtype>::compute_loss_ub(Workspace* ws,
+    uint64_t* p_g_qry, uint64_t* p_g_pos, uint64_t* p_g_neg) {
+  const int nb = nb_;
+  const int step = nb * 2 + 1;
+  const Dtype kNoPath = Dtype(-1e30);
+
+  /**
+   * Compute the table. Only the last two rows of m are kept; entries
+   * outside the reachable range [-i-1, i+1] stay at kNoPath, so every m
+   * simply looks at l = m-1, m, m+1 of the previous row.
+   */
+  std::fill(ws->m_rows.begin(), ws->m_rows.end(), kNoPath);
+  Dtype* p_m_old = &ws->m_rows[nb + 2];
+  Dtype* p_m_cur = &ws->m_rows[step + 4 + nb + 2];
+  signed char* p_c = &ws->choice[nb];
+  const Dtype* p_cont = &ws->cont[1];
+
+  // the first row of m_table and choice_table
+  for (int m=-1; m<=1; m++) {
+    p_m_cur[m] = p_cont[m];
+    p_c[m] = m;
+  }
 
-    // the first row of m_table and choice_table
-    for (int m=-1; m<=1; m++) {
-      p_m_cur[m] = p_cont[m];
-      p_c[m] = m;
+  // the sencond and rest rows of m_table and choice_table
+  for (int i=1; i<nb; ++i) {
+    std::swap(p_m_old, p_m_cur);
+    p_c += step;
+    p_cont += 3;
+    const Dtype cont_neg = p_cont[-1];
+    const Dtype cont_zero = p_cont[0];
+    const Dtype cont_pos = p_cont[1];
+    for (int m=-i-1; m<=+i+1; ++m) {
+      // same preference as scanning l = m-1 .. m+1 with a strict >
+      Dtype best = p_m_old[m-1] + cont_pos;
+      signed char choice = 1;
+      Dtype cur_loss = p_m_old[m] + cont_zero;
+      choice = cur_loss > best ? 0 : choice;
+      best = cur_loss > best ? cur_loss : best;
+      cur_loss = p_m_old[m+1] + cont_neg;
+      choice = cur_loss > best ? -1 : choice;
+      best = cur_loss > best ? cur_loss : best;
+      p_m_cur[m] = best;
+      p_c[m] = choice;
     }
+  }
 
-    // the sencond and rest rows of m_table and choice_table
-    for (int i=1; i<nb; ++i) {
-      p_m_old = p_m_cur;
-      p_m_cur += step;
-      p_c += step;
-      p_cont += 3;
-      for (int m=-i-1; m<=+i+1; ++m) {
-        p_m_cur[m] = -1e30;
-#if 0
-        for (int ei=-1; ei<=1; ++ei) {
-          if (m-ei >= -i && m-ei <= i) {
-            cur_loss = p_m_old[m-ei] + p_cont[ei];
-            if (cur_loss > p_m_cur[m]) {
-              p_m_cur[m] = cur_loss;
-              p_c[m] = ei;
-            }
-          }
-        }
-#else
-        for (int l=std::max(m-1, -i); l<=std::min(m+1, i); ++l) {
-          cur_loss = p_m_old[l] + p_cont[m-l];
-          if (cur_loss > p_m_cur[m]) {
-            p_m_cur[m] = cur_loss;
-            p_c[m] = m - l;
-          }
-        }
-#endif
-      }
+  /**
+   * find the path
+   */
+  int max_m = -nb;
+  Dtype max_infer = std::max(max_m - 1, 0) + p_m_cur[max_m];  // Eq(7)
+  Dtype cur_infer;
+  for (int m=-nb+1; m<=nb; ++m) {
+    cur_infer = std::max(m - 1, 0) + p_m_cur[m];
+    if (cur_infer > max_infer) {
+      max_m = m;
+      max_infer = cur_infer;
     }
+  }
+  const int words = caffe_code_words(nb);
+  std::fill(p_g_qry, p_g_qry + words, 0);
+  std::fill(p_g_pos, p_g_pos + words, 0);
+  std::fill(p_g_neg, p_g_neg + words, 0);
+  int ei;
+  for (int i=nb-1; i>=0; --i) {
+    ei = p_c[max_m];
+    const uint64_t sign = ws->sign[i * 3 + ei + 1];
+    p_g_qry[i / 64] |= (sign & 1) << (i % 64);
+    p_g_pos[i / 64] |= (sign >> 1 & 1) << (i % 64);
+    p_g_neg[i / 64] |= (sign >> 2 & 1) << (i % 64);
+    max_m -= ei;
+    p_c -= step;
+  }
+  return max_infer;
+}
 
-    /**
-     * find the path
-     */
-    int max_m = -nb;
-    Dtype max_infer = std::max(max_m - 1, 0) + p_m_cur[max_m];  // Eq(7)
-    Dtype cur_infer;
-    for (int m=-nb+1; m<=nb; ++m) {
-      cur_infer = std::max(m - 1, 0) + p_m_cur[m];
-      if (cur_infer > max_infer) {
-        max_m = m;
-        max_infer = cur_infer;
+template <typename Dtype>
+void HDMLLossUpperBoundLayer<Dtype>::ProcessChunks(int num, const Dtype* qry,
+    const Dtype* pos, const Dtype* neg, uint64_t* h, uint64_t* g, int begin,
+    int end) {
+  int words = caffe_code_words(nb_);
+  int num_chunks = workspace_.size();
+  for (int chunk=begin; chunk<end; ++chunk) {
+    Workspace* ws = &workspace_[chunk];
+    for (int k=chunk*num/num_chunks; k<(chunk+1)*num/num_chunks; ++k) {
+      const Dtype* qry_k = qry + k * nb_;
+      const Dtype* pos_k = pos + k * nb_;
+      const Dtype* neg_k = neg + k * nb_;
+      compute_h(qry_k, pos_k, neg_k, h + k * words, h + (num + k) * words,
+          h + (2 * num + k) * words);
+      compute_infer_loss(qry_k, pos_k, neg_k, ws);
+      Dtype loss = compute_loss_ub(ws, g + k * words, g + (num + k) * words,
+          g + (2 * num + k) * words);
+      for (int i=0; i<nb_; i++) {
+        loss -= std::abs(qry_k[i]) + std::abs(pos_k[i]) + std::abs(neg_k[i]);
       }
-    }
-    LOG(INFO) << max_m << '\t' << max_infer;
-    loss_ub += max_infer;
-    int * p_g_qry_ = this->g_qry_.mutable_cpu_data() + this->g_qry_.offset(k);
-    int * p_g_pos_ = this->g_pos_.mutable_cpu_data() + this->g_pos_.offset(k);
-    int * p_g_neg_ = this->g_neg_.mutable_cpu_data() + this->g_neg_.offset(k);
-    int ei;
-    for (int i=nb-1; i>=0; --i) {
-      ei = p_c[max_m];
-      p_g_qry_[i] = this->infer_qry_buffer_.data_at(k, i, ei+1, 0);
-      p_g_pos_[i] = this->infer_pos_buffer_.data_at(k, i, ei+1, 0);
-      p_g_neg_[i] = this->infer_neg_buffer_.data_at(k, i, ei+1, 0);
-      max_m -= ei;
-      p_c -= step;
+      sample_loss_[k] = loss;
     }
   }
-
-  delete [] m_table;
-  delete [] choice_table;
-  return loss_ub;
 }
 
-
 template <typename Dtype>
 void HDMLLossUpperBoundLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
@@ -186,10 +160,18 @@ void HDMLLossUpperBoundLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bott
   if (this->layer_param_.loss_weight_size() == 0) {
     this->layer_param_.add_loss_weight(Dtype(1));
   }
+  // one chunk of samples per thread; all samples cost the same
+  pool_.reset(new ThreadPool(
+      this->layer_param_.triplet_loss_param().num_threads()));
+}
 
+template <typename Dtype>
+void HDMLLossUpperBoundLayer<Dtype>::Reshape(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  LossLayer<Dtype>::Reshape(bottom, top);
   int num = bottom[0]->num();
   int nb = bottom[0]->channels();
-  
+
   CHECK_EQ(num, bottom[1]->num());
   CHECK_EQ(num, bottom[2]->num());
   CHECK_EQ(nb, bottom[1]->channels());
@@ -201,37 +183,33 @@ void HDMLLossUpperBoundLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bott
   CHECK_EQ(bottom[1]->width(), 1);
   CHECK_EQ(bottom[2]->width(), 1);
 
-  this->infer_cont_.Reshape(num, nb, 3, 1);
-  this->infer_qry_buffer_.Reshape(num, nb, 3, 1);
-  this->infer_pos_buffer_.Reshape(num, nb, 3, 1);
-  this->infer_neg_buffer_.Reshape(num, nb, 3, 1);
-
-  this->h_qry_.Reshape(num, nb, 1, 1);
-  this->h_pos_.Reshape(num, nb, 1, 1);
-  this->h_neg_.Reshape(num, nb, 1, 1);
-
-  this->g_qry_.Reshape(num, nb, 1, 1);
-  this->g_pos_.Reshape(num, nb, 1, 1);
-  this->g_neg_.Reshape(num, nb, 1, 1);
+  nb_ = nb;
+  h_.resize(3 * num * caffe_code_words(nb));
+  g_.resize(3 * num * caffe_code_words(nb));
+  sample_loss_.resize(num);
+  workspace_.resize(std::min(num, pool_->size()));
+  for (int c=0; c<workspace_.size(); ++c) {
+    workspace_[c].cont.resize(nb * 3);
+    workspace_[c].sign.resize(nb * 3);
+    workspace_[c].m_rows.resize(2 * (2 * nb + 1 + 4));
+    workspace_[c].choice.resize(nb * (2 * nb + 1));
+  }
 }
 
 template <typename Dtype>
 void HDMLLossUpperBoundLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
-  const Blob<Dtype>* qry = bottom[0];   // ->cpu_data();
-  const Blob<Dtype>* pos = bottom[1];   // ->cpu_data();
-  const Blob<Dtype>* neg = bottom[2];   // ->cpu_data();
-
-  this->compute_h(qry, pos, neg);
-  this->compute_infer_loss(qry, pos, neg);
+  // Touch the buffers here: SyncedMemory is not safe to sync from workers.
+  pool_->ParallelFor(workspace_.size(), boost::bind(
+      &HDMLLossUpperBoundLayer<Dtype>::ProcessChunks, this,
+      bottom[0]->num(), bottom[0]->cpu_data(), bottom[1]->cpu_data(),
+      bottom[2]->cpu_data(), &h_[0], &g_[0], _1, _2));
 
-  Dtype loss_ub = this->compute_loss_ub();
-  for (int i=0; i<qry->count(); i++) {
-    loss_ub -= std::abs(qry->cpu_data()[i]);
-    loss_ub -= std::abs(pos->cpu_data()[i]);
-    loss_ub -= std::abs(neg->cpu_data()[i]);
+  Dtype loss_ub = 0.0;
+  for (int k=0; k<sample_loss_.size(); ++k) {
+    loss_ub += sample_loss_[k];
   }
-  loss_ub /= qry->num();
+  loss_ub /= bottom[0]->num();
 
   top[0]->mutable_cpu_data()[0] = loss_ub;
 }
@@ -239,28 +217,19 @@ void HDMLLossUpperBoundLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bot
 template <typename Dtype>
 void HDMLLossUpperBoundLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
-  if (true || propagate_down[0]) {
-    int num = bottom[0]->num();
-    int nb = bottom[0]->channels();
+  // h_ and g_ hold the query, positive and negative codes back to back,
+  // like the three bottoms; each bit stands for +1 when set and -1 if not.
+  int num = bottom[0]->num();
+  int words = caffe_code_words(nb_);
+  for (int b=0; b<3; ++b) {
+    Dtype* diff = bottom[b]->mutable_cpu_diff();
     for (int k=0; k<num; ++k) {
-      Dtype* qry_diff = bottom[0]->mutable_cpu_diff() + bottom[0]->offset(k);
-      Dtype* pos_diff = bottom[1]->mutable_cpu_diff() + bottom[1]->offset(k);
-      Dtype* neg_diff = bottom[2]->mutable_cpu_diff() + bottom[2]->offset(k);
-
-      const int * p_h_qry = this->h_qry_.cpu_data() + this->h_qry_.offset(k);
-      const int * p_h_pos = this->h_pos_.cpu_data() + this->h_pos_.offset(k);
-      const int * p_h_neg = this->h_neg_.cpu_data() + this->h_neg_.offset(k);
-
-      const int * p_g_qry = this->g_qry_.cpu_data() + this->g_qry_.offset(k);
-      const int * p_g_pos = this->g_pos_.cpu_data() + this->g_pos_.offset(k);
-      const int * p_g_neg = this->g_neg_.cpu_data() + this->g_neg_.offset(k);
-      for (int i=0; i<nb; ++i) {
-        qry_diff[i] = + p_g_qry[i] - p_h_qry[i];
-        pos_diff[i] = + p_g_pos[i] - p_h_pos[i];
-        neg_diff[i] = + p_g_neg[i] - p_h_neg[i];
-        // LOG_IF(INFO, qry_diff[i]) << k << '\t' << i << '\t' << qry_diff[i];
-        // LOG_IF(INFO, pos_diff[i]) << k << '\t' << i << '\t' << pos_diff[i];
-        // LOG_IF(INFO, neg_diff[i]) << k << '\t' << i << '\t' << neg_diff[i];
+      const uint64_t* h = &h_[(b * num + k) * words];
+      const uint64_t* g = &g_[(b * num + k) * words];
+      for (int i=0; i<nb_; ++i) {
+        int h_bit = (h[i / 64] >> (i % 64)) & 1;
+        int g_bit = (g[i / 64] >> (i % 64)) & 1;
+        diff[k * nb_ + i] = 2 * (g_bit - h_bit);
       }
     }
   }
@@ -1,6 +1,7 @@
 #ifdef USE_OPENCV
 #include <opencv2/core/core.hpp>
 
+#include <boost/bind.hpp>
 #include <fstream>  // NOLINT(readability/streams)
 #include <iostream>  // NOLINT(readability/streams)
 #include <string>
@@ -77,8 +78,8 @@ void ImageDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   const int batch_size = this->layer_param_.image_data_param().batch_size();
   CHECK_GT(batch_size, 0) << "Positive batch size required";
   top_shape[0] = batch_size;
-  for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
-    this->prefetch_[i].data_.Reshape(top_shape);
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    this->prefetch_[i]->data_.Reshape(top_shape);
   }
   top[0]->Reshape(top_shape);
 
@@ -88,8 +89,8 @@ void ImageDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   // label
   vector<int> label_shape(1, batch_size);
   top[1]->Reshape(label_shape);
-  for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
-    this->prefetch_[i].label_.Reshape(label_shape);
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    this->prefetch_[i]->label_.Reshape(label_shape);
   }
 }
 
@@ -105,7 +106,6 @@ template <typename Dtype>
 void ImageDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
   CPUTimer batch_timer;
   batch_timer.Start();
-  double read_time = 0;
   double trans_time = 0;
   CPUTimer timer;
   CHECK(batch->data_.count());
@@ -134,21 +134,10 @@ void ImageDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
 
   // datum scales
   const int lines_size = lines_.size();
+  batch_files_.resize(batch_size);
   for (int item_id = 0; item_id < batch_size; ++item_id) {
-    // get a blob
-    timer.Start();
     CHECK_GT(lines_size, lines_id_);
-    cv::Mat cv_img = ReadImageToCVMat(root_folder + lines_[lines_id_].first,
-        new_height, new_width, is_color);
-    CHECK(cv_img.data) << "Could not load " << lines_[lines_id_].first;
-    read_time += timer.MicroSeconds();
-    timer.Start();
-    // Apply transformations (mirror, crop...) to the image
-    int offset = batch->data_.offset(item_id);
-    this->transformed_data_.set_cpu_data(prefetch_data + offset);
-    this->data_transformer_->Transform(cv_img, &(this->transformed_data_));
-    trans_time += timer.MicroSeconds();
-
+    batch_files_[item_id] = root_folder + lines_[lines_id_].first;
     prefetch_label[item_id] = lines_[lines_id_].second;
     // go to the next iter
     lines_id_++;
@@ -161,10 +150,30 @@ void ImageDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
       }
     }
   }
+  // Reading decodes the image, so it runs on the decode threads too.
+  timer.Start();
+  this->LoadItems(batch_size, boost::bind(&ImageDataLayer<Dtype>::LoadImage,
+      this, batch, prefetch_data, _1, _2, _3));
+  trans_time += timer.MicroSeconds();
   batch_timer.Stop();
   DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
-  DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
-  DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
+  DLOG(INFO) << "Read and transform time: " << trans_time / 1000 << " ms.";
+}
+
+template <typename Dtype>
+void ImageDataLayer<Dtype>::LoadImage(Batch<Dtype>* batch,
+    Dtype* prefetch_data, int item_id, DataTransformer<Dtype>* transformer,
+    Blob<Dtype>* transformed) {
+  const ImageDataParameter& image_data_param =
+      this->layer_param_.image_data_param();
+  cv::Mat cv_img = ReadImageToCVMat(batch_files_[item_id],
+      image_data_param.new_height(), image_data_param.new_width(),
+      image_data_param.is_color());
+  CHECK(cv_img.data) << "Could not load " << batch_files_[item_id];
+  // Apply transformations (mirror, crop...) to the image
+  int offset = batch->data_.offset(item_id);
+  transformed->set_cpu_data(prefetch_data + offset);
+  transformer->Transform(cv_img, transformed);
 }
 
 INSTANTIATE_CLASS(ImageDataLayer);
@@ -0,0 +1,88 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "caffe/layers/multiple_similarity_layer.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void MultipleSimilarityLayer<Dtype>::Reshape(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  //bottom[0] is the anchor point
+  //bottom[1] is the positive/negative point
+  int num = bottom[0]->num();
+  int num_pos_neg = bottom[1]->num();
+  CHECK_EQ(bottom[0]->count() / num, bottom[1]->count() / num_pos_neg)
+      << "Anchors and samples must have the same dimension.";
+  CHECK(num_pos_neg % num == 0)
+      << "the num_pos_neg should be devisible of num";
+  top[0]->Reshape(num, 1, 1, 1);
+  sim_.Reshape(num, num_pos_neg / num, 1, 1);
+  weight_.ReshapeLike(sim_);
+}
+
+template <typename Dtype>
+Dtype MultipleSimilarityLayer<Dtype>::AggregateRow(
+    const MultipleSimilarityParameter& param, int k, const Dtype* sim,
+    Dtype* weight) {
+  const Dtype scale = param.scale();
+  Dtype max_sim = *std::max_element(sim, sim + k);
+  switch (param.aggregation()) {
+  case MultipleSimilarityParameter_Aggregation_MEAN: {
+    Dtype sum = 0;
+    for (int j=0; j<k; ++j) {
+      sum += sim[j];
+    }
+    caffe_set(k, Dtype(1) / k, weight);
+    return sum / k;
+  }
+  case MultipleSimilarityParameter_Aggregation_MAX:
+    // the first maximum takes the whole gradient
+    caffe_set(k, Dtype(0), weight);
+    weight[std::max_element(sim, sim + k) - sim] = 1;
+    return max_sim;
+  case MultipleSimilarityParameter_Aggregation_LSE: {
+    // shifted by the maximum; the weights are the softmax of scale * sim
+    Dtype sum = 0;
+    for (int j=0; j<k; ++j) {
+      weight[j] = std::exp(scale * (sim[j] - max_sim));
+      sum += weight[j];
+    }
+    caffe_scal(k, Dtype(1) / sum, weight);
+    return max_sim + std::log(sum / k) / scale;
+  }
+  default:
+    LOG(FATAL) << "Unknown aggregation " << param.aggregation();
+  }
+  return 0;
+}
+
+template <typename Dtype>
+void MultipleSimilarityLayer<Dtype>::Aggregate(Dtype* top_data) {
+  const MultipleSimilarityParameter& param =
+      this->layer_param_.multiple_similarity_param();
+  int num = sim_.num();
+  int k = sim_.channels();
+  const Dtype* sim = sim_.cpu_data();
+  Dtype* weight = weight_.mutable_cpu_data();
+  for (int i=0; i<num; ++i) {
+    top_data[i] = AggregateRow(param, k, sim + i * k, weight + i * k);
+  }
+}
+
+template <typename Dtype>
+void MultipleSimilarityLayer<Dtype>::BackwardAggregate(
+    const Dtype* top_diff) {
+  int k = sim_.channels();
+  const Dtype* weight = weight_.cpu_data();
+  Dtype* sim_diff = sim_.mutable_cpu_diff();
+  for (int i=0; i<sim_.num(); ++i) {
+    caffe_cpu_scale(k, top_diff[i], weight + i * k, sim_diff + i * k);
+  }
+}
+
+INSTANTIATE_CLASS(MultipleSimilarityLayer);
+
+}  // namespace caffe
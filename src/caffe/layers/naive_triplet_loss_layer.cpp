@@ -56,6 +56,24 @@ void NaiveTripletLossLayer<Dtype>::LayerSetUp(
   neg_sim_top_vec_.clear();
   neg_sim_top_vec_.push_back(&neg_sim_);
   neg_sim_layer_->SetUp(neg_sim_bottom_vec_, neg_sim_top_vec_);
+
+  bank_rows_ = 0;
+  int bank_size = this->layer_param_.triplet_loss_param().memory_bank_size();
+  // The bank is a training device: test nets see each batch once and would
+  // only ever mine their own, possibly stale, bank.
+  if (this->phase_ == TRAIN && bank_size > 0) {
+    CHECK_EQ(bottom.size(), 2)
+        << "The memory bank needs the query labels as second bottom.";
+    CHECK(sim_type == "DotProductSimilarity"
+        || sim_type == "EuclideanSimilarity")
+        << "The memory bank does not support " << sim_type;
+    bank_.reset(new MemoryBank<Dtype>(bank_size, bottom[0]->count() / num));
+  }
+  const HardMiningParameter& hard_mining_param =
+      this->layer_param_.hard_mining_param();
+  if (this->phase_ == TRAIN && !hard_mining_param.table().empty()) {
+    hardness_ = HardnessTable::Get(hard_mining_param.table());
+  }
 }
 
 template <typename Dtype>
@@ -68,6 +86,33 @@ void NaiveTripletLossLayer<Dtype>::Reshape(
   split_layer_->Reshape(split_bottom_vec_, split_top_vec_);
   pos_sim_layer_->Reshape(pos_sim_bottom_vec_, pos_sim_top_vec_);
   neg_sim_layer_->Reshape(neg_sim_bottom_vec_, neg_sim_top_vec_);
+  qry_diff_.ReshapeLike(qry_feat_);
+  if (bottom.size() > 1) {
+    CHECK_EQ(bottom[1]->count(), qry_feat_.num())
+        << "There must be one label per query.";
+  }
+}
+
+template <typename Dtype>
+void NaiveTripletLossLayer<Dtype>::ComputeBankSimilarity() {
+  int num = qry_feat_.num();
+  int dim = qry_feat_.count() / num;
+  const Dtype* qry = qry_feat_.cpu_data();
+  bank_sim_.Reshape(num, bank_rows_, 1, 1);
+  Dtype* sim = bank_sim_.mutable_cpu_data();
+  caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, num, bank_rows_, dim,
+      Dtype(1), qry, bank_->feat().cpu_data(), Dtype(0), sim);
+  if (this->layer_param_.triplet_loss_param().sim_type()
+      == "EuclideanSimilarity") {
+    // -0.5 * |q - b|^2 = q.b - 0.5 * |q|^2 - 0.5 * |b|^2
+    const Dtype* bank_norm = bank_->norm();
+    for (int i=0; i<num; ++i) {
+      Dtype qry_norm = caffe_cpu_dot(dim, qry + i * dim, qry + i * dim);
+      for (int k=0; k<bank_rows_; ++k) {
+        sim[i * bank_rows_ + k] -= Dtype(0.5) * (qry_norm + bank_norm[k]);
+      }
+    }
+  }
 }
 
 template <typename Dtype>
@@ -92,13 +137,102 @@ void NaiveTripletLossLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& botto
     loss += per_triplet_loss[i];
     accuracy += (pos_sim[i] > neg_sim[i] ? 1 : 0);
   }
+  if (hardness_) {
+    hardness_->Update(count, per_triplet_loss,
+        this->layer_param_.hard_mining_param().momentum());
+  }
+
+  // Each query adds the mean hinge over its bank negatives; the hinges go
+  // to bank_sim_ diff for the backward pass.
+  bank_rows_ = bank_ ? bank_->size() : 0;
+  if (bank_rows_ > 0) {
+    ComputeBankSimilarity();
+    const Dtype margin = this->layer_param_.triplet_loss_param().margin();
+    const Dtype* qry_label = bottom[1]->cpu_data();
+    const Dtype* bank_label = bank_->label();
+    const Dtype* bank_sim = bank_sim_.cpu_data();
+    Dtype* bank_loss = bank_sim_.mutable_cpu_diff();
+    for (int i=0; i<count; ++i) {
+      Dtype sum = 0;
+      int num_neg = 0;
+      for (int k=0; k<bank_rows_; ++k) {
+        int idx = i * bank_rows_ + k;
+        bank_loss[idx] = 0;
+        if (bank_label[k] != qry_label[i]) {
+          bank_loss[idx] = std::max(Dtype(0),
+              margin - pos_sim[i] + bank_sim[idx]);
+          sum += bank_loss[idx];
+          ++num_neg;
+        }
+      }
+      if (num_neg > 0) {
+        loss += sum / num_neg;
+      }
+    }
+    WeighBankNegatives(qry_label);
+  }
+  // Push only after mining, so a batch is never its own negative. The
+  // gradient of the bank terms is already in bank_grad_.
+  if (bank_ && this->phase_ == TRAIN) {
+    // queries and positives share the query label
+    bank_->Push(count, qry_feat_.cpu_data(), bottom[1]->cpu_data());
+    bank_->Push(count, pos_feat_.cpu_data(), bottom[1]->cpu_data());
+  }
   top[0]->mutable_cpu_data()[0] = loss / count;
   top[1]->mutable_cpu_data()[0] = accuracy / count;
 }
 
+template <typename Dtype>
+void NaiveTripletLossLayer<Dtype>::WeighBankNegatives(
+    const Dtype* qry_label) {
+  bool sample = this->layer_param_.triplet_loss_param().sample();
+  int num = qry_feat_.num();
+  int dim = qry_feat_.count() / num;
+  const Dtype* pos_sim = pos_sim_.cpu_data();
+  const Dtype* bank_sim = bank_sim_.cpu_data();
+  const Dtype* bank_label = bank_->label();
+  bank_pos_weight_.resize(num);
+  // turn the hinges into d loss / d S(q, b)
+  Dtype* bank_diff = bank_sim_.mutable_cpu_diff();
+  for (int i=0; i<num; ++i) {
+    Dtype row_sum = 0;
+    int num_neg = 0;
+    for (int k=0; k<bank_rows_; ++k) {
+      num_neg += (bank_label[k] != qry_label[i]);
+    }
+    for (int k=0; k<bank_rows_; ++k) {
+      int idx = i * bank_rows_ + k;
+      if (bank_diff[idx] > 0 && (!sample || pos_sim[i] > bank_sim[idx])) {
+        bank_diff[idx] = Dtype(1) / num_neg;
+        row_sum += bank_diff[idx];
+      } else {
+        bank_diff[idx] = 0;
+      }
+    }
+    bank_pos_weight_[i] = row_sum;
+  }
+  // dS/dq is b for the dot product and b - q for the Euclidean similarity
+  bank_grad_.ReshapeLike(qry_feat_);
+  Dtype* bank_grad = bank_grad_.mutable_cpu_data();
+  caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, num, dim, bank_rows_,
+      Dtype(1), bank_diff, bank_->feat().cpu_data(), Dtype(0), bank_grad);
+  if (this->layer_param_.triplet_loss_param().sim_type()
+      == "EuclideanSimilarity") {
+    const Dtype* qry = qry_feat_.cpu_data();
+    for (int i=0; i<num; ++i) {
+      caffe_axpy(dim, -bank_pos_weight_[i], qry + i * dim,
+          bank_grad + i * dim);
+    }
+  }
+}
+
 template <typename Dtype>
 void NaiveTripletLossLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  if (propagate_down.size() > 1 && propagate_down[1]) {
+    LOG(FATAL) << this->type()
+               << " Layer cannot backpropagate to label inputs.";
+  }
   if (propagate_down[0]) {
     bool sample = this->layer_param_.triplet_loss_param().sample();
     Dtype* pos_diff = pos_sim_.mutable_cpu_diff();
@@ -106,17 +240,34 @@ void NaiveTripletLossLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     const Dtype* pos_sim = pos_sim_.cpu_data();
     const Dtype* neg_sim = neg_sim_.cpu_data();
     int count = pos_sim_.count();
+    const Dtype scale = top[0]->cpu_diff()[0] / count;
     for (int i=0; i<count; ++i) {
       if (pos_diff[i] && (!sample || pos_sim[i] > neg_sim[i])) {
-        pos_diff[i] = -1;
-        neg_diff[i] = 1;
+        pos_diff[i] = -scale;
+        neg_diff[i] = scale;
       } else {
         pos_diff[i] = 0;
         neg_diff[i] = 0;
       }
+      if (bank_rows_ > 0) {
+        pos_diff[i] -= scale * bank_pos_weight_[i];
+      }
+    }
+    // Both similarity layers write the query diff, so the first one is kept
+    // aside and added back; the bank terms add to it last.
+    vector<bool> sim_propagate_down(2, true);
+    pos_sim_layer_->Backward(pos_sim_top_vec_, sim_propagate_down,
+        pos_sim_bottom_vec_);
+    caffe_copy(qry_feat_.count(), qry_feat_.cpu_diff(),
+        qry_diff_.mutable_cpu_data());
+    neg_sim_layer_->Backward(neg_sim_top_vec_, sim_propagate_down,
+        neg_sim_bottom_vec_);
+    caffe_axpy(qry_feat_.count(), Dtype(1), qry_diff_.cpu_data(),
+        qry_feat_.mutable_cpu_diff());
+    if (bank_rows_ > 0) {
+      caffe_axpy(qry_feat_.count(), scale, bank_grad_.cpu_data(),
+          qry_feat_.mutable_cpu_diff());
     }
-    pos_sim_layer_->Backward(pos_sim_top_vec_, propagate_down, pos_sim_bottom_vec_);
-    neg_sim_layer_->Backward(neg_sim_top_vec_, propagate_down, neg_sim_bottom_vec_);
     split_layer_->Backward(split_top_vec_, propagate_down, split_bottom_vec_);
   }
 }
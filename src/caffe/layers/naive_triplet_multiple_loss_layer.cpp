@@ -6,6 +6,8 @@
 #include "caffe/layer.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/layers/euclidean_multiple_similarity_layer.hpp"
+#include "caffe/layers/multiple_similarity_layer.hpp"
 #include "caffe/layers/naive_triplet_multiple_loss_layer.hpp"
 
 /*
@@ -26,18 +28,37 @@ void NaiveTripletMultipleLossLayer<Dtype>::LayerSetUp(
 
   int num = bottom[0]->num();
   CHECK(num > 0) << "Number of images must be positive.";
-  //CHECK(num % 3 == 0) << "Number of images must be multiple of 3.";
-  //int batch_size = num / 3;
   batch_size_ = this->layer_param_.multiple_triplet_loss_param().batch_size();
   anchor_len_ = this->layer_param_.multiple_triplet_loss_param().anchor_len();
   pos_len_ = this->layer_param_.multiple_triplet_loss_param().pos_len();
   neg_len_ = this->layer_param_.multiple_triplet_loss_param().neg_len();
-  //CHECK( num == batch_size_*(anchor_len_ + pos_len_ + neg_len_) ) << "the following equation should be met: num == batch_size_ * (anchor_len_ + pos_len_ + neg_len_)"; 
+
+  const string & sim_type =
+      this->layer_param_.multiple_triplet_loss_param().sim_type();
+  dot_product_ = (sim_type == "DotProductSimilarity"
+      || sim_type == "DotProductMultipleSimilarity");
+  multiple_ = (sim_type == "DotProductMultipleSimilarity"
+      || sim_type == "EuclideanMultipleSimilarity");
+  fused_ = dot_product_ || multiple_ || sim_type == "EuclideanSimilarity";
+  if (!fused_) {
+    SetUpSubLayers(bottom);
+  }
+  const HardMiningParameter& hard_mining_param =
+      this->layer_param_.hard_mining_param();
+  if (this->phase_ == TRAIN && !hard_mining_param.table().empty()) {
+    hardness_ = HardnessTable::Get(hard_mining_param.table());
+  }
+}
+
+template <typename Dtype>
+void NaiveTripletMultipleLossLayer<Dtype>::SetUpSubLayers(
+    const vector<Blob<Dtype>*>& bottom) {
   LayerParameter split_param;
   split_param.set_type("Slice");
   split_param.mutable_slice_param()->set_axis(0);
-  split_param.mutable_slice_param()->add_slice_point( batch_size_*anchor_len_ );
-  split_param.mutable_slice_param()->add_slice_point( batch_size_*(anchor_len_ + pos_len_ ));
+  split_param.mutable_slice_param()->add_slice_point(batch_size_ * anchor_len_);
+  split_param.mutable_slice_param()->add_slice_point(
+      batch_size_ * (anchor_len_ + pos_len_));
   split_layer_ = LayerRegistry<Dtype>::CreateLayer(split_param);
   split_bottom_vec_.clear();
   split_bottom_vec_.push_back(bottom[0]);
@@ -47,11 +68,11 @@ void NaiveTripletMultipleLossLayer<Dtype>::LayerSetUp(
   split_top_vec_.push_back(&neg_feat_);
   split_layer_->SetUp(split_bottom_vec_, split_top_vec_);
 
-  const string & sim_type = this->layer_param_.multiple_triplet_loss_param().sim_type();
-
-  LayerParameter pos_sim_param;
-  pos_sim_param.set_type(sim_type);
-  pos_sim_layer_ = LayerRegistry<Dtype>::CreateLayer(pos_sim_param);
+  LayerParameter sim_param;
+  sim_param.set_type(this->layer_param_.multiple_triplet_loss_param().sim_type());
+  sim_param.mutable_multiple_similarity_param()->CopyFrom(
+      this->layer_param_.multiple_similarity_param());
+  pos_sim_layer_ = LayerRegistry<Dtype>::CreateLayer(sim_param);
   pos_sim_bottom_vec_.clear();
   pos_sim_bottom_vec_.push_back(&qry_feat_);
   pos_sim_bottom_vec_.push_back(&pos_feat_);
@@ -59,9 +80,7 @@ void NaiveTripletMultipleLossLayer<Dtype>::LayerSetUp(
   pos_sim_top_vec_.push_back(&pos_sim_);
   pos_sim_layer_->SetUp(pos_sim_bottom_vec_, pos_sim_top_vec_);
 
-  LayerParameter neg_sim_param;
-  neg_sim_param.set_type(sim_type);
-  neg_sim_layer_ = LayerRegistry<Dtype>::CreateLayer(neg_sim_param);
+  neg_sim_layer_ = LayerRegistry<Dtype>::CreateLayer(sim_param);
   neg_sim_bottom_vec_.clear();
   neg_sim_bottom_vec_.push_back(&qry_feat_);
   neg_sim_bottom_vec_.push_back(&neg_feat_);
@@ -77,58 +96,191 @@ void NaiveTripletMultipleLossLayer<Dtype>::Reshape(
   top[0]->Reshape(loss_shape);
   top[1]->Reshape(loss_shape);
 
-  split_layer_->Reshape(split_bottom_vec_, split_top_vec_);
-  pos_sim_layer_->Reshape(pos_sim_bottom_vec_, pos_sim_top_vec_);
-  neg_sim_layer_->Reshape(neg_sim_bottom_vec_, neg_sim_top_vec_);
+  int num = bottom[0]->num();
+  int count = batch_size_ * anchor_len_;
+  int num_pos = batch_size_ * pos_len_;
+  int num_neg = num - count - num_pos;
+  CHECK(num_pos > 0 && num_pos % count == 0)
+      << "Every anchor needs the same number of positives.";
+  CHECK(num_neg > 0 && num_neg % count == 0)
+      << "Every anchor needs the same number of negatives.";
+  triplet_loss_.Reshape(count, 1, 1, 1);
+  if (!fused_) {
+    split_layer_->Reshape(split_bottom_vec_, split_top_vec_);
+    pos_sim_layer_->Reshape(pos_sim_bottom_vec_, pos_sim_top_vec_);
+    neg_sim_layer_->Reshape(neg_sim_bottom_vec_, neg_sim_top_vec_);
+    qry_diff_.ReshapeLike(qry_feat_);
+    return;
+  }
+  if (!multiple_) {
+    CHECK_EQ(num_pos, count) << "Every anchor needs one positive.";
+    CHECK_EQ(num_neg, count) << "Every anchor needs one negative.";
+  }
+  pos_sim_.Reshape(count, num_pos / count, 1, 1);
+  neg_sim_.Reshape(count, num_neg / count, 1, 1);
+  pos_weight_.ReshapeLike(pos_sim_);
+  neg_weight_.ReshapeLike(neg_sim_);
+}
+
+template <typename Dtype>
+void NaiveTripletMultipleLossLayer<Dtype>::Similarities(int k, int dim,
+    const Dtype* q, const Dtype* b, Dtype* sim) const {
+  if (dot_product_) {
+    caffe_cpu_gemv<Dtype>(CblasNoTrans, k, dim, Dtype(1), b, q, Dtype(0), sim);
+  } else {
+    EuclideanMultipleSimilarityLayer<Dtype>::Similarities(k, dim, q, b, sim);
+  }
 }
 
+/**
+ * With the aggregation weights w_j,
+ *   dot product:  dq = sum_j w_j b_j,          db_j = w_j q
+ *   euclidean:    dq = sum_j w_j (b_j - q),    db_j = w_j (q - b_j)
+ */
 template <typename Dtype>
-void NaiveTripletMultipleLossLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
-    const vector<Blob<Dtype>*>& top) {
-  split_layer_->Forward(split_bottom_vec_, split_top_vec_);
-  pos_sim_layer_->Forward(pos_sim_bottom_vec_, pos_sim_top_vec_);
-  neg_sim_layer_->Forward(neg_sim_bottom_vec_, neg_sim_top_vec_);
+void NaiveTripletMultipleLossLayer<Dtype>::SimilarityGradient(int k, int dim,
+    const Dtype* q, const Dtype* b, const Dtype* w, Dtype alpha, Dtype* dq,
+    Dtype* db) const {
+  caffe_cpu_gemv<Dtype>(CblasTrans, k, dim, alpha, b, w, Dtype(1), dq);
+  caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, k, dim, 1, alpha, w, q,
+      Dtype(0), db);
+  if (!dot_product_) {
+    Dtype weight_sum = 0;
+    for (int j=0; j<k; ++j) {
+      weight_sum += w[j];
+      caffe_axpy(dim, -alpha * w[j], b + j * dim, db + j * dim);
+    }
+    caffe_axpy(dim, -alpha * weight_sum, q, dq);
+  }
+}
 
-  const Dtype* pos_sim = pos_sim_.cpu_data();
-  const Dtype* neg_sim = neg_sim_.cpu_data();
-  Dtype* per_triplet_loss = pos_sim_.mutable_cpu_diff();
-  int count = pos_sim_.count();
+template <typename Dtype>
+void NaiveTripletMultipleLossLayer<Dtype>::Forward_cpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  const Dtype margin = this->layer_param_.triplet_loss_param().margin();
+  int count = triplet_loss_.count();
+  Dtype* per_triplet_loss = triplet_loss_.mutable_cpu_data();
+  // S(q, p) and S(q, n) of every anchor
+  Dtype* pos_sim;
+  Dtype* neg_sim;
+  if (fused_) {
+    const MultipleSimilarityParameter& param =
+        this->layer_param_.multiple_similarity_param();
+    int dim = bottom[0]->count() / bottom[0]->num();
+    int pos_k = pos_sim_.channels();
+    int neg_k = neg_sim_.channels();
+    const Dtype* qry = bottom[0]->cpu_data();
+    const Dtype* pos = qry + count * dim;
+    const Dtype* neg = pos + count * pos_k * dim;
+    Dtype* pos_sims = pos_sim_.mutable_cpu_data();
+    Dtype* neg_sims = neg_sim_.mutable_cpu_data();
+    Dtype* pos_weight = pos_weight_.mutable_cpu_data();
+    Dtype* neg_weight = neg_weight_.mutable_cpu_data();
+    // the fused path leaves the diffs free for the aggregated similarities
+    pos_sim = pos_sim_.mutable_cpu_diff();
+    neg_sim = neg_sim_.mutable_cpu_diff();
+    for (int i=0; i<count; ++i) {
+      Similarities(pos_k, dim, qry + i * dim, pos + i * pos_k * dim,
+          pos_sims + i * pos_k);
+      Similarities(neg_k, dim, qry + i * dim, neg + i * neg_k * dim,
+          neg_sims + i * neg_k);
+      pos_sim[i] = MultipleSimilarityLayer<Dtype>::AggregateRow(param, pos_k,
+          pos_sims + i * pos_k, pos_weight + i * pos_k);
+      neg_sim[i] = MultipleSimilarityLayer<Dtype>::AggregateRow(param, neg_k,
+          neg_sims + i * neg_k, neg_weight + i * neg_k);
+    }
+  } else {
+    split_layer_->Forward(split_bottom_vec_, split_top_vec_);
+    pos_sim_layer_->Forward(pos_sim_bottom_vec_, pos_sim_top_vec_);
+    neg_sim_layer_->Forward(neg_sim_bottom_vec_, neg_sim_top_vec_);
+    pos_sim = pos_sim_.mutable_cpu_data();
+    neg_sim = neg_sim_.mutable_cpu_data();
+  }
 
   Dtype loss = 0;
   Dtype accuracy = 0;
   for (int i=0; i<count; ++i) {
-    per_triplet_loss[i] = std::max(Dtype(0),
-        this->layer_param_.triplet_loss_param().margin()
-        - pos_sim[i] + neg_sim[i]);
+    per_triplet_loss[i] = std::max(Dtype(0), margin - pos_sim[i] + neg_sim[i]);
     loss += per_triplet_loss[i];
     accuracy += (pos_sim[i] > neg_sim[i] ? 1 : 0);
   }
+  // 1 for the anchors whose hinge is backpropagated, 0 for the others
+  bool sample = this->layer_param_.triplet_loss_param().sample();
+  Dtype* active = triplet_loss_.mutable_cpu_diff();
+  for (int i=0; i<count; ++i) {
+    active[i] = per_triplet_loss[i] && (!sample || pos_sim[i] > neg_sim[i]);
+  }
+  if (hardness_) {
+    hardness_->Update(count, per_triplet_loss,
+        this->layer_param_.hard_mining_param().momentum());
+  }
   top[0]->mutable_cpu_data()[0] = loss / count;
   top[1]->mutable_cpu_data()[0] = accuracy / count;
 }
 
 template <typename Dtype>
-void NaiveTripletMultipleLossLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
-    const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
-  if (propagate_down[0]) {
-    bool sample = this->layer_param_.triplet_loss_param().sample();
-    Dtype* pos_diff = pos_sim_.mutable_cpu_diff();
-    Dtype* neg_diff = neg_sim_.mutable_cpu_diff();
-    const Dtype* pos_sim = pos_sim_.cpu_data();
-    const Dtype* neg_sim = neg_sim_.cpu_data();
-    int count = pos_sim_.count();
-    for (int i=0; i<count; ++i) {
-      if (pos_diff[i] && (!sample || pos_sim[i] > neg_sim[i])) {
-        pos_diff[i] = -1;
-        neg_diff[i] = 1;
-      } else {
-        pos_diff[i] = 0;
-        neg_diff[i] = 0;
-      }
+void NaiveTripletMultipleLossLayer<Dtype>::BackwardSubLayers(Dtype scale) {
+  const Dtype* active = triplet_loss_.cpu_diff();
+  Dtype* pos_diff = pos_sim_.mutable_cpu_diff();
+  Dtype* neg_diff = neg_sim_.mutable_cpu_diff();
+  for (int i=0; i<triplet_loss_.count(); ++i) {
+    pos_diff[i] = -scale * active[i];
+    neg_diff[i] = scale * active[i];
+  }
+  // both similarities write the query diff, so keep the first one
+  vector<bool> propagate_down(2, true);
+  pos_sim_layer_->Backward(pos_sim_top_vec_, propagate_down,
+      pos_sim_bottom_vec_);
+  caffe_copy(qry_feat_.count(), qry_feat_.cpu_diff(),
+      qry_diff_.mutable_cpu_data());
+  neg_sim_layer_->Backward(neg_sim_top_vec_, propagate_down,
+      neg_sim_bottom_vec_);
+  caffe_axpy(qry_feat_.count(), Dtype(1), qry_diff_.cpu_data(),
+      qry_feat_.mutable_cpu_diff());
+  split_layer_->Backward(split_top_vec_, propagate_down, split_bottom_vec_);
+}
+
+template <typename Dtype>
+void NaiveTripletMultipleLossLayer<Dtype>::Backward_cpu(
+    const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+    const vector<Blob<Dtype>*>& bottom) {
+  if (!propagate_down[0]) {
+    return;
+  }
+  int count = triplet_loss_.count();
+  const Dtype scale = top[0]->cpu_diff()[0] / count;
+  if (!fused_) {
+    BackwardSubLayers(scale);
+    return;
+  }
+  int dim = bottom[0]->count() / bottom[0]->num();
+  int pos_k = pos_sim_.channels();
+  int neg_k = neg_sim_.channels();
+  const Dtype* active = triplet_loss_.cpu_diff();
+  const Dtype* pos_weight = pos_weight_.cpu_data();
+  const Dtype* neg_weight = neg_weight_.cpu_data();
+  const Dtype* qry = bottom[0]->cpu_data();
+  const Dtype* pos = qry + count * dim;
+  const Dtype* neg = pos + count * pos_k * dim;
+  Dtype* qry_diff = bottom[0]->mutable_cpu_diff();
+  Dtype* pos_diff = qry_diff + count * dim;
+  Dtype* neg_diff = pos_diff + count * pos_k * dim;
+  // an active hinge has gradient -1 w.r.t. S(q, p) and 1 w.r.t. S(q, n)
+  for (int i=0; i<count; ++i) {
+    const Dtype* q = qry + i * dim;
+    Dtype* dq = qry_diff + i * dim;
+    Dtype* dp = pos_diff + i * pos_k * dim;
+    Dtype* dn = neg_diff + i * neg_k * dim;
+    caffe_set(dim, Dtype(0), dq);
+    if (active[i]) {
+      SimilarityGradient(pos_k, dim, q, pos + i * pos_k * dim,
+          pos_weight + i * pos_k, -scale, dq, dp);
+      SimilarityGradient(neg_k, dim, q, neg + i * neg_k * dim,
+          neg_weight + i * neg_k, scale, dq, dn);
+    } else {
+      caffe_set(pos_k * dim, Dtype(0), dp);
+      caffe_set(neg_k * dim, Dtype(0), dn);
     }
-    pos_sim_layer_->Backward(pos_sim_top_vec_, propagate_down, pos_sim_bottom_vec_);
-    neg_sim_layer_->Backward(neg_sim_top_vec_, propagate_down, neg_sim_bottom_vec_);
-    split_layer_->Backward(split_top_vec_, propagate_down, split_bottom_vec_);
   }
 }
 
@@ -10,6 +10,17 @@
 
 namespace caffe {
 
+template <typename Dtype>
+void PairwiseRankingLossLayer<Dtype>::LayerSetUp(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  LossLayer<Dtype>::LayerSetUp(bottom, top);
+  const HardMiningParameter& hard_mining_param =
+      this->layer_param_.hard_mining_param();
+  if (this->phase_ == TRAIN && !hard_mining_param.table().empty()) {
+    hardness_ = HardnessTable::Get(hard_mining_param.table());
+  }
+}
+
 template <typename Dtype>
 void PairwiseRankingLossLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
@@ -26,6 +37,10 @@ void PairwiseRankingLossLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bo
         - pos_sim[i] + neg_sim[i]);
     loss[0] += per_triplet_loss[i];
   }
+  if (hardness_) {
+    hardness_->Update(count, per_triplet_loss,
+        this->layer_param_.hard_mining_param().momentum());
+  }
   loss[0] /= count;
 }
 
@@ -0,0 +1,188 @@
+#ifdef USE_OPENCV
+#include <opencv2/core/core.hpp>
+#endif  // USE_OPENCV
+
+#include <boost/bind.hpp>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "caffe/data_transformer.hpp"
+#include "caffe/layers/pk_data_layer.hpp"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/rng.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+PKDataLayer<Dtype>::~PKDataLayer() {
+  this->StopInternalThread();
+}
+
+template <typename Dtype>
+void PKDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  const DataParameter& data_param = this->layer_param_.data_param();
+  const PKSamplerParameter& pk_param = this->layer_param_.pk_sampler_param();
+  const int batch_size = pk_param.num_labels() * pk_param.images_per_label();
+  CHECK_GT(batch_size, 0) << "num_labels and images_per_label must be "
+      "positive";
+  db_.reset(db::GetDB(data_param.backend()));
+  db_->Open(data_param.source(), db::READ);
+  cursor_.reset(db_->NewCursor());
+
+  // Index the keys by label.
+  map<int, int> label_index;
+  vector<int> labels;
+  vector<vector<string> > keys;
+  Datum datum;
+  for (cursor_->SeekToFirst(); cursor_->valid(); cursor_->Next()) {
+    db::ParseValue(cursor_.get(), &datum);
+    map<int, int>::iterator it = label_index.find(datum.label());
+    if (it == label_index.end()) {
+      it = label_index.insert(std::make_pair(datum.label(),
+          static_cast<int>(labels.size()))).first;
+      labels.push_back(datum.label());
+      keys.push_back(vector<string>());
+    }
+    keys[it->second].push_back(cursor_->key());
+  }
+  int num_images = 0;
+  for (int i = 0; i < labels.size(); ++i) {
+    if (keys[i].size() < 2) {
+      continue;
+    }
+    labels_.push_back(labels[i]);
+    keys_.push_back(vector<string>());
+    keys_.back().swap(keys[i]);
+    num_images += keys_.back().size();
+  }
+  LOG(INFO) << "Indexed " << num_images << " images of " << labels_.size()
+      << " labels; left out " << labels.size() - labels_.size()
+      << " labels with a single image";
+  CHECK_GE(labels_.size(), pk_param.num_labels())
+      << "Not enough labels with two or more images";
+
+  const unsigned int prefetch_rng_seed = caffe_rng_rand();
+  prefetch_rng_.reset(new Caffe::RNG(prefetch_rng_seed));
+  for (int i = 0; i < labels_.size(); ++i) {
+    label_order_.push_back(i);
+  }
+  // Start with a shuffle of every order.
+  label_pos_ = label_order_.size();
+  for (int i = 0; i < keys_.size(); ++i) {
+    key_pos_.push_back(keys_[i].size());
+  }
+
+  // Read a data point, and use it to initialize the top blob.
+  cursor_->SeekToFirst();
+  db::ParseValue(cursor_.get(), &datum);
+  vector<int> top_shape = this->data_transformer_->InferBlobShape(datum);
+  this->transformed_data_.Reshape(top_shape);
+  top_shape[0] = batch_size;
+  top[0]->Reshape(top_shape);
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    this->prefetch_[i]->data_.Reshape(top_shape);
+  }
+  LOG(INFO) << "output data size: " << top[0]->num() << ","
+      << top[0]->channels() << "," << top[0]->height() << ","
+      << top[0]->width();
+  // label
+  if (this->output_labels_) {
+    vector<int> label_shape(1, batch_size);
+    top[1]->Reshape(label_shape);
+    for (int i = 0; i < this->prefetch_.size(); ++i) {
+      this->prefetch_[i]->label_.Reshape(label_shape);
+    }
+  }
+}
+
+template <typename Dtype>
+void PKDataLayer<Dtype>::SampleBatchKeys() {
+  const PKSamplerParameter& pk_param = this->layer_param_.pk_sampler_param();
+  const int num_labels = pk_param.num_labels();
+  const int images_per_label = pk_param.images_per_label();
+  caffe::rng_t* prefetch_rng =
+      static_cast<caffe::rng_t*>(prefetch_rng_->generator());
+  batch_keys_.clear();
+  // Reshuffle early rather than repeat a label or an image within a batch.
+  if (label_pos_ + num_labels > label_order_.size()) {
+    shuffle(label_order_.begin(), label_order_.end(), prefetch_rng);
+    label_pos_ = 0;
+  }
+  for (int p = 0; p < num_labels; ++p) {
+    const int l = label_order_[label_pos_++];
+    vector<string>& keys = keys_[l];
+    if (key_pos_[l] + images_per_label > keys.size()) {
+      shuffle(keys.begin(), keys.end(), prefetch_rng);
+      key_pos_[l] = 0;
+    }
+    // Labels with fewer images than images_per_label repeat some.
+    for (int k = 0; k < images_per_label; ++k) {
+      batch_keys_.push_back(keys[key_pos_[l]]);
+      key_pos_[l] = (key_pos_[l] + 1) % keys.size();
+    }
+  }
+}
+
+// This function is called on prefetch thread
+template <typename Dtype>
+void PKDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
+  CPUTimer batch_timer;
+  batch_timer.Start();
+  double read_time = 0;
+  double trans_time = 0;
+  CPUTimer timer;
+  CHECK(batch->data_.count());
+  CHECK(this->transformed_data_.count());
+
+  timer.Start();
+  SampleBatchKeys();
+  const int batch_size = batch_keys_.size();
+  datums_.resize(batch_size);
+  for (int item_id = 0; item_id < batch_size; ++item_id) {
+    cursor_->Seek(batch_keys_[item_id]);
+    CHECK(cursor_->valid() && cursor_->key() == batch_keys_[item_id])
+        << "Record " << batch_keys_[item_id] << " is gone from the DB";
+    db::ParseValue(cursor_.get(), &datums_[item_id]);
+  }
+  read_time += timer.MicroSeconds();
+
+  // Reshape according to the first datum of each batch
+  // on single input batches allows for inputs of varying dimension.
+  vector<int> top_shape = this->data_transformer_->InferBlobShape(datums_[0]);
+  this->transformed_data_.Reshape(top_shape);
+  top_shape[0] = batch_size;
+  batch->data_.Reshape(top_shape);
+  Dtype* top_data = batch->data_.mutable_cpu_data();
+  if (this->output_labels_) {
+    Dtype* top_label = batch->label_.mutable_cpu_data();
+    for (int item_id = 0; item_id < batch_size; ++item_id) {
+      top_label[item_id] = datums_[item_id].label();
+    }
+  }
+  timer.Start();
+  // Apply data transformations (mirror, scale, crop...)
+  this->LoadItems(batch_size, boost::bind(&PKDataLayer<Dtype>::TransformItem,
+      this, batch, top_data, _1, _2, _3));
+  trans_time += timer.MicroSeconds();
+  timer.Stop();
+  batch_timer.Stop();
+  DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
+  DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
+  DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
+}
+
+template <typename Dtype>
+void PKDataLayer<Dtype>::TransformItem(Batch<Dtype>* batch, Dtype* top_data,
+    int item_id, DataTransformer<Dtype>* transformer,
+    Blob<Dtype>* transformed) {
+  int offset = batch->data_.offset(item_id);
+  transformed->set_cpu_data(top_data + offset);
+  transformer->Transform(datums_[item_id], transformed);
+}
+
+INSTANTIATE_CLASS(PKDataLayer);
+REGISTER_LAYER_CLASS(PKData);
+
+}  // namespace caffe
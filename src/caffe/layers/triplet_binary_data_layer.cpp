@@ -59,23 +59,40 @@ void TripletBinaryDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& b
     CHECK_GT(lines_.size(), skip) << "Not enough points to skip";
     lines_id_ = skip;
   }
-  // Load meta data
-  std::ifstream metafile((root_folder + "meta").c_str());
-  std::string dtype;
-  metafile >> dtype;
-  // int n, c, h, w;
-  // metafile << n << c << h << w;
   vector<int> & top_shape = this->top_shape_;
   top_shape.resize(4);
-  for (int i = 0; i < top_shape.size(); ++i) {
-    metafile >> this->top_shape_[i];
+  const string& packed_source =
+      this->layer_param_.image_data_param().packed_source();
+  if (!packed_source.empty()) {
+    LOG(INFO) << "Opening packed features " << packed_source;
+    packed_.reset(new PackedFeatureFile());
+    packed_->Open(packed_source);
+    top_shape[1] = packed_->channels();
+    top_shape[2] = packed_->height();
+    top_shape[3] = packed_->width();
+    for (int i = 0; i < lines_.size(); ++i) {
+      for (int tri_id = 0; tri_id < 3; ++tri_id) {
+        CHECK_GE(packed_->Find(lines_[i][tri_id]), 0) << "No row "
+            << lines_[i][tri_id] << " in " << packed_source;
+      }
+    }
+  } else {
+    // Load meta data
+    std::ifstream metafile((root_folder + "meta").c_str());
+    std::string dtype;
+    metafile >> dtype;
+    // int n, c, h, w;
+    // metafile << n << c << h << w;
+    for (int i = 0; i < top_shape.size(); ++i) {
+      metafile >> this->top_shape_[i];
+    }
   }
   // Reshape prefetch_data and top[0] according to the batch_size.
   const int batch_size = this->layer_param_.image_data_param().batch_size();
   CHECK_GT(batch_size, 0) << "Positive batch size required";
   this->top_shape_[0] = batch_size * 3;
-  for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
-    this->prefetch_[i].data_.Reshape(this->top_shape_);
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    this->prefetch_[i]->data_.Reshape(this->top_shape_);
   }
   top[0]->Reshape(this->top_shape_);
 
@@ -112,8 +129,19 @@ void TripletBinaryDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
   const int lines_size = lines_.size();
   const int batch_size = top_shape[0] / 3;
   const int count = top_shape[1] * top_shape[2] * top_shape[3];
+  // the packed rows of each slot of the batch
+  vector<int64_t> rows(packed_ ? top_shape[0] : 0);
   for (int item_id = 0; item_id < batch_size; ++item_id) {
     for (int tri_id=0; tri_id<3; ++tri_id) {
+      if (packed_) {
+        // Only name the rows here, so that their pages are all read ahead
+        // before the first copy.
+        CHECK_GT(lines_size, lines_id_);
+        int64_t& row = rows[item_id + tri_id * batch_size];
+        row = packed_->Find(lines_[lines_id_][tri_id]);
+        packed_->WillNeed(row);
+        continue;
+      }
       // get a blob
       timer.Start();
       CHECK_GT(lines_size, lines_id_);
@@ -135,6 +163,11 @@ void TripletBinaryDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
       }
     }
   }
+  timer.Start();
+  for (int i = 0; i < rows.size(); ++i) {
+    packed_->CopyRow(rows[i], prefetch_data + batch->data_.offset(i));
+  }
+  read_time += timer.MicroSeconds();
   batch_timer.Stop();
   DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
   DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
@@ -1,6 +1,7 @@
 #ifdef USE_OPENCV
 #include <opencv2/core/core.hpp>
 
+#include <boost/bind.hpp>
 #include <fstream>  // NOLINT(readability/streams)
 #include <iostream>  // NOLINT(readability/streams)
 #include <string>
@@ -10,6 +11,7 @@
 #include "caffe/layers/triplet_db_data_layer.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/util/benchmark.hpp"
+#include "caffe/util/format.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
 #include "caffe/util/rng.hpp"
@@ -33,19 +35,26 @@ template <typename Dtype>
 void TripletDBDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
   const int batch_size = this->layer_param_.triplet_data_param().batch_size();
+  const HardMiningParameter& hard_mining_param =
+      this->layer_param_.hard_mining_param();
+  if (this->phase_ == TRAIN && !hard_mining_param.table().empty()) {
+    // The table holds the keys of one batch at a time, which the solvers
+    // of a multi-GPU run would overwrite for each other.
+    CHECK_EQ(Caffe::solver_count(), 1)
+        << "hard_mining_param.table needs a single solver";
+    hardness_ = HardnessTable::Get(hard_mining_param.table());
+  }
+  // Records are only known to share images through image table ids.
+  const ImageCacheParameter& cache_param =
+      this->layer_param_.image_cache_param();
+  if (cache_param.size_mb() > 0 &&
+      !this->layer_param_.triplet_data_param().image_source().empty()) {
+    image_cache_ = DecodedImageCache::Get(cache_param.name(),
+        static_cast<size_t>(cache_param.size_mb()) << 20);
+  }
   TripletDatum& triplet_datum = *( reader_.full().peek() );
-  Datum datum = UnravelTripletDatumToDatum( triplet_datum, 0 );
-
-  /*
-  datum.set_data( triplet_datum.data_anchor() );
-  datum.set_encoded( triplet_datum.encoded() );
-  datum.set_channels( triplet_datum.channels() );
-  datum.set_height( triplet_datum.height() );
-  datum.set_width( triplet_datum.width() );
-  */
- 
-  CHECK( sizeof(datum) > 0 ) << "the constructed datum from triplet_datum is void!"; 
-  vector<int> top_shape = this->data_transformer_->InferBlobShape(datum);
+  vector<int> top_shape = this->data_transformer_->InferBlobShape(
+      UnravelTripletDatumToView( triplet_datum, 0 ) );
   this->transformed_data_.Reshape(top_shape);
   
   top_shape[0] = 3*batch_size;
@@ -57,8 +66,8 @@ void TripletDBDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& botto
               << " " << top_shape[2] 
               << " " << top_shape[3];
   }
-  for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
-    this->prefetch_[i].data_.Reshape(top_shape);
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    this->prefetch_[i]->data_.Reshape(top_shape);
   }
   LOG(INFO) << "output data size: " << top[0]->num() << ","
     << top[0]->channels() << "," << top[0]->height() << ","
@@ -74,26 +83,13 @@ void TripletDBDataLayer<Dtype>::ShuffleTriplets() {
 }
 */
 template <typename Dtype>
-Datum TripletDBDataLayer<Dtype>::UnravelTripletDatumToDatum( const TripletDatum& triplet_datum, int tag ){
-  
-  CHECK( tag <= 3 ) << "the indicator tag should not be larger than 3 ";
-  Datum datum;
-  if( tag == 0 )
-    datum.set_data( triplet_datum.data_anchor() );
-  if( tag == 1 )
-    datum.set_data( triplet_datum.data_pos() );
-  if( tag == 2 )
-    datum.set_data( triplet_datum.data_neg() );
-
-  datum.set_channels( triplet_datum.channels() );
-  datum.set_height( triplet_datum.height() );
-  datum.set_width( triplet_datum.width() );
-
-  datum.set_encoded( triplet_datum.encoded() );
+DatumView TripletDBDataLayer<Dtype>::UnravelTripletDatumToView( const TripletDatum& triplet_datum, int tag ){
   
-  CHECK( sizeof(datum) > 0 ) << "the datum is not successfully initialized from triplet_datum since it is empty";
-
-  return datum;
+  CHECK( tag < 3 ) << "the indicator tag should be smaller than 3 ";
+  const string& data = tag == 0 ? triplet_datum.data_anchor()
+      : ( tag == 1 ? triplet_datum.data_pos() : triplet_datum.data_neg() );
+  return DatumView( data.data(), data.size(), triplet_datum.channels(),
+      triplet_datum.height(), triplet_datum.width(), triplet_datum.encoded() );
 }
 
 // This function is called on prefetch thread
@@ -110,52 +106,88 @@ void TripletDBDataLayer<Dtype>::load_batch( Batch<Dtype>* batch ) {
 
   const int batch_size = this->layer_param_.triplet_data_param().batch_size();
   TripletDatum& triplet_datum = *( reader_.full().peek() );
-  Datum datum = UnravelTripletDatumToDatum( triplet_datum, 0 );
-  //datum.set_data( triplet_datum.data_anchor() );
-  //datum.set_encoded( triplet_datum.encoded() );
-  //datum.set_channels( triplet_datum.channels() );
-  //datum.set_height( triplet_datum.height() );
-  //datum.set_width( triplet_datum.width() );
-
-  CHECK( sizeof( datum ) > 0 ) << "the constructed datum is void ";
- 
-  vector<int> top_shape = this->data_transformer_->InferBlobShape( datum );
+  vector<int> top_shape = this->data_transformer_->InferBlobShape(
+      UnravelTripletDatumToView( triplet_datum, 0 ) );
   this->transformed_data_.Reshape( top_shape );
   top_shape[0] = 3*batch_size;
   batch->data_.Reshape( top_shape );
 
   Dtype* prefetch_data = batch->data_.mutable_cpu_data();
+  vector<string>& keys = batch->keys_;
+  keys.clear();
 
   // datum scales
-  // const int lines_size = lines_.size();
+  timer.Start();
+  datums_.resize( batch_size );
   for (int item_id = 0; item_id < batch_size; ++item_id) {
-    //LOG( INFO ) << "item_id = " << item_id;
-    timer.Start();
-    TripletDatum& triplet_datum = *( reader_.full().pop("Waiting for triplet data") );
-    read_time += timer.MicroSeconds();
-    timer.Start();
-
-    for (int tri_id=0; tri_id<3; ++tri_id) {
-      // get a blob
-      //timer.Start();
-      Datum datum_query = UnravelTripletDatumToDatum( triplet_datum, tri_id );
-      //Datum datum_pos =  UnravelTripletDatumToDatum( triplet_datum, 1 );
-      //Datum datum_neg = UnravelTripletDatumToDatum( triplet_datum, 2 );
-
-      int offset = batch->data_.offset( item_id + tri_id * batch_size );
-      this->transformed_data_.set_cpu_data( prefetch_data + offset );
-      this->data_transformer_->Transform( datum_query, &(this->transformed_data_) );
-      //trans_time += timer.MicroSeconds();
+    datums_[item_id] = reader_.full().pop("Waiting for triplet data");
+    if (hardness_) {
+      keys.push_back(datums_[item_id]->key());
     }
-    trans_time += timer.MicroSeconds();
-    reader_.free().push(const_cast<TripletDatum*>(&triplet_datum));
-    //LOG( INFO ) << "Read the " << item_id << "-th batch_size";
+  }
+  read_time += timer.MicroSeconds();
+  // one task per image, in the order the serial loop visited them
+  timer.Start();
+  this->LoadItems( 3 * batch_size, boost::bind(
+      &TripletDBDataLayer<Dtype>::TransformImage, this, batch, prefetch_data,
+      _1, _2, _3) );
+  trans_time += timer.MicroSeconds();
+  for (int item_id = 0; item_id < batch_size; ++item_id) {
+    reader_.free().push(datums_[item_id]);
   }
   timer.Stop();
   batch_timer.Stop();
   DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
   DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
   DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
+  if (image_cache_) {
+    LOG_EVERY_N(INFO, 1000) << "Image cache " << image_cache_->hits()
+        << " hits, " << image_cache_->misses() << " misses";
+  }
+}
+
+template <typename Dtype>
+void TripletDBDataLayer<Dtype>::TransformView( const DatumView& view, int image_id,
+    DataTransformer<Dtype>* transformer, Blob<Dtype>* transformed ) {
+  if (!image_cache_ || image_id < 0 || !view.encoded) {
+    transformer->Transform( view, transformed );
+    return;
+  }
+  // The decode options are part of the key, as layers may share the cache.
+  const string key = this->layer_param_.triplet_data_param().image_source() + ":" +
+      format_int( image_id ) + ( this->transform_param_.force_color() ? ":c"
+      : ( this->transform_param_.force_gray() ? ":g" : "" ) );
+  cv::Mat cv_img;
+  if (!image_cache_->Lookup( key, &cv_img )) {
+    cv_img = transformer->DecodeView( view );
+    image_cache_->Insert( key, cv_img );
+  }
+  transformer->Transform( cv_img, transformed );
+}
+
+template <typename Dtype>
+void TripletDBDataLayer<Dtype>::TransformImage( Batch<Dtype>* batch,
+    Dtype* prefetch_data, int k, DataTransformer<Dtype>* transformer,
+    Blob<Dtype>* transformed ) {
+  const int batch_size = this->layer_param_.triplet_data_param().batch_size();
+  const int item_id = k / 3;
+  const int tri_id = k % 3;
+  // the view reads the datum in place; it is freed after the batch
+  int offset = batch->data_.offset( item_id + tri_id * batch_size );
+  transformed->set_cpu_data( prefetch_data + offset );
+  const TripletDatum& triplet_datum = *datums_[item_id];
+  const int image_id = !triplet_datum.has_anchor_id() ? -1 : ( tri_id == 0
+      ? triplet_datum.anchor_id() : ( tri_id == 1 ? triplet_datum.pos_id()
+      : triplet_datum.neg_id() ) );
+  TransformView( UnravelTripletDatumToView( triplet_datum, tri_id ), image_id,
+      transformer, transformed );
+}
+
+template <typename Dtype>
+void TripletDBDataLayer<Dtype>::OnNextBatch(const Batch<Dtype>& batch) {
+  if (hardness_) {
+    hardness_->SetBatchKeys(batch.keys_);
+  }
 }
 
 INSTANTIATE_CLASS(TripletDBDataLayer);
@@ -1,8 +1,9 @@
 #ifdef USE_OPENCV
 #include <opencv2/core/core.hpp>
 
-#include <fstream>  // NOLINT(readability/streams)
+#include <boost/bind.hpp>
 #include <iostream>  // NOLINT(readability/streams)
+#include <sstream>  // NOLINT(readability/streams)
 #include <string>
 #include <utility>
 #include <vector>
@@ -32,14 +33,23 @@ void TripletImageDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bo
   CHECK((new_height == 0 && new_width == 0) ||
       (new_height > 0 && new_width > 0)) << "Current implementation requires "
       "new_height and new_width to be set at the same time.";
+  const ImageCacheParameter& cache_param =
+      this->layer_param_.image_cache_param();
+  if (cache_param.size_mb() > 0) {
+    image_cache_ = DecodedImageCache::Get(cache_param.name(),
+        static_cast<size_t>(cache_param.size_mb()) << 20);
+  }
   // Read the file with filenames
   const string& source = this->layer_param_.image_data_param().source();
   LOG(INFO) << "Opening file " << source;
-  std::ifstream infile(source.c_str());
-  vector<string> filenames(3);
-  while (infile >> filenames[0] >> filenames[1] >> filenames[2]) {
-    lines_.push_back(filenames);
+  {
+    ThreadPool pool(this->layer_param_.image_data_param().list_threads());
+    lines_.Load(source, &pool);
+    if (this->layer_param_.image_data_param().validate_images()) {
+      lines_.Validate(root_folder, &pool);
+    }
   }
+  CHECK_GT(lines_.size(), 0) << "No triplets in " << source;
 
   if (this->layer_param_.image_data_param().shuffle()) {
     // randomly shuffle data
@@ -48,7 +58,6 @@ void TripletImageDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bo
     prefetch_rng_.reset(new Caffe::RNG(prefetch_rng_seed));
     ShuffleTriplets();
   }
-  LOG(INFO) << "A total of " << lines_.size() << " images.";
 
   lines_id_ = 0;
   // Check if we would need to randomly skip a few data points
@@ -60,17 +69,18 @@ void TripletImageDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bo
     lines_id_ = skip;
   }
   // Read an image, and use it to initialize the top blob.
+  const TripletList::Triplet& triplet = lines_.triplet(lines_id_);
   int tag = 0;
-  cv::Mat cv_img = ReadImageToCVMat(root_folder + lines_[lines_id_][0], new_height, new_width, is_color);
+  cv::Mat cv_img = ReadImageToCVMat(root_folder + lines_.path(triplet.id[0]), new_height, new_width, is_color);
   if( !cv_img.data ){
-     cv_img = ReadImageToCVMat(root_folder + lines_[lines_id_][1], new_height, new_width, is_color);
+     cv_img = ReadImageToCVMat(root_folder + lines_.path(triplet.id[1]), new_height, new_width, is_color);
      tag = 1;
      if( !cv_img.data ){
-       cv_img = ReadImageToCVMat(root_folder + lines_[lines_id_][2], new_height, new_width, is_color);
+       cv_img = ReadImageToCVMat(root_folder + lines_.path(triplet.id[2]), new_height, new_width, is_color);
        tag = 2;
      }
   }
-  CHECK(cv_img.data) << "Could not load " << lines_[lines_id_][tag];//it is aweful if all the three image are bad images;
+  CHECK(cv_img.data) << "Could not load " << lines_.path(triplet.id[tag]);//it is aweful if all the three image are bad images;
   // Use data_transformer to infer the expected blob shape from a cv_image.
   vector<int> top_shape = this->data_transformer_->InferBlobShape(cv_img);
   this->transformed_data_.Reshape(top_shape);
@@ -78,8 +88,8 @@ void TripletImageDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bo
   const int batch_size = this->layer_param_.image_data_param().batch_size();
   CHECK_GT(batch_size, 0) << "Positive batch size required";
   top_shape[0] = batch_size * 3;
-  for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
-    this->prefetch_[i].data_.Reshape(top_shape);
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    this->prefetch_[i]->data_.Reshape(top_shape);
   }
   top[0]->Reshape(top_shape);
 
@@ -92,7 +102,7 @@ template <typename Dtype>
 void TripletImageDataLayer<Dtype>::ShuffleTriplets() {
   caffe::rng_t* prefetch_rng =
       static_cast<caffe::rng_t*>(prefetch_rng_->generator());
-  shuffle(lines_.begin(), lines_.end(), prefetch_rng);
+  lines_.Shuffle(prefetch_rng);
 }
 
 // This function is called on prefetch thread
@@ -100,7 +110,6 @@ template <typename Dtype>
 void TripletImageDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
   CPUTimer batch_timer;
   batch_timer.Start();
-  double read_time = 0;
   double trans_time = 0;
   CPUTimer timer;
   CHECK(batch->data_.count());
@@ -115,17 +124,18 @@ void TripletImageDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
   // Reshape according to the first image of each batch
   // on single input batches allows for inputs of varying dimension.
   //
+  const TripletList::Triplet& triplet = lines_.triplet(lines_id_);
   int tag = 0;
-  cv::Mat cv_img = ReadImageToCVMat(root_folder + lines_[lines_id_][0], new_height, new_width, is_color);
+  cv::Mat cv_img = ReadImageToCVMat(root_folder + lines_.path(triplet.id[0]), new_height, new_width, is_color);
   if( !cv_img.data ){
-    cv_img = ReadImageToCVMat(root_folder + lines_[lines_id_][1], new_height, new_width, is_color);
+    cv_img = ReadImageToCVMat(root_folder + lines_.path(triplet.id[1]), new_height, new_width, is_color);
     tag = 1;
     if( !cv_img.data ){
-      cv_img = ReadImageToCVMat(root_folder + lines_[lines_id_][2], new_height, new_width, is_color);
+      cv_img = ReadImageToCVMat(root_folder + lines_.path(triplet.id[2]), new_height, new_width, is_color);
       tag = 2;
     }
   }
-  CHECK(cv_img.data) << "Could not load " << lines_[lines_id_][tag];
+  CHECK(cv_img.data) << "Could not load " << lines_.path(triplet.id[tag]);
   // Use data_transformer to infer the expected blob shape from a cv_img.
   vector<int> top_shape = this->data_transformer_->InferBlobShape(cv_img);
   this->transformed_data_.Reshape(top_shape);
@@ -137,42 +147,95 @@ void TripletImageDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
 
   // datum scales
   const int lines_size = lines_.size();
+  batch_triplets_.resize(batch_size);
+  loaded_.resize(batch_size);
+  pending_.clear();
   for (int item_id = 0; item_id < batch_size; ++item_id) {
-    for (int tri_id=0; tri_id<3; ++tri_id) {
-      // get a blob
-      timer.Start();
+    pending_.push_back(item_id);
+  }
+  // Triplets with an unreadable image are skipped: their slots are refilled
+  // from the next lines until every item loaded.
+  while (!pending_.empty()) {
+    for (int k = 0; k < pending_.size(); ++k) {
       CHECK_GT(lines_size, lines_id_);
-      cv::Mat cv_img = ReadImageToCVMat(root_folder + lines_[lines_id_][tri_id],
-          new_height, new_width, is_color);
-      if( !cv_img.data ){
-        item_id--;
-        break;
+      batch_triplets_[pending_[k]] = lines_.triplet(lines_id_);
+      // go to the next iter
+      lines_id_++;
+      if (lines_id_ >= lines_size) {
+        // We have reached the end. Restart from the first.
+        DLOG(INFO) << "Restarting data prefetching from start.";
+        lines_id_ = 0;
+        if (this->layer_param_.image_data_param().shuffle()) {
+          ShuffleTriplets();
+        }
       }
-      CHECK(cv_img.data) << "Could not load " << lines_[lines_id_][tri_id];
-      read_time += timer.MicroSeconds();
-      timer.Start();
-      // Apply transformations (mirror, crop...) to the image
-      int offset = batch->data_.offset(item_id + tri_id * batch_size);
-      this->transformed_data_.set_cpu_data(prefetch_data + offset);
-      this->data_transformer_->Transform(cv_img, &(this->transformed_data_));
-      trans_time += timer.MicroSeconds();
     }
-
-    // go to the next iter
-    lines_id_++;
-    if (lines_id_ >= lines_size) {
-      // We have reached the end. Restart from the first.
-      DLOG(INFO) << "Restarting data prefetching from start.";
-      lines_id_ = 0;
-      if (this->layer_param_.image_data_param().shuffle()) {
-        ShuffleTriplets();
+    timer.Start();
+    this->LoadItems(pending_.size(), boost::bind(
+        &TripletImageDataLayer<Dtype>::LoadTriplet, this, batch,
+        prefetch_data, _1, _2, _3));
+    trans_time += timer.MicroSeconds();
+    int num_pending = 0;
+    for (int k = 0; k < pending_.size(); ++k) {
+      if (!loaded_[pending_[k]]) {
+        pending_[num_pending++] = pending_[k];
       }
     }
+    pending_.resize(num_pending);
   }
   batch_timer.Stop();
   DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
-  DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
-  DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
+  DLOG(INFO) << "Read and transform time: " << trans_time / 1000 << " ms.";
+  if (image_cache_) {
+    LOG_EVERY_N(INFO, 1000) << "Image cache " << image_cache_->hits()
+        << " hits, " << image_cache_->misses() << " misses";
+  }
+}
+
+template <typename Dtype>
+void TripletImageDataLayer<Dtype>::LoadTriplet(Batch<Dtype>* batch,
+    Dtype* prefetch_data, int k, DataTransformer<Dtype>* transformer,
+    Blob<Dtype>* transformed) {
+  const ImageDataParameter& image_data_param =
+      this->layer_param_.image_data_param();
+  const int batch_size = image_data_param.batch_size();
+  const int item_id = pending_[k];
+  const TripletList::Triplet& triplet = batch_triplets_[item_id];
+  loaded_[item_id] = false;
+  for (int tri_id=0; tri_id<3; ++tri_id) {
+    cv::Mat cv_img = ReadImage(image_data_param.root_folder() +
+        lines_.path(triplet.id[tri_id]));
+    if( !cv_img.data ){
+      return;
+    }
+    // Apply transformations (mirror, crop...) to the image
+    int offset = batch->data_.offset(item_id + tri_id * batch_size);
+    transformed->set_cpu_data(prefetch_data + offset);
+    transformer->Transform(cv_img, transformed);
+  }
+  loaded_[item_id] = true;
+}
+
+template <typename Dtype>
+cv::Mat TripletImageDataLayer<Dtype>::ReadImage(const string& filename) {
+  const ImageDataParameter& image_data_param =
+      this->layer_param_.image_data_param();
+  if (!image_cache_) {
+    return ReadImageToCVMat(filename, image_data_param.new_height(),
+        image_data_param.new_width(), image_data_param.is_color());
+  }
+  // The read options are part of the key, as layers may share the cache.
+  std::ostringstream key;
+  key << filename << ":" << image_data_param.new_height() << "x"
+      << image_data_param.new_width()
+      << (image_data_param.is_color() ? ":c" : ":g");
+  cv::Mat cv_img;
+  if (!image_cache_->Lookup(key.str(), &cv_img)) {
+    cv_img = ReadImageToCVMat(filename, image_data_param.new_height(),
+        image_data_param.new_width(), image_data_param.is_color());
+    image_cache_->Insert(key.str(), cv_img);
+  }
+  return cv_img;
 }
 
 INSTANTIATE_CLASS(TripletImageDataLayer);
@@ -1,6 +1,7 @@
 #ifdef USE_OPENCV
 #include <opencv2/core/core.hpp>
 
+#include <boost/bind.hpp>
 #include <fstream>  // NOLINT(readability/streams)
 #include <iostream>  // NOLINT(readability/streams)
 #include <string>
@@ -10,6 +11,7 @@
 #include "caffe/layers/triplet_multiple_db_data_layer.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/util/benchmark.hpp"
+#include "caffe/util/format.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
 #include "caffe/util/rng.hpp"
@@ -33,19 +35,26 @@ template <typename Dtype>
 void TripletMultipleDBDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
   const int batch_size = this->layer_param_.triplet_data_param().batch_size();
+  const HardMiningParameter& hard_mining_param =
+      this->layer_param_.hard_mining_param();
+  if (this->phase_ == TRAIN && !hard_mining_param.table().empty()) {
+    // The table holds the keys of one batch at a time, which the solvers
+    // of a multi-GPU run would overwrite for each other.
+    CHECK_EQ(Caffe::solver_count(), 1)
+        << "hard_mining_param.table needs a single solver";
+    hardness_ = HardnessTable::Get(hard_mining_param.table());
+  }
+  // Records are only known to share images through image table ids.
+  const ImageCacheParameter& cache_param =
+      this->layer_param_.image_cache_param();
+  if (cache_param.size_mb() > 0 &&
+      !this->layer_param_.triplet_multiple_data_param().image_source().empty()) {
+    image_cache_ = DecodedImageCache::Get(cache_param.name(),
+        static_cast<size_t>(cache_param.size_mb()) << 20);
+  }
   TripletMultipleDatum& triplet_multiple_datum = *( reader_.full().peek() );
-  Datum datum = PeepUnravelTripletMultipleDatumToDatum( triplet_multiple_datum, 0 );
-
-  /*
-  datum.set_data( triplet_datum.data_anchor() );
-  datum.set_encoded( triplet_datum.encoded() );
-  datum.set_channels( triplet_datum.channels() );
-  datum.set_height( triplet_datum.height() );
-  datum.set_width( triplet_datum.width() );
-  */
- 
-  CHECK( sizeof(datum) > 0 ) << "the constructed datum from triplet_datum is void!"; 
-  vector<int> top_shape = this->data_transformer_->InferBlobShape(datum);
+  vector<int> top_shape = this->data_transformer_->InferBlobShape(
+      UnravelTripletMultipleDatumToView( triplet_multiple_datum, 0, 0 ) );
   this->transformed_data_.Reshape(top_shape);
  
   //calculating the basic top_shape[0] size;
@@ -59,8 +68,8 @@ void TripletMultipleDBDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*
               << " " << top_shape[2] 
               << " " << top_shape[3];
   }
-  for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
-    this->prefetch_[i].data_.Reshape(top_shape);
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    this->prefetch_[i]->data_.Reshape(top_shape);
   }
   LOG(INFO) << "output data size: " << top[0]->num() << ","
     << top[0]->channels() << "," << top[0]->height() << ","
@@ -82,78 +91,24 @@ int TripletMultipleDBDataLayer<Dtype>::CompImgNumPerBatch( const TripletMultiple
 }
 
 template <typename Dtype>
-std::vector<Datum> TripletMultipleDBDataLayer<Dtype>::UnravelTripletMultipleDatumToDatum( const TripletMultipleDatum& triplet_multiple_datum, int tag ){
-  CHECK( tag <= 3 ) << "the indicator tag should be larger than 3 ";
-  std::vector< Datum > datum_vec;
-
-  //extract anchor points;
-  if( tag == 0 ){
-    for( int i = 0; i < triplet_multiple_datum.data_anchor_size(); ++i ){
-      Datum datum_tmp;
-      //datum_tmp.set_data( triplet_multiple_datum.data_anchor()[i] );
-      datum_tmp.set_data( triplet_multiple_datum.data_anchor(0) );
-      datum_tmp.set_channels( triplet_multiple_datum.channels() );
-      datum_tmp.set_height( triplet_multiple_datum.height() );
-      datum_tmp.set_width( triplet_multiple_datum.width() );
-      datum_tmp.set_encoded( triplet_multiple_datum.encoded() );
-
-      datum_vec.push_back( datum_tmp );
-    }
-  }
-
-  if( tag == 1 ){
-    for( int i = 0; i < triplet_multiple_datum.data_pos_size(); ++i ){
-      Datum datum_tmp;
-      //datum_tmp.set_data( triplet_multiple_datum.data_pos()[i] );
-      datum_tmp.set_data( triplet_multiple_datum.data_pos(0) );
-      datum_tmp.set_channels( triplet_multiple_datum.channels() );
-      datum_tmp.set_height( triplet_multiple_datum.height() );
-      datum_tmp.set_width( triplet_multiple_datum.width() );
-      datum_tmp.set_encoded( triplet_multiple_datum.encoded() );
-
-      datum_vec.push_back( datum_tmp );
-    }
-  }
-
-  if( tag == 2 ){
-    for( int i = 0; i < triplet_multiple_datum.data_neg_size(); ++i ){
-      Datum datum_tmp;
-      //datum_tmp.set_data( triplet_multiple_datum.data_neg()[i] );
-      datum_tmp.set_data( triplet_multiple_datum.data_neg(i) );
-      datum_tmp.set_channels( triplet_multiple_datum.channels() );
-      datum_tmp.set_height( triplet_multiple_datum.height() );
-      datum_tmp.set_width( triplet_multiple_datum.width() );
-      datum_tmp.set_encoded( triplet_multiple_datum.encoded() );
-
-      datum_vec.push_back( datum_tmp );
-    }
-  }
- 
-  CHECK( datum_vec.size() > 0 ) << "the unravelled datum_vec should be larger than 0"; 
-  return datum_vec;
-}
-
-template <typename Dtype>
-Datum TripletMultipleDBDataLayer<Dtype>::PeepUnravelTripletMultipleDatumToDatum( const TripletMultipleDatum& triplet_multiple_datum, int tag ){
-  
-  CHECK( tag <= 3 ) << "the indicator tag should not be larger than 3 ";
-  Datum datum;
+int TripletMultipleDBDataLayer<Dtype>::CompImgNumPerTag( const TripletMultipleDatum& triplet_multiple_datum, int tag ){
+  CHECK( tag < 3 ) << "the indicator tag should be smaller than 3 ";
   if( tag == 0 )
-    datum.set_data( triplet_multiple_datum.data_anchor(0) );
+    return triplet_multiple_datum.data_anchor_size();
   if( tag == 1 )
-    datum.set_data( triplet_multiple_datum.data_pos(0) );
-  if( tag == 2 )
-    datum.set_data( triplet_multiple_datum.data_neg(0) );
-
-  datum.set_channels( triplet_multiple_datum.channels() );
-  datum.set_height( triplet_multiple_datum.height() );
-  datum.set_width( triplet_multiple_datum.width() );
-
-  datum.set_encoded( triplet_multiple_datum.encoded() );
-  
-  CHECK( sizeof(datum) > 0 ) << "the datum is not successfully initialized from triplet_datum since it is empty";
+    return triplet_multiple_datum.data_pos_size();
+  return triplet_multiple_datum.data_neg_size();
+}
 
-  return datum;
+template <typename Dtype>
+DatumView TripletMultipleDBDataLayer<Dtype>::UnravelTripletMultipleDatumToView( const TripletMultipleDatum& triplet_multiple_datum, int tag, int index ){
+  CHECK( tag < 3 ) << "the indicator tag should be smaller than 3 ";
+  const string& data = tag == 0 ? triplet_multiple_datum.data_anchor( index )
+      : ( tag == 1 ? triplet_multiple_datum.data_pos( index )
+      : triplet_multiple_datum.data_neg( index ) );
+  return DatumView( data.data(), data.size(), triplet_multiple_datum.channels(),
+      triplet_multiple_datum.height(), triplet_multiple_datum.width(),
+      triplet_multiple_datum.encoded() );
 }
 
 // This function is called on prefetch thread
@@ -170,67 +125,95 @@ void TripletMultipleDBDataLayer<Dtype>::load_batch( Batch<Dtype>* batch ) {
 
   const int batch_size = this->layer_param_.triplet_data_param().batch_size();
   TripletMultipleDatum& triplet_multiple_datum = *( reader_.full().peek() );
-  Datum datum = PeepUnravelTripletMultipleDatumToDatum( triplet_multiple_datum, 0 );
-  //datum.set_data( triplet_datum.data_anchor() );
-  //datum.set_encoded( triplet_datum.encoded() );
-  //datum.set_channels( triplet_datum.channels() );
-  //datum.set_height( triplet_datum.height() );
-  //datum.set_width( triplet_datum.width() );
-
-  CHECK( sizeof( datum ) > 0 ) << "the constructed datum is void ";
- 
-  vector<int> top_shape = this->data_transformer_->InferBlobShape( datum );
+  vector<int> top_shape = this->data_transformer_->InferBlobShape(
+      UnravelTripletMultipleDatumToView( triplet_multiple_datum, 0, 0 ) );
   this->transformed_data_.Reshape( top_shape );
   int img_num_per_batch = CompImgNumPerBatch( triplet_multiple_datum );
   top_shape[0] = img_num_per_batch*batch_size;
   batch->data_.Reshape( top_shape );
 
   Dtype* prefetch_data = batch->data_.mutable_cpu_data();
+  vector<string>& keys = batch->keys_;
+  keys.clear();
 
   // datum scales
-  // const int lines_size = lines_.size();
+  timer.Start();
+  datums_.resize( batch_size );
   for (int item_id = 0; item_id < batch_size; ++item_id) {
-    //LOG( INFO ) << "item_id = " << item_id;
-    timer.Start();
-    TripletMultipleDatum& triplet_multiple_datum = *( reader_.full().pop("Waiting for triplet data") );
-    read_time += timer.MicroSeconds();
-    timer.Start();
-
-    int skip_step = 0;
-    int skip_step_prev = 0;
-    for (int tri_id=0; tri_id<3; ++tri_id) {
-      // get a blob
-      //timer.Start();
-      std::vector< Datum > datum_query = UnravelTripletMultipleDatumToDatum( triplet_multiple_datum, tri_id );
-      //Datum datum_pos =  UnravelTripletDatumToDatum( triplet_datum, 1 );
-      //Datum datum_neg = UnravelTripletDatumToDatum( triplet_datum, 2 );
-
-      //skip_step_prev += datum_query.size();
-      if( tri_id > 0 ){
-        skip_step = skip_step_prev;
-      }
-
-      skip_step_prev += datum_query.size();
-      int skip_current = datum_query.size();
-      for( int i = 0; i < datum_query.size(); ++i ){
-        int offset_tmp = batch->data_.offset( item_id*skip_current + batch_size * skip_step  + i );
-        this->transformed_data_.set_cpu_data( prefetch_data + offset_tmp );
-        this->data_transformer_->Transform( datum_query, &(this->transformed_data_) );
-      }
-      //int offset = batch->data_.offset( item_id + tri_id * batch_size );
-      //this->transformed_data_.set_cpu_data( prefetch_data + offset );
-      //this->data_transformer_->Transform( datum_query, &(this->transformed_data_) );
-      //trans_time += timer.MicroSeconds();
+    datums_[item_id] = reader_.full().pop("Waiting for triplet data");
+    if (hardness_) {
+      keys.push_back(datums_[item_id]->key());
     }
-    trans_time += timer.MicroSeconds();
-    reader_.free().push(const_cast<TripletMultipleDatum*>(&triplet_multiple_datum));
-    //LOG( INFO ) << "Read the " << item_id << "-th batch_size";
+  }
+  read_time += timer.MicroSeconds();
+  timer.Start();
+  this->LoadItems( batch_size, boost::bind(
+      &TripletMultipleDBDataLayer<Dtype>::TransformRecord, this, batch,
+      prefetch_data, _1, _2, _3) );
+  trans_time += timer.MicroSeconds();
+  for (int item_id = 0; item_id < batch_size; ++item_id) {
+    reader_.free().push(datums_[item_id]);
   }
   timer.Stop();
   batch_timer.Stop();
   DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
   DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
   DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
+  if (image_cache_) {
+    LOG_EVERY_N(INFO, 1000) << "Image cache " << image_cache_->hits()
+        << " hits, " << image_cache_->misses() << " misses";
+  }
+}
+
+template <typename Dtype>
+void TripletMultipleDBDataLayer<Dtype>::TransformView( const DatumView& view, int image_id,
+    DataTransformer<Dtype>* transformer, Blob<Dtype>* transformed ) {
+  if (!image_cache_ || image_id < 0 || !view.encoded) {
+    transformer->Transform( view, transformed );
+    return;
+  }
+  // The decode options are part of the key, as layers may share the cache.
+  const string key = this->layer_param_.triplet_multiple_data_param().image_source() + ":" +
+      format_int( image_id ) + ( this->transform_param_.force_color() ? ":c"
+      : ( this->transform_param_.force_gray() ? ":g" : "" ) );
+  cv::Mat cv_img;
+  if (!image_cache_->Lookup( key, &cv_img )) {
+    cv_img = transformer->DecodeView( view );
+    image_cache_->Insert( key, cv_img );
+  }
+  transformer->Transform( cv_img, transformed );
+}
+
+template <typename Dtype>
+void TripletMultipleDBDataLayer<Dtype>::TransformRecord( Batch<Dtype>* batch,
+    Dtype* prefetch_data, int item_id, DataTransformer<Dtype>* transformer,
+    Blob<Dtype>* transformed ) {
+  const int batch_size = this->layer_param_.triplet_data_param().batch_size();
+  const TripletMultipleDatum& triplet_multiple_datum = *datums_[item_id];
+  int skip_step = 0;
+  for (int tri_id=0; tri_id<3; ++tri_id) {
+    int skip_current = CompImgNumPerTag( triplet_multiple_datum, tri_id );
+    CHECK( skip_current > 0 ) << "every tag should hold at least one image";
+    // the views read the datum in place; it is freed after the batch
+    for( int i = 0; i < skip_current; ++i ){
+      int offset_tmp = batch->data_.offset( item_id*skip_current + batch_size * skip_step  + i );
+      transformed->set_cpu_data( prefetch_data + offset_tmp );
+      const google::protobuf::RepeatedField<int32_t>& ids = tri_id == 0
+          ? triplet_multiple_datum.anchor_id() : ( tri_id == 1
+          ? triplet_multiple_datum.pos_id() : triplet_multiple_datum.neg_id() );
+      TransformView(
+          UnravelTripletMultipleDatumToView( triplet_multiple_datum, tri_id, i ),
+          i < ids.size() ? ids.Get( i ) : -1, transformer, transformed );
+    }
+    skip_step += skip_current;
+  }
+}
+
+template <typename Dtype>
+void TripletMultipleDBDataLayer<Dtype>::OnNextBatch(const Batch<Dtype>& batch) {
+  if (hardness_) {
+    hardness_->SetBatchKeys(batch.keys_);
+  }
 }
 
 INSTANTIATE_CLASS(TripletMultipleDBDataLayer);
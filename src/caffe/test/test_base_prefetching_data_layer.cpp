@@ -0,0 +1,145 @@
+#include <boost/thread.hpp>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/layers/base_data_layer.hpp"
+#include "caffe/util/format.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+// Loads batch n as n % 3 + 1 rows (or rows_ if set) of 3 values, all n,
+// keyed "n", taking load_ms_ per batch, and records the keys NextBatch
+// reports.
+template <typename Dtype>
+class CountingDataLayer : public BasePrefetchingDataLayer<Dtype> {
+ public:
+  explicit CountingDataLayer(const LayerParameter& param)
+      : BasePrefetchingDataLayer<Dtype>(param), rows_(0), load_ms_(0),
+        loaded_(0) {}
+  virtual ~CountingDataLayer() { this->StopInternalThread(); }
+  virtual void DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    top[0]->Reshape(1, 3, 1, 1);
+    for (int i = 0; i < this->prefetch_.size(); ++i) {
+      this->prefetch_[i]->data_.Reshape(1, 3, 1, 1);
+    }
+  }
+  virtual inline const char* type() const { return "CountingData"; }
+  virtual inline int ExactNumTopBlobs() const { return 1; }
+
+  int rows_;
+  int load_ms_;
+  vector<string> reported_;
+
+ protected:
+  virtual void load_batch(Batch<Dtype>* batch) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(load_ms_));
+    batch->data_.Reshape(rows_ ? rows_ : loaded_ % 3 + 1, 3, 1, 1);
+    caffe_set(batch->data_.count(), Dtype(loaded_),
+        batch->data_.mutable_cpu_data());
+    batch->keys_.assign(1, format_int(loaded_));
+    ++loaded_;
+  }
+  virtual void OnNextBatch(const Batch<Dtype>& batch) {
+    reported_.push_back(batch.keys_[0]);
+  }
+
+  int loaded_;
+};
+
+template <typename Dtype>
+class BasePrefetchingDataLayerTest : public CPUDeviceTest<Dtype> {
+ protected:
+  BasePrefetchingDataLayerTest() : blob_top_data_(new Blob<Dtype>()) {
+    blob_top_vec_.push_back(blob_top_data_);
+  }
+  virtual ~BasePrefetchingDataLayerTest() { delete blob_top_data_; }
+
+  Blob<Dtype>* const blob_top_data_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(BasePrefetchingDataLayerTest, TestDtypes);
+
+// With a single batch, the one the tops hold has to be given back before
+// the next is popped, and the keys reported are those of the popped batch.
+TYPED_TEST(BasePrefetchingDataLayerTest, TestReportsPoppedBatchAtDepthOne) {
+  LayerParameter param;
+  param.mutable_prefetch_param()->set_depth(1);
+  CountingDataLayer<TypeParam> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int iter = 0; iter < 4; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    ASSERT_EQ(iter + 1, layer.reported_.size());
+    EXPECT_EQ(format_int(iter), layer.reported_[iter]);
+    EXPECT_EQ(iter, this->blob_top_data_->cpu_data()[0]);
+  }
+}
+
+// The tops point into the batch until the next Forward, so the prefetch
+// thread must not refill it meanwhile, and their size must follow the batch
+// shape whether it grows or shrinks.
+TYPED_TEST(BasePrefetchingDataLayerTest, TestHeldBatchAndShapeChanges) {
+  LayerParameter param;
+  param.mutable_prefetch_param()->set_depth(2);
+  CountingDataLayer<TypeParam> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int iter = 0; iter < 6; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    EXPECT_EQ(iter % 3 + 1, this->blob_top_data_->num());
+    EXPECT_EQ(this->blob_top_data_->count() * sizeof(TypeParam),
+        this->blob_top_data_->data()->size());
+    // give the prefetch thread time to fill every free batch
+    boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+    for (int i = 0; i < this->blob_top_data_->count(); ++i) {
+      EXPECT_EQ(iter, this->blob_top_data_->cpu_data()[i]);
+    }
+  }
+}
+
+// A net that keeps waiting for slow batches gets a deeper prefetch queue,
+// up to max_depth.
+TYPED_TEST(BasePrefetchingDataLayerTest, TestGrowsUnderStarvation) {
+  LayerParameter param;
+  PrefetchParameter* prefetch_param = param.mutable_prefetch_param();
+  prefetch_param->set_depth(1);
+  prefetch_param->set_max_depth(3);
+  prefetch_param->set_grow_window(2);
+  CountingDataLayer<TypeParam> layer(param);
+  layer.load_ms_ = 5;
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(1, layer.prefetch_depth());
+  for (int iter = 0; iter < 12; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  }
+  EXPECT_EQ(3, layer.prefetch_depth());
+}
+
+// The depth does not grow past memory_budget_mb, whatever max_depth says.
+TYPED_TEST(BasePrefetchingDataLayerTest, TestGrowthHeldByMemoryBudget) {
+  LayerParameter param;
+  PrefetchParameter* prefetch_param = param.mutable_prefetch_param();
+  prefetch_param->set_depth(1);
+  prefetch_param->set_max_depth(4);
+  prefetch_param->set_grow_window(2);
+  prefetch_param->set_memory_budget_mb(1);
+  CountingDataLayer<TypeParam> layer(param);
+  layer.load_ms_ = 5;
+  // a bit over a third of a MB per batch, so three would not fit
+  layer.rows_ = (1 << 20) / (9 * sizeof(TypeParam)) + 1;
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int iter = 0; iter < 12; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  }
+  EXPECT_EQ(2, layer.prefetch_depth());
+}
+
+}  // namespace caffe
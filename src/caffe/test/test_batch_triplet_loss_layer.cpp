@@ -0,0 +1,329 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/layers/batch_triplet_loss_layer.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_gradient_check_util.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class BatchTripletLossLayerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  BatchTripletLossLayerTest()
+      : blob_bottom_data_(new Blob<Dtype>(12, 4, 1, 1)),
+        blob_bottom_label_(new Blob<Dtype>(12, 1, 1, 1)),
+        blob_top_loss_(new Blob<Dtype>()),
+        blob_top_accuracy_(new Blob<Dtype>()),
+        blob_top_debug_(new Blob<Dtype>()) {
+    Caffe::set_random_seed(1701);
+    FillerParameter filler_param;
+    filler_param.set_std(0.5);
+    GaussianFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_data_);
+    blob_bottom_vec_.push_back(blob_bottom_data_);
+    // classes of different sizes spread over the batch; the wide label
+    // range takes the rank compression path of the grouping
+    const int labels[] = {1, 2, 3, 1, 3, 2, 2, 1, 3, 1, 100000, 100000};
+    for (int i = 0; i < blob_bottom_label_->count(); ++i) {
+      blob_bottom_label_->mutable_cpu_data()[i] = labels[i];
+    }
+    blob_bottom_vec_.push_back(blob_bottom_label_);
+    blob_top_vec_.push_back(blob_top_loss_);
+    blob_top_vec_.push_back(blob_top_accuracy_);
+    blob_top_vec_.push_back(blob_top_debug_);
+  }
+  virtual ~BatchTripletLossLayerTest() {
+    delete blob_bottom_data_;
+    delete blob_bottom_label_;
+    delete blob_top_loss_;
+    delete blob_top_accuracy_;
+    delete blob_top_debug_;
+  }
+
+  Dtype SquaredDistance(int i, int j) {
+    const int dim = blob_bottom_data_->channels();
+    const Dtype* data = blob_bottom_data_->cpu_data();
+    Dtype dist = 0;
+    for (int d = 0; d < dim; ++d) {
+      Dtype diff = data[i * dim + d] - data[j * dim + d];
+      dist += diff * diff;
+    }
+    return dist;
+  }
+
+  // Enumerates every triplet like the original implementation did. With
+  // use_bank a first iteration stores the batch in the memory bank, so every
+  // negative shows up twice in the second one.
+  void TestForwardAgainstEnumeration(bool sample, Dtype mu,
+      int tile_size = 0, bool use_bank = false) {
+    LayerParameter layer_param;
+    TripletLossParameter* triplet_param =
+        layer_param.mutable_triplet_loss_param();
+    triplet_param->set_margin(1.);
+    triplet_param->set_mu(mu);
+    triplet_param->set_sample(sample);
+    triplet_param->set_num_threads(3);
+    triplet_param->set_tile_size(tile_size);
+    triplet_param->set_memory_bank_size(use_bank ? 20 : 0);
+    BatchTripletLossLayer<Dtype> layer(layer_param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    if (use_bank) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      vector<bool> propagate_down(2, false);
+      propagate_down[0] = true;
+      layer.Backward(blob_top_vec_, propagate_down, blob_bottom_vec_);
+    }
+    layer.Forward(blob_bottom_vec_, blob_top_vec_);
+
+    const Dtype margin = triplet_param->margin();
+    const Dtype* label = blob_bottom_label_->cpu_data();
+    const int num = blob_bottom_data_->num();
+    Dtype pair_loss = 0, rank_loss = 0, smp_rank_loss = 0;
+    int num_pair = 0, num_tri = 0, num_err = 0, num_smp = 0;
+    for (int i = 0; i < num; ++i) {
+      for (int j = 0; j < num; ++j) {
+        if (i == j || label[j] != label[i]) {
+          continue;
+        }
+        Dtype pos_dist = SquaredDistance(i, j);
+        if (mu < 1) {
+          pair_loss += pos_dist;
+          ++num_pair;
+        }
+        for (int k = 0; k < (use_bank ? 2 * num : num); ++k) {
+          if (label[k % num] == label[i]) {
+            continue;
+          }
+          Dtype neg_dist = SquaredDistance(i, k % num);
+          ++num_tri;
+          num_err += (pos_dist >= neg_dist);
+          Dtype cur_rank_loss = margin + pos_dist - neg_dist;
+          if (cur_rank_loss > 0) {
+            rank_loss += cur_rank_loss;
+            if (!sample || neg_dist > pos_dist) {
+              smp_rank_loss += cur_rank_loss;
+              ++num_smp;
+            }
+          }
+        }
+      }
+    }
+    pair_loss = num_pair > 0 ? pair_loss / num_pair : 0;
+    rank_loss /= num_tri;
+    const Dtype kErrorMargin = 1e-4;
+    EXPECT_NEAR(blob_top_loss_->cpu_data()[0],
+        rank_loss * mu + pair_loss * (1 - mu), kErrorMargin);
+    EXPECT_NEAR(blob_top_accuracy_->cpu_data()[0],
+        1 - Dtype(num_err) / num_tri, kErrorMargin);
+    const Dtype* debug = blob_top_debug_->cpu_data();
+    EXPECT_NEAR(debug[0], num_smp > 0 ? smp_rank_loss / num_smp : 0,
+        kErrorMargin);
+    EXPECT_NEAR(debug[1], rank_loss, kErrorMargin);
+    EXPECT_NEAR(debug[2], pair_loss, kErrorMargin);
+    EXPECT_EQ(debug[3], num_tri);
+    EXPECT_EQ(debug[4], num_smp);
+  }
+
+  // Sums the N-pair or lifted structured loss over every positive pair.
+  void TestForwardPairMode(TripletLossParameter_LossMode mode) {
+    LayerParameter layer_param;
+    TripletLossParameter* triplet_param =
+        layer_param.mutable_triplet_loss_param();
+    triplet_param->set_margin(1.);
+    triplet_param->set_loss_mode(mode);
+    triplet_param->set_num_threads(3);
+    BatchTripletLossLayer<Dtype> layer(layer_param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    layer.Forward(blob_bottom_vec_, blob_top_vec_);
+
+    const Dtype margin = triplet_param->margin();
+    const Dtype* label = blob_bottom_label_->cpu_data();
+    const int num = blob_bottom_data_->num();
+    bool lifted = mode == TripletLossParameter_LossMode_LIFTED;
+    double loss = 0;
+    int num_pair = 0, num_tri = 0, num_err = 0;
+    for (int i = 0; i < num; ++i) {
+      for (int j = lifted ? i + 1 : 0; j < num; ++j) {
+        if (i == j || label[j] != label[i]) {
+          continue;
+        }
+        Dtype pos_dist = SquaredDistance(i, j);
+        double sum = 0;
+        for (int k = 0; k < num; ++k) {
+          if (label[k] == label[i]) {
+            continue;
+          }
+          Dtype neg_dist = SquaredDistance(i, k);
+          ++num_tri;
+          num_err += (pos_dist >= neg_dist);
+          sum += lifted ? std::exp(margin - std::sqrt(neg_dist))
+              : std::exp(pos_dist - neg_dist);
+          if (lifted) {
+            // the lifted pair also counts the triplets of its other end
+            ++num_tri;
+            num_err += (pos_dist >= SquaredDistance(j, k));
+            sum += std::exp(margin - std::sqrt(SquaredDistance(j, k)));
+          }
+        }
+        if (lifted) {
+          double hinge = std::max(0., std::log(sum) + std::sqrt(pos_dist));
+          loss += 0.5 * hinge * hinge;
+        } else {
+          loss += std::log(1 + sum);
+        }
+        ++num_pair;
+      }
+    }
+    const Dtype kErrorMargin = 1e-4;
+    EXPECT_NEAR(blob_top_loss_->cpu_data()[0], loss / num_pair,
+        kErrorMargin);
+    EXPECT_NEAR(blob_top_accuracy_->cpu_data()[0],
+        1 - Dtype(num_err) / num_tri, kErrorMargin);
+    EXPECT_NEAR(blob_top_debug_->cpu_data()[1], loss / num_pair,
+        kErrorMargin);
+    EXPECT_EQ(blob_top_debug_->cpu_data()[3], num_tri);
+  }
+
+  Blob<Dtype>* const blob_bottom_data_;
+  Blob<Dtype>* const blob_bottom_label_;
+  Blob<Dtype>* const blob_top_loss_;
+  Blob<Dtype>* const blob_top_accuracy_;
+  Blob<Dtype>* const blob_top_debug_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(BatchTripletLossLayerTest, TestDtypesAndDevices);
+
+TYPED_TEST(BatchTripletLossLayerTest, TestForward) {
+  this->TestForwardAgainstEnumeration(false, 0.5);
+}
+
+TYPED_TEST(BatchTripletLossLayerTest, TestForwardSample) {
+  this->TestForwardAgainstEnumeration(true, 1.);
+}
+
+TYPED_TEST(BatchTripletLossLayerTest, TestForwardTiled) {
+  // 4 and 6 tiles; 5 tiles exercise the dummy tile of the schedule
+  this->TestForwardAgainstEnumeration(false, 0.5, 3);
+  this->TestForwardAgainstEnumeration(true, 0.5, 2);
+  this->TestForwardAgainstEnumeration(true, 1., 3);
+  this->TestForwardAgainstEnumeration(false, 1., 5);
+}
+
+TYPED_TEST(BatchTripletLossLayerTest, TestForwardMemoryBank) {
+  this->TestForwardAgainstEnumeration(false, 0.5, 0, true);
+  this->TestForwardAgainstEnumeration(true, 0.5, 3, true);
+}
+
+TYPED_TEST(BatchTripletLossLayerTest, TestGradient) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  // The gradient is averaged over the sampled triplets and the loss over all
+  // of them; a large margin makes every triplet sampled so the two agree.
+  layer_param.mutable_triplet_loss_param()->set_margin(100.);
+  layer_param.mutable_triplet_loss_param()->set_mu(0.5);
+  layer_param.mutable_triplet_loss_param()->set_num_threads(2);
+  BatchTripletLossLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  GradientChecker<Dtype> checker(1e-3, 1e-2, 1701);
+  // only the loss (top 0) is differentiable
+  checker.CheckGradientSingle(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_, 0, 0, 0);
+}
+
+TYPED_TEST(BatchTripletLossLayerTest, TestGradientTiled) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.mutable_triplet_loss_param()->set_margin(100.);
+  layer_param.mutable_triplet_loss_param()->set_mu(0.5);
+  layer_param.mutable_triplet_loss_param()->set_tile_size(5);
+  BatchTripletLossLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  GradientChecker<Dtype> checker(1e-3, 1e-2, 1701);
+  checker.CheckGradientSingle(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_, 0, 0, 0);
+}
+
+TYPED_TEST(BatchTripletLossLayerTest, TestBackwardTiledMatchesDense) {
+  // With a small margin and sampling only some triplets get weights; the
+  // tiled mode folds them into its gradient during the forward pass.
+  typedef typename TypeParam::Dtype Dtype;
+  const int count = this->blob_bottom_data_->count();
+  vector<bool> propagate_down(2, false);
+  propagate_down[0] = true;
+  vector<Dtype> diff[2];
+  for (int tiled = 0; tiled < 2; ++tiled) {
+    LayerParameter layer_param;
+    TripletLossParameter* triplet_param =
+        layer_param.mutable_triplet_loss_param();
+    triplet_param->set_margin(1.);
+    triplet_param->set_mu(0.5);
+    triplet_param->set_sample(true);
+    triplet_param->set_num_threads(3);
+    triplet_param->set_tile_size(tiled ? 3 : 0);
+    triplet_param->set_memory_bank_size(20);
+    BatchTripletLossLayer<Dtype> layer(layer_param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    // the second iteration also mines the bank
+    for (int iter = 0; iter < 2; ++iter) {
+      layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+      this->blob_top_loss_->mutable_cpu_diff()[0] = 1;
+      layer.Backward(this->blob_top_vec_, propagate_down,
+          this->blob_bottom_vec_);
+    }
+    const Dtype* bottom_diff = this->blob_bottom_data_->cpu_diff();
+    diff[tiled].assign(bottom_diff, bottom_diff + count);
+  }
+  for (int i = 0; i < count; ++i) {
+    EXPECT_NEAR(diff[0][i], diff[1][i], 1e-4);
+  }
+}
+
+TYPED_TEST(BatchTripletLossLayerTest, TestForwardNPair) {
+  this->TestForwardPairMode(TripletLossParameter_LossMode_NPAIR);
+}
+
+TYPED_TEST(BatchTripletLossLayerTest, TestForwardLifted) {
+  this->TestForwardPairMode(TripletLossParameter_LossMode_LIFTED);
+}
+
+TYPED_TEST(BatchTripletLossLayerTest, TestGradientNPair) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.mutable_triplet_loss_param()->set_loss_mode(
+      TripletLossParameter_LossMode_NPAIR);
+  layer_param.mutable_triplet_loss_param()->set_num_threads(2);
+  BatchTripletLossLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  GradientChecker<Dtype> checker(1e-3, 1e-2, 1701);
+  checker.CheckGradientSingle(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_, 0, 0, 0);
+}
+
+TYPED_TEST(BatchTripletLossLayerTest, TestGradientLifted) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  // a large margin keeps every pair inside its hinge
+  layer_param.mutable_triplet_loss_param()->set_margin(10.);
+  layer_param.mutable_triplet_loss_param()->set_loss_mode(
+      TripletLossParameter_LossMode_LIFTED);
+  layer_param.mutable_triplet_loss_param()->set_num_threads(2);
+  BatchTripletLossLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  GradientChecker<Dtype> checker(1e-3, 1e-2, 1701);
+  checker.CheckGradientSingle(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_, 0, 0, 0);
+}
+
+}  // namespace caffe
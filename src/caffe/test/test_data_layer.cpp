@@ -279,6 +279,53 @@ class DataLayerTest : public MultiDeviceTest<TypeParam> {
     }
   }
 
+  // With decode threads every item draws its own seed, so the batches must
+  // not depend on how many threads decode them.
+  void TestReadCropTrainSequenceThreads() {
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(5);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+
+    TransformationParameter* transform_param =
+        param.mutable_transform_param();
+    transform_param->set_crop_size(1);
+    transform_param->set_mirror(true);
+
+    Caffe::set_random_seed(seed_);
+    param.mutable_prefetch_param()->set_decode_threads(2);
+    vector<vector<Dtype> > crop_sequence;
+    {
+      DataLayer<Dtype> layer1(param);
+      layer1.SetUp(blob_bottom_vec_, blob_top_vec_);
+      for (int iter = 0; iter < 2; ++iter) {
+        layer1.Forward(blob_bottom_vec_, blob_top_vec_);
+        for (int i = 0; i < 5; ++i) {
+          EXPECT_EQ(i, blob_top_label_->cpu_data()[i]);
+        }
+        crop_sequence.push_back(vector<Dtype>(blob_top_data_->cpu_data(),
+            blob_top_data_->cpu_data() + 10));
+      }
+    }  // destroy 1st data layer and unlock the db
+
+    Caffe::set_random_seed(seed_);
+    param.mutable_prefetch_param()->set_decode_threads(4);
+    DataLayer<Dtype> layer2(param);
+    layer2.SetUp(blob_bottom_vec_, blob_top_vec_);
+    for (int iter = 0; iter < 2; ++iter) {
+      layer2.Forward(blob_bottom_vec_, blob_top_vec_);
+      for (int i = 0; i < 5; ++i) {
+        EXPECT_EQ(i, blob_top_label_->cpu_data()[i]);
+      }
+      for (int i = 0; i < 10; ++i) {
+        EXPECT_EQ(crop_sequence[iter][i], blob_top_data_->cpu_data()[i])
+            << "debug: iter " << iter << " i " << i;
+      }
+    }
+  }
+
   void TestReadCropTrainSequenceUnseeded() {
     LayerParameter param;
     param.set_phase(TRAIN);
@@ -422,6 +469,12 @@ TYPED_TEST(DataLayerTest, TestReadCropTrainSequenceUnseededLMDB) {
   this->TestReadCropTrainSequenceUnseeded();
 }
 
+TYPED_TEST(DataLayerTest, TestReadCropTrainSequenceThreadsLMDB) {
+  const bool unique_pixels = true;  // all images the same; pixels different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestReadCropTrainSequenceThreads();
+}
+
 TYPED_TEST(DataLayerTest, TestReadCropTestLMDB) {
   const bool unique_pixels = true;  // all images the same; pixels different
   this->Fill(unique_pixels, DataParameter_DB_LMDB);
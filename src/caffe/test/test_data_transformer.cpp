@@ -121,6 +121,40 @@ TYPED_TEST(DataTransformTest, TestEmptyTransformUniquePixels) {
   }
 }
 
+TYPED_TEST(DataTransformTest, TestViewTransform) {
+  TransformationParameter transform_param;
+  transform_param.set_crop_size(2);
+  transform_param.set_mirror(true);
+  transform_param.add_mean_value(3);
+  const int channels = 3;
+  const int height = 4;
+  const int width = 5;
+
+  Datum datum;
+  FillDatum(0, channels, height, width, true, &datum);
+  // the same pixels in another message, viewed in place
+  TripletDatum triplet_datum;
+  triplet_datum.set_data_pos(datum.data());
+  const string& bytes = triplet_datum.data_pos();
+  DatumView view(bytes.data(), bytes.size(), channels, height, width, false);
+  DataTransformer<TypeParam> transformer(transform_param, TRAIN);
+  EXPECT_EQ(transformer.InferBlobShape(view),
+      transformer.InferBlobShape(datum));
+  Blob<TypeParam> blob(1, channels, 2, 2);
+  Blob<TypeParam> view_blob(1, channels, 2, 2);
+  for (int iter = 0; iter < this->num_iter_; ++iter) {
+    Caffe::set_random_seed(this->seed_ + iter);
+    transformer.InitRand();
+    transformer.Transform(datum, &blob);
+    Caffe::set_random_seed(this->seed_ + iter);
+    transformer.InitRand();
+    transformer.Transform(view, &view_blob);
+    for (int j = 0; j < blob.count(); ++j) {
+      EXPECT_EQ(view_blob.cpu_data()[j], blob.cpu_data()[j]);
+    }
+  }
+}
+
 TYPED_TEST(DataTransformTest, TestCropSize) {
   TransformationParameter transform_param;
   const bool unique_pixels = false;  // all pixels the same equal to label
@@ -1,5 +1,6 @@
 #if defined(USE_LEVELDB) && defined(USE_LMDB) && defined(USE_OPENCV)
 #include <string>
+#include <vector>
 
 #include "boost/scoped_ptr.hpp"
 #include "gtest/gtest.h"
@@ -117,6 +118,54 @@ TYPED_TEST(DBTest, TestKeyValue) {
   EXPECT_FALSE(cursor->valid());
 }
 
+TYPED_TEST(DBTest, TestValueView) {
+  scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
+  db->Open(this->source_, db::READ);
+  scoped_ptr<db::Cursor> cursor(db->NewCursor());
+  for (; cursor->valid(); cursor->Next()) {
+    const char* data;
+    size_t size;
+    cursor->value_view(&data, &size);
+    EXPECT_EQ(string(data, size), cursor->value());
+    Datum datum, expected;
+    EXPECT_TRUE(db::ParseValue(cursor.get(), &datum));
+    expected.ParseFromString(cursor->value());
+    EXPECT_EQ(datum.SerializeAsString(), expected.SerializeAsString());
+  }
+}
+
+TYPED_TEST(DBTest, TestSeek) {
+  scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
+  db->Open(this->source_, db::READ);
+  scoped_ptr<db::Cursor> cursor(db->NewCursor());
+  cursor->Seek("fish-bike.jpg");
+  EXPECT_TRUE(cursor->valid());
+  EXPECT_EQ(cursor->key(), "fish-bike.jpg");
+  cursor->Seek("dog.jpg");
+  EXPECT_TRUE(cursor->valid());
+  EXPECT_EQ(cursor->key(), "fish-bike.jpg");
+  cursor->Seek("cat");
+  EXPECT_TRUE(cursor->valid());
+  EXPECT_EQ(cursor->key(), "cat.jpg");
+  cursor->Seek("zebra.jpg");
+  EXPECT_FALSE(cursor->valid());
+}
+
+TYPED_TEST(DBTest, TestShardKeyRanges) {
+  scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
+  db->Open(this->source_, db::READ);
+  scoped_ptr<db::Cursor> cursor(db->NewCursor());
+  vector<string> starts;
+  EXPECT_EQ(2, db::ShardKeyRanges(cursor.get(), 2, &starts));
+  ASSERT_EQ(starts.size(), 2);
+  EXPECT_EQ(starts[0], "cat.jpg");
+  EXPECT_EQ(starts[1], "fish-bike.jpg");
+  EXPECT_EQ(cursor->key(), "cat.jpg");
+  db::ShardKeyRanges(cursor.get(), 1, &starts);
+  ASSERT_EQ(starts.size(), 1);
+  EXPECT_EQ(starts[0], "cat.jpg");
+}
+
 TYPED_TEST(DBTest, TestWrite) {
   scoped_ptr<db::DB> db(db::GetDB(TypeParam::backend));
   db->Open(this->source_, db::WRITE);
@@ -0,0 +1,56 @@
+#ifdef USE_OPENCV
+#include <opencv2/core/core.hpp>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/decoded_image_cache.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class DecodedImageCacheTest : public ::testing::Test {};
+
+TEST_F(DecodedImageCacheTest, TestGetShares) {
+  shared_ptr<DecodedImageCache> cache =
+      DecodedImageCache::Get("test_get_shares", 100);
+  EXPECT_EQ(cache, DecodedImageCache::Get("test_get_shares", 100));
+  EXPECT_NE(cache, DecodedImageCache::Get("test_get_shares_other", 100));
+}
+
+TEST_F(DecodedImageCacheTest, TestEvictsLeastRecentlyUsed) {
+  shared_ptr<DecodedImageCache> cache =
+      DecodedImageCache::Get("test_evicts", 100);
+  // 40 bytes each, so the cache holds two
+  cv::Mat a(5, 8, CV_8UC1, cv::Scalar(1));
+  cv::Mat b(5, 8, CV_8UC1, cv::Scalar(2));
+  cv::Mat c(5, 8, CV_8UC1, cv::Scalar(3));
+  cv::Mat image;
+  cache->Insert("a", a);
+  cache->Insert("b", b);
+  EXPECT_TRUE(cache->Lookup("a", &image));
+  EXPECT_EQ(image.data, a.data);
+  cache->Insert("c", c);
+  EXPECT_FALSE(cache->Lookup("b", &image));
+  EXPECT_TRUE(cache->Lookup("a", &image));
+  EXPECT_TRUE(cache->Lookup("c", &image));
+  EXPECT_EQ(image.at<uchar>(0, 0), 3);
+  EXPECT_EQ(cache->size(), 80);
+  EXPECT_EQ(cache->hits(), 3);
+  EXPECT_EQ(cache->misses(), 1);
+}
+
+TEST_F(DecodedImageCacheTest, TestSkipsLargeAndEmpty) {
+  shared_ptr<DecodedImageCache> cache =
+      DecodedImageCache::Get("test_skips", 100);
+  cv::Mat image;
+  cache->Insert("large", cv::Mat(11, 10, CV_8UC1, cv::Scalar(0)));
+  cache->Insert("empty", cv::Mat());
+  EXPECT_FALSE(cache->Lookup("large", &image));
+  EXPECT_FALSE(cache->Lookup("empty", &image));
+  EXPECT_EQ(cache->size(), 0);
+}
+
+}  // namespace caffe
+#endif  // USE_OPENCV
@@ -0,0 +1,109 @@
+#include <map>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/db.hpp"
+#include "caffe/util/format.hpp"
+#include "caffe/util/hardness_table.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+// Iterates over the keys "0" .. "num - 1", each with its key as value.
+class VectorCursor : public db::Cursor {
+ public:
+  explicit VectorCursor(int num) : num_(num), pos_(0) {}
+  virtual void SeekToFirst() { pos_ = 0; }
+  virtual void Next() { ++pos_; }
+  virtual string key() { return format_int(pos_); }
+  virtual string value() { return format_int(pos_); }
+  virtual bool valid() { return pos_ < num_; }
+
+ protected:
+  int num_;
+  int pos_;
+};
+
+class HardnessTableTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    Caffe::set_random_seed(1701);
+    for (int i = 0; i < 4; ++i) {
+      keys_.push_back(format_int(i));
+    }
+  }
+
+  vector<string> keys_;
+};
+
+TEST_F(HardnessTableTest, TestGetShares) {
+  shared_ptr<HardnessTable> table = HardnessTable::Get("test_get_shares");
+  EXPECT_EQ(table, HardnessTable::Get("test_get_shares"));
+  EXPECT_NE(table, HardnessTable::Get("test_get_other"));
+}
+
+TEST_F(HardnessTableTest, TestUpdate) {
+  shared_ptr<HardnessTable> table = HardnessTable::Get("test_update");
+  // no batch published yet
+  const float loss[] = {0, 0, 2, 2, 1, 3, 4, 4};
+  table->Update(8, loss, 0.5);
+  EXPECT_EQ(table->size(), 0);
+  // two losses per record: the hardness is 0, 2, 2, 4
+  table->SetBatchKeys(keys_);
+  table->Update(8, loss, 0.5);
+  EXPECT_EQ(table->size(), 4);
+  EXPECT_FLOAT_EQ(table->SampleRate("0", 0.1, 4), 0.1);
+  EXPECT_FLOAT_EQ(table->SampleRate("1", 0.1, 4), 1);
+  EXPECT_FLOAT_EQ(table->SampleRate("3", 0.1, 4), 2);
+  EXPECT_FLOAT_EQ(table->SampleRate("3", 0.1, 1.5), 1.5);
+  EXPECT_FLOAT_EQ(table->SampleRate("unseen", 0.1, 4), 1);
+  // record 3 moves half way to 0: 0, 2, 2, 2
+  vector<string> last(1, keys_[3]);
+  table->SetBatchKeys(last);
+  const double zero[] = {0, 0};
+  table->Update(2, zero, 0.5);
+  EXPECT_FLOAT_EQ(table->SampleRate("3", 0.1, 4), 4. / 3);
+}
+
+TEST_F(HardnessTableTest, TestSampler) {
+  const int num = 100;
+  shared_ptr<HardnessTable> table = HardnessTable::Get("test_sampler");
+  // records 0 .. 9 are hard, the others easy
+  vector<string> keys;
+  vector<float> loss;
+  for (int i = 0; i < num; ++i) {
+    keys.push_back(format_int(i));
+    loss.push_back(i < 10 ? 10 : 0.1);
+  }
+  table->SetBatchKeys(keys);
+  table->Update(num, &loss[0], 0.5);
+
+  HardMiningParameter param;
+  param.set_table("test_sampler");
+  param.set_min_rate(0.1);
+  param.set_max_rate(4);
+  HardnessSampler sampler(param);
+  VectorCursor cursor(num);
+  std::map<string, int> visits;
+  const int draws = 2000;
+  for (int i = 0; i < draws; ++i) {
+    string key, value;
+    sampler.Next(&cursor, &key, &value);
+    EXPECT_EQ(key, value);
+    ++visits[key];
+  }
+  int hard = 0;
+  for (int i = 0; i < 10; ++i) {
+    hard += visits[format_int(i)];
+  }
+  // the hard records have rate 4, the easy ones about 0.1, so the hard
+  // records should get 40 / (40 + 9) of the draws
+  EXPECT_GT(hard, draws * 0.7);
+  EXPECT_LT(hard, draws * 0.95);
+}
+
+}  // namespace caffe
@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/layers/hdml_loss_upper_bound_layer.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename TypeParam>
+class HDMLLossUpperBoundLayerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  HDMLLossUpperBoundLayerTest()
+      : blob_top_loss_(new Blob<Dtype>()) {
+    Caffe::set_random_seed(1701);
+    FillerParameter filler_param;
+    GaussianFiller<Dtype> filler(filler_param);
+    for (int b = 0; b < 3; ++b) {
+      // more than one word of code bits
+      blob_bottom_vec_.push_back(new Blob<Dtype>(kNum, 70, 1, 1));
+      filler.Fill(blob_bottom_vec_[b]);
+    }
+    blob_top_vec_.push_back(blob_top_loss_);
+  }
+  virtual ~HDMLLossUpperBoundLayerTest() {
+    for (int b = 0; b < 3; ++b) {
+      delete blob_bottom_vec_[b];
+    }
+    delete blob_top_loss_;
+  }
+
+  /**
+   * The full (D + 1) x (2D + 1) table over the eight sign choices of every
+   * bit, where m counts the bits on which the query code differs from the
+   * positive one minus those on which it differs from the negative one.
+   * Returns the loss of sample k and its subgradient, g - h, in diff.
+   */
+  Dtype ReferenceLoss(int k, vector<Dtype>* diff) {
+    const int nb = blob_bottom_vec_[0]->channels();
+    const int width = 2 * nb + 1;
+    const Dtype* x[3];
+    for (int b = 0; b < 3; ++b) {
+      x[b] = blob_bottom_vec_[b]->cpu_data() + k * nb;
+    }
+    const Dtype kNoPath = Dtype(-1e30);
+    vector<Dtype> table((nb + 1) * width, kNoPath);
+    vector<int> choice(nb * width, -1);
+    table[nb] = 0;
+    for (int i = 0; i < nb; ++i) {
+      for (int m = -i; m <= i; ++m) {
+        const Dtype prev = table[i * width + nb + m];
+        if (prev == kNoPath) {
+          continue;
+        }
+        for (int s = 0; s < 8; ++s) {
+          Dtype sign[3];
+          Dtype cont = 0;
+          for (int b = 0; b < 3; ++b) {
+            sign[b] = (s >> b & 1) ? 1 : -1;
+            cont += sign[b] * x[b][i];
+          }
+          const int next = m + (sign[0] != sign[1]) - (sign[0] != sign[2]);
+          Dtype* entry = &table[(i + 1) * width + nb + next];
+          if (prev + cont > *entry) {
+            *entry = prev + cont;
+            choice[i * width + nb + next] = s * width + nb + m;
+          }
+        }
+      }
+    }
+    int best_m = -nb;
+    Dtype best = kNoPath;
+    for (int m = -nb; m <= nb; ++m) {
+      const Dtype loss = std::max(m - 1, 0) + table[nb * width + nb + m];
+      if (loss > best) {
+        best = loss;
+        best_m = m;
+      }
+    }
+    diff->assign(3 * nb, 0);
+    for (int i = nb - 1; i >= 0; --i) {
+      const int c = choice[i * width + nb + best_m];
+      const int s = c / width;
+      best_m = c % width - nb;
+      for (int b = 0; b < 3; ++b) {
+        const Dtype g = (s >> b & 1) ? 1 : -1;
+        const Dtype h = x[b][i] > 0 ? 1 : -1;
+        (*diff)[b * nb + i] = g - h;
+        best -= std::abs(x[b][i]);
+      }
+    }
+    return best;
+  }
+
+  // Runs the layer on the current bottoms and compares with ReferenceLoss.
+  void CheckForwardBackward(Layer<Dtype>* layer) {
+    layer->Reshape(blob_bottom_vec_, blob_top_vec_);
+    layer->Forward(blob_bottom_vec_, blob_top_vec_);
+    vector<bool> propagate_down(3, true);
+    layer->Backward(blob_top_vec_, propagate_down, blob_bottom_vec_);
+    const int num = blob_bottom_vec_[0]->num();
+    const int nb = blob_bottom_vec_[0]->channels();
+    Dtype loss = 0;
+    for (int k = 0; k < num; ++k) {
+      vector<Dtype> diff;
+      loss += ReferenceLoss(k, &diff);
+      for (int b = 0; b < 3; ++b) {
+        const Dtype* bottom_diff = blob_bottom_vec_[b]->cpu_diff() + k * nb;
+        for (int i = 0; i < nb; ++i) {
+          EXPECT_EQ(diff[b * nb + i], bottom_diff[i])
+              << "sample " << k << " bottom " << b << " bit " << i;
+        }
+      }
+    }
+    EXPECT_NEAR(loss / num, blob_top_loss_->cpu_data()[0], 1e-4);
+  }
+
+  void TestForwardBackward(int num_threads) {
+    LayerParameter layer_param;
+    layer_param.mutable_triplet_loss_param()->set_num_threads(num_threads);
+    HDMLLossUpperBoundLayer<Dtype> layer(layer_param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    CheckForwardBackward(&layer);
+  }
+
+  static const int kNum = 5;
+  Blob<Dtype>* const blob_top_loss_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(HDMLLossUpperBoundLayerTest, TestDtypesAndDevices);
+
+TYPED_TEST(HDMLLossUpperBoundLayerTest, TestForwardBackward) {
+  this->TestForwardBackward(1);
+}
+
+TYPED_TEST(HDMLLossUpperBoundLayerTest, TestForwardBackwardThreaded) {
+  this->TestForwardBackward(3);
+}
+
+// The per-sample buffers follow the batch size when it shrinks or grows.
+TYPED_TEST(HDMLLossUpperBoundLayerTest, TestReshape) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  layer_param.mutable_triplet_loss_param()->set_num_threads(3);
+  HDMLLossUpperBoundLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  this->CheckForwardBackward(&layer);
+  FillerParameter filler_param;
+  GaussianFiller<Dtype> filler(filler_param);
+  const int nums[] = {2, 9};
+  const int nbs[] = {70, 33};
+  for (int i = 0; i < 2; ++i) {
+    for (int b = 0; b < 3; ++b) {
+      this->blob_bottom_vec_[b]->Reshape(nums[i], nbs[i], 1, 1);
+      filler.Fill(this->blob_bottom_vec_[b]);
+    }
+    this->CheckForwardBackward(&layer);
+  }
+}
+
+}  // namespace caffe
@@ -229,6 +229,43 @@ TEST_F(IOTest, TestReadImageToCVMatResizedGray) {
   EXPECT_EQ(cv_img.cols, 256);
 }
 
+#if CV_MAJOR_VERSION > 3 || (CV_MAJOR_VERSION == 3 && CV_MINOR_VERSION >= 1)
+TEST_F(IOTest, TestImageReadFlagForSize) {
+  // 480 x 360
+  string filename = EXAMPLES_SOURCE_DIR "images/cat.jpg";
+  EXPECT_EQ(cv::IMREAD_REDUCED_COLOR_8,
+      ImageReadFlagForSize(filename, 60, 60, true));
+  EXPECT_EQ(cv::IMREAD_REDUCED_GRAYSCALE_4,
+      ImageReadFlagForSize(filename, 100, 120, false));
+  EXPECT_EQ(cv::IMREAD_REDUCED_COLOR_2,
+      ImageReadFlagForSize(filename, 240, 100, true));
+  EXPECT_EQ(CV_LOAD_IMAGE_COLOR,
+      ImageReadFlagForSize(filename, 256, 256, true));
+  // a file without a JPEG header to read
+  EXPECT_EQ(CV_LOAD_IMAGE_GRAYSCALE, ImageReadFlagForSize(
+      EXAMPLES_SOURCE_DIR "images/missing.jpg", 60, 60, false));
+}
+
+TEST_F(IOTest, TestReadImageToCVMatResizedSmall) {
+  // Small enough to be decoded at 1/8 scale, and then padded and resized
+  // as the full size image would be.
+  string filename = EXAMPLES_SOURCE_DIR "images/cat.jpg";
+  cv::Mat cv_img = ReadImageToCVMat(filename, 60, 60);
+  EXPECT_EQ(cv_img.channels(), 3);
+  EXPECT_EQ(cv_img.rows, 60);
+  EXPECT_EQ(cv_img.cols, 60);
+  cv::Mat cv_img_reduced = cv::imread(filename, cv::IMREAD_REDUCED_COLOR_8);
+  ASSERT_EQ(cv_img_reduced.rows, 45);
+  ASSERT_EQ(cv_img_reduced.cols, 60);
+  cv::copyMakeBorder(cv_img_reduced, cv_img_reduced, 7, 7, 0, 0,
+      cv::BORDER_REPLICATE);
+  cv::resize(cv_img_reduced, cv_img_reduced, cv::Size(60, 60));
+  cv::Mat diff;
+  cv::absdiff(cv_img, cv_img_reduced, diff);
+  EXPECT_EQ(0, cv::countNonZero(diff.reshape(1)));
+}
+#endif
+
 TEST_F(IOTest, TestCVMatToDatum) {
   string filename = EXAMPLES_SOURCE_DIR "images/cat.jpg";
   cv::Mat cv_img = ReadImageToCVMat(filename);
@@ -119,6 +119,59 @@ TYPED_TEST(CPUMathFunctionsTest, TestCopy) {
   }
 }
 
+TYPED_TEST(CPUMathFunctionsTest, TestPackBits) {
+  // 323 bit codes end in a partial word
+  const int n = 23;
+  const int nbits = 17 * 19;
+  const int nwords = caffe_code_words(nbits);
+  const TypeParam* x = this->blob_bottom_->cpu_data();
+  vector<uint64_t> codes(n * nwords);
+  caffe_cpu_pack_bits(n, nbits, x, &codes[0]);
+  TypeParam* y = this->blob_top_->mutable_cpu_data();
+  caffe_cpu_unpack_bits(n, nbits, &codes[0], y);
+  for (int i = 0; i < n * nbits; ++i) {
+    EXPECT_EQ(y[i], x[i] > 0 ? 1 : -1);
+  }
+  for (int i = 0; i < n; ++i) {
+    EXPECT_EQ(codes[i * nwords + nwords - 1] >> (nbits % 64), uint64_t(0));
+  }
+  vector<int> dist(n);
+  caffe_cpu_hamming_distances(n, nwords, &codes[0], &codes[0], &dist[0]);
+  for (int i = 0; i < n; ++i) {
+    int std_dist = 0;
+    for (int j = 0; j < nbits; ++j) {
+      std_dist += (x[j] > 0) != (x[i * nbits + j] > 0);
+    }
+    EXPECT_EQ(dist[i], std_dist);
+  }
+}
+
+// Every code length from one word up to past two AVX2 vectors, so that the
+// vector loop and the words left over are both covered.
+TYPED_TEST(CPUMathFunctionsTest, TestHammingDistances) {
+  const int n = 37;
+  for (int nwords = 1; nwords <= 9; ++nwords) {
+    vector<uint64_t> codes((n + 1) * nwords);
+    for (int w = 0; w < codes.size(); ++w) {
+      codes[w] = static_cast<uint64_t>(caffe_rng_rand()) << 32 |
+          caffe_rng_rand();
+    }
+    vector<int> dist(n);
+    const uint64_t* query = &codes[n * nwords];
+    caffe_cpu_hamming_distances(n, nwords, query, &codes[0], &dist[0]);
+    for (int i = 0; i < n; ++i) {
+      int std_dist = 0;
+      for (int j = 0; j < nwords * 64; ++j) {
+        std_dist += ((query[j / 64] ^ codes[i * nwords + j / 64]) >>
+            (j % 64)) & 1;
+      }
+      EXPECT_EQ(std_dist, dist[i]);
+      EXPECT_EQ(std_dist, caffe_cpu_hamming_distance(nwords, query,
+          &codes[i * nwords]));
+    }
+  }
+}
+
 #ifndef CPU_ONLY
 
 template <typename Dtype>
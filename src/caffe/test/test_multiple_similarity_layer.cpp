@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/layers/dotproduct_multiple_similarity_layer.hpp"
+#include "caffe/layers/euclidean_multiple_similarity_layer.hpp"
+#include "caffe/util/math_functions.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_gradient_check_util.hpp"
+
+namespace caffe {
+
+// A device of TestDtypesAndDevices with the layer under test and the
+// similarity of one anchor and sample it is expected to compute.
+template <typename Device>
+struct DotProductMultiple : public Device {
+  typedef DotProductMultipleSimilarityLayer<typename Device::Dtype> Layer;
+  static typename Device::Dtype Similarity(typename Device::Dtype a,
+      typename Device::Dtype b) {
+    return a * b;
+  }
+};
+
+template <typename Device>
+struct EuclideanMultiple : public Device {
+  typedef EuclideanMultipleSimilarityLayer<typename Device::Dtype> Layer;
+  static typename Device::Dtype Similarity(typename Device::Dtype a,
+      typename Device::Dtype b) {
+    return -0.5 * (a - b) * (a - b);
+  }
+};
+
+#ifdef CPU_ONLY
+
+typedef ::testing::Types<DotProductMultiple<CPUDevice<float> >,
+                         DotProductMultiple<CPUDevice<double> >,
+                         EuclideanMultiple<CPUDevice<float> >,
+                         EuclideanMultiple<CPUDevice<double> > >
+                         MultipleSimilarityTypes;
+
+#else
+
+typedef ::testing::Types<DotProductMultiple<CPUDevice<float> >,
+                         DotProductMultiple<CPUDevice<double> >,
+                         DotProductMultiple<GPUDevice<float> >,
+                         DotProductMultiple<GPUDevice<double> >,
+                         EuclideanMultiple<CPUDevice<float> >,
+                         EuclideanMultiple<CPUDevice<double> >,
+                         EuclideanMultiple<GPUDevice<float> >,
+                         EuclideanMultiple<GPUDevice<double> > >
+                         MultipleSimilarityTypes;
+
+#endif
+
+template <typename TypeParam>
+class MultipleSimilarityLayerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+  typedef typename TypeParam::Layer LayerType;
+
+ protected:
+  MultipleSimilarityLayerTest()
+      : epsilon_(Dtype(1e-5)),
+        blob_bottom_0_(new Blob<Dtype>()),
+        blob_bottom_1_(new Blob<Dtype>()),
+        blob_top_(new Blob<Dtype>()) {}
+  virtual void SetUp() {
+    Caffe::set_random_seed(1701);
+    // three samples per anchor
+    blob_bottom_0_->Reshape(2, 5, 1, 1);
+    blob_bottom_1_->Reshape(6, 5, 1, 1);
+    FillerParameter filler_param;
+    GaussianFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_0_);
+    filler.Fill(this->blob_bottom_1_);
+    blob_bottom_vec_.push_back(blob_bottom_0_);
+    blob_bottom_vec_.push_back(blob_bottom_1_);
+    blob_top_vec_.push_back(blob_top_);
+  }
+  virtual ~MultipleSimilarityLayerTest() {
+    delete blob_bottom_0_;
+    delete blob_bottom_1_;
+    delete blob_top_;
+  }
+
+  LayerParameter Param(MultipleSimilarityParameter_Aggregation aggregation) {
+    LayerParameter layer_param;
+    MultipleSimilarityParameter* param =
+        layer_param.mutable_multiple_similarity_param();
+    param->set_aggregation(aggregation);
+    param->set_scale(2.);
+    return layer_param;
+  }
+
+  void TestForward(MultipleSimilarityParameter_Aggregation aggregation) {
+    LayerType layer(Param(aggregation));
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    const int dim = blob_bottom_0_->count() / blob_bottom_0_->num();
+    const int k = blob_bottom_1_->num() / blob_bottom_0_->num();
+    for (int i = 0; i < blob_bottom_0_->num(); ++i) {
+      Dtype mean = 0, max = -1e10, lse = 0;
+      for (int j = 0; j < k; ++j) {
+        Dtype sim = 0;
+        for (int d = 0; d < dim; ++d) {
+          sim += TypeParam::Similarity(
+              blob_bottom_0_->cpu_data()[i * dim + d],
+              blob_bottom_1_->cpu_data()[(i * k + j) * dim + d]);
+        }
+        mean += sim / k;
+        max = std::max(max, sim);
+        lse += std::exp(2 * sim) / k;
+      }
+      Dtype expected = mean;
+      if (aggregation == MultipleSimilarityParameter_Aggregation_MAX) {
+        expected = max;
+      } else if (aggregation == MultipleSimilarityParameter_Aggregation_LSE) {
+        expected = std::log(lse) / 2;
+      }
+      EXPECT_NEAR(expected, blob_top_->cpu_data()[i], epsilon_);
+    }
+  }
+
+  void TestGradient(MultipleSimilarityParameter_Aggregation aggregation) {
+    LayerType layer(Param(aggregation));
+    GradientChecker<Dtype> checker(1e-2, 1e-2);
+    checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+        this->blob_top_vec_);
+  }
+
+  // Backward must not change the forward state, or a second call (as from
+  // several consumers of the top) would scale the gradient again.
+  void TestBackwardTwice(MultipleSimilarityParameter_Aggregation aggregation) {
+    LayerType layer(Param(aggregation));
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    caffe_set(blob_top_->count(), Dtype(3), blob_top_->mutable_cpu_diff());
+    vector<bool> propagate_down(2, true);
+    vector<Dtype> first[2];
+    for (int pass = 0; pass < 2; ++pass) {
+      layer.Backward(this->blob_top_vec_, propagate_down,
+          this->blob_bottom_vec_);
+      for (int b = 0; b < 2; ++b) {
+        const Blob<Dtype>* bottom = this->blob_bottom_vec_[b];
+        if (pass == 0) {
+          first[b].assign(bottom->cpu_diff(),
+              bottom->cpu_diff() + bottom->count());
+          continue;
+        }
+        for (int i = 0; i < bottom->count(); ++i) {
+          EXPECT_NEAR(first[b][i], bottom->cpu_diff()[i], epsilon_);
+        }
+      }
+    }
+  }
+
+  Dtype epsilon_;
+
+  Blob<Dtype>* const blob_bottom_0_;
+  Blob<Dtype>* const blob_bottom_1_;
+  Blob<Dtype>* const blob_top_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(MultipleSimilarityLayerTest, MultipleSimilarityTypes);
+
+TYPED_TEST(MultipleSimilarityLayerTest, TestSetup) {
+  typename TypeParam::Layer layer((LayerParameter()));
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(this->blob_top_->num(), 2);
+  EXPECT_EQ(this->blob_top_->channels(), 1);
+  EXPECT_EQ(this->blob_top_->height(), 1);
+  EXPECT_EQ(this->blob_top_->width(), 1);
+}
+
+TYPED_TEST(MultipleSimilarityLayerTest, TestForwardMean) {
+  this->TestForward(MultipleSimilarityParameter_Aggregation_MEAN);
+}
+
+TYPED_TEST(MultipleSimilarityLayerTest, TestForwardMax) {
+  this->TestForward(MultipleSimilarityParameter_Aggregation_MAX);
+}
+
+TYPED_TEST(MultipleSimilarityLayerTest, TestForwardLSE) {
+  this->TestForward(MultipleSimilarityParameter_Aggregation_LSE);
+}
+
+TYPED_TEST(MultipleSimilarityLayerTest, TestGradientMean) {
+  this->TestGradient(MultipleSimilarityParameter_Aggregation_MEAN);
+}
+
+TYPED_TEST(MultipleSimilarityLayerTest, TestGradientMax) {
+  this->TestGradient(MultipleSimilarityParameter_Aggregation_MAX);
+}
+
+TYPED_TEST(MultipleSimilarityLayerTest, TestGradientLSE) {
+  this->TestGradient(MultipleSimilarityParameter_Aggregation_LSE);
+}
+
+TYPED_TEST(MultipleSimilarityLayerTest, TestBackwardTwice) {
+  this->TestBackwardTwice(MultipleSimilarityParameter_Aggregation_MEAN);
+  this->TestBackwardTwice(MultipleSimilarityParameter_Aggregation_LSE);
+}
+
+}  // namespace caffe
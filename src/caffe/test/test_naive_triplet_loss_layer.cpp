@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/layers/naive_triplet_loss_layer.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_gradient_check_util.hpp"
+
+namespace caffe {
+
+// Stops pushing to the memory bank, so that every forward pass of the
+// gradient checker mines the same bank negatives.
+template <typename Dtype>
+class FrozenBankTripletLossLayer : public NaiveTripletLossLayer<Dtype> {
+ public:
+  explicit FrozenBankTripletLossLayer(const LayerParameter& param)
+      : NaiveTripletLossLayer<Dtype>(param) {}
+  void FreezeBank() { this->phase_ = TEST; }
+};
+
+template <typename TypeParam>
+class NaiveTripletLossLayerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  NaiveTripletLossLayerTest()
+      : blob_bottom_data_(new Blob<Dtype>(3 * kNum, 4, 1, 1)),
+        blob_bottom_label_(new Blob<Dtype>(kNum, 1, 1, 1)),
+        blob_top_loss_(new Blob<Dtype>()),
+        blob_top_accuracy_(new Blob<Dtype>()) {
+    Caffe::set_random_seed(1701);
+    FillData();
+    blob_bottom_vec_.push_back(blob_bottom_data_);
+    const int labels[] = {1, 2, 3, 1, 2, 3};
+    for (int i = 0; i < kNum; ++i) {
+      blob_bottom_label_->mutable_cpu_data()[i] = labels[i];
+    }
+    blob_bottom_vec_.push_back(blob_bottom_label_);
+    blob_top_vec_.push_back(blob_top_loss_);
+    blob_top_vec_.push_back(blob_top_accuracy_);
+  }
+  virtual ~NaiveTripletLossLayerTest() {
+    delete blob_bottom_data_;
+    delete blob_bottom_label_;
+    delete blob_top_loss_;
+    delete blob_top_accuracy_;
+  }
+
+  void FillData() {
+    FillerParameter filler_param;
+    filler_param.set_std(0.5);
+    GaussianFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_data_);
+  }
+
+  static Dtype Similarity(const string& sim_type, const Dtype* a,
+      const Dtype* b, int dim) {
+    Dtype sim = 0;
+    for (int d = 0; d < dim; ++d) {
+      sim += sim_type == "DotProductSimilarity" ?
+          a[d] * b[d] : Dtype(-0.5) * (a[d] - b[d]) * (a[d] - b[d]);
+    }
+    return sim;
+  }
+
+  // The hinge of every triplet, plus for every query the mean hinge over the
+  // bank rows with another label.
+  void ReferenceLoss(const string& sim_type, Dtype margin,
+      const vector<Dtype>& bank_feat, const vector<Dtype>& bank_label,
+      Dtype* loss, Dtype* accuracy) {
+    const int dim = blob_bottom_data_->channels();
+    const Dtype* qry = blob_bottom_data_->cpu_data();
+    const Dtype* pos = qry + kNum * dim;
+    const Dtype* neg = pos + kNum * dim;
+    const Dtype* label = blob_bottom_label_->cpu_data();
+    *loss = 0;
+    *accuracy = 0;
+    for (int i = 0; i < kNum; ++i) {
+      Dtype pos_sim = Similarity(sim_type, qry + i * dim, pos + i * dim, dim);
+      Dtype neg_sim = Similarity(sim_type, qry + i * dim, neg + i * dim, dim);
+      *loss += std::max(Dtype(0), margin - pos_sim + neg_sim);
+      *accuracy += pos_sim > neg_sim;
+      Dtype bank_loss = 0;
+      int num_neg = 0;
+      for (int k = 0; k < bank_label.size(); ++k) {
+        if (bank_label[k] == label[i]) {
+          continue;
+        }
+        Dtype bank_sim = Similarity(sim_type, qry + i * dim,
+            &bank_feat[k * dim], dim);
+        bank_loss += std::max(Dtype(0), margin - pos_sim + bank_sim);
+        ++num_neg;
+      }
+      if (num_neg > 0) {
+        *loss += bank_loss / num_neg;
+      }
+    }
+    *loss /= kNum;
+    *accuracy /= kNum;
+  }
+
+  LayerParameter BankParam(const string& sim_type, Dtype margin) {
+    LayerParameter layer_param;
+    layer_param.mutable_triplet_loss_param()->set_sim_type(sim_type);
+    layer_param.mutable_triplet_loss_param()->set_margin(margin);
+    layer_param.mutable_triplet_loss_param()->set_memory_bank_size(4 * kNum);
+    return layer_param;
+  }
+
+  // Runs a first batch through a TRAIN layer, then refills the bottom and
+  // returns the queries and positives of the first batch, which the layer
+  // now holds in its bank.
+  void FillBank(Layer<Dtype>* layer, vector<Dtype>* bank_feat,
+      vector<Dtype>* bank_label) {
+    layer->SetUp(blob_bottom_vec_, blob_top_vec_);
+    layer->Forward(blob_bottom_vec_, blob_top_vec_);
+    const Dtype* data = blob_bottom_data_->cpu_data();
+    bank_feat->assign(data, data + 2 * kNum * blob_bottom_data_->channels());
+    const Dtype* label = blob_bottom_label_->cpu_data();
+    bank_label->assign(label, label + kNum);
+    bank_label->insert(bank_label->end(), label, label + kNum);
+    FillData();
+  }
+
+  void TestForward(const string& sim_type) {
+    const Dtype margin = 0.5;
+    LayerParameter layer_param;
+    layer_param.mutable_triplet_loss_param()->set_sim_type(sim_type);
+    layer_param.mutable_triplet_loss_param()->set_margin(margin);
+    NaiveTripletLossLayer<Dtype> layer(layer_param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    layer.Forward(blob_bottom_vec_, blob_top_vec_);
+    Dtype loss, accuracy;
+    ReferenceLoss(sim_type, margin, vector<Dtype>(), vector<Dtype>(),
+        &loss, &accuracy);
+    EXPECT_NEAR(blob_top_loss_->cpu_data()[0], loss, 1e-5);
+    EXPECT_NEAR(blob_top_accuracy_->cpu_data()[0], accuracy, 1e-5);
+  }
+
+  void TestForwardMemoryBank(const string& sim_type) {
+    const Dtype margin = 0.5;
+    NaiveTripletLossLayer<Dtype> layer(BankParam(sim_type, margin));
+    vector<Dtype> bank_feat, bank_label;
+    FillBank(&layer, &bank_feat, &bank_label);
+    layer.Forward(blob_bottom_vec_, blob_top_vec_);
+    Dtype loss, accuracy;
+    ReferenceLoss(sim_type, margin, bank_feat, bank_label, &loss, &accuracy);
+    EXPECT_NEAR(blob_top_loss_->cpu_data()[0], loss, 1e-5);
+    EXPECT_NEAR(blob_top_accuracy_->cpu_data()[0], accuracy, 1e-5);
+  }
+
+  void TestGradient(const string& sim_type) {
+    LayerParameter layer_param;
+    // a large margin keeps every triplet inside its hinge
+    layer_param.mutable_triplet_loss_param()->set_sim_type(sim_type);
+    layer_param.mutable_triplet_loss_param()->set_margin(10.);
+    NaiveTripletLossLayer<Dtype> layer(layer_param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    GradientChecker<Dtype> checker(1e-3, 1e-2, 1701);
+    checker.CheckGradientSingle(&layer, blob_bottom_vec_, blob_top_vec_,
+        0, 0, 0);
+  }
+
+  void TestGradientMemoryBank(const string& sim_type) {
+    FrozenBankTripletLossLayer<Dtype> layer(BankParam(sim_type, 10.));
+    vector<Dtype> bank_feat, bank_label;
+    FillBank(&layer, &bank_feat, &bank_label);
+    layer.FreezeBank();
+    GradientChecker<Dtype> checker(1e-3, 1e-2, 1701);
+    checker.CheckGradientSingle(&layer, blob_bottom_vec_, blob_top_vec_,
+        0, 0, 0);
+  }
+
+  static const int kNum = 6;
+  Blob<Dtype>* const blob_bottom_data_;
+  Blob<Dtype>* const blob_bottom_label_;
+  Blob<Dtype>* const blob_top_loss_;
+  Blob<Dtype>* const blob_top_accuracy_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(NaiveTripletLossLayerTest, TestDtypesAndDevices);
+
+TYPED_TEST(NaiveTripletLossLayerTest, TestForward) {
+  this->TestForward("DotProductSimilarity");
+  this->TestForward("EuclideanSimilarity");
+}
+
+TYPED_TEST(NaiveTripletLossLayerTest, TestForwardMemoryBank) {
+  this->TestForwardMemoryBank("DotProductSimilarity");
+  this->TestForwardMemoryBank("EuclideanSimilarity");
+}
+
+TYPED_TEST(NaiveTripletLossLayerTest, TestForwardTestPhaseSkipsBank) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param = this->BankParam("EuclideanSimilarity", 0.5);
+  layer_param.set_phase(TEST);
+  NaiveTripletLossLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int iter = 0; iter < 2; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  }
+  Dtype loss, accuracy;
+  this->ReferenceLoss("EuclideanSimilarity", 0.5, vector<Dtype>(),
+      vector<Dtype>(), &loss, &accuracy);
+  EXPECT_NEAR(this->blob_top_loss_->cpu_data()[0], loss, 1e-5);
+}
+
+TYPED_TEST(NaiveTripletLossLayerTest, TestGradient) {
+  this->TestGradient("DotProductSimilarity");
+  this->TestGradient("EuclideanSimilarity");
+}
+
+TYPED_TEST(NaiveTripletLossLayerTest, TestGradientMemoryBank) {
+  this->TestGradientMemoryBank("DotProductSimilarity");
+  this->TestGradientMemoryBank("EuclideanSimilarity");
+}
+
+}  // namespace caffe
@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/layer_factory.hpp"
+#include "caffe/layers/dotproduct_multiple_similarity_layer.hpp"
+#include "caffe/layers/naive_triplet_multiple_loss_layer.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/test/test_gradient_check_util.hpp"
+
+namespace caffe {
+
+// DotProductMultipleSimilarity under a name the loss does not fuse, so that
+// it runs the slice and similarity sub-layers.
+template <typename Dtype>
+class GenericDotMultipleSimilarityLayer
+    : public DotProductMultipleSimilarityLayer<Dtype> {
+ public:
+  explicit GenericDotMultipleSimilarityLayer(const LayerParameter& param)
+      : DotProductMultipleSimilarityLayer<Dtype>(param) {}
+};
+
+REGISTER_LAYER_CLASS(GenericDotMultipleSimilarity);
+
+template <typename TypeParam>
+class NaiveTripletMultipleLossLayerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  NaiveTripletMultipleLossLayerTest()
+      : blob_bottom_data_(new Blob<Dtype>()),
+        blob_top_loss_(new Blob<Dtype>()),
+        blob_top_accuracy_(new Blob<Dtype>()) {
+    Caffe::set_random_seed(1701);
+    blob_bottom_vec_.push_back(blob_bottom_data_);
+    blob_top_vec_.push_back(blob_top_loss_);
+    blob_top_vec_.push_back(blob_top_accuracy_);
+  }
+  virtual ~NaiveTripletMultipleLossLayerTest() {
+    delete blob_bottom_data_;
+    delete blob_top_loss_;
+    delete blob_top_accuracy_;
+  }
+
+  // kBatch x kAnchor anchors with pos_k positives and neg_k negatives each
+  LayerParameter Param(const string& sim_type, int pos_k, int neg_k,
+      MultipleSimilarityParameter_Aggregation aggregation, Dtype margin) {
+    LayerParameter layer_param;
+    TripletMultipleLossParameter* triplet_param =
+        layer_param.mutable_multiple_triplet_loss_param();
+    triplet_param->set_sim_type(sim_type);
+    triplet_param->set_batch_size(kBatch);
+    triplet_param->set_anchor_len(kAnchor);
+    triplet_param->set_pos_len(kAnchor * pos_k);
+    triplet_param->set_neg_len(kAnchor * neg_k);
+    layer_param.mutable_triplet_loss_param()->set_margin(margin);
+    layer_param.mutable_multiple_similarity_param()->set_aggregation(
+        aggregation);
+    layer_param.mutable_multiple_similarity_param()->set_scale(2.);
+    int count = kBatch * kAnchor;
+    blob_bottom_data_->Reshape(count * (1 + pos_k + neg_k), kDim, 1, 1);
+    FillerParameter filler_param;
+    filler_param.set_std(0.5);
+    GaussianFiller<Dtype> filler(filler_param);
+    filler.Fill(blob_bottom_data_);
+    return layer_param;
+  }
+
+  static Dtype Aggregate(const LayerParameter& layer_param,
+      const vector<Dtype>& sim) {
+    const MultipleSimilarityParameter& param =
+        layer_param.multiple_similarity_param();
+    Dtype result = 0;
+    switch (param.aggregation()) {
+    case MultipleSimilarityParameter_Aggregation_MEAN:
+      for (int j = 0; j < sim.size(); ++j) {
+        result += sim[j] / sim.size();
+      }
+      return result;
+    case MultipleSimilarityParameter_Aggregation_MAX:
+      return *std::max_element(sim.begin(), sim.end());
+    default:
+      for (int j = 0; j < sim.size(); ++j) {
+        result += std::exp(param.scale() * sim[j]) / sim.size();
+      }
+      return std::log(result) / param.scale();
+    }
+  }
+
+  // Every hinge from the similarities of an anchor to each of its samples.
+  void ReferenceLoss(const LayerParameter& layer_param, int pos_k,
+      Dtype* loss, Dtype* accuracy) {
+    const bool dot = layer_param.multiple_triplet_loss_param().sim_type().find(
+        "Dot") != string::npos;
+    const Dtype margin = layer_param.triplet_loss_param().margin();
+    const int count = kBatch * kAnchor;
+    const int neg_k = blob_bottom_data_->num() / count - 1 - pos_k;
+    const Dtype* qry = blob_bottom_data_->cpu_data();
+    const Dtype* pos = qry + count * kDim;
+    const Dtype* neg = pos + count * pos_k * kDim;
+    *loss = 0;
+    *accuracy = 0;
+    for (int i = 0; i < count; ++i) {
+      vector<Dtype> pos_sim(pos_k, 0), neg_sim(neg_k, 0);
+      for (int d = 0; d < kDim; ++d) {
+        Dtype q = qry[i * kDim + d];
+        for (int j = 0; j < pos_k; ++j) {
+          Dtype p = pos[(i * pos_k + j) * kDim + d];
+          pos_sim[j] += dot ? q * p : Dtype(-0.5) * (q - p) * (q - p);
+        }
+        for (int j = 0; j < neg_k; ++j) {
+          Dtype n = neg[(i * neg_k + j) * kDim + d];
+          neg_sim[j] += dot ? q * n : Dtype(-0.5) * (q - n) * (q - n);
+        }
+      }
+      Dtype s_p = Aggregate(layer_param, pos_sim);
+      Dtype s_n = Aggregate(layer_param, neg_sim);
+      *loss += std::max(Dtype(0), margin - s_p + s_n);
+      *accuracy += s_p > s_n;
+    }
+    *loss /= count;
+    *accuracy /= count;
+  }
+
+  void TestForward(const string& sim_type, int pos_k, int neg_k,
+      MultipleSimilarityParameter_Aggregation aggregation) {
+    LayerParameter layer_param = Param(sim_type, pos_k, neg_k, aggregation,
+        0.5);
+    NaiveTripletMultipleLossLayer<Dtype> layer(layer_param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    layer.Forward(blob_bottom_vec_, blob_top_vec_);
+    Dtype loss, accuracy;
+    ReferenceLoss(layer_param, pos_k, &loss, &accuracy);
+    EXPECT_NEAR(blob_top_loss_->cpu_data()[0], loss, 1e-5);
+    EXPECT_NEAR(blob_top_accuracy_->cpu_data()[0], accuracy, 1e-5);
+  }
+
+  void TestGradient(const string& sim_type, int pos_k, int neg_k,
+      MultipleSimilarityParameter_Aggregation aggregation) {
+    // a large margin keeps every triplet inside its hinge
+    NaiveTripletMultipleLossLayer<Dtype> layer(
+        Param(sim_type, pos_k, neg_k, aggregation, 10.));
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    GradientChecker<Dtype> checker(1e-3, 1e-2, 1701);
+    checker.CheckGradientSingle(&layer, blob_bottom_vec_, blob_top_vec_,
+        0, 0, 0);
+  }
+
+  static const int kBatch = 2;
+  static const int kAnchor = 2;
+  static const int kDim = 4;
+  Blob<Dtype>* const blob_bottom_data_;
+  Blob<Dtype>* const blob_top_loss_;
+  Blob<Dtype>* const blob_top_accuracy_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(NaiveTripletMultipleLossLayerTest, TestDtypesAndDevices);
+
+TYPED_TEST(NaiveTripletMultipleLossLayerTest, TestForward) {
+  this->TestForward("DotProductSimilarity", 1, 1,
+      MultipleSimilarityParameter_Aggregation_MEAN);
+  this->TestForward("EuclideanSimilarity", 1, 1,
+      MultipleSimilarityParameter_Aggregation_MEAN);
+}
+
+TYPED_TEST(NaiveTripletMultipleLossLayerTest, TestForwardMultiple) {
+  this->TestForward("DotProductMultipleSimilarity", 2, 3,
+      MultipleSimilarityParameter_Aggregation_MEAN);
+  this->TestForward("DotProductMultipleSimilarity", 2, 3,
+      MultipleSimilarityParameter_Aggregation_MAX);
+  this->TestForward("DotProductMultipleSimilarity", 2, 3,
+      MultipleSimilarityParameter_Aggregation_LSE);
+  this->TestForward("EuclideanMultipleSimilarity", 2, 3,
+      MultipleSimilarityParameter_Aggregation_MEAN);
+  this->TestForward("EuclideanMultipleSimilarity", 2, 3,
+      MultipleSimilarityParameter_Aggregation_MAX);
+  this->TestForward("EuclideanMultipleSimilarity", 2, 3,
+      MultipleSimilarityParameter_Aggregation_LSE);
+}
+
+TYPED_TEST(NaiveTripletMultipleLossLayerTest, TestForwardSubLayers) {
+  this->TestForward("GenericDotMultipleSimilarity", 2, 3,
+      MultipleSimilarityParameter_Aggregation_LSE);
+}
+
+TYPED_TEST(NaiveTripletMultipleLossLayerTest, TestGradient) {
+  this->TestGradient("DotProductSimilarity", 1, 1,
+      MultipleSimilarityParameter_Aggregation_MEAN);
+  this->TestGradient("EuclideanSimilarity", 1, 1,
+      MultipleSimilarityParameter_Aggregation_MEAN);
+}
+
+TYPED_TEST(NaiveTripletMultipleLossLayerTest, TestGradientMultiple) {
+  this->TestGradient("DotProductMultipleSimilarity", 2, 3,
+      MultipleSimilarityParameter_Aggregation_MEAN);
+  this->TestGradient("DotProductMultipleSimilarity", 2, 3,
+      MultipleSimilarityParameter_Aggregation_LSE);
+  this->TestGradient("EuclideanMultipleSimilarity", 2, 3,
+      MultipleSimilarityParameter_Aggregation_MEAN);
+  this->TestGradient("EuclideanMultipleSimilarity", 2, 3,
+      MultipleSimilarityParameter_Aggregation_LSE);
+}
+
+// The query diff of both similarity sub-layers has to add up.
+TYPED_TEST(NaiveTripletMultipleLossLayerTest, TestGradientSubLayers) {
+  this->TestGradient("GenericDotMultipleSimilarity", 2, 3,
+      MultipleSimilarityParameter_Aggregation_LSE);
+}
+
+}  // namespace caffe
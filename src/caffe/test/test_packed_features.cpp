@@ -0,0 +1,61 @@
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/packed_features.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class PackedFeaturesTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    MakeTempFilename(&filename_);
+    // three rows of 1 x 2 x 3 float32 values, added out of name order
+    PackedFeatureWriter writer(filename_, sizeof(float), 1, 2, 3);
+    const char* names[] = {"b/2", "a/1", "c"};
+    for (int row = 0; row < 3; ++row) {
+      float values[6];
+      for (int i = 0; i < 6; ++i) {
+        values[i] = row * 10 + i;
+      }
+      writer.Add(names[row], reinterpret_cast<const char*>(values));
+    }
+  }
+
+  string filename_;
+};
+
+TEST_F(PackedFeaturesTest, TestFind) {
+  PackedFeatureFile file;
+  file.Open(filename_);
+  EXPECT_EQ(file.num(), 3);
+  EXPECT_EQ(file.channels(), 1);
+  EXPECT_EQ(file.height(), 2);
+  EXPECT_EQ(file.width(), 3);
+  EXPECT_EQ(file.Find("b/2"), 0);
+  EXPECT_EQ(file.Find("a/1"), 1);
+  EXPECT_EQ(file.Find("c"), 2);
+  EXPECT_EQ(file.Find("b"), -1);
+  EXPECT_EQ(file.Find("d"), -1);
+  EXPECT_STREQ(file.name(1), "a/1");
+}
+
+TEST_F(PackedFeaturesTest, TestCopyRow) {
+  PackedFeatureFile file;
+  file.Open(filename_);
+  float floats[6];
+  double doubles[6];
+  file.WillNeed(2);
+  file.CopyRow(2, floats);
+  file.CopyRow(2, doubles);
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_EQ(floats[i], 20 + i);
+    EXPECT_EQ(doubles[i], 20 + i);
+  }
+}
+
+}  // namespace caffe
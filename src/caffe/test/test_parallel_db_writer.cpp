@@ -0,0 +1,88 @@
+#include <boost/bind.hpp>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/db.hpp"
+#include "caffe/util/format.hpp"
+#include "caffe/util/parallel_db_writer.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+// Records what is committed, and the last Reserve hint.
+class RecordingDB : public db::DB {
+ public:
+  class RecordingTransaction : public db::Transaction {
+   public:
+    explicit RecordingTransaction(RecordingDB* db) : db_(db) {}
+    virtual void Put(const string& key, const string& value) {
+      keys_.push_back(key);
+    }
+    virtual void Commit() {
+      db_->keys_.insert(db_->keys_.end(), keys_.begin(), keys_.end());
+      db_->commits_.push_back(keys_.size());
+      keys_.clear();
+    }
+
+   protected:
+    RecordingDB* db_;
+    vector<string> keys_;
+  };
+
+  RecordingDB() : reserved_records_(0), reserved_bytes_(0) {}
+  virtual void Open(const string& source, db::Mode mode) {}
+  virtual void Close() {}
+  virtual db::Cursor* NewCursor() { return NULL; }
+  virtual db::Transaction* NewTransaction() {
+    return new RecordingTransaction(this);
+  }
+  virtual void Reserve(size_t num_records, size_t record_bytes) {
+    reserved_records_ = num_records;
+    reserved_bytes_ = record_bytes;
+  }
+
+  vector<string> keys_;
+  vector<int> commits_;
+  size_t reserved_records_;
+  size_t reserved_bytes_;
+};
+
+// Leaves out every multiple of 7; values are 10 bytes, keys 8.
+bool EncodeRecord(int index, string* key, string* value) {
+  if (index % 7 == 0) {
+    return false;
+  }
+  *key = format_int(index, 8);
+  *value = string(10, 'x');
+  return true;
+}
+
+class ParallelDBWriterTest : public ::testing::Test {};
+
+TEST_F(ParallelDBWriterTest, TestWritesInOrder) {
+  for (int num_threads = 1; num_threads <= 4; ++num_threads) {
+    RecordingDB db;
+    ParallelDBWriter writer(&db, num_threads, 5, 16);
+    const int num = 100;
+    EXPECT_EQ(writer.Run(num, boost::bind(&EncodeRecord, _1, _2, _3), 10),
+        85);
+    vector<string> expected;
+    for (int i = 0; i < num; ++i) {
+      if (i % 7 != 0) {
+        expected.push_back(format_int(i, 8));
+      }
+    }
+    EXPECT_EQ(db.keys_, expected);
+    ASSERT_EQ(db.commits_.size(), 6);
+    EXPECT_EQ(db.commits_[0], 16);
+    EXPECT_EQ(db.commits_[5], 5);
+    EXPECT_EQ(db.reserved_records_, num);
+    EXPECT_EQ(db.reserved_bytes_, 18);
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,164 @@
+#ifdef USE_LMDB
+#include <set>
+#include <string>
+#include <vector>
+
+#include "boost/scoped_ptr.hpp"
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/layers/pk_data_layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/db.hpp"
+#include "caffe/util/format.hpp"
+#include "caffe/util/io.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+using boost::scoped_ptr;
+
+template <typename TypeParam>
+class PKDataLayerTest : public MultiDeviceTest<TypeParam> {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  PKDataLayerTest()
+      : blob_top_data_(new Blob<Dtype>()),
+        blob_top_label_(new Blob<Dtype>()) {}
+  virtual void SetUp() {
+    MakeTempDir(&filename_);
+    filename_ += "/db";
+    blob_top_vec_.push_back(blob_top_data_);
+    blob_top_vec_.push_back(blob_top_label_);
+    Fill();
+  }
+  virtual ~PKDataLayerTest() {
+    delete blob_top_data_;
+    delete blob_top_label_;
+  }
+
+  // Record i holds the single pixel i. Labels 0 to kLabels - 1 have
+  // kImagesPerLabel records each, interleaved, and label kSingleLabel one.
+  void Fill() {
+    scoped_ptr<db::DB> db(db::GetDB(DataParameter_DB_LMDB));
+    db->Open(filename_, db::NEW);
+    scoped_ptr<db::Transaction> txn(db->NewTransaction());
+    for (int i = 0; i <= kLabels * kImagesPerLabel; ++i) {
+      Datum datum;
+      datum.set_label(i < kLabels * kImagesPerLabel ? i % kLabels
+          : kSingleLabel);
+      datum.set_channels(1);
+      datum.set_height(1);
+      datum.set_width(1);
+      datum.mutable_data()->push_back(static_cast<uint8_t>(i));
+      string out;
+      CHECK(datum.SerializeToString(&out));
+      txn->Put(format_int(i, 8), out);
+    }
+    txn->Commit();
+    db->Close();
+  }
+
+  LayerParameter Param(int num_labels, int images_per_label) {
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_source(filename_);
+    data_param->set_backend(DataParameter_DB_LMDB);
+    param.mutable_pk_sampler_param()->set_num_labels(num_labels);
+    param.mutable_pk_sampler_param()->set_images_per_label(images_per_label);
+    return param;
+  }
+
+  // Runs iters batches from a layer seeded with seed and returns their
+  // record ids, batch after batch.
+  vector<int> Read(const LayerParameter& param, int seed, int iters) {
+    Caffe::set_random_seed(seed);
+    PKDataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    vector<int> records;
+    for (int iter = 0; iter < iters; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      for (int i = 0; i < blob_top_data_->count(); ++i) {
+        records.push_back(static_cast<int>(blob_top_data_->cpu_data()[i]));
+      }
+    }
+    return records;
+  }
+
+  static const int kLabels = 5;
+  static const int kImagesPerLabel = 3;
+  static const int kSingleLabel = 9;
+  string filename_;
+  Blob<Dtype>* const blob_top_data_;
+  Blob<Dtype>* const blob_top_label_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(PKDataLayerTest, TestDtypesAndDevices);
+
+// Every batch holds num_labels distinct labels, each as images_per_label
+// distinct images in a row, and never the label with a single image.
+TYPED_TEST(PKDataLayerTest, TestBatchesByLabel) {
+  typedef typename TypeParam::Dtype Dtype;
+  const int num_labels = 3;
+  const int images_per_label = 2;
+  const int single_label = this->kSingleLabel;
+  PKDataLayer<Dtype> layer(this->Param(num_labels, images_per_label));
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(num_labels * images_per_label, this->blob_top_data_->num());
+  EXPECT_EQ(num_labels * images_per_label, this->blob_top_label_->num());
+  for (int iter = 0; iter < 20; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    const Dtype* data = this->blob_top_data_->cpu_data();
+    const Dtype* label = this->blob_top_label_->cpu_data();
+    std::set<int> labels;
+    for (int p = 0; p < num_labels; ++p) {
+      const int l = static_cast<int>(label[p * images_per_label]);
+      EXPECT_NE(single_label, l);
+      EXPECT_TRUE(labels.insert(l).second) << "label " << l << " repeats";
+      std::set<int> images;
+      for (int k = 0; k < images_per_label; ++k) {
+        const int item = p * images_per_label + k;
+        const int record = static_cast<int>(data[item]);
+        EXPECT_EQ(l, label[item]);
+        EXPECT_EQ(l, record % this->kLabels);
+        EXPECT_TRUE(images.insert(record).second)
+            << "image " << record << " repeats";
+      }
+    }
+  }
+}
+
+// With every label in each batch, the label left out is the only one
+// missing.
+TYPED_TEST(PKDataLayerTest, TestSingleImageLabelsLeftOut) {
+  typedef typename TypeParam::Dtype Dtype;
+  const int num_labels = this->kLabels;
+  const int single_label = this->kSingleLabel;
+  PKDataLayer<Dtype> layer(this->Param(num_labels, 2));
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  for (int iter = 0; iter < 5; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    std::set<int> labels;
+    for (int i = 0; i < this->blob_top_label_->count(); ++i) {
+      labels.insert(static_cast<int>(this->blob_top_label_->cpu_data()[i]));
+    }
+    EXPECT_EQ(num_labels, labels.size());
+    EXPECT_EQ(0, labels.count(single_label));
+  }
+}
+
+TYPED_TEST(PKDataLayerTest, TestReproducible) {
+  const LayerParameter param = this->Param(2, 2);
+  const vector<int> first = this->Read(param, 1701, 10);
+  EXPECT_EQ(first, this->Read(param, 1701, 10));
+  EXPECT_NE(first, this->Read(param, 1702, 10));
+}
+
+}  // namespace caffe
+#endif  // USE_LMDB
@@ -0,0 +1,175 @@
+#ifdef USE_LMDB
+#include <set>
+#include <string>
+#include <vector>
+
+#include "boost/scoped_ptr.hpp"
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/triplet_data_reader.hpp"
+#include "caffe/util/db.hpp"
+#include "caffe/util/format.hpp"
+#include "caffe/util/image_table.hpp"
+#include "caffe/util/io.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+using boost::scoped_ptr;
+
+class TripletDataReaderTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    MakeTempDir(&root_);
+    // raw images of 1 x 2 x 3 bytes, all different
+    for (int id = 0; id < kImages; ++id) {
+      images_.push_back(string());
+      for (int i = 0; i < 6; ++i) {
+        images_.back().push_back(static_cast<char>(id * 6 + i));
+      }
+    }
+    FillImageTable();
+    FillRecords();
+  }
+
+  static int ImageId(int record, int slot) {
+    return (record * 3 + slot * 2) % kImages;
+  }
+
+  void FillImageTable() {
+    scoped_ptr<db::DB> db(db::GetDB(DataParameter_DB_LMDB));
+    db->Open(root_ + "/images", db::NEW);
+    scoped_ptr<db::Transaction> txn(db->NewTransaction());
+    for (int id = 0; id < kImages; ++id) {
+      Datum image;
+      image.set_channels(1);
+      image.set_height(2);
+      image.set_width(3);
+      image.set_data(images_[id]);
+      string out;
+      CHECK(image.SerializeToString(&out));
+      txn->Put(ImageTableKey(id), out);
+    }
+    txn->Commit();
+    db->Close();
+  }
+
+  // Writes the same triplets twice: once as ids into the image table, and
+  // once with the image bytes in every record.
+  void FillRecords() {
+    scoped_ptr<db::DB> ids(db::GetDB(DataParameter_DB_LMDB));
+    ids->Open(root_ + "/ids", db::NEW);
+    scoped_ptr<db::Transaction> ids_txn(ids->NewTransaction());
+    scoped_ptr<db::DB> bytes(db::GetDB(DataParameter_DB_LMDB));
+    bytes->Open(root_ + "/bytes", db::NEW);
+    scoped_ptr<db::Transaction> bytes_txn(bytes->NewTransaction());
+    for (int r = 0; r < kRecords; ++r) {
+      TripletDatum record;
+      record.set_anchor_id(ImageId(r, 0));
+      record.set_pos_id(ImageId(r, 1));
+      record.set_neg_id(ImageId(r, 2));
+      string out;
+      CHECK(record.SerializeToString(&out));
+      ids_txn->Put(format_int(r, 8), out);
+
+      record.Clear();
+      record.set_channels(1);
+      record.set_height(2);
+      record.set_width(3);
+      record.set_data_anchor(images_[ImageId(r, 0)]);
+      record.set_data_pos(images_[ImageId(r, 1)]);
+      record.set_data_neg(images_[ImageId(r, 2)]);
+      CHECK(record.SerializeToString(&out));
+      bytes_txn->Put(format_int(r, 8), out);
+    }
+    ids_txn->Commit();
+    ids->Close();
+    bytes_txn->Commit();
+    bytes->Close();
+  }
+
+  LayerParameter Param(const string& name, const string& source,
+      const string& image_source, int reader_threads) {
+    LayerParameter param;
+    param.set_name(name);
+    param.set_phase(TRAIN);
+    TripletDataParameter* data_param = param.mutable_triplet_data_param();
+    data_param->set_source(root_ + "/" + source);
+    if (!image_source.empty()) {
+      data_param->set_image_source(root_ + "/" + image_source);
+    }
+    data_param->set_backend(TripletDataParameter_DB_LMDB);
+    data_param->set_batch_size(4);
+    data_param->set_reader_threads(reader_threads);
+    return param;
+  }
+
+  // Pops count records from a reader of param.
+  vector<TripletDatum> Read(const LayerParameter& param, int count) {
+    TripletDataReader reader(param);
+    vector<TripletDatum> records(count);
+    for (int i = 0; i < count; ++i) {
+      TripletDatum* record = reader.full().pop();
+      records[i].CopyFrom(*record);
+      reader.free().push(record);
+    }
+    return records;
+  }
+
+  void TestRoundTrip(int reader_threads) {
+    const vector<TripletDatum> ids = Read(Param("ids", "ids", "images",
+        reader_threads), 2 * kRecords);
+    const vector<TripletDatum> bytes = Read(Param("bytes", "bytes", "",
+        reader_threads), 2 * kRecords);
+    for (int i = 0; i < 2 * kRecords; ++i) {
+      EXPECT_EQ(bytes[i].channels(), ids[i].channels());
+      EXPECT_EQ(bytes[i].height(), ids[i].height());
+      EXPECT_EQ(bytes[i].width(), ids[i].width());
+      EXPECT_EQ(bytes[i].encoded(), ids[i].encoded());
+      EXPECT_EQ(bytes[i].data_anchor(), ids[i].data_anchor()) << "record " << i;
+      EXPECT_EQ(bytes[i].data_pos(), ids[i].data_pos()) << "record " << i;
+      EXPECT_EQ(bytes[i].data_neg(), ids[i].data_neg()) << "record " << i;
+    }
+  }
+
+  // more images than records, so that every record has its own anchor
+  static const int kImages = 13;
+  static const int kRecords = 12;
+  string root_;
+  vector<string> images_;
+};
+
+TEST_F(TripletDataReaderTest, TestImageTableRoundTrip) {
+  TestRoundTrip(1);
+}
+
+TEST_F(TripletDataReaderTest, TestImageTableRoundTripSharded) {
+  TestRoundTrip(3);
+}
+
+// Ranges of 2 or 3 records, handed out in turn so that every pass still
+// gives each record once, and in the same order.
+TEST_F(TripletDataReaderTest, TestShardsReadEachRecordOncePerPass) {
+  const LayerParameter param = Param("bytes", "bytes", "", 5);
+  const vector<TripletDatum> records = Read(param, 3 * kRecords);
+  const vector<TripletDatum> again = Read(param, 3 * kRecords);
+  std::set<string> anchors;
+  for (int i = 0; i < 3 * kRecords; ++i) {
+    const int pass = i / kRecords;
+    if (pass == 0) {
+      EXPECT_TRUE(anchors.insert(records[i].data_anchor()).second)
+          << "record " << i << " read twice in a pass";
+    } else {
+      EXPECT_EQ(records[i % kRecords].data_anchor(), records[i].data_anchor())
+          << "pass " << pass << " record " << i % kRecords;
+    }
+    EXPECT_EQ(records[i].data_anchor(), again[i].data_anchor());
+  }
+  EXPECT_EQ(static_cast<size_t>(kRecords), anchors.size());
+}
+
+}  // namespace caffe
+#endif  // USE_LMDB
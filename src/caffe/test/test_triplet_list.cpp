@@ -0,0 +1,71 @@
+#include <fstream>  // NOLINT(readability/streams)
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/thread_pool.hpp"
+#include "caffe/util/triplet_list.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class TripletListTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    MakeTempDir(&dir_);
+    dir_ += "/";
+    source_ = dir_ + "list.txt";
+    std::ofstream list(source_.c_str());
+    list << "a.jpg b.jpg c.jpg\n"
+         << "\n"
+         << "a.jpg  d.png\tc.jpg\r\n"
+         << "only two.jpg\n"
+         << "b.jpg c.jpg junk.jpg";
+  }
+
+  string Path(const TripletList& list, int i, int k) {
+    return list.path(list.triplet(i).id[k]);
+  }
+
+  string dir_;
+  string source_;
+};
+
+TEST_F(TripletListTest, TestLoad) {
+  for (int num_threads = 1; num_threads <= 3; ++num_threads) {
+    ThreadPool pool(num_threads);
+    TripletList list;
+    list.Load(source_, &pool);
+    ASSERT_EQ(list.size(), 3);
+    EXPECT_EQ(list.num_paths(), 5);
+    EXPECT_EQ(Path(list, 0, 0), "a.jpg");
+    EXPECT_EQ(Path(list, 0, 1), "b.jpg");
+    EXPECT_EQ(Path(list, 0, 2), "c.jpg");
+    EXPECT_EQ(Path(list, 1, 1), "d.png");
+    EXPECT_EQ(Path(list, 2, 2), "junk.jpg");
+    // Each distinct path has one id.
+    EXPECT_EQ(list.triplet(0).id[0], list.triplet(1).id[0]);
+    EXPECT_EQ(list.triplet(0).id[2], list.triplet(2).id[1]);
+  }
+}
+
+TEST_F(TripletListTest, TestValidate) {
+  const char jpeg[] = "\xFF\xD8\xFF\xE0";
+  const char png[] = "\x89PNG\r\n\x1A\n";
+  std::ofstream(string(dir_ + "a.jpg").c_str()) << jpeg;
+  std::ofstream(string(dir_ + "b.jpg").c_str()) << jpeg;
+  std::ofstream(string(dir_ + "c.jpg").c_str()) << jpeg;
+  std::ofstream(string(dir_ + "d.png").c_str()) << png;
+  std::ofstream(string(dir_ + "junk.jpg").c_str()) << "<html>";
+  ThreadPool pool(2);
+  TripletList list;
+  list.Load(source_, &pool);
+  EXPECT_EQ(list.Validate(dir_, &pool), 1);
+  ASSERT_EQ(list.size(), 2);
+  EXPECT_EQ(Path(list, 1, 1), "d.png");
+}
+
+}  // namespace caffe
@@ -15,9 +15,7 @@ using boost::weak_ptr;
 map<const string, weak_ptr<TripletDataReader::Body> > TripletDataReader::bodies_;
 static boost::mutex bodies_mutex_;
 
-TripletDataReader::TripletDataReader(const LayerParameter& param)
-    : queue_pair_(new QueuePair(  //
-        param.triplet_data_param().prefetch() * param.triplet_data_param().batch_size())) {
+TripletDataReader::TripletDataReader(const LayerParameter& param) {
   // Get or create a body
   boost::mutex::scoped_lock lock(bodies_mutex_);
   string key = source_key(param);
@@ -27,6 +25,9 @@ TripletDataReader::TripletDataReader(const LayerParameter& param)
     body_.reset(new Body(param));
     bodies_[key] = weak_ptr<Body>(body_);
   }
+  queue_pair_.reset(new QueuePair(
+      param.triplet_data_param().prefetch() * param.triplet_data_param().batch_size(),
+      body_->arena_));
   body_->new_queue_pairs_.push(queue_pair_);
 }
 
@@ -41,27 +42,51 @@ TripletDataReader::~TripletDataReader() {
 
 //
 
-TripletDataReader::QueuePair::QueuePair(int size) {
+TripletDataReader::QueuePair::QueuePair(int size,
+    const shared_ptr<RecordArena>& arena) : arena_(arena) {
   // Initialize the free queue with requested number of datums
   for (int i = 0; i < size; ++i) {
-    free_.push(new TripletDatum());
+    free_.push(arena_->Create<TripletDatum>());
   }
 }
 
 TripletDataReader::QueuePair::~QueuePair() {
   TripletDatum* triplet_datum;
   while (free_.try_pop(&triplet_datum)) {
-    delete triplet_datum;
+    RecordArena::Release(triplet_datum);
   }
   while (full_.try_pop(&triplet_datum)) {
-    delete triplet_datum;
+    RecordArena::Release(triplet_datum);
   }
 }
 
+// Fills in the images of a record that refers to them by image table id.
+static void FetchImages(db::Cursor* images, TripletDatum* triplet_datum) {
+  if (!images) {
+    return;
+  }
+  Datum anchor, image;
+  ReadImageFromTable(images, triplet_datum->anchor_id(), &anchor);
+  triplet_datum->mutable_data_anchor()->swap(*anchor.mutable_data());
+  ReadImageFromTable(images, triplet_datum->pos_id(), &image);
+  CheckImageShape(image, anchor);
+  triplet_datum->mutable_data_pos()->swap(*image.mutable_data());
+  ReadImageFromTable(images, triplet_datum->neg_id(), &image);
+  CheckImageShape(image, anchor);
+  triplet_datum->mutable_data_neg()->swap(*image.mutable_data());
+  triplet_datum->set_channels(anchor.channels());
+  triplet_datum->set_height(anchor.height());
+  triplet_datum->set_width(anchor.width());
+  triplet_datum->set_encoded(anchor.encoded());
+}
+
 //
 
 TripletDataReader::Body::Body(const LayerParameter& param)
     : param_(param),
+      arena_(new RecordArena()),
+      next_shard_(0),
+      pass_left_(0),
       new_queue_pairs_() {
   StartInternalThread();
 }
@@ -74,6 +99,17 @@ void TripletDataReader::Body::InternalThreadEntry() {
   shared_ptr<db::DB> db(db::GetDB(param_.triplet_data_param().backend()));
   db->Open(param_.triplet_data_param().source(), db::READ);
   shared_ptr<db::Cursor> cursor(db->NewCursor());
+  // Made here so that it draws from the random stream of this thread.
+  if (param_.phase() == TRAIN && !param_.hard_mining_param().table().empty()) {
+    sampler_.reset(new HardnessSampler(param_.hard_mining_param()));
+  }
+  shared_ptr<db::DB> image_db;
+  if (!param_.triplet_data_param().image_source().empty()) {
+    image_db.reset(db::GetDB(param_.triplet_data_param().backend()));
+    image_db->Open(param_.triplet_data_param().image_source(), db::READ);
+    image_cursor_.reset(image_db->NewCursor());
+  }
+  StartShards(db.get(), cursor.get(), image_db.get());
   vector<shared_ptr<QueuePair> > qps;
   try {
     int solver_count = param_.phase() == TRAIN ? Caffe::solver_count() : 1;
@@ -86,11 +122,27 @@ void TripletDataReader::Body::InternalThreadEntry() {
       read_one(cursor.get(), qp.get());
       qps.push_back(qp);
     }
+    // Log the queue waits about every report_interval batches.
+    const uint64_t report_records =
+        static_cast<uint64_t>(param_.prefetch_param().report_interval())
+        * param_.triplet_data_param().batch_size();
+    uint64_t records = 0;
     // Main loop
     while (!must_stop()) {
       for (int i = 0; i < solver_count; ++i) {
         read_one(cursor.get(), qps[i].get());
       }
+      if (report_records > 0 && ++records % report_records == 0) {
+        for (int i = 0; i < solver_count; ++i) {
+          LOG(INFO) << "Reader of " << param_.name() << " queue " << i
+              << ": layer waited " << qps[i]->full_.num_waits() << " / "
+              << qps[i]->full_.num_pops() << " times, "
+              << qps[i]->full_.wait_seconds() << " s; reader waited "
+              << qps[i]->free_.num_waits() << " / "
+              << qps[i]->free_.num_pops() << " times, "
+              << qps[i]->free_.wait_seconds() << " s";
+        }
+      }
       // Check no additional readers have been created. This can happen if
       // more than one net is trained at a time per process, whether single
       // or multi solver. It might also happen if two data layers have same
@@ -100,12 +152,76 @@ void TripletDataReader::Body::InternalThreadEntry() {
   } catch (boost::thread_interrupted&) {
     // Interrupted exception is expected on shutdown
   }
+  // The cursors must go before their DBs. A stop request that ended the loop
+  // through must_stop() is still pending, and would cut the joins of the
+  // shards short, leaving them running on freed queues.
+  boost::this_thread::disable_interruption no_interruption;
+  shards_.clear();
+  image_cursor_.reset();
+}
+
+void TripletDataReader::Body::StartShards(db::DB* db, db::Cursor* cursor,
+    db::DB* image_db) {
+  const int reader_threads = param_.triplet_data_param().reader_threads();
+  if (reader_threads <= 1) {
+    return;
+  }
+  if (sampler_) {
+    LOG(WARNING) << "reader_threads is ignored with hard_mining_param.table";
+    return;
+  }
+  vector<string> starts;
+  const int64_t count = db::ShardKeyRanges(cursor, reader_threads, &starts);
+  for (int i = 0; i < reader_threads; ++i) {
+    shard_records_.push_back((i + 1) * count / reader_threads
+        - i * count / reader_threads);
+    // Cursors are made here, one at a time, and then only used by a shard.
+    shards_.push_back(shared_ptr<Shard>(new Shard(db->NewCursor(),
+        image_db ? image_db->NewCursor() : NULL, starts[i],
+        i + 1 < reader_threads ? starts[i + 1] : string(),
+        param_.triplet_data_param().batch_size(), arena_)));
+  }
+  LOG(INFO) << "Reading " << param_.triplet_data_param().source() << " with "
+      << reader_threads << " threads";
 }
 
 void TripletDataReader::Body::read_one(db::Cursor* cursor, QueuePair* qp) {
   TripletDatum* triplet_datum = qp->free_.pop();
-  // TODO deserialize in-place instead of copy?
-  triplet_datum->ParseFromString(cursor->value());
+  if (!shards_.empty()) {
+    // Each shard gives as many records per pass as its range holds, so that
+    // every pass has each record once, in the same order.
+    if (pass_left_ == 0) {
+      shard_left_ = shard_records_;
+      for (int i = 0; i < shard_records_.size(); ++i) {
+        pass_left_ += shard_records_[i];
+      }
+      next_shard_ = 0;
+    }
+    while (shard_left_[next_shard_] == 0) {
+      next_shard_ = (next_shard_ + 1) % shards_.size();
+    }
+    --shard_left_[next_shard_];
+    --pass_left_;
+    // Swap the next parsed record in, giving the shard back an empty one.
+    QueuePair* shard = &shards_[next_shard_]->qp_;
+    next_shard_ = (next_shard_ + 1) % shards_.size();
+    TripletDatum* parsed = shard->full_.pop();
+    triplet_datum->Swap(parsed);
+    shard->free_.push(parsed);
+    qp->full_.push(triplet_datum);
+    return;
+  }
+  if (sampler_) {
+    string key, value;
+    sampler_->Next(cursor, &key, &value);
+    triplet_datum->ParseFromString(value);
+    triplet_datum->set_key(key);
+    FetchImages(image_cursor_.get(), triplet_datum);
+    qp->full_.push(triplet_datum);
+    return;
+  }
+  db::ParseValue(cursor, triplet_datum);
+  FetchImages(image_cursor_.get(), triplet_datum);
   qp->full_.push( triplet_datum );
 
   // go to the next iter
@@ -116,4 +232,36 @@ void TripletDataReader::Body::read_one(db::Cursor* cursor, QueuePair* qp) {
   }
 }
 
+//
+
+TripletDataReader::Shard::Shard(db::Cursor* cursor, db::Cursor* image_cursor,
+    const string& begin, const string& end, int size,
+    const shared_ptr<RecordArena>& arena)
+    : qp_(size, arena), cursor_(cursor), image_cursor_(image_cursor),
+      begin_(begin), end_(end) {
+  StartInternalThread();
+}
+
+TripletDataReader::Shard::~Shard() {
+  StopInternalThread();
+}
+
+void TripletDataReader::Shard::InternalThreadEntry() {
+  try {
+    cursor_->Seek(begin_);
+    while (!must_stop()) {
+      TripletDatum* triplet_datum = qp_.free_.pop();
+      db::ParseValue(cursor_.get(), triplet_datum);
+      FetchImages(image_cursor_.get(), triplet_datum);
+      qp_.full_.push(triplet_datum);
+      cursor_->Next();
+      if (!cursor_->valid() || (!end_.empty() && cursor_->key() >= end_)) {
+        cursor_->Seek(begin_);
+      }
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+}
+
 }  // namespace caffe
@@ -15,9 +15,7 @@ using boost::weak_ptr;
 map<const string, weak_ptr<TripletMultipleDataReader::Body> > TripletMultipleDataReader::bodies_;
 static boost::mutex bodies_mutex_;
 
-TripletMultipleDataReader::TripletMultipleDataReader(const LayerParameter& param)
-    : queue_pair_(new QueuePair(  //
-        param.triplet_multiple_data_param().prefetch() * param.triplet_multiple_data_param().batch_size())) {
+TripletMultipleDataReader::TripletMultipleDataReader(const LayerParameter& param) {
   // Get or create a body
   boost::mutex::scoped_lock lock(bodies_mutex_);
   string key = source_key(param);
@@ -27,6 +25,9 @@ TripletMultipleDataReader::TripletMultipleDataReader(const LayerParameter& param
     body_.reset(new Body(param));
     bodies_[key] = weak_ptr<Body>(body_);
   }
+  queue_pair_.reset(new QueuePair(
+      param.triplet_multiple_data_param().prefetch() * param.triplet_multiple_data_param().batch_size(),
+      body_->arena_));
   body_->new_queue_pairs_.push(queue_pair_);
 }
 
@@ -41,27 +42,74 @@ TripletMultipleDataReader::~TripletMultipleDataReader() {
 
 //
 
-TripletMultipleDataReader::QueuePair::QueuePair(int size) {
+TripletMultipleDataReader::QueuePair::QueuePair(int size,
+    const shared_ptr<RecordArena>& arena) : arena_(arena) {
   // Initialize the free queue with requested number of datums
   for (int i = 0; i < size; ++i) {
-    free_.push(new TripletMultipleDatum());
+    free_.push(arena_->Create<TripletMultipleDatum>());
   }
 }
 
 TripletMultipleDataReader::QueuePair::~QueuePair() {
   TripletMultipleDatum* triplet_datum;
   while (free_.try_pop(&triplet_datum)) {
-    delete triplet_datum;
+    RecordArena::Release(triplet_datum);
   }
   while (full_.try_pop(&triplet_datum)) {
-    delete triplet_datum;
+    RecordArena::Release(triplet_datum);
   }
 }
 
+// Reads the images ids into data, CHECKing that they have the shape of
+// first. Unless has_first is set, first takes the shape of the first image.
+static void FetchImageList(db::Cursor* images,
+    const google::protobuf::RepeatedField<int>& ids,
+    google::protobuf::RepeatedPtrField<string>* data, Datum* first,
+    bool* has_first) {
+  Datum image;
+  data->Clear();
+  for (int i = 0; i < ids.size(); ++i) {
+    ReadImageFromTable(images, ids.Get(i), &image);
+    if (*has_first) {
+      CheckImageShape(image, *first);
+    } else {
+      first->set_channels(image.channels());
+      first->set_height(image.height());
+      first->set_width(image.width());
+      first->set_encoded(image.encoded());
+      *has_first = true;
+    }
+    data->Add()->swap(*image.mutable_data());
+  }
+}
+
+// Fills in the images of a record that refers to them by image table id.
+static void FetchImages(db::Cursor* images,
+    TripletMultipleDatum* triplet_datum) {
+  if (!images) {
+    return;
+  }
+  Datum first;
+  bool has_first = false;
+  FetchImageList(images, triplet_datum->anchor_id(),
+      triplet_datum->mutable_data_anchor(), &first, &has_first);
+  FetchImageList(images, triplet_datum->pos_id(),
+      triplet_datum->mutable_data_pos(), &first, &has_first);
+  FetchImageList(images, triplet_datum->neg_id(),
+      triplet_datum->mutable_data_neg(), &first, &has_first);
+  triplet_datum->set_channels(first.channels());
+  triplet_datum->set_height(first.height());
+  triplet_datum->set_width(first.width());
+  triplet_datum->set_encoded(first.encoded());
+}
+
 //
 
 TripletMultipleDataReader::Body::Body(const LayerParameter& param)
     : param_(param),
+      arena_(new RecordArena()),
+      next_shard_(0),
+      pass_left_(0),
       new_queue_pairs_() {
   StartInternalThread();
 }
@@ -74,6 +122,17 @@ void TripletMultipleDataReader::Body::InternalThreadEntry() {
   shared_ptr<db::DB> db(db::GetDB(param_.triplet_multiple_data_param().backend()));
   db->Open(param_.triplet_multiple_data_param().source(), db::READ);
   shared_ptr<db::Cursor> cursor(db->NewCursor());
+  // Made here so that it draws from the random stream of this thread.
+  if (param_.phase() == TRAIN && !param_.hard_mining_param().table().empty()) {
+    sampler_.reset(new HardnessSampler(param_.hard_mining_param()));
+  }
+  shared_ptr<db::DB> image_db;
+  if (!param_.triplet_multiple_data_param().image_source().empty()) {
+    image_db.reset(db::GetDB(param_.triplet_multiple_data_param().backend()));
+    image_db->Open(param_.triplet_multiple_data_param().image_source(), db::READ);
+    image_cursor_.reset(image_db->NewCursor());
+  }
+  StartShards(db.get(), cursor.get(), image_db.get());
   vector<shared_ptr<QueuePair> > qps;
   try {
     int solver_count = param_.phase() == TRAIN ? Caffe::solver_count() : 1;
@@ -86,11 +145,27 @@ void TripletMultipleDataReader::Body::InternalThreadEntry() {
       read_one(cursor.get(), qp.get());
       qps.push_back(qp);
     }
+    // Log the queue waits about every report_interval batches.
+    const uint64_t report_records =
+        static_cast<uint64_t>(param_.prefetch_param().report_interval())
+        * param_.triplet_multiple_data_param().batch_size();
+    uint64_t records = 0;
     // Main loop
     while (!must_stop()) {
       for (int i = 0; i < solver_count; ++i) {
         read_one(cursor.get(), qps[i].get());
       }
+      if (report_records > 0 && ++records % report_records == 0) {
+        for (int i = 0; i < solver_count; ++i) {
+          LOG(INFO) << "Reader of " << param_.name() << " queue " << i
+              << ": layer waited " << qps[i]->full_.num_waits() << " / "
+              << qps[i]->full_.num_pops() << " times, "
+              << qps[i]->full_.wait_seconds() << " s; reader waited "
+              << qps[i]->free_.num_waits() << " / "
+              << qps[i]->free_.num_pops() << " times, "
+              << qps[i]->free_.wait_seconds() << " s";
+        }
+      }
       // Check no additional readers have been created. This can happen if
       // more than one net is trained at a time per process, whether single
       // or multi solver. It might also happen if two data layers have same
@@ -100,12 +175,76 @@ void TripletMultipleDataReader::Body::InternalThreadEntry() {
   } catch (boost::thread_interrupted&) {
     // Interrupted exception is expected on shutdown
   }
+  // The cursors must go before their DBs. A stop request that ended the loop
+  // through must_stop() is still pending, and would cut the joins of the
+  // shards short, leaving them running on freed queues.
+  boost::this_thread::disable_interruption no_interruption;
+  shards_.clear();
+  image_cursor_.reset();
+}
+
+void TripletMultipleDataReader::Body::StartShards(db::DB* db, db::Cursor* cursor,
+    db::DB* image_db) {
+  const int reader_threads = param_.triplet_multiple_data_param().reader_threads();
+  if (reader_threads <= 1) {
+    return;
+  }
+  if (sampler_) {
+    LOG(WARNING) << "reader_threads is ignored with hard_mining_param.table";
+    return;
+  }
+  vector<string> starts;
+  const int64_t count = db::ShardKeyRanges(cursor, reader_threads, &starts);
+  for (int i = 0; i < reader_threads; ++i) {
+    shard_records_.push_back((i + 1) * count / reader_threads
+        - i * count / reader_threads);
+    // Cursors are made here, one at a time, and then only used by a shard.
+    shards_.push_back(shared_ptr<Shard>(new Shard(db->NewCursor(),
+        image_db ? image_db->NewCursor() : NULL, starts[i],
+        i + 1 < reader_threads ? starts[i + 1] : string(),
+        param_.triplet_multiple_data_param().batch_size(), arena_)));
+  }
+  LOG(INFO) << "Reading " << param_.triplet_multiple_data_param().source() << " with "
+      << reader_threads << " threads";
 }
 
 void TripletMultipleDataReader::Body::read_one(db::Cursor* cursor, QueuePair* qp) {
   TripletMultipleDatum* triplet_datum = qp->free_.pop();
-  // TODO deserialize in-place instead of copy?
-  triplet_datum->ParseFromString(cursor->value());
+  if (!shards_.empty()) {
+    // Each shard gives as many records per pass as its range holds, so that
+    // every pass has each record once, in the same order.
+    if (pass_left_ == 0) {
+      shard_left_ = shard_records_;
+      for (int i = 0; i < shard_records_.size(); ++i) {
+        pass_left_ += shard_records_[i];
+      }
+      next_shard_ = 0;
+    }
+    while (shard_left_[next_shard_] == 0) {
+      next_shard_ = (next_shard_ + 1) % shards_.size();
+    }
+    --shard_left_[next_shard_];
+    --pass_left_;
+    // Swap the next parsed record in, giving the shard back an empty one.
+    QueuePair* shard = &shards_[next_shard_]->qp_;
+    next_shard_ = (next_shard_ + 1) % shards_.size();
+    TripletMultipleDatum* parsed = shard->full_.pop();
+    triplet_datum->Swap(parsed);
+    shard->free_.push(parsed);
+    qp->full_.push(triplet_datum);
+    return;
+  }
+  if (sampler_) {
+    string key, value;
+    sampler_->Next(cursor, &key, &value);
+    triplet_datum->ParseFromString(value);
+    triplet_datum->set_key(key);
+    FetchImages(image_cursor_.get(), triplet_datum);
+    qp->full_.push(triplet_datum);
+    return;
+  }
+  db::ParseValue(cursor, triplet_datum);
+  FetchImages(image_cursor_.get(), triplet_datum);
   qp->full_.push( triplet_datum );
 
   // go to the next iter
@@ -116,4 +255,36 @@ void TripletMultipleDataReader::Body::read_one(db::Cursor* cursor, QueuePair* qp
   }
 }
 
+//
+
+TripletMultipleDataReader::Shard::Shard(db::Cursor* cursor, db::Cursor* image_cursor,
+    const string& begin, const string& end, int size,
+    const shared_ptr<RecordArena>& arena)
+    : qp_(size, arena), cursor_(cursor), image_cursor_(image_cursor),
+      begin_(begin), end_(end) {
+  StartInternalThread();
+}
+
+TripletMultipleDataReader::Shard::~Shard() {
+  StopInternalThread();
+}
+
+void TripletMultipleDataReader::Shard::InternalThreadEntry() {
+  try {
+    cursor_->Seek(begin_);
+    while (!must_stop()) {
+      TripletMultipleDatum* triplet_datum = qp_.free_.pop();
+      db::ParseValue(cursor_.get(), triplet_datum);
+      FetchImages(image_cursor_.get(), triplet_datum);
+      qp_.full_.push(triplet_datum);
+      cursor_->Next();
+      if (!cursor_->valid() || (!end_.empty() && cursor_->key() >= end_)) {
+        cursor_->Seek(begin_);
+      }
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+}
+
 }  // namespace caffe
@@ -3,6 +3,7 @@
 #include "caffe/util/db_lmdb.hpp"
 
 #include <string>
+#include <vector>
 
 namespace caffe { namespace db {
 
@@ -70,5 +71,26 @@ DB* GetDB(const string& backend) {
   return NULL;
 }
 
+int64_t ShardKeyRanges(Cursor* cursor, int shards, vector<string>* starts) {
+  CHECK_GT(shards, 0);
+  int64_t count = cursor->num_records();
+  if (count < 0) {
+    count = 0;
+    for (cursor->SeekToFirst(); cursor->valid(); cursor->Next()) {
+      ++count;
+    }
+  }
+  CHECK_GE(count, shards) << "Fewer records than reader threads";
+  starts->clear();
+  int64_t index = 0;
+  for (cursor->SeekToFirst(); starts->size() < shards; cursor->Next()) {
+    if (index++ == starts->size() * count / shards) {
+      starts->push_back(cursor->key());
+    }
+  }
+  cursor->SeekToFirst();
+  return count;
+}
+
 }  // namespace db
 }  // namespace caffe
@@ -48,6 +48,28 @@ LMDBTransaction* LMDB::NewTransaction() {
   return new LMDBTransaction(mdb_env_);
 }
 
+void LMDB::Reserve(size_t num_records, size_t record_bytes) {
+  MDB_stat stat;
+  MDB_CHECK(mdb_env_stat(mdb_env_, &stat));
+  const size_t page_size = stat.ms_psize;
+  size_t bytes_per_record;
+  if (record_bytes < page_size / 4) {
+    // Small records share leaf pages, which are at least half full.
+    bytes_per_record = record_bytes * 2;
+  } else {
+    // Larger ones take whole overflow pages.
+    bytes_per_record = (record_bytes / page_size + 1) * page_size;
+  }
+  // Leave a quarter on top for the branch pages and a low estimate.
+  const size_t map_size = num_records * bytes_per_record / 4 * 5;
+  struct MDB_envinfo current_info;
+  MDB_CHECK(mdb_env_info(mdb_env_, &current_info));
+  if (map_size > current_info.me_mapsize) {
+    LOG(INFO) << "Setting LMDB map size to " << (map_size >> 20) << "MB";
+    MDB_CHECK(mdb_env_set_mapsize(mdb_env_, map_size));
+  }
+}
+
 void LMDBTransaction::Put(const string& key, const string& value) {
   keys.push_back(key);
   values.push_back(value);
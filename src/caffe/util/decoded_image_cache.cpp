@@ -0,0 +1,94 @@
+#ifdef USE_OPENCV
+#include <boost/thread.hpp>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "caffe/util/decoded_image_cache.hpp"
+
+namespace caffe {
+
+using boost::weak_ptr;
+
+class DecodedImageCache::sync {
+ public:
+  mutable boost::mutex mutex_;
+};
+
+static map<const string, weak_ptr<DecodedImageCache> > caches_;
+static boost::mutex caches_mutex_;
+
+shared_ptr<DecodedImageCache> DecodedImageCache::Get(const string& name,
+    size_t capacity) {
+  boost::mutex::scoped_lock lock(caches_mutex_);
+  weak_ptr<DecodedImageCache>& weak = caches_[name];
+  shared_ptr<DecodedImageCache> cache = weak.lock();
+  if (!cache) {
+    cache.reset(new DecodedImageCache(capacity));
+    weak = cache;
+  } else if (cache->capacity_ != capacity) {
+    LOG(WARNING) << "Image cache " << name << " already has "
+        << (cache->capacity_ >> 20) << " MB";
+  }
+  return cache;
+}
+
+DecodedImageCache::DecodedImageCache(size_t capacity)
+    : sync_(new sync()), capacity_(capacity), size_(0), hits_(0),
+      misses_(0) {
+}
+
+static size_t image_bytes(const cv::Mat& image) {
+  return image.total() * image.elemSize();
+}
+
+bool DecodedImageCache::Lookup(const string& key, cv::Mat* image) {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  map<string, LRUList::iterator>::iterator it = index_.find(key);
+  if (it == index_.end()) {
+    ++misses_;
+    return false;
+  }
+  ++hits_;
+  lru_.splice(lru_.begin(), lru_, it->second);
+  *image = it->second->second;
+  return true;
+}
+
+void DecodedImageCache::Insert(const string& key, const cv::Mat& image) {
+  const size_t bytes = image_bytes(image);
+  if (!image.data || bytes > capacity_) {
+    return;
+  }
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  // Another thread may have decoded the same image meanwhile.
+  if (index_.count(key)) {
+    return;
+  }
+  while (size_ + bytes > capacity_) {
+    size_ -= image_bytes(lru_.back().second);
+    index_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+  lru_.push_front(std::make_pair(key, image));
+  index_[key] = lru_.begin();
+  size_ += bytes;
+}
+
+uint64_t DecodedImageCache::hits() const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return hits_;
+}
+
+uint64_t DecodedImageCache::misses() const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return misses_;
+}
+
+size_t DecodedImageCache::size() const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return size_;
+}
+
+}  // namespace caffe
+#endif  // USE_OPENCV
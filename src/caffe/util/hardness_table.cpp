@@ -0,0 +1,138 @@
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "caffe/util/hardness_table.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+using boost::weak_ptr;
+
+class HardnessTable::sync {
+ public:
+  boost::mutex mutex_;
+};
+
+static map<const string, weak_ptr<HardnessTable> > tables_;
+static boost::mutex tables_mutex_;
+
+shared_ptr<HardnessTable> HardnessTable::Get(const string& name) {
+  boost::mutex::scoped_lock lock(tables_mutex_);
+  weak_ptr<HardnessTable>& weak = tables_[name];
+  shared_ptr<HardnessTable> table = weak.lock();
+  if (!table) {
+    table.reset(new HardnessTable());
+    weak = table;
+  }
+  return table;
+}
+
+HardnessTable::HardnessTable()
+    : sync_(new sync()), total_(0) {
+}
+
+void HardnessTable::SetBatchKeys(const vector<string>& keys) {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  batch_keys_ = keys;
+}
+
+template <typename Dtype>
+void HardnessTable::Update(int count, const Dtype* loss, float momentum) {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  const int num = batch_keys_.size();
+  if (num == 0) {
+    return;
+  }
+  CHECK_EQ(count % num, 0)
+      << "The loss does not split evenly over the " << num << " records.";
+  const int per_record = count / num;
+  for (int r = 0; r < num; ++r) {
+    float record_loss = 0;
+    for (int i = r * per_record; i < (r + 1) * per_record; ++i) {
+      record_loss += loss[i];
+    }
+    record_loss /= per_record;
+    std::pair<map<string, float>::iterator, bool> entry =
+        hardness_.insert(std::make_pair(batch_keys_[r], record_loss));
+    if (!entry.second) {
+      float& hardness = entry.first->second;
+      total_ -= hardness;
+      hardness = momentum * hardness + (1 - momentum) * record_loss;
+    }
+    total_ += entry.first->second;
+  }
+}
+
+template void HardnessTable::Update<float>(int count, const float* loss,
+    float momentum);
+template void HardnessTable::Update<double>(int count, const double* loss,
+    float momentum);
+
+float HardnessTable::SampleRate(const string& key, float min_rate,
+    float max_rate) {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  map<string, float>::const_iterator it = hardness_.find(key);
+  if (it == hardness_.end()) {
+    return 1;
+  }
+  // rounding can leave total_ a bit below zero once everything is easy
+  float mean = std::max(total_, 0.) / hardness_.size();
+  float rate = mean > 0 ? it->second / mean : min_rate;
+  return std::min(max_rate, std::max(min_rate, rate));
+}
+
+int HardnessTable::size() {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return hardness_.size();
+}
+
+//
+
+HardnessSampler::HardnessSampler(const HardMiningParameter& param)
+    : param_(param),
+      table_(HardnessTable::Get(param.table())),
+      repeat_turn_(false) {
+  CHECK_GT(param_.min_rate(), 0) << "min_rate must be positive so that "
+      "every pass over the DB emits records.";
+  CHECK_GE(param_.max_rate(), 1);
+}
+
+void HardnessSampler::Next(db::Cursor* cursor, string* key, string* value) {
+  repeat_turn_ = !repeat_turn_;
+  if (repeat_turn_ && !repeats_.empty()) {
+    key->swap(repeats_.front().first);
+    value->swap(repeats_.front().second);
+    repeats_.pop_front();
+    return;
+  }
+  while (true) {
+    float rate = table_->SampleRate(cursor->key(), param_.min_rate(),
+        param_.max_rate());
+    float u;
+    caffe_rng_uniform<float>(1, 0, 1, &u);
+    bool emit = rate >= 1 || u < rate;
+    if (emit) {
+      *key = cursor->key();
+      *value = cursor->value();
+      for (int r = 1; r < std::floor(rate + u) &&
+           repeats_.size() < param_.max_repeats(); ++r) {
+        repeats_.push_back(std::make_pair(*key, *value));
+      }
+    }
+    cursor->Next();
+    if (!cursor->valid()) {
+      DLOG(INFO) << "Restarting data prefetching from start.";
+      cursor->SeekToFirst();
+    }
+    if (emit) {
+      return;
+    }
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,73 @@
+#include <map>
+#include <string>
+
+#include "caffe/util/format.hpp"
+#include "caffe/util/image_table.hpp"
+#include "caffe/util/io.hpp"
+
+namespace caffe {
+
+string ImageTableKey(int id) {
+  return format_int(id, 8);
+}
+
+void ReadImageFromTable(db::Cursor* cursor, int id, Datum* image) {
+  const string key = ImageTableKey(id);
+  cursor->Seek(key);
+  CHECK(cursor->valid() && cursor->key() == key)
+      << "Image " << id << " is not in the image table";
+  db::ParseValue(cursor, image);
+}
+
+void CheckImageShape(const Datum& image, const Datum& first) {
+  if (image.encoded()) {
+    return;
+  }
+  CHECK(image.channels() == first.channels() &&
+      image.height() == first.height() && image.width() == first.width())
+      << "The images of a record differ in shape: " << image.channels()
+      << " x " << image.height() << " x " << image.width() << " vs "
+      << first.channels() << " x " << first.height() << " x "
+      << first.width();
+}
+
+#ifdef USE_OPENCV
+ImageTableWriter::ImageTableWriter(const string& backend,
+    const string& source, int height, int width, bool is_color)
+    : db_(db::GetDB(backend)), height_(height), width_(width),
+      is_color_(is_color), num_images_(0) {
+  db_->Open(source, db::NEW);
+  txn_.reset(db_->NewTransaction());
+}
+
+ImageTableWriter::~ImageTableWriter() {
+  txn_->Commit();
+  LOG(INFO) << "Wrote " << num_images_ << " images to the image table.";
+}
+
+int ImageTableWriter::Id(const string& filename, const string& encoding) {
+  map<string, int>::const_iterator it = ids_.find(filename);
+  if (it != ids_.end()) {
+    return it->second;
+  }
+  // Failures are remembered as -1 so the file is only tried once.
+  int& id = ids_[filename];
+  Datum image;
+  if (!ReadImageToDatum(filename, 0, height_, width_, is_color_, encoding,
+      &image)) {
+    id = -1;
+    return id;
+  }
+  id = num_images_++;
+  string out;
+  CHECK(image.SerializeToString(&out));
+  txn_->Put(ImageTableKey(id), out);
+  if (num_images_ % 1000 == 0) {
+    txn_->Commit();
+    txn_.reset(db_->NewTransaction());
+  }
+  return id;
+}
+#endif  // USE_OPENCV
+
+}  // namespace caffe
@@ -70,11 +70,86 @@ void WriteProtoToBinaryFile(const Message& proto, const char* filename) {
 }
 
 #ifdef USE_OPENCV
+// Reads the height and width of a JPEG from its start of frame marker,
+// seeking over the other segments so that only the marker headers are read.
+static bool ReadJPEGSize(std::istream* file, int* height, int* width) {
+  unsigned char p[5];
+  if (!file->read(reinterpret_cast<char*>(p), 2) ||
+      p[0] != 0xFF || p[1] != 0xD8) {
+    return false;
+  }
+  while (file->read(reinterpret_cast<char*>(p), 2)) {
+    if (p[0] != 0xFF) {
+      return false;
+    }
+    unsigned char marker = p[1];
+    while (marker == 0xFF) {  // fill bytes
+      if (!file->read(reinterpret_cast<char*>(&marker), 1)) {
+        return false;
+      }
+    }
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+      continue;  // markers without a length
+    }
+    if (marker == 0xD9 || marker == 0xDA) {
+      return false;  // no frame before the image data
+    }
+    if (!file->read(reinterpret_cast<char*>(p), 2)) {
+      return false;
+    }
+    const int length = (p[0] << 8) | p[1];
+    // SOF0 to SOF15, but DHT, JPG and DAC share the range.
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+        marker != 0xC8 && marker != 0xCC) {
+      if (!file->read(reinterpret_cast<char*>(p), 5)) {
+        return false;
+      }
+      *height = (p[1] << 8) | p[2];
+      *width = (p[3] << 8) | p[4];
+      return *height > 0 && *width > 0;
+    }
+    if (length < 2 || !file->seekg(length - 2, std::ios::cur)) {
+      return false;
+    }
+  }
+  return false;
+}
+
+int ImageReadFlagForSize(const string& filename, const int height,
+    const int width, const bool is_color) {
+  const int cv_read_flag = (is_color ? CV_LOAD_IMAGE_COLOR :
+    CV_LOAD_IMAGE_GRAYSCALE);
+#if CV_MAJOR_VERSION > 3 || (CV_MAJOR_VERSION == 3 && CV_MINOR_VERSION >= 1)
+  std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+  int img_height, img_width;
+  if (!file || !ReadJPEGSize(&file, &img_height, &img_width)) {
+    return cv_read_flag;
+  }
+  // libjpeg rounds the scaled size up, so length / scale >= min_length.
+  const int min_length = std::max(height, width);
+  const int length = std::max(img_height, img_width);
+  if (length >= 8 * min_length) {
+    return is_color ? cv::IMREAD_REDUCED_COLOR_8 :
+        cv::IMREAD_REDUCED_GRAYSCALE_8;
+  } else if (length >= 4 * min_length) {
+    return is_color ? cv::IMREAD_REDUCED_COLOR_4 :
+        cv::IMREAD_REDUCED_GRAYSCALE_4;
+  } else if (length >= 2 * min_length) {
+    return is_color ? cv::IMREAD_REDUCED_COLOR_2 :
+        cv::IMREAD_REDUCED_GRAYSCALE_2;
+  }
+#endif
+  return cv_read_flag;
+}
+
 cv::Mat ReadImageToCVMat(const string& filename,
     const int height, const int width, const bool is_color) {
   cv::Mat cv_img;
   int cv_read_flag = (is_color ? CV_LOAD_IMAGE_COLOR :
     CV_LOAD_IMAGE_GRAYSCALE);
+  if (height > 0 && width > 0) {
+    cv_read_flag = ImageReadFlagForSize(filename, height, width, is_color);
+  }
   cv::Mat cv_img_origin = cv::imread(filename, cv_read_flag);
   if (!cv_img_origin.data) {
     //LOG(ERROR) << "Could not open or find file " << filename;
@@ -394,29 +469,32 @@ bool ReadFileToDatum(const string& filename, const int label,
 
 #ifdef USE_OPENCV
 cv::Mat DecodeDatumToCVMatNative(const Datum& datum) {
-  cv::Mat cv_img;
   CHECK(datum.encoded()) << "Datum not encoded";
   const string& data = datum.data();
-  std::vector<char> vec_data(data.c_str(), data.c_str() + data.size());
-  cv_img = cv::imdecode(vec_data, -1);
-  if (!cv_img.data) {
-    LOG(ERROR) << "Could not decode datum ";
-  }
-  return cv_img;
+  return DecodeBytesToCVMatNative(data.data(), data.size());
 }
 cv::Mat DecodeDatumToCVMat(const Datum& datum, bool is_color) {
-  cv::Mat cv_img;
   CHECK(datum.encoded()) << "Datum not encoded";
   const string& data = datum.data();
-  std::vector<char> vec_data(data.c_str(), data.c_str() + data.size());
-  int cv_read_flag = (is_color ? CV_LOAD_IMAGE_COLOR :
-    CV_LOAD_IMAGE_GRAYSCALE);
-  cv_img = cv::imdecode(vec_data, cv_read_flag);
+  return DecodeBytesToCVMat(data.data(), data.size(), is_color);
+}
+
+static cv::Mat DecodeBytes(const char* data, size_t size, int cv_read_flag) {
+  // imdecode only reads its input, so wrap the bytes instead of copying
+  const cv::Mat buf(1, size, CV_8UC1, const_cast<char*>(data));
+  cv::Mat cv_img = cv::imdecode(buf, cv_read_flag);
   if (!cv_img.data) {
     LOG(ERROR) << "Could not decode datum ";
   }
   return cv_img;
 }
+cv::Mat DecodeBytesToCVMatNative(const char* data, size_t size) {
+  return DecodeBytes(data, size, -1);
+}
+cv::Mat DecodeBytesToCVMat(const char* data, size_t size, bool is_color) {
+  return DecodeBytes(data, size, is_color ? CV_LOAD_IMAGE_COLOR :
+      CV_LOAD_IMAGE_GRAYSCALE);
+}
 
 // If Datum is encoded will decoded using DecodeDatumToCVMat and CVMatToDatum
 // If Datum is not encoded will do nothing
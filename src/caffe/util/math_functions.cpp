@@ -1,8 +1,14 @@
 #include <boost/math/special_functions/next.hpp>
 #include <boost/random.hpp>
 
+#include <algorithm>
 #include <limits>
 
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
 #include "caffe/common.hpp"
 #include "caffe/util/math_functions.hpp"
 #include "caffe/util/rng.hpp"
@@ -45,6 +51,24 @@ void caffe_cpu_gemv<double>(const CBLAS_TRANSPOSE TransA, const int M,
   cblas_dgemv(CblasRowMajor, TransA, M, N, alpha, A, N, x, 1, beta, y, 1);
 }
 
+template <>
+void caffe_cpu_syrk<float>(const CBLAS_TRANSPOSE TransA, const int N,
+    const int K, const float alpha, const float* A, const float beta,
+    float* C) {
+  int lda = (TransA == CblasNoTrans) ? K : N;
+  cblas_ssyrk(CblasRowMajor, CblasUpper, TransA, N, K, alpha, A, lda, beta,
+      C, N);
+}
+
+template <>
+void caffe_cpu_syrk<double>(const CBLAS_TRANSPOSE TransA, const int N,
+    const int K, const double alpha, const double* A, const double beta,
+    double* C) {
+  int lda = (TransA == CblasNoTrans) ? K : N;
+  cblas_dsyrk(CblasRowMajor, CblasUpper, TransA, N, K, alpha, A, lda, beta,
+      C, N);
+}
+
 template <>
 void caffe_axpy<float>(const int N, const float alpha, const float* X,
     float* Y) { cblas_saxpy(N, alpha, X, 1, Y, 1); }
@@ -372,4 +396,151 @@ void caffe_cpu_scale<double>(const int n, const double alpha, const double *x,
   cblas_dscal(n, alpha, y, 1);
 }
 
+template <typename Dtype>
+void caffe_cpu_pack_bits(const int n, const int nbits, const Dtype* x,
+    uint64_t* codes) {
+  const int nwords = caffe_code_words(nbits);
+  for (int i = 0; i < n; ++i) {
+    const Dtype* row = x + i * nbits;
+    uint64_t* code = codes + i * nwords;
+    for (int w = 0; w < nwords; ++w) {
+      const int end = std::min(64, nbits - w * 64);
+      uint64_t word = 0;
+      for (int b = 0; b < end; ++b) {
+        word |= static_cast<uint64_t>(row[w * 64 + b] > 0) << b;
+      }
+      code[w] = word;
+    }
+  }
+}
+
+template
+void caffe_cpu_pack_bits<float>(const int n, const int nbits, const float* x,
+    uint64_t* codes);
+template
+void caffe_cpu_pack_bits<double>(const int n, const int nbits,
+    const double* x, uint64_t* codes);
+
+template <typename Dtype>
+void caffe_cpu_unpack_bits(const int n, const int nbits,
+    const uint64_t* codes, Dtype* x) {
+  const int nwords = caffe_code_words(nbits);
+  for (int i = 0; i < n; ++i) {
+    const uint64_t* code = codes + i * nwords;
+    Dtype* row = x + i * nbits;
+    for (int j = 0; j < nbits; ++j) {
+      row[j] = ((code[j / 64] >> (j % 64)) & 1) ? Dtype(1) : Dtype(-1);
+    }
+  }
+}
+
+template
+void caffe_cpu_unpack_bits<float>(const int n, const int nbits,
+    const uint64_t* codes, float* x);
+template
+void caffe_cpu_unpack_bits<double>(const int n, const int nbits,
+    const uint64_t* codes, double* x);
+
+namespace {
+
+typedef void (*HammingKernel)(const int n, const int nwords,
+    const uint64_t* query, const uint64_t* codes, int* dist);
+
+void HammingDistancesGeneric(const int n, const int nwords,
+    const uint64_t* query, const uint64_t* codes, int* dist) {
+  for (int i = 0; i < n; ++i) {
+    const uint64_t* code = codes + i * nwords;
+    int d = 0;
+    for (int w = 0; w < nwords; ++w) {
+      d += caffe_popcount(query[w] ^ code[w]);
+    }
+    dist[i] = d;
+  }
+}
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CAFFE_HAMMING_X86
+
+// The same loop, but __builtin_popcountll becomes a single popcnt.
+__attribute__((target("popcnt")))
+void HammingDistancesPopcnt(const int n, const int nwords,
+    const uint64_t* query, const uint64_t* codes, int* dist) {
+  for (int i = 0; i < n; ++i) {
+    const uint64_t* code = codes + i * nwords;
+    int d = 0;
+    for (int w = 0; w < nwords; ++w) {
+      d += __builtin_popcountll(query[w] ^ code[w]);
+    }
+    dist[i] = d;
+  }
+}
+
+// Counts four words at a time by looking up the bits of every nibble with
+// pshufb, and sums the byte counts into 64-bit lanes with psadbw.
+__attribute__((target("avx2,popcnt")))
+void HammingDistancesAVX2(const int n, const int nwords,
+    const uint64_t* query, const uint64_t* codes, int* dist) {
+  const __m256i lut = _mm256_setr_epi8(
+      0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+      0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low = _mm256_set1_epi8(0x0f);
+  const __m256i zero = _mm256_setzero_si256();
+  const int nvec = nwords / 4;
+  for (int i = 0; i < n; ++i) {
+    const uint64_t* code = codes + i * nwords;
+    __m256i acc = zero;
+    for (int v = 0; v < nvec; ++v) {
+      const __m256i x = _mm256_xor_si256(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(query) + v),
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(code) + v));
+      const __m256i count = _mm256_add_epi8(
+          _mm256_shuffle_epi8(lut, _mm256_and_si256(x, low)),
+          _mm256_shuffle_epi8(lut,
+              _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+      acc = _mm256_add_epi64(acc, _mm256_sad_epu8(count, zero));
+    }
+    const __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(acc),
+        _mm256_extracti128_si256(acc, 1));
+    int d = _mm_cvtsi128_si32(sum) + _mm_extract_epi32(sum, 2);
+    for (int w = nvec * 4; w < nwords; ++w) {
+      d += __builtin_popcountll(query[w] ^ code[w]);
+    }
+    dist[i] = d;
+  }
+}
+
+#endif  // x86 with GNU extensions
+
+// Picks the widest kernel the CPU runs; codes shorter than a vector gain
+// nothing from AVX2.
+HammingKernel SelectHammingKernel(const int nwords) {
+#ifdef CAFFE_HAMMING_X86
+  static const bool has_popcnt = (__builtin_cpu_init(),
+      __builtin_cpu_supports("popcnt"));
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  if (has_avx2 && nwords >= 4) {
+    return HammingDistancesAVX2;
+  }
+  if (has_popcnt) {
+    return HammingDistancesPopcnt;
+  }
+#endif
+  return HammingDistancesGeneric;
+}
+
+}  // namespace
+
+int caffe_cpu_hamming_distance(const int nwords, const uint64_t* a,
+    const uint64_t* b) {
+  int dist;
+  SelectHammingKernel(nwords)(1, nwords, a, b, &dist);
+  return dist;
+}
+
+void caffe_cpu_hamming_distances(const int n, const int nwords,
+    const uint64_t* query, const uint64_t* codes, int* dist) {
+  SelectHammingKernel(nwords)(n, nwords, query, codes, dist);
+}
+
 }  // namespace caffe
@@ -0,0 +1,39 @@
+#include <algorithm>
+
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/memory_bank.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+MemoryBank<Dtype>::MemoryBank(int capacity, int dim)
+    : feat_(capacity, dim, 1, 1), label_(capacity, 1, 1, 1),
+      norm_(capacity, 1, 1, 1), head_(0), size_(0) {
+  CHECK_GT(capacity, 0) << "Memory bank capacity must be positive.";
+  CHECK_GT(dim, 0) << "Memory bank dimension must be positive.";
+}
+
+template <typename Dtype>
+void MemoryBank<Dtype>::Push(int num, const Dtype* feat, const Dtype* label) {
+  int dim = this->dim();
+  // Only the newest rows survive a push larger than the bank.
+  if (num > capacity()) {
+    feat += (num - capacity()) * dim;
+    label += num - capacity();
+    num = capacity();
+  }
+  Dtype* feat_data = feat_.mutable_cpu_data();
+  Dtype* label_data = label_.mutable_cpu_data();
+  Dtype* norm_data = norm_.mutable_cpu_data();
+  for (int i=0; i<num; ++i) {
+    caffe_copy(dim, feat + i * dim, feat_data + head_ * dim);
+    label_data[head_] = label[i];
+    norm_data[head_] = caffe_cpu_dot(dim, feat + i * dim, feat + i * dim);
+    head_ = (head_ + 1) % capacity();
+  }
+  size_ = std::min(size_ + num, capacity());
+}
+
+INSTANTIATE_CLASS(MemoryBank);
+
+}  // namespace caffe
@@ -0,0 +1,204 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "caffe/util/packed_features.hpp"
+
+namespace caffe {
+
+namespace {
+
+const char kMagic[8] = {'C', 'F', 'E', 'A', 'T', 'P', 'K', '1'};
+
+inline uint64_t Align(uint64_t offset, uint64_t alignment) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+// Orders row ids by the name of their row.
+struct NameLess {
+  explicit NameLess(const vector<string>& names) : names_(names) {}
+  bool operator()(int64_t a, int64_t b) const {
+    return names_[a] < names_[b];
+  }
+  const vector<string>& names_;
+};
+
+template <typename From, typename To>
+void ConvertRow(const char* values, int count, To* data) {
+  const From* from = reinterpret_cast<const From*>(values);
+  for (int i = 0; i < count; ++i) {
+    data[i] = static_cast<To>(from[i]);
+  }
+}
+
+}  // namespace
+
+PackedFeatureFile::PackedFeatureFile()
+    : data_(NULL), size_(0), header_(NULL), index_(NULL), names_(NULL) {}
+
+PackedFeatureFile::~PackedFeatureFile() {
+  Close();
+}
+
+void PackedFeatureFile::Open(const string& filename) {
+  Close();
+  int fd = open(filename.c_str(), O_RDONLY);
+  CHECK_GE(fd, 0) << "Failed to open " << filename;
+  struct stat st;
+  CHECK_EQ(fstat(fd, &st), 0) << "Failed to stat " << filename;
+  size_ = st.st_size;
+  CHECK_GE(size_, sizeof(PackedFeatureHeader))
+      << filename << " is not a packed feature file";
+  void* data = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  CHECK(data != MAP_FAILED) << "Failed to map " << filename;
+  data_ = static_cast<const char*>(data);
+  // Rows are read in shuffled order, so readahead would mostly be wasted.
+  madvise(data, size_, MADV_RANDOM);
+
+  header_ = reinterpret_cast<const PackedFeatureHeader*>(data_);
+  CHECK(memcmp(header_->magic, kMagic, sizeof(kMagic)) == 0)
+      << filename << " is not a packed feature file";
+  CHECK(header_->value_size == sizeof(float) ||
+      header_->value_size == sizeof(double))
+      << "Unknown value size " << header_->value_size << " in " << filename;
+  CHECK_LE(header_->names_offset + header_->num * sizeof(uint64_t), size_)
+      << filename << " is truncated";
+  index_ = reinterpret_cast<const int64_t*>(data_ + header_->index_offset);
+  names_ = reinterpret_cast<const uint64_t*>(data_ + header_->names_offset);
+}
+
+void PackedFeatureFile::Close() {
+  if (data_) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+  data_ = NULL;
+  size_ = 0;
+  header_ = NULL;
+  index_ = NULL;
+  names_ = NULL;
+}
+
+int64_t PackedFeatureFile::Find(const string& name) const {
+  const int64_t* end = index_ + header_->num;
+  const int64_t* it = index_;
+  int64_t n = header_->num;
+  while (n > 0) {
+    const int64_t half = n / 2;
+    if (strcmp(this->name(it[half]), name.c_str()) < 0) {
+      it += half + 1;
+      n -= half + 1;
+    } else {
+      n = half;
+    }
+  }
+  return (it != end && name == this->name(*it)) ? *it : -1;
+}
+
+const char* PackedFeatureFile::name(int64_t row) const {
+  const char* strings = reinterpret_cast<const char*>(names_ + header_->num);
+  return strings + names_[row];
+}
+
+void PackedFeatureFile::WillNeed(int64_t row) const {
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  const size_t row_bytes = count() * header_->value_size;
+  const size_t begin = header_->rows_offset + row * row_bytes;
+  const size_t page_begin = begin / page_size * page_size;
+  madvise(const_cast<char*>(data_) + page_begin,
+      begin + row_bytes - page_begin, MADV_WILLNEED);
+}
+
+template <typename Dtype>
+void PackedFeatureFile::CopyRow(int64_t row, Dtype* data) const {
+  CHECK_GE(row, 0);
+  CHECK_LT(row, header_->num);
+  const size_t row_bytes = count() * header_->value_size;
+  const char* values = data_ + header_->rows_offset + row * row_bytes;
+  if (header_->value_size == sizeof(Dtype)) {
+    memcpy(data, values, row_bytes);
+  } else if (header_->value_size == sizeof(float)) {
+    ConvertRow<float>(values, count(), data);
+  } else {
+    ConvertRow<double>(values, count(), data);
+  }
+}
+
+template void PackedFeatureFile::CopyRow(int64_t row, float* data) const;
+template void PackedFeatureFile::CopyRow(int64_t row, double* data) const;
+
+PackedFeatureWriter::PackedFeatureWriter(const string& filename,
+    int value_size, int channels, int height, int width)
+    : filename_(filename) {
+  CHECK(value_size == sizeof(float) || value_size == sizeof(double))
+      << "Values must be float32 or float64";
+  memset(&header_, 0, sizeof(header_));
+  memcpy(header_.magic, kMagic, sizeof(kMagic));
+  header_.value_size = value_size;
+  header_.channels = channels;
+  header_.height = height;
+  header_.width = width;
+  header_.rows_offset = Align(sizeof(header_), 64);
+  row_bytes_ = static_cast<size_t>(channels) * height * width * value_size;
+  file_ = fopen(filename.c_str(), "wb");
+  CHECK(file_) << "Failed to open " << filename;
+  CHECK_EQ(fseek(file_, header_.rows_offset, SEEK_SET), 0);
+}
+
+PackedFeatureWriter::~PackedFeatureWriter() {
+  Close();
+}
+
+void PackedFeatureWriter::Add(const string& name, const char* values) {
+  CHECK(file_) << filename_ << " is closed";
+  CHECK_EQ(fwrite(values, 1, row_bytes_, file_), row_bytes_)
+      << "Failed to write " << filename_;
+  names_.push_back(name);
+}
+
+void PackedFeatureWriter::Close() {
+  if (!file_) {
+    return;
+  }
+  const int64_t num = names_.size();
+  header_.num = num;
+  header_.index_offset = Align(header_.rows_offset + num * row_bytes_, 8);
+  header_.names_offset = header_.index_offset + num * sizeof(int64_t);
+  vector<int64_t> index(num);
+  for (int64_t i = 0; i < num; ++i) {
+    index[i] = i;
+  }
+  std::sort(index.begin(), index.end(), NameLess(names_));
+  for (int64_t i = 1; i < num; ++i) {
+    CHECK_NE(names_[index[i - 1]], names_[index[i]])
+        << "Duplicate row name in " << filename_;
+  }
+  vector<uint64_t> offsets(num);
+  uint64_t offset = 0;
+  for (int64_t i = 0; i < num; ++i) {
+    offsets[i] = offset;
+    offset += names_[i].size() + 1;
+  }
+  CHECK_EQ(fseek(file_, header_.index_offset, SEEK_SET), 0);
+  bool ok = num == 0 ||
+      (fwrite(&index[0], sizeof(int64_t), num, file_) == num &&
+       fwrite(&offsets[0], sizeof(uint64_t), num, file_) == num);
+  for (int64_t i = 0; ok && i < num; ++i) {
+    ok = fwrite(names_[i].c_str(), 1, names_[i].size() + 1, file_) ==
+        names_[i].size() + 1;
+  }
+  ok = ok && fseek(file_, 0, SEEK_SET) == 0 &&
+      fwrite(&header_, sizeof(header_), 1, file_) == 1;
+  ok = fclose(file_) == 0 && ok;
+  file_ = NULL;
+  CHECK(ok) << "Failed to write " << filename_;
+  LOG(INFO) << "Packed " << num << " rows into " << filename_;
+}
+
+}  // namespace caffe
@@ -0,0 +1,155 @@
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "caffe/util/parallel_db_writer.hpp"
+#include "caffe/util/thread_pool.hpp"
+
+namespace caffe {
+
+class ParallelDBWriter::sync {
+ public:
+  boost::mutex mutex_;
+  boost::condition_variable encoded_;
+  boost::condition_variable written_;
+};
+
+ParallelDBWriter::ParallelDBWriter(db::DB* db, int num_threads,
+    int max_pending, int commit_every)
+    : db_(db), num_threads_(num_threads), max_pending_(max_pending),
+      commit_every_(commit_every), sync_(new sync()), num_(0),
+      next_encode_(0), next_write_(0) {
+  if (num_threads_ <= 0) {
+    num_threads_ = std::max(1u, boost::thread::hardware_concurrency());
+  }
+  CHECK_GT(max_pending_, 0);
+  CHECK_GT(commit_every_, 0);
+}
+
+ParallelDBWriter::~ParallelDBWriter() {}
+
+int ParallelDBWriter::Run(int num, const EncodeFunc& encode,
+    int sample_size) {
+  encode_ = encode;
+  if (sample_size > 0 && num > 0) {
+    Reserve(num, sample_size);
+  }
+  num_ = num;
+  next_encode_ = 0;
+  next_write_ = 0;
+  pending_.assign(max_pending_, Record());
+  vector<shared_ptr<boost::thread> > workers;
+  for (int i = 0; i < num_threads_; ++i) {
+    workers.push_back(shared_ptr<boost::thread>(
+        new boost::thread(&ParallelDBWriter::WorkerEntry, this)));
+  }
+
+  boost::scoped_ptr<db::Transaction> txn(db_->NewTransaction());
+  int count = 0;
+  string key, value;
+  for (int index = 0; index < num; ++index) {
+    bool ok;
+    {
+      boost::mutex::scoped_lock lock(sync_->mutex_);
+      Record& record = pending_[index % max_pending_];
+      while (!record.ready) {
+        sync_->encoded_.wait(lock);
+      }
+      ok = record.ok;
+      key.swap(record.key);
+      value.swap(record.value);
+      record.ready = false;
+      ++next_write_;
+    }
+    sync_->written_.notify_all();
+    if (!ok) {
+      continue;
+    }
+    txn->Put(key, value);
+    if (++count % commit_every_ == 0) {
+      // Commit db
+      txn->Commit();
+      txn.reset(db_->NewTransaction());
+      LOG(INFO) << "Processed " << count << " files.";
+    }
+  }
+  // write the last batch
+  if (count % commit_every_ != 0) {
+    txn->Commit();
+    LOG(INFO) << "Processed " << count << " files.";
+  }
+  for (int i = 0; i < workers.size(); ++i) {
+    workers[i]->join();
+  }
+  encode_.clear();
+  return count;
+}
+
+void ParallelDBWriter::Reserve(int num, int sample_size) {
+  vector<int> indices;
+  for (int i = 0; i < sample_size && i < num; ++i) {
+    indices.push_back(static_cast<int64_t>(i) * num /
+        std::min(sample_size, num));
+  }
+  vector<size_t> bytes(indices.size(), 0);
+  ThreadPool pool(num_threads_);
+  pool.ParallelFor(indices.size(), boost::bind(
+      &ParallelDBWriter::EncodeSample, this, indices, &bytes, _1, _2));
+  size_t total = 0;
+  int num_encoded = 0;
+  for (int i = 0; i < bytes.size(); ++i) {
+    total += bytes[i];
+    num_encoded += bytes[i] > 0;
+  }
+  if (num_encoded == 0) {
+    return;
+  }
+  const size_t record_bytes = total / num_encoded;
+  LOG(INFO) << "Sampled records average " << record_bytes << " bytes";
+  db_->Reserve(num, record_bytes);
+}
+
+void ParallelDBWriter::EncodeSample(const vector<int>& indices,
+    vector<size_t>* bytes, int begin, int end) {
+  string key, value;
+  for (int i = begin; i < end; ++i) {
+    if (encode_(indices[i], &key, &value)) {
+      (*bytes)[i] = key.size() + value.size();
+    }
+  }
+}
+
+void ParallelDBWriter::WorkerEntry() {
+  Record record;
+  while (true) {
+    int index;
+    {
+      boost::mutex::scoped_lock lock(sync_->mutex_);
+      if (next_encode_ >= num_) {
+        return;
+      }
+      index = next_encode_++;
+      // Stay at most max_pending_ records ahead of the writer.
+      while (index >= next_write_ + max_pending_) {
+        sync_->written_.wait(lock);
+      }
+    }
+    record.key.clear();
+    record.value.clear();
+    record.ok = encode_(index, &record.key, &record.value);
+    {
+      boost::mutex::scoped_lock lock(sync_->mutex_);
+      Record& slot = pending_[index % max_pending_];
+      slot.ok = record.ok;
+      slot.key.swap(record.key);
+      slot.value.swap(record.value);
+      slot.ready = true;
+    }
+    sync_->encoded_.notify_all();
+  }
+}
+
+}  // namespace caffe
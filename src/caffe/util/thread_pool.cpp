@@ -0,0 +1,105 @@
+#include <boost/thread.hpp>
+#include <algorithm>
+
+#include "caffe/util/thread_pool.hpp"
+
+namespace caffe {
+
+class ThreadPool::sync {
+ public:
+  boost::mutex mutex_;
+  boost::condition_variable work_condition_;
+  boost::condition_variable done_condition_;
+};
+
+ThreadPool::ThreadPool(int num_threads)
+    : num_threads_(num_threads), sync_(new sync()), n_(0), grain_(1),
+      next_(0), busy_(0), generation_(0), stop_(false) {
+  if (num_threads_ <= 0) {
+    num_threads_ = std::max(1u, boost::thread::hardware_concurrency());
+  }
+  // The calling thread takes part in every loop, so it counts as one.
+  for (int i = 1; i < num_threads_; ++i) {
+    workers_.push_back(shared_ptr<boost::thread>(
+        new boost::thread(&ThreadPool::WorkerEntry, this)));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    stop_ = true;
+  }
+  sync_->work_condition_.notify_all();
+  for (int i = 0; i < workers_.size(); ++i) {
+    workers_[i]->join();
+  }
+}
+
+void ThreadPool::ParallelFor(int n,
+    const boost::function<void(int, int)>& func) {
+  if (n <= 0) {
+    return;
+  }
+  if (workers_.empty() || n == 1) {
+    func(0, n);
+    return;
+  }
+  {
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    func_ = func;
+    n_ = n;
+    // A few chunks per thread keeps uneven ranges balanced.
+    grain_ = std::max(1, n / (num_threads_ * 4));
+    next_ = 0;
+    busy_ = workers_.size();
+    ++generation_;
+  }
+  sync_->work_condition_.notify_all();
+  RunChunks();
+
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  while (busy_ > 0) {
+    sync_->done_condition_.wait(lock);
+  }
+  func_.clear();
+}
+
+void ThreadPool::RunChunks() {
+  while (true) {
+    int begin, end;
+    {
+      boost::mutex::scoped_lock lock(sync_->mutex_);
+      if (next_ >= n_) {
+        return;
+      }
+      begin = next_;
+      end = std::min(n_, begin + grain_);
+      next_ = end;
+    }
+    func_(begin, end);
+  }
+}
+
+void ThreadPool::WorkerEntry() {
+  int seen = 0;
+  while (true) {
+    {
+      boost::mutex::scoped_lock lock(sync_->mutex_);
+      while (!stop_ && generation_ == seen) {
+        sync_->work_condition_.wait(lock);
+      }
+      if (stop_) {
+        return;
+      }
+      seen = generation_;
+    }
+    RunChunks();
+    boost::mutex::scoped_lock lock(sync_->mutex_);
+    if (--busy_ == 0) {
+      sync_->done_condition_.notify_all();
+    }
+  }
+}
+
+}  // namespace caffe
@@ -1,3 +1,4 @@
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/thread.hpp>
 #include <string>
 
@@ -17,7 +18,8 @@ class TripletBlockingQueue<T>::sync {
 
 template<typename T>
 TripletBlockingQueue<T>::TripletBlockingQueue()
-    : sync_(new sync()) {
+    : sync_(new sync()), num_pops_(0), num_waits_(0), wait_us_(0),
+      front_waited_(false) {
 }
 
 template<typename T>
@@ -38,6 +40,7 @@ bool TripletBlockingQueue<T>::try_pop(T* t) {
 
   *t = queue_.front();
   queue_.pop();
+  front_waited_ = false;
   return true;
 }
 
@@ -45,11 +48,23 @@ template<typename T>
 T TripletBlockingQueue<T>::pop(const string& log_on_wait) {
   boost::mutex::scoped_lock lock(sync_->mutex_);
 
-  while (queue_.empty()) {
-    if (!log_on_wait.empty()) {
-      LOG_EVERY_N(INFO, 1000)<< log_on_wait;
+  ++num_pops_;
+  if (queue_.empty()) {
+    boost::posix_time::ptime start =
+        boost::posix_time::microsec_clock::local_time();
+    while (queue_.empty()) {
+      if (!log_on_wait.empty()) {
+        LOG_EVERY_N(INFO, 1000)<< log_on_wait;
+      }
+      sync_->condition_.wait(lock);
     }
-    sync_->condition_.wait(lock);
+    front_waited_ = true;
+    wait_us_ += (boost::posix_time::microsec_clock::local_time() - start)
+        .total_microseconds();
+  }
+  if (front_waited_) {
+    ++num_waits_;
+    front_waited_ = false;
   }
 
   T t = queue_.front();
@@ -73,8 +88,15 @@ template<typename T>
 T TripletBlockingQueue<T>::peek() {
   boost::mutex::scoped_lock lock(sync_->mutex_);
 
-  while (queue_.empty()) {
-    sync_->condition_.wait(lock);
+  if (queue_.empty()) {
+    boost::posix_time::ptime start =
+        boost::posix_time::microsec_clock::local_time();
+    while (queue_.empty()) {
+      sync_->condition_.wait(lock);
+    }
+    front_waited_ = true;
+    wait_us_ += (boost::posix_time::microsec_clock::local_time() - start)
+        .total_microseconds();
   }
 
   return queue_.front();
@@ -86,6 +108,24 @@ size_t TripletBlockingQueue<T>::size() const {
   return queue_.size();
 }
 
+template<typename T>
+uint64_t TripletBlockingQueue<T>::num_pops() const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return num_pops_;
+}
+
+template<typename T>
+uint64_t TripletBlockingQueue<T>::num_waits() const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return num_waits_;
+}
+
+template<typename T>
+double TripletBlockingQueue<T>::wait_seconds() const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return wait_us_ / 1e6;
+}
+
 template class TripletBlockingQueue<Batch<float>*>;
 template class TripletBlockingQueue<Batch<double>*>;
 template class TripletBlockingQueue<TripletDatum*>;
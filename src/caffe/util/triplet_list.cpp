@@ -0,0 +1,293 @@
+#include <boost/bind.hpp>
+#include <boost/unordered_map.hpp>
+#include <algorithm>
+#include <fstream>  // NOLINT(readability/streams)
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "caffe/util/triplet_list.hpp"
+
+namespace caffe {
+
+namespace {
+
+// Bytes of the list parsed at a time; only the distinct paths outlive it.
+const size_t kBlockBytes = 64 << 20;
+// Marks the ids of paths first seen in the current block, which are
+// numbered within their shard until the block is done.
+const uint32_t kNewPath = 1u << 31;
+
+inline bool IsSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// FNV-1a, to spread the paths over the interning shards.
+inline uint32_t PathHash(const char* s, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; ++i) {
+    hash = (hash ^ static_cast<unsigned char>(s[i])) * 16777619u;
+  }
+  return hash;
+}
+
+struct Token {
+  const char* begin;
+  int length;
+  int shard;
+  uint32_t id;
+};
+
+typedef boost::unordered_map<string, uint32_t> PathIndex;
+
+/**
+ * Parses a list one block at a time. The lines of a block are split in
+ * parallel chunks, then each shard of the path index interns the paths
+ * that hash to it, so no two threads touch the same map.
+ */
+class TripletListParser {
+ public:
+  TripletListParser(int num_shards, int num_chunks)
+      : index_(num_shards), new_paths_(num_shards), base_(num_shards),
+        chunk_begin_(num_chunks + 1), tokens_(num_chunks),
+        malformed_(num_chunks), num_malformed_(0) {}
+
+  /// Parses the whole lines in [data, data + size) into list.
+  void ParseBlock(const char* data, size_t size, ThreadPool* pool,
+      vector<char>* pool_chars, vector<uint64_t>* offsets,
+      vector<TripletList::Triplet>* triplets) {
+    const int num_chunks = tokens_.size();
+    data_ = data;
+    chunk_begin_[0] = 0;
+    for (int c = 1; c < num_chunks; ++c) {
+      size_t pos = std::max(chunk_begin_[c - 1], size * c / num_chunks);
+      while (pos < size && pos > 0 && data[pos - 1] != '\n') {
+        ++pos;
+      }
+      chunk_begin_[c] = pos;
+    }
+    chunk_begin_[num_chunks] = size;
+    pool->ParallelFor(num_chunks,
+        boost::bind(&TripletListParser::SplitChunks, this, _1, _2));
+    pool->ParallelFor(index_.size(),
+        boost::bind(&TripletListParser::InternShards, this, _1, _2));
+
+    // Number the new paths shard by shard after the ones already known.
+    uint64_t next_id = offsets->size();
+    for (int s = 0; s < index_.size(); ++s) {
+      base_[s] = next_id;
+      for (int j = 0; j < new_paths_[s].size(); ++j) {
+        PathIndex::value_type* entry = new_paths_[s][j];
+        entry->second = next_id++;
+        offsets->push_back(pool_chars->size());
+        pool_chars->insert(pool_chars->end(), entry->first.begin(),
+            entry->first.end());
+        pool_chars->push_back('\0');
+      }
+      new_paths_[s].clear();
+    }
+    CHECK_LT(next_id, kNewPath) << "Too many distinct paths";
+    for (int c = 0; c < num_chunks; ++c) {
+      const vector<Token>& tokens = tokens_[c];
+      for (int t = 0; t < tokens.size(); t += 3) {
+        TripletList::Triplet triplet;
+        for (int k = 0; k < 3; ++k) {
+          const Token& token = tokens[t + k];
+          triplet.id[k] = (token.id & kNewPath) ?
+              base_[token.shard] + (token.id & ~kNewPath) : token.id;
+        }
+        triplets->push_back(triplet);
+      }
+      num_malformed_ += malformed_[c];
+    }
+  }
+
+  inline int num_malformed() const { return num_malformed_; }
+
+ protected:
+  void SplitChunks(int begin, int end) {
+    for (int c = begin; c < end; ++c) {
+      vector<Token>& tokens = tokens_[c];
+      tokens.clear();
+      malformed_[c] = 0;
+      size_t pos = chunk_begin_[c];
+      const size_t chunk_end = chunk_begin_[c + 1];
+      while (pos < chunk_end) {
+        const size_t line_start = tokens.size();
+        int num_tokens = 0;
+        while (pos < chunk_end && data_[pos] != '\n') {
+          if (IsSpace(data_[pos])) {
+            ++pos;
+            continue;
+          }
+          Token token;
+          token.begin = data_ + pos;
+          while (pos < chunk_end && !IsSpace(data_[pos])) {
+            ++pos;
+          }
+          token.length = data_ + pos - token.begin;
+          token.shard = PathHash(token.begin, token.length) % index_.size();
+          token.id = 0;
+          tokens.push_back(token);
+          ++num_tokens;
+        }
+        ++pos;
+        if (num_tokens != 3) {
+          tokens.resize(line_start);
+          if (num_tokens > 0) {
+            ++malformed_[c];
+          }
+        }
+      }
+    }
+  }
+
+  void InternShards(int begin, int end) {
+    for (int s = begin; s < end; ++s) {
+      PathIndex& index = index_[s];
+      for (int c = 0; c < tokens_.size(); ++c) {
+        vector<Token>& tokens = tokens_[c];
+        for (int t = 0; t < tokens.size(); ++t) {
+          Token& token = tokens[t];
+          if (token.shard != s) {
+            continue;
+          }
+          std::pair<PathIndex::iterator, bool> inserted = index.insert(
+              std::make_pair(string(token.begin, token.length),
+                  kNewPath | static_cast<uint32_t>(new_paths_[s].size())));
+          if (inserted.second) {
+            // Elements of an unordered_map stay put when it rehashes.
+            new_paths_[s].push_back(&*inserted.first);
+          }
+          token.id = inserted.first->second;
+        }
+      }
+    }
+  }
+
+  vector<PathIndex> index_;
+  vector<vector<PathIndex::value_type*> > new_paths_;
+  vector<uint64_t> base_;
+  const char* data_;
+  vector<size_t> chunk_begin_;
+  vector<vector<Token> > tokens_;
+  vector<int> malformed_;
+  int num_malformed_;
+};
+
+void CheckPaths(const TripletList* list, const string& root_folder,
+    vector<char>* valid, int begin, int end) {
+  for (int id = begin; id < end; ++id) {
+    (*valid)[id] = HasImageHeader(root_folder + list->path(id));
+  }
+}
+
+}  // namespace
+
+void TripletList::Load(const string& source, ThreadPool* pool) {
+  std::ifstream infile(source.c_str(), std::ios::binary);
+  CHECK(infile.good()) << "Failed to open " << source;
+  TripletListParser parser(pool->size(), pool->size() * 4);
+  vector<char> block;
+  size_t carry = 0;
+  while (true) {
+    block.resize(carry + kBlockBytes);
+    infile.read(&block[carry], kBlockBytes);
+    const size_t size = carry + infile.gcount();
+    const bool eof = !infile;
+    // Parse up to the last full line and carry the rest over.
+    size_t end = size;
+    if (!eof) {
+      while (end > 0 && block[end - 1] != '\n') {
+        --end;
+      }
+    }
+    parser.ParseBlock(&block[0], end, pool, &pool_, &offsets_, &triplets_);
+    carry = size - end;
+    std::copy(block.begin() + end, block.begin() + size, block.begin());
+    if (eof) {
+      break;
+    }
+  }
+  if (parser.num_malformed() > 0) {
+    LOG(WARNING) << "Skipped " << parser.num_malformed() << " lines of "
+        << source << " that do not hold three paths";
+  }
+  LOG(INFO) << "A total of " << triplets_.size() << " triplets over "
+      << offsets_.size() << " images, " << (memory_bytes() >> 20) << " MB";
+}
+
+int TripletList::Validate(const string& root_folder, ThreadPool* pool) {
+  vector<char> valid(offsets_.size());
+  pool->ParallelFor(offsets_.size(), boost::bind(&CheckPaths, this,
+      root_folder, &valid, _1, _2));
+  int num_invalid = 0;
+  for (int id = 0; id < valid.size(); ++id) {
+    if (!valid[id]) {
+      LOG_IF(WARNING, num_invalid < 10) << "Not an image: " << root_folder
+          << path(id);
+      ++num_invalid;
+    }
+  }
+  int num_kept = 0;
+  for (int i = 0; i < triplets_.size(); ++i) {
+    const Triplet& triplet = triplets_[i];
+    if (valid[triplet.id[0]] && valid[triplet.id[1]] &&
+        valid[triplet.id[2]]) {
+      triplets_[num_kept++] = triplet;
+    }
+  }
+  const int num_dropped = triplets_.size() - num_kept;
+  triplets_.resize(num_kept);
+  LOG(INFO) << "Dropped " << num_dropped << " triplets over " << num_invalid
+      << " images that cannot be read";
+  return num_dropped;
+}
+
+void TripletList::Shuffle(caffe::rng_t* rng) {
+  shuffle(triplets_.begin(), triplets_.end(), rng);
+}
+
+size_t TripletList::memory_bytes() const {
+  return pool_.size() + offsets_.size() * sizeof(uint64_t) +
+      triplets_.size() * sizeof(Triplet);
+}
+
+bool HasImageHeader(const string& filename) {
+  std::ifstream file(filename.c_str(), std::ios::binary);
+  unsigned char h[12] = {0};
+  file.read(reinterpret_cast<char*>(h), sizeof(h));
+  const int n = file.gcount();
+  if (n >= 3 && h[0] == 0xFF && h[1] == 0xD8 && h[2] == 0xFF) {
+    return true;  // JPEG
+  }
+  if (n >= 8 && h[0] == 0x89 && h[1] == 'P' && h[2] == 'N' && h[3] == 'G' &&
+      h[4] == '\r' && h[5] == '\n' && h[6] == 0x1A && h[7] == '\n') {
+    return true;  // PNG
+  }
+  if (n >= 2 && h[0] == 'B' && h[1] == 'M') {
+    return true;  // BMP
+  }
+  if (n >= 4 && ((h[0] == 'I' && h[1] == 'I' && h[2] == 42 && h[3] == 0) ||
+      (h[0] == 'M' && h[1] == 'M' && h[2] == 0 && h[3] == 42))) {
+    return true;  // TIFF
+  }
+  if (n >= 12 && h[0] == 'R' && h[1] == 'I' && h[2] == 'F' && h[3] == 'F' &&
+      h[8] == 'W' && h[9] == 'E' && h[10] == 'B' && h[11] == 'P') {
+    return true;  // WebP
+  }
+  if (n >= 2 && h[0] == 'P' && h[1] >= '1' && h[1] <= '6') {
+    return true;  // PBM, PGM, PPM
+  }
+  if (n >= 4 && h[0] == 0x59 && h[1] == 0xA6 && h[2] == 0x6A &&
+      h[3] == 0x95) {
+    return true;  // Sun raster
+  }
+  if (n >= 8 && h[0] == 0 && h[1] == 0 && h[2] == 0 && h[3] == 0x0C &&
+      h[4] == 'j' && h[5] == 'P') {
+    return true;  // JPEG 2000
+  }
+  return false;
+}
+
+}  // namespace caffe
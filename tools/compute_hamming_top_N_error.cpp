@@ -0,0 +1,216 @@
+// Computes the top-N retrieval error of binary codes: every feature is
+// binarized by its signs, packed 64 bits per word, and each query is ranked
+// against the whole base list by Hamming distance.
+//
+// Both lists use the format of compute_top_N_error:
+//   img_name label f_0 f_1 ... f_{D-1}
+#include <stdint.h>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "boost/bind.hpp"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/thread_pool.hpp"
+
+using namespace caffe;  // NOLINT(build/namespaces)
+
+using std::make_pair;
+using std::pair;
+using std::string;
+using std::vector;
+
+DEFINE_string(query_fea_list, "",
+    "The query image feature list.");
+DEFINE_string(base_fea_list, "",
+    "The base image feature list.");
+DEFINE_int32(top_n, 5,
+    "Report the error of the top-1 to top-N retrieved images.");
+DEFINE_int32(num_threads, 0,
+    "Number of search threads; 0 uses every core.");
+
+// Queries that share one pass over the base codes, which are read in
+// chunks small enough to stay in cache while every query of the block runs
+// the vectorized distance kernel over them.
+const int kQueryBlock = 16;
+const int kBaseChunk = 1024;
+
+// The packed codes of a feature list, nwords words per image.
+struct CodeList {
+  int nbits;
+  int nwords;
+  vector<string> names;
+  vector<int> labels;
+  vector<uint64_t> codes;
+};
+
+void ReadCodes(const string& file_name, CodeList* list) {
+  std::ifstream infile(file_name.c_str());
+  CHECK(infile.good()) << "Failed to open " << file_name;
+  list->nbits = 0;
+  list->nwords = 0;
+  string line;
+  vector<float> feat;
+  while (std::getline(infile, line)) {
+    const char* p = line.c_str();
+    while (*p == ' ') {
+      ++p;
+    }
+    const char* name = p;
+    while (*p != '\0' && *p != ' ') {
+      ++p;
+    }
+    if (p == name) {
+      continue;
+    }
+    const char* name_end = p;
+    char* end;
+    int label = strtol(p, &end, 10);
+    CHECK(end != p) << "Missing label in line: " << line;
+    p = end;
+    feat.clear();
+    while (true) {
+      float value = strtof(p, &end);
+      if (end == p) {
+        break;
+      }
+      feat.push_back(value);
+      p = end;
+    }
+    if (list->nbits == 0) {
+      CHECK_GT(feat.size(), 0) << "No feature in line: " << line;
+      list->nbits = feat.size();
+      list->nwords = caffe_code_words(list->nbits);
+    }
+    CHECK_EQ(feat.size(), list->nbits) << "Feature size mismatch in line: "
+        << line;
+    list->names.push_back(string(name, name_end));
+    list->labels.push_back(label);
+    list->codes.resize(list->codes.size() + list->nwords);
+    caffe_cpu_pack_bits(1, list->nbits, &feat[0],
+        &list->codes[list->codes.size() - list->nwords]);
+  }
+}
+
+// Finds the top_n nearest base codes of the queries in blocks [begin, end).
+// Ties go to the lower base index, so the result does not depend on the
+// number of threads.
+void SearchBlocks(const CodeList* query, const CodeList* base, int top_n,
+    int* result, int begin, int end) {
+  const int nwords = base->nwords;
+  const int num_query = query->labels.size();
+  const int num_base = base->labels.size();
+  // one max-heap of (distance, index) per query
+  vector<vector<pair<int, int> > > heap(kQueryBlock);
+  vector<int> dist(kBaseChunk);
+  for (int block = begin; block < end; ++block) {
+    const int q_begin = block * kQueryBlock;
+    const int q_end = std::min(num_query, q_begin + kQueryBlock);
+    for (int q = 0; q < q_end - q_begin; ++q) {
+      heap[q].clear();
+    }
+    for (int chunk = 0; chunk < num_base; chunk += kBaseChunk) {
+      const int chunk_size = std::min(kBaseChunk, num_base - chunk);
+      for (int q = 0; q < q_end - q_begin; ++q) {
+        caffe_cpu_hamming_distances(chunk_size, nwords,
+            &query->codes[(q_begin + q) * nwords],
+            &base->codes[chunk * nwords], &dist[0]);
+        vector<pair<int, int> >& h = heap[q];
+        for (int i = 0; i < chunk_size; ++i) {
+          if (h.size() < top_n) {
+            h.push_back(make_pair(dist[i], chunk + i));
+            std::push_heap(h.begin(), h.end());
+          } else if (dist[i] < h.front().first) {
+            std::pop_heap(h.begin(), h.end());
+            h.back() = make_pair(dist[i], chunk + i);
+            std::push_heap(h.begin(), h.end());
+          }
+        }
+      }
+    }
+    for (int q = 0; q < q_end - q_begin; ++q) {
+      std::sort_heap(heap[q].begin(), heap[q].end());
+      for (int k = 0; k < top_n; ++k) {
+        result[(q_begin + q) * top_n + k] = heap[q][k].second;
+      }
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  FLAGS_alsologtostderr = 1;
+
+#ifndef GFLAGS_GFLAGS_H_
+  namespace gflags = google;
+#endif
+
+  gflags::SetUsageMessage("Compute the top-N retrieval error of binary codes"
+        " by brute-force Hamming search\n"
+        "Usage:\n"
+        "    compute_hamming_top_N_error -query_fea_list QUERY_LIST"
+        " -base_fea_list BASE_LIST [-top_n N] [-num_threads T]\n");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc != 1 || FLAGS_query_fea_list.empty() ||
+      FLAGS_base_fea_list.empty()) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0],
+        "tools/compute_hamming_top_N_error");
+    return 1;
+  }
+
+  CodeList query, base;
+  ReadCodes(FLAGS_query_fea_list, &query);
+  ReadCodes(FLAGS_base_fea_list, &base);
+  CHECK_GT(query.labels.size(), 0) << "Empty query list";
+  CHECK_GT(base.labels.size(), 0) << "Empty base list";
+  CHECK_EQ(query.nbits, base.nbits) << "Query and base code lengths differ";
+  LOG(INFO) << query.labels.size() << " queries, " << base.labels.size()
+      << " base images, " << base.nbits << " bits";
+
+  const int num_query = query.labels.size();
+  const int top_n = std::min<int>(FLAGS_top_n, base.labels.size());
+  CHECK_GT(top_n, 0);
+  vector<int> result(num_query * top_n);
+  ThreadPool pool(FLAGS_num_threads);
+  pool.ParallelFor((num_query + kQueryBlock - 1) / kQueryBlock,
+      boost::bind(&SearchBlocks, &query, &base, top_n, &result[0], _1, _2));
+
+  // A query is right at top-k if any of its first k results shares its
+  // label; the error is averaged per label, then over all queries.
+  std::map<int, pair<int, vector<int> > > stat;
+  vector<int> total(top_n, 0);
+  for (int q = 0; q < num_query; ++q) {
+    pair<int, vector<int> >& s = stat[query.labels[q]];
+    s.second.resize(top_n, 0);
+    ++s.first;
+    bool found = false;
+    for (int k = 0; k < top_n; ++k) {
+      found = found || base.labels[result[q * top_n + k]] == query.labels[q];
+      s.second[k] += found;
+      total[k] += found;
+    }
+  }
+  for (std::map<int, pair<int, vector<int> > >::const_iterator it =
+       stat.begin(); it != stat.end(); ++it) {
+    std::cout << "label = " << it->first << "\n";
+    for (int k = 0; k < top_n; ++k) {
+      std::cout << "top" << k + 1 << " error = "
+          << 1 - float(it->second.second[k]) / it->second.first << "\n";
+    }
+  }
+  std::cout << "all labels\n";
+  for (int k = 0; k < top_n; ++k) {
+    std::cout << "top" << k + 1 << " error = "
+        << 1 - float(total[k]) / num_query << "\n";
+  }
+  std::cout << std::flush;
+  return 0;
+}
@@ -12,6 +12,7 @@
 #include <utility>
 #include <vector>
 #include <sstream>
+#include "boost/bind.hpp"
 #include "boost/scoped_ptr.hpp"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
@@ -19,7 +20,9 @@
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/db.hpp"
 #include "caffe/util/format.hpp"
+#include "caffe/util/image_table.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/parallel_db_writer.hpp"
 #include "caffe/util/rng.hpp"
 
 using namespace caffe;  // NOLINT(build/namespaces)
@@ -63,6 +66,80 @@ DEFINE_string(multiple_triplet_list_name,"",
     "Required: the triplet list file, in which each line stores the anchor/positive/negative images, respectively, being separated by \t or a blank.");
 DEFINE_string(db_save_name,"",
     "Required: the file name that stores the created DB proto buffers.");
+DEFINE_string(image_db_save_name, "",
+    "Optional: write each image once to this image table DB, and only the "
+    "image ids to the triplet records; read it back with image_source.");
+DEFINE_int32(threads, 0,
+    "Threads reading and encoding images; 0 for one per core. Writing an "
+    "image table uses one.");
+DEFINE_int32(max_pending, 1024,
+    "How many records may be encoded ahead of the one being written");
+DEFINE_int32(sample_size, 100,
+    "Records encoded up front to size the DB for the whole list");
+
+#ifdef USE_OPENCV
+// Reads the images of each multiple triplet into a TripletMultipleDatum
+// record.
+class MultipleTripletEncoder {
+ public:
+  MultipleTripletEncoder(
+      const std::vector< struct MultipleTripletPair >& mult_trip_list_total,
+      int resize_height, int resize_width, bool is_color, bool encoded,
+      const string& encode_type, ImageTableWriter* image_table)
+      : mult_trip_list_total_(mult_trip_list_total),
+        resize_height_(resize_height), resize_width_(resize_width),
+        is_color_(is_color), encoded_(encoded), encode_type_(encode_type),
+        image_table_(image_table) {}
+
+  bool Encode(int line_id, string* key_str, string* out) {
+    bool status;
+
+    TripletMultipleDatum mult_triplet_datum;
+    std::string enc = encode_type_;
+    if (encoded_ && !enc.size()) {
+      // Guess the encoding type from the file name
+      string fn = mult_trip_list_total_[line_id].anchor_vec[0];
+      size_t p = fn.rfind('.');
+      if ( p == fn.npos )
+        LOG(WARNING) << "Failed to guess the encoding of '" << fn << "'";
+      enc = fn.substr(p);
+      std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
+    }
+    if (image_table_) {
+      const struct MultipleTripletPair& trip_pair = mult_trip_list_total_[line_id];
+      status = true;
+      for( int i = 0; i < trip_pair.anchor_vec.size(); ++i ){
+        mult_triplet_datum.add_anchor_id( image_table_->Id( trip_pair.anchor_vec[i], enc ) );
+        status = status && mult_triplet_datum.anchor_id( i ) >= 0;
+      }
+      for( int i = 0; i < trip_pair.pos_vec.size(); ++i ){
+        mult_triplet_datum.add_pos_id( image_table_->Id( trip_pair.pos_vec[i], enc ) );
+        status = status && mult_triplet_datum.pos_id( i ) >= 0;
+      }
+      for( int i = 0; i < trip_pair.neg_vec.size(); ++i ){
+        mult_triplet_datum.add_neg_id( image_table_->Id( trip_pair.neg_vec[i], enc ) );
+        status = status && mult_triplet_datum.neg_id( i ) >= 0;
+      }
+    } else {
+      status = ReadMultipleTripletImagesToMultipleTripletDatum( mult_trip_list_total_[line_id], resize_height_, resize_width_, is_color_, enc, &mult_triplet_datum);
+    }
+    if (status == false) return false;
+    // sequential
+    *key_str = caffe::format_int(line_id, 8) + "_" + mult_trip_list_total_[line_id].anchor_vec[0];
+    CHECK( mult_triplet_datum.SerializeToString( out ) );
+    return true;
+  }
+
+ private:
+  const std::vector< struct MultipleTripletPair >& mult_trip_list_total_;
+  int resize_height_;
+  int resize_width_;
+  bool is_color_;
+  bool encoded_;
+  string encode_type_;
+  ImageTableWriter* image_table_;
+};
+#endif  // USE_OPENCV
 
 int main(int argc, char** argv) {
 #ifdef USE_OPENCV
@@ -144,68 +221,22 @@ int main(int argc, char** argv) {
   // Create new DB
   scoped_ptr<db::DB> db(db::GetDB(FLAGS_backend));
   db->Open( db_save_name.c_str(), db::NEW);
-  scoped_ptr<db::Transaction> txn(db->NewTransaction());
+  scoped_ptr<ImageTableWriter> image_table;
+  if (FLAGS_image_db_save_name.size()) {
+    image_table.reset(new ImageTableWriter(FLAGS_backend,
+        FLAGS_image_db_save_name, resize_height, resize_width, is_color));
+  }
 
   // Storing to db
   //std::string root_folder(argv[1]);
-  //struct TripletMultipleDatum mult_triplet_datum;
-  //TripletMultipleDatum mult_triplet_datum;
-  int count = 0;
-  //int data_size = 0;
-  //bool data_size_initialized = false;
-
-  for( int line_id = 0; line_id < mult_trip_list_total.size(); ++line_id ) {
-    bool status;
-
-    TripletMultipleDatum mult_triplet_datum;
-    std::string enc = encode_type;
-    if (encoded && !enc.size()) {
-      // Guess the encoding type from the file name
-      string fn = mult_trip_list_total[line_id].anchor_vec[0];
-      size_t p = fn.rfind('.');
-      if ( p == fn.npos )
-        LOG(WARNING) << "Failed to guess the encoding of '" << fn << "'";
-      enc = fn.substr(p);
-      std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
-    }
-    status = ReadMultipleTripletImagesToMultipleTripletDatum( mult_trip_list_total[line_id], resize_height, resize_width, is_color, enc, &mult_triplet_datum);
-    //LOG( INFO ) << "finished gen db once";
-    if (status == false) continue;
-    //LOG( INFO ) << mult_triplet_datum.data_anchor_size(); 
-    //LOG( INFO ) << mult_triplet_datum.data_pos_size(); 
-    //LOG( INFO ) << mult_triplet_datum.data_neg_size(); 
-    /*
-    if (check_size) {
-      if (!data_size_initialized) {
-        data_size = triplet_datum.channels() * triplet_datum.height() * triplet_datum.width();
-        data_size_initialized = true;
-      } else {
-        const std::string& data = triplet_datum.data_anchor();
-        CHECK_EQ(data.size(), data_size) << "Incorrect data field size "
-            << data.size();
-      }
-     */
-    //}
-    // sequential
-    string key_str = caffe::format_int(line_id, 8) + "_" + mult_trip_list_total[line_id].anchor_vec[0];
-
-    // Put in db
-    std::string out;
-    CHECK( mult_triplet_datum.SerializeToString( &out ) );
-    txn->Put( key_str, out );
-
-    if (++count % 1000 == 0) {
-      // Commit db
-      txn->Commit();
-      txn.reset(db->NewTransaction());
-      LOG(INFO) << "Processed " << count << " files.";
-    }
-  }
-  // write the last batch
-  if (count % 1000 != 0) {
-    txn->Commit();
-    LOG(INFO) << "Processed " << count << " files.";
-  }
+  MultipleTripletEncoder encoder(mult_trip_list_total, resize_height,
+      resize_width, is_color, encoded, encode_type, image_table.get());
+  // The image table hands out ids in the order it first sees images.
+  ParallelDBWriter writer(db.get(), image_table ? 1 : FLAGS_threads,
+      FLAGS_max_pending, 1000);
+  writer.Run(mult_trip_list_total.size(), boost::bind(
+      &MultipleTripletEncoder::Encode, &encoder, _1, _2, _3),
+      image_table ? 0 : FLAGS_sample_size);
 #else
   LOG(FATAL) << "This tool requires OpenCV; compile with USE_OPENCV.";
 #endif  // USE_OPENCV
@@ -12,14 +12,18 @@
 #include <utility>
 #include <vector>
 
+#include "boost/bind.hpp"
 #include "boost/scoped_ptr.hpp"
+#include "boost/thread.hpp"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/db.hpp"
 #include "caffe/util/format.hpp"
+#include "caffe/util/image_table.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/parallel_db_writer.hpp"
 #include "caffe/util/rng.hpp"
 
 using namespace caffe;  // NOLINT(build/namespaces)
@@ -44,6 +48,82 @@ DEFINE_string(triplet_list_name,"",
     "Required: the triplet list file, in which each line stores the anchor/positive/negative images, respectively, being separated by \t or a blank.");
 DEFINE_string(db_save_name,"",
     "Required: the file name that stores the created DB proto buffers.");
+DEFINE_string(image_db_save_name, "",
+    "Optional: write each image once to this image table DB, and only the "
+    "image ids to the triplet records; read it back with image_source.");
+DEFINE_int32(threads, 0,
+    "Threads reading and encoding images; 0 for one per core. Writing an "
+    "image table uses one.");
+DEFINE_int32(max_pending, 1024,
+    "How many records may be encoded ahead of the one being written");
+DEFINE_int32(sample_size, 100,
+    "Records encoded up front to size the DB for the whole list");
+
+#ifdef USE_OPENCV
+// Reads the images of each triplet into a TripletDatum record.
+class TripletEncoder {
+ public:
+  TripletEncoder(const std::vector< std::vector< std::string > >& lines,
+      int resize_height, int resize_width, bool is_color, bool encoded,
+      const string& encode_type, bool check_size,
+      ImageTableWriter* image_table)
+      : lines_(lines), resize_height_(resize_height),
+        resize_width_(resize_width), is_color_(is_color), encoded_(encoded),
+        encode_type_(encode_type), check_size_(check_size),
+        image_table_(image_table), data_size_(-1) {}
+
+  bool Encode(int line_id, string* key_str, string* out) {
+    TripletDatum triplet_datum;
+    bool status;
+    std::string enc = encode_type_;
+    if (encoded_ && !enc.size()) {
+      // Guess the encoding type from the file name
+      string fn = lines_[line_id][0];
+      size_t p = fn.rfind('.');
+      if ( p == fn.npos )
+        LOG(WARNING) << "Failed to guess the encoding of '" << fn << "'";
+      enc = fn.substr(p);
+      std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
+    }
+    if (image_table_) {
+      triplet_datum.set_anchor_id( image_table_->Id( lines_[line_id][0], enc ) );
+      triplet_datum.set_pos_id( image_table_->Id( lines_[line_id][1], enc ) );
+      triplet_datum.set_neg_id( image_table_->Id( lines_[line_id][2], enc ) );
+      status = triplet_datum.anchor_id() >= 0 && triplet_datum.pos_id() >= 0
+          && triplet_datum.neg_id() >= 0;
+    } else {
+      status = ReadTripletImagesToTripletDatum( lines_[line_id], resize_height_, resize_width_, is_color_, enc, &triplet_datum);
+    }
+    if (status == false) return false;
+    if (check_size_ && !image_table_) {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (data_size_ < 0) {
+        data_size_ = triplet_datum.channels() * triplet_datum.height() * triplet_datum.width();
+      } else {
+        const std::string& data = triplet_datum.data_anchor();
+        CHECK_EQ(data.size(), data_size_) << "Incorrect data field size "
+            << data.size();
+      }
+    }
+    // sequential
+    *key_str = caffe::format_int(line_id, 8) + "_" + lines_[line_id][0];
+    CHECK( triplet_datum.SerializeToString( out ) );
+    return true;
+  }
+
+ private:
+  const std::vector< std::vector< std::string > >& lines_;
+  int resize_height_;
+  int resize_width_;
+  bool is_color_;
+  bool encoded_;
+  string encode_type_;
+  bool check_size_;
+  ImageTableWriter* image_table_;
+  boost::mutex mutex_;
+  int data_size_;
+};
+#endif  // USE_OPENCV
 
 int main(int argc, char** argv) {
 #ifdef USE_OPENCV
@@ -109,59 +189,21 @@ int main(int argc, char** argv) {
   // Create new DB
   scoped_ptr<db::DB> db(db::GetDB(FLAGS_backend));
   db->Open( db_save_name.c_str(), db::NEW);
-  scoped_ptr<db::Transaction> txn(db->NewTransaction());
+  scoped_ptr<ImageTableWriter> image_table;
+  if (FLAGS_image_db_save_name.size()) {
+    image_table.reset(new ImageTableWriter(FLAGS_backend,
+        FLAGS_image_db_save_name, resize_height, resize_width, is_color));
+  }
 
   // Storing to db
   //std::string root_folder(argv[1]);
-  TripletDatum triplet_datum;
-  int count = 0;
-  int data_size = 0;
-  bool data_size_initialized = false;
-
-  for (int line_id = 0; line_id < lines.size(); ++line_id) {
-    bool status;
-    std::string enc = encode_type;
-    if (encoded && !enc.size()) {
-      // Guess the encoding type from the file name
-      string fn = lines[line_id][0];
-      size_t p = fn.rfind('.');
-      if ( p == fn.npos )
-        LOG(WARNING) << "Failed to guess the encoding of '" << fn << "'";
-      enc = fn.substr(p);
-      std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
-    }
-    status = ReadTripletImagesToTripletDatum( lines[line_id], resize_height, resize_width, is_color, enc, &triplet_datum);
-    if (status == false) continue;
-    if (check_size) {
-      if (!data_size_initialized) {
-        data_size = triplet_datum.channels() * triplet_datum.height() * triplet_datum.width();
-        data_size_initialized = true;
-      } else {
-        const std::string& data = triplet_datum.data_anchor();
-        CHECK_EQ(data.size(), data_size) << "Incorrect data field size "
-            << data.size();
-      }
-    }
-    // sequential
-    string key_str = caffe::format_int(line_id, 8) + "_" + lines[line_id][0];
-
-    // Put in db
-    std::string out;
-    CHECK( triplet_datum.SerializeToString( &out ) );
-    txn->Put( key_str, out );
-
-    if (++count % 1000 == 0) {
-      // Commit db
-      txn->Commit();
-      txn.reset(db->NewTransaction());
-      LOG(INFO) << "Processed " << count << " files.";
-    }
-  }
-  // write the last batch
-  if (count % 1000 != 0) {
-    txn->Commit();
-    LOG(INFO) << "Processed " << count << " files.";
-  }
+  TripletEncoder encoder(lines, resize_height, resize_width, is_color,
+      encoded, encode_type, check_size, image_table.get());
+  // The image table hands out ids in the order it first sees images.
+  ParallelDBWriter writer(db.get(), image_table ? 1 : FLAGS_threads,
+      FLAGS_max_pending, 1000);
+  writer.Run(lines.size(), boost::bind(&TripletEncoder::Encode, &encoder,
+      _1, _2, _3), image_table ? 0 : FLAGS_sample_size);
 #else
   LOG(FATAL) << "This tool requires OpenCV; compile with USE_OPENCV.";
 #endif  // USE_OPENCV
@@ -0,0 +1,91 @@
+// This program packs a directory of binary feature blobs, as read by
+// BinaryDataLayer and TripletBinaryDataLayer, into one packed feature file.
+// Usage:
+//   pack_binary_features FEATURE_DIR/ PACKED_FILE
+//
+// where FEATURE_DIR holds a meta file (dtype, then num channels height
+// width) and one file per blob. Every file but meta becomes a row named by
+// its path under FEATURE_DIR, holding the channels * height * width values
+// the layers read from it.
+
+#include <algorithm>
+#include <fstream>  // NOLINT(readability/streams)
+#include <string>
+#include <vector>
+
+#include "boost/filesystem.hpp"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "caffe/util/packed_features.hpp"
+
+using namespace caffe;  // NOLINT(build/namespaces)
+namespace fs = boost::filesystem;
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  // Print output to stderr (while still logging)
+  FLAGS_alsologtostderr = 1;
+
+#ifndef GFLAGS_GFLAGS_H_
+  namespace gflags = google;
+#endif
+
+  gflags::SetUsageMessage("Pack a directory of binary feature blobs and\n"
+        "its meta file into one packed feature file.\n"
+        "Usage:\n"
+        "    pack_binary_features FEATURE_DIR/ PACKED_FILE\n");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (argc < 3) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0], "tools/pack_binary_features");
+    return 1;
+  }
+
+  const fs::path root(argv[1]);
+  std::ifstream metafile((root / "meta").string().c_str());
+  string dtype;
+  int num, channels, height, width;
+  CHECK(metafile >> dtype >> num >> channels >> height >> width)
+      << "Failed to read " << (root / "meta").string();
+  int value_size = 0;
+  if (dtype == "float32") {
+    value_size = sizeof(float);
+  } else if (dtype == "float64") {
+    value_size = sizeof(double);
+  } else {
+    LOG(FATAL) << "Unknown dtype " << dtype;
+  }
+
+  // Name the rows by their path under root, as the list files do.
+  vector<string> names;
+  const string prefix = root.string();
+  for (fs::recursive_directory_iterator it(root), end; it != end; ++it) {
+    if (!fs::is_regular_file(it->status())) {
+      continue;
+    }
+    string name = it->path().string().substr(prefix.size());
+    if (!name.empty() && name[0] == '/') {
+      name = name.substr(1);
+    }
+    if (name != "meta") {
+      names.push_back(name);
+    }
+  }
+  std::sort(names.begin(), names.end());
+
+  PackedFeatureWriter writer(argv[2], value_size, channels, height, width);
+  vector<char> values(writer.row_bytes());
+  for (int i = 0; i < names.size(); ++i) {
+    const string filename = (root / names[i]).string();
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    CHECK(file.read(&values[0], values.size()))
+        << filename << " holds less than one row";
+    writer.Add(names[i], &values[0]);
+    if ((i + 1) % 10000 == 0) {
+      LOG(INFO) << "Packed " << i + 1 << " files.";
+    }
+  }
+  writer.Close();
+  return 0;
+}